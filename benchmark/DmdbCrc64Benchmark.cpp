@@ -0,0 +1,48 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <vector>
+
+#include "../src/DmdbCrc64.hpp"
+#include "../src/DmdbUtil.hpp"
+
+using namespace Dmdb;
+
+typedef uint64_t (*Crc64Function)(uint64_t, const unsigned char*, uint64_t);
+
+/* Usage: DmdbCrc64Benchmark [buffer bytes] [rounds] */
+int main(int argc, char* argv[]) {
+    size_t bufLen = argc > 1 ? strtoull(argv[1], nullptr, 10) : 1024*1024;
+    int rounds = argc > 2 ? atoi(argv[2]) : 1000;
+    std::vector<unsigned char> buf(bufLen);
+    for(size_t i = 0; i < bufLen; ++i) {
+        buf[i] = static_cast<unsigned char>(rand());
+    }
+    struct {
+        const char* name;
+        Crc64Function function;
+        bool isAvailable;
+    } variants[] = {
+        {"bytewise", DmdbCrc64::Crc64Bytewise, true},
+        {"slicing-by-8", DmdbCrc64::Crc64Slicing8, true},
+        {"slicing-by-16", DmdbCrc64::Crc64Slicing16, true},
+        {"clmul", DmdbCrc64::Crc64Clmul, DmdbCrc64::IsClmulSupported()}
+    };
+    uint64_t expected = DmdbCrc64::Crc64Bytewise(0, buf.data(), bufLen);
+    printf("buffer: %zu bytes, rounds: %d\n", bufLen, rounds);
+    for(auto &variant : variants) {
+        if(!variant.isAvailable) {
+            printf("%-14s not supported by this CPU\n", variant.name);
+            continue;
+        }
+        uint64_t crc = 0;
+        uint64_t startUs = DmdbUtil::GetCurrentUs();
+        for(int i = 0; i < rounds; ++i) {
+            crc = variant.function(0, buf.data(), bufLen);
+        }
+        uint64_t costUs = DmdbUtil::GetCurrentUs() - startUs;
+        double gbPerSecond = costUs > 0 ? static_cast<double>(bufLen) * rounds / costUs / 1000.0 : 0;
+        printf("%-14s %8.3f GB/s %s\n", variant.name, gbPerSecond, crc == expected ? "" : "MISMATCH");
+    }
+    return 0;
+}
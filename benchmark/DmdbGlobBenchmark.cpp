@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <regex>
+#include <string>
+#include <vector>
+
+#include "../src/DmdbGlobPattern.hpp"
+#include "../src/DmdbUtil.hpp"
+
+using namespace Dmdb;
+
+/* Usage: DmdbGlobBenchmark [keys] [rounds] */
+int main(int argc, char* argv[]) {
+    size_t keysNum = argc > 1 ? strtoull(argv[1], nullptr, 10) : 100000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 10;
+    const char* prefixes[] = {"user:", "order:", "session:", "item:"};
+    std::vector<std::string> keys(keysNum);
+    for(size_t i = 0; i < keysNum; ++i) {
+        keys[i] = std::string(prefixes[rand() % 4]) + std::to_string(rand()) + (rand() % 2 ? ":name" : ":age");
+    }
+    /* The regex is what KEYS used before, it's written to match the same keys as the glob */
+    struct {
+        const char* glob;
+        const char* regex;
+    } patterns[] = {
+        {"user:*", "^user:"},
+        {"*:name", ":name$"},
+        {"user:1*:name", "^user:1.*:name$"},
+        {"*[0-3]?:age", "[0-3].:age$"},
+        {"session:12345:age", "^session:12345:age$"}
+    };
+    printf("keys: %zu, rounds: %d\n", keysNum, rounds);
+    for(auto &pattern : patterns) {
+        DmdbGlobPattern glob(pattern.glob);
+        std::regex regexPattern(pattern.regex);
+        size_t globMatched = 0;
+        size_t regexMatched = 0;
+        uint64_t startUs = DmdbUtil::GetCurrentUs();
+        for(int i = 0; i < rounds; ++i) {
+            for(size_t j = 0; j < keysNum; ++j) {
+                globMatched += glob.Match(keys[j]);
+            }
+        }
+        uint64_t globUs = DmdbUtil::GetCurrentUs() - startUs;
+        startUs = DmdbUtil::GetCurrentUs();
+        for(int i = 0; i < rounds; ++i) {
+            for(size_t j = 0; j < keysNum; ++j) {
+                regexMatched += std::regex_search(keys[j], regexPattern);
+            }
+        }
+        uint64_t regexUs = DmdbUtil::GetCurrentUs() - startUs;
+        double total = static_cast<double>(keysNum) * rounds;
+        printf("%-20s glob %8.2f Mkeys/s, regex %8.2f Mkeys/s %s\n", pattern.glob,
+               globUs > 0 ? total / globUs : 0, regexUs > 0 ? total / regexUs : 0,
+               globMatched == regexMatched ? "" : "MISMATCH");
+    }
+    return 0;
+}
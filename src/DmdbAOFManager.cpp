@@ -0,0 +1,708 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <strings.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+
+#include "DmdbAOFManager.hpp"
+#include "DmdbServerFriends.hpp"
+#include "DmdbServerLogger.hpp"
+#include "DmdbClientContact.hpp"
+#include "DmdbCommand.hpp"
+#include "DmdbDatabaseManager.hpp"
+#include "DmdbRDBManager.hpp"
+#include "DmdbUtil.hpp"
+
+
+namespace Dmdb {
+
+const size_t AOF_READ_SIZE = 1024*1024;
+/* The rewrite child writes the commands to the file when so many bytes are generated */
+const size_t AOF_REWRITE_WRITE_SIZE = 1024*1024;
+const size_t AOF_REWRITE_PAIRS_PER_ROUND = 100;
+const uint64_t AOF_EVERYSEC_INTERVAL_MS = 1000;
+/* The parent appends the rewrite buffer to the new file in chunks of it */
+const size_t AOF_REWRITE_APPEND_CHUNK_SIZE = 4*1024*1024;
+
+thread_local DmdbAOFManager* DmdbAOFManager::_instance = nullptr;
+
+DmdbAOFManager* DmdbAOFManager::GetUniqueAOFManagerInstance(const std::string &file) {
+    if(_instance == nullptr) {
+        _instance = new DmdbAOFManager(file);
+    }
+    return _instance;
+}
+
+bool DmdbAOFManager::String2FsyncPolicy(const std::string &str, AOFFsyncPolicy &policy) {
+    if(strcasecmp(str.c_str(), "always") == 0) {
+        policy = AOFFsyncPolicy::ALWAYS;
+    } else if(strcasecmp(str.c_str(), "everysec") == 0) {
+        policy = AOFFsyncPolicy::EVERYSEC;
+    } else if(strcasecmp(str.c_str(), "no") == 0) {
+        policy = AOFFsyncPolicy::NO;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void DmdbAOFManager::SetAOFEnabled(bool isEnabled) {
+    _is_aof_enabled = isEnabled;
+}
+
+bool DmdbAOFManager::IsAOFEnabled() {
+    return _is_aof_enabled;
+}
+
+void DmdbAOFManager::SetFsyncPolicy(AOFFsyncPolicy policy) {
+    _fsync_policy = policy;
+}
+
+void DmdbAOFManager::SetRewritePercentage(uint64_t percentage) {
+    _rewrite_percentage = percentage;
+}
+
+void DmdbAOFManager::SetRewriteMinSize(uint64_t minSize) {
+    _rewrite_min_size = minSize;
+}
+
+std::string DmdbAOFManager::GetAOFFile() {
+    return _aof_file;
+}
+
+bool DmdbAOFManager::IsAOFFileExisting() {
+    struct stat fileStat;
+    return stat(_aof_file.c_str(), &fileStat) == 0;
+}
+
+/* Returns INCOMPLETE if more data is needed, pos isn't moved unless the command is complete */
+RequestParseState DmdbAOFManager::ParseCommand(const std::string &buf, size_t &pos, std::string &commandName,
+                                               std::vector<std::string> &parameters) {
+    size_t cur = pos;
+    long long argc = 0;
+    RequestParseState state = ParseNumberLine(buf, cur, '*', argc);
+    if(state != RequestParseState::COMPLETE) {
+        return state;
+    }
+    if(argc <= 0) {
+        return RequestParseState::FAILED;
+    }
+    parameters.resize(argc - 1);
+    for(long long i = 0; i < argc; ++i) {
+        long long bulkLen = 0;
+        state = ParseNumberLine(buf, cur, '$', bulkLen);
+        if(state != RequestParseState::COMPLETE) {
+            return state;
+        }
+        if(bulkLen < 0) {
+            return RequestParseState::FAILED;
+        }
+        if(buf.length() - cur < static_cast<size_t>(bulkLen) + 2) {
+            return RequestParseState::INCOMPLETE;
+        }
+        if(buf[cur + bulkLen] != '\r' || buf[cur + bulkLen + 1] != '\n') {
+            return RequestParseState::FAILED;
+        }
+        std::string &arg = i == 0 ? commandName : parameters[i - 1];
+        arg.assign(buf, cur, bulkLen);
+        cur += bulkLen + 2;
+    }
+    pos = cur;
+    return RequestParseState::COMPLETE;
+}
+
+RequestParseState DmdbAOFManager::ParseNumberLine(const std::string &buf, size_t &cur, char prefix, long long &num) {
+    if(cur >= buf.length()) {
+        return RequestParseState::INCOMPLETE;
+    }
+    if(buf[cur] != prefix) {
+        return RequestParseState::FAILED;
+    }
+    size_t lineEnd = buf.find("\r\n", cur);
+    if(lineEnd == std::string::npos) {
+        return buf.length() - cur > 32 ? RequestParseState::FAILED : RequestParseState::INCOMPLETE;
+    }
+    char* numEnd = nullptr;
+    num = strtoll(buf.c_str() + cur + 1, &numEnd, 10);
+    if(numEnd != buf.c_str() + lineEnd) {
+        return RequestParseState::FAILED;
+    }
+    cur = lineEnd + 2;
+    return RequestParseState::COMPLETE;
+}
+
+/* A command log ends with a half written command if the server crashed while writing it, or with a
+ * transaction without EXEC. We load the complete part and cut the rest off, so the commands
+ * appended later can be loaded next time. A rewritten file may start with an RDB preamble rather
+ * than a command, it's loaded by the RDB manager and the commands after it are replayed */
+bool DmdbAOFManager::LoadAppendOnlyFile() {
+    DmdbAOFRequiredComponents components;
+    GetDmdbAOFRequiredComponents(components);
+    int fd = open(_aof_file.c_str(), O_RDONLY);
+    if(fd < 0) {
+        components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                    "Failed to open AOF file:%s! Error info:%s",
+                                                    _aof_file.c_str(), strerror(errno));
+        return false;
+    }
+    _is_loading = true;
+    /* Replies of the commands are dropped */
+    DmdbClientContact aofClient(-1, "aof", 0);
+    aofClient.SetChecked();
+    std::string buf;
+    size_t pos = 0;
+    /* The offset of buf[0] in the file */
+    uint64_t bufOffset = 0;
+    bool isInMulti = false;
+    uint64_t multiOffset = 0;
+    std::vector<DmdbQueuedCommand> multiCommands;
+    std::string commandName;
+    std::vector<std::string> parameters;
+    size_t commandsNum = 0;
+    bool isCorrupted = false;
+    bool isEof = false;
+    char firstByte = 0;
+
+    if(read(fd, &firstByte, sizeof(firstByte)) == sizeof(firstByte) && firstByte != '*') {
+        if(!components._rdb_manager->LoadDatabase(-1, _aof_file, &bufOffset)) {
+            close(fd);
+            _is_loading = false;
+            return false;
+        }
+    }
+    if(lseek(fd, bufOffset, SEEK_SET) < 0) {
+        components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                    "Failed to seek AOF file:%s! Error info:%s",
+                                                    _aof_file.c_str(), strerror(errno));
+        close(fd);
+        _is_loading = false;
+        return false;
+    }
+
+    while(!isEof && !isCorrupted) {
+        size_t oldLen = buf.length();
+        buf.resize(oldLen + AOF_READ_SIZE);
+        ssize_t readRet = read(fd, &buf[oldLen], AOF_READ_SIZE);
+        if(readRet < 0) {
+            if(errno == EINTR) {
+                buf.resize(oldLen);
+                continue;
+            }
+            components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                        "Failed to read AOF file:%s! Error info:%s",
+                                                        _aof_file.c_str(), strerror(errno));
+            close(fd);
+            _is_loading = false;
+            return false;
+        }
+        buf.resize(oldLen + readRet);
+        isEof = readRet == 0;
+
+        while(true) {
+            size_t commandStart = pos;
+            RequestParseState state = ParseCommand(buf, pos, commandName, parameters);
+            if(state == RequestParseState::INCOMPLETE) {
+                break;
+            }
+            DmdbCommand* command = state == RequestParseState::COMPLETE ? DmdbCommand::LookupCommand(commandName) : nullptr;
+            if(command == nullptr || !command->IsArityOk(parameters.size() + 1)) {
+                components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                            "Invalid command at offset %llu of AOF file:%s",
+                                                            static_cast<unsigned long long>(bufOffset + commandStart),
+                                                            _aof_file.c_str());
+                isCorrupted = true;
+                break;
+            }
+            if(command->GetName() == "multi") {
+                isInMulti = true;
+                multiOffset = bufOffset + commandStart;
+                multiCommands.clear();
+            } else if(command->GetName() == "exec") {
+                for(size_t i = 0; i < multiCommands.size(); ++i) {
+                    multiCommands[i]._command->Execute(aofClient, multiCommands[i]._parameters);
+                }
+                isInMulti = false;
+                multiCommands.clear();
+            } else if(isInMulti) {
+                multiCommands.push_back(DmdbQueuedCommand{command, parameters});
+            } else {
+                command->Execute(aofClient, parameters);
+            }
+            aofClient.ClearRepliedData(aofClient.GetOutputBufLength());
+            commandsNum++;
+        }
+        /* Drop the parsed commands */
+        buf.erase(0, pos);
+        bufOffset += pos;
+        pos = 0;
+    }
+    close(fd);
+    _is_loading = false;
+    if(isCorrupted) {
+        return false;
+    }
+
+    uint64_t validSize = isInMulti ? multiOffset : bufOffset;
+    uint64_t fileSize = bufOffset + buf.length();
+    if(validSize < fileSize) {
+        components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                    "AOF file:%s is truncated, the last %llu bytes are dropped",
+                                                    _aof_file.c_str(),
+                                                    static_cast<unsigned long long>(fileSize - validSize));
+        if(truncate(_aof_file.c_str(), validSize) < 0) {
+            components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                        "Failed to truncate AOF file:%s! Error info:%s",
+                                                        _aof_file.c_str(), strerror(errno));
+            return false;
+        }
+    }
+    components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE,
+                                                "AOF file:%s has been loaded successfully, %lu commands replayed",
+                                                _aof_file.c_str(), commandsNum);
+    return true;
+}
+
+bool DmdbAOFManager::StartAppendOnly() {
+    DmdbAOFRequiredComponents components;
+    GetDmdbAOFRequiredComponents(components);
+    if(!_is_aof_enabled || _aof_fd >= 0) {
+        return true;
+    }
+    _aof_fd = open(_aof_file.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if(_aof_fd < 0) {
+        components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                    "Failed to open AOF file:%s! Error info:%s",
+                                                    _aof_file.c_str(), strerror(errno));
+        return false;
+    }
+    struct stat fileStat;
+    if(fstat(_aof_fd, &fileStat) == 0) {
+        _aof_current_size = fileStat.st_size;
+        _aof_base_size = fileStat.st_size;
+    }
+    _last_fsync_ms = DmdbUtil::GetCurrentMs();
+    /* Signals should be handled by the main thread only */
+    sigset_t blockSet, oldSet;
+    sigfillset(&blockSet);
+    pthread_sigmask(SIG_BLOCK, &blockSet, &oldSet);
+    _background_thread = std::thread(&DmdbAOFManager::BackgroundJobMain, this);
+    pthread_sigmask(SIG_SETMASK, &oldSet, nullptr);
+    return true;
+}
+
+/* It's called when the server is shutting down, everything in _aof_buf is written and fsynced */
+void DmdbAOFManager::StopAppendOnly() {
+    if(_aof_fd < 0) {
+        return;
+    }
+    if(_rewrite_tmp_fd >= 0) {
+        AbortRewrite();
+    }
+    if(!_aof_buf.empty() && WriteAll(_aof_fd, _aof_buf.data(), _aof_buf.length())) {
+        _aof_buf.clear();
+    }
+    {
+        std::lock_guard<std::mutex> lock(_jobs_mutex);
+        _is_stopping = true;
+    }
+    _jobs_cond.notify_all();
+    if(_background_thread.joinable()) {
+        _background_thread.join();
+    }
+    fdatasync(_aof_fd);
+    close(_aof_fd);
+    _aof_fd = -1;
+}
+
+void DmdbAOFManager::CatMultiBulk(std::string &dst, const std::vector<std::string_view> &argv) {
+    dst += "*" + std::to_string(argv.size()) + "\r\n";
+    for(size_t i = 0; i < argv.size(); ++i) {
+        dst += "$" + std::to_string(argv[i].length()) + "\r\n";
+        dst.append(argv[i].data(), argv[i].length());
+        dst += "\r\n";
+    }
+}
+
+/* TTLs in the commands are relative to the time they are executed, they are changed into absolute
+ * time, otherwise the keys would live longer after every restart */
+void DmdbAOFManager::CatCommand(std::string &dst, DmdbCommand* command, const std::vector<std::string_view> &argv,
+                                std::string_view rawRequest) {
+    const std::string &commandName = command->GetName();
+    if(commandName == "expire" && argv.size() == 3) {
+        uint64_t expireTime = strtoull(std::string(argv[2]).c_str(), nullptr, 10) * 1000 + DmdbUtil::GetCurrentMs();
+        std::string expireTimeStr = std::to_string(expireTime);
+        CatMultiBulk(dst, {"pexpireat", argv[1], expireTimeStr});
+        return;
+    }
+    if(commandName == "set") {
+        std::vector<std::string> translatedArgv;
+        for(size_t i = 3; i + 1 < argv.size(); ++i) {
+            bool isEx = argv[i].length() == 2 && strncasecmp(argv[i].data(), "ex", 2) == 0;
+            bool isPx = argv[i].length() == 2 && strncasecmp(argv[i].data(), "px", 2) == 0;
+            if(!isEx && !isPx) {
+                continue;
+            }
+            if(translatedArgv.empty()) {
+                translatedArgv.assign(argv.begin(), argv.end());
+            }
+            uint64_t expireTime = strtoull(translatedArgv[i + 1].c_str(), nullptr, 10);
+            if(isEx) {
+                expireTime *= 1000;
+            }
+            translatedArgv[i] = "PXAT";
+            translatedArgv[i + 1] = std::to_string(expireTime + DmdbUtil::GetCurrentMs());
+            i++;
+        }
+        if(!translatedArgv.empty()) {
+            CatMultiBulk(dst, std::vector<std::string_view>(translatedArgv.begin(), translatedArgv.end()));
+            return;
+        }
+    }
+    if(rawRequest.empty()) {
+        CatMultiBulk(dst, argv);
+    } else {
+        dst.append(rawRequest.data(), rawRequest.length());
+    }
+}
+
+void DmdbAOFManager::FeedCommand(DmdbCommand* command, const std::vector<std::string_view> &argv, std::string_view rawRequest) {
+    if(!_is_aof_enabled || _is_loading) {
+        return;
+    }
+    size_t oldLen = _aof_buf.length();
+    CatCommand(_aof_buf, command, argv, rawRequest);
+    if(_is_rewriting) {
+        _rewrite_buf.append(_aof_buf, oldLen, std::string::npos);
+    }
+}
+
+void DmdbAOFManager::FeedRawData(std::string_view data) {
+    if(!_is_aof_enabled || _is_loading) {
+        return;
+    }
+    _aof_buf.append(data.data(), data.length());
+    if(_is_rewriting) {
+        _rewrite_buf.append(data.data(), data.length());
+    }
+}
+
+bool DmdbAOFManager::WriteAll(int fd, const char* data, size_t len) {
+    size_t written = 0;
+    while(written < len) {
+        ssize_t ret = write(fd, data + written, len - written);
+        if(ret < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        written += ret;
+    }
+    return true;
+}
+
+/* It's called before the replies are sent. With "always" the fsync is done here, otherwise the
+ * background thread does it */
+void DmdbAOFManager::FlushAppendOnlyFile() {
+    if(_aof_fd < 0) {
+        return;
+    }
+    AppendRewriteBufIfNeed();
+    DmdbAOFRequiredComponents components;
+    GetDmdbAOFRequiredComponents(components);
+    if(_last_fsync_errno.load(std::memory_order_relaxed) != 0) {
+        components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                    "Failed to fsync AOF file:%s in the background! Error info:%s",
+                                                    _aof_file.c_str(), strerror(_last_fsync_errno.exchange(0)));
+    }
+    if(_fsync_policy == AOFFsyncPolicy::ALWAYS) {
+        /* The replies are sent right after we return, so all the commands must be on disk by then.
+         * We can't tell the clients their commands are lost, exiting is the only choice */
+        if(_aof_buf.empty()) {
+            return;
+        }
+        if(!WriteAll(_aof_fd, _aof_buf.data(), _aof_buf.length()) || fdatasync(_aof_fd) < 0) {
+            components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                        "Failed to write AOF file:%s with fsync policy always! Error info:%s",
+                                                        _aof_file.c_str(), strerror(errno));
+            DmdbUtil::ServerExitWithErrMsg("Failed to write AOF file:" + _aof_file);
+        }
+        _aof_current_size += _aof_buf.length();
+        _aof_buf.clear();
+        _is_fsync_needed = false;
+        return;
+    }
+    if(!_aof_buf.empty()) {
+        ssize_t ret = write(_aof_fd, _aof_buf.data(), _aof_buf.length());
+        if(ret < 0 && errno != EINTR && errno != EAGAIN) {
+            components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                        "Failed to write AOF file:%s, we'll try again later! Error info:%s",
+                                                        _aof_file.c_str(), strerror(errno));
+        }
+        if(ret > 0) {
+            /* The rest is written next time */
+            _aof_buf.erase(0, ret);
+            _aof_current_size += ret;
+            _is_fsync_needed = true;
+        }
+    }
+    if(!_is_fsync_needed || _fsync_policy == AOFFsyncPolicy::NO) {
+        return;
+    }
+    uint64_t currentMs = DmdbUtil::GetCurrentMs();
+    if(currentMs - _last_fsync_ms >= AOF_EVERYSEC_INTERVAL_MS && !_is_fsync_in_progress.load(std::memory_order_acquire)) {
+        _is_fsync_in_progress.store(true, std::memory_order_relaxed);
+        AddBackgroundJob(AOFBackgroundJobType::FSYNC, _aof_fd);
+        _is_fsync_needed = false;
+        _last_fsync_ms = currentMs;
+    }
+}
+
+void DmdbAOFManager::RewriteIfNeed() {
+    if(_aof_fd < 0 || _is_rewriting || _rewrite_percentage == 0 || _aof_current_size < _rewrite_min_size) {
+        return;
+    }
+    DmdbAOFRequiredComponents components;
+    GetDmdbAOFRequiredComponents(components);
+    if(components._rdb_manager->IsAOFRewritePlanned()) {
+        return;
+    }
+    uint64_t baseSize = _aof_base_size > 0 ? _aof_base_size : 1;
+    uint64_t growth = (_aof_current_size - baseSize) * 100 / baseSize;
+    if(_aof_current_size > baseSize && growth >= _rewrite_percentage) {
+        components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE,
+                                                    "AOF file:%s grows %llu%%, start to rewrite it",
+                                                    _aof_file.c_str(), static_cast<unsigned long long>(growth));
+        components._rdb_manager->SetAOFRewritePlan();
+    }
+}
+
+std::string DmdbAOFManager::GetRewriteTmpFile(pid_t childPid, uint64_t childStartMs) {
+    return std::to_string(childPid) + "_" + std::to_string(childStartMs) + ".aof";
+}
+
+/* It runs in the rdb child. With the preamble the data is saved in the RDB format, it's much faster to
+ * load than the commands, otherwise a SET command is generated for every pair. The commands executed
+ * since the child was created are appended by the parent in both cases */
+SaveRetCode DmdbAOFManager::RewriteAppendOnlyFile(const std::string &tmpFile) {
+    DmdbAOFRequiredComponents components;
+    GetDmdbAOFRequiredComponents(components);
+    if(*components._is_preamble) {
+        SaveRetCode retCode = components._rdb_manager->SaveData(-1, false, tmpFile);
+        if(retCode != SaveRetCode::SAVE_OK) {
+            return retCode;
+        }
+        int fd = open(tmpFile.c_str(), O_WRONLY);
+        if(fd < 0 || fdatasync(fd) < 0) {
+            if(fd >= 0) {
+                close(fd);
+            }
+            return SaveRetCode::WRITE_ERR;
+        }
+        close(fd);
+        return SaveRetCode::SAVE_OK;
+    }
+    int fd = open(tmpFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+        components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                    "Failed to open temp AOF file:%s! Error info:%s",
+                                                    tmpFile.c_str(), strerror(errno));
+        return SaveRetCode::OPEN_ERR;
+    }
+    std::string buf;
+    bool isOver = false;
+    size_t pairsAmount = 0;
+    while(!isOver) {
+        isOver = components._database_manager->GetNPairsFormatCommandSequential(buf, AOF_REWRITE_PAIRS_PER_ROUND, pairsAmount);
+        if(buf.length() < AOF_REWRITE_WRITE_SIZE && !isOver) {
+            continue;
+        }
+        if(!WriteAll(fd, buf.data(), buf.length())) {
+            components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                        "Failed to write temp AOF file:%s! Error info:%s",
+                                                        tmpFile.c_str(), strerror(errno));
+            close(fd);
+            return SaveRetCode::WRITE_ERR;
+        }
+        buf.clear();
+    }
+    if(fdatasync(fd) < 0) {
+        close(fd);
+        return SaveRetCode::WRITE_ERR;
+    }
+    close(fd);
+    return SaveRetCode::SAVE_OK;
+}
+
+/* It's called by the parent right after the rewrite child is created */
+void DmdbAOFManager::StartRewriteBuf() {
+    _is_rewriting = true;
+    _rewrite_buf.clear();
+}
+
+/* The commands executed while the child was running are appended to the new file by
+ * AppendRewriteBufIfNeed() in bounded chunks, then the new file replaces the old one */
+void DmdbAOFManager::HandleRewriteOver(bool isOk, const std::string &tmpFile) {
+    DmdbAOFRequiredComponents components;
+    GetDmdbAOFRequiredComponents(components);
+    if(!isOk) {
+        components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                    "Failed to rewrite AOF file:%s", _aof_file.c_str());
+        unlink(tmpFile.c_str());
+        _is_rewriting = false;
+        _rewrite_buf.clear();
+        return;
+    }
+    _rewrite_tmp_fd = open(tmpFile.c_str(), O_WRONLY | O_APPEND);
+    _rewrite_tmp_file = tmpFile;
+    if(_rewrite_tmp_fd < 0) {
+        components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                    "Failed to open temp AOF file:%s! Error info:%s",
+                                                    tmpFile.c_str(), strerror(errno));
+        AbortRewrite();
+        return;
+    }
+    /* _is_rewriting stays true, the new commands go on being appended to _rewrite_buf */
+    _rewrite_buf_written = 0;
+    _rewrite_buf_last_len = _rewrite_buf.length();
+    AppendRewriteBufIfNeed();
+}
+
+bool DmdbAOFManager::IsRewriteFinishing() {
+    return _rewrite_tmp_fd >= 0;
+}
+
+/* It's called once per loop. At most max(AOF_REWRITE_APPEND_CHUNK_SIZE, 2 * the bytes fed since the
+ * last call) bytes are written, so the loop never blocks on a big buffer, and the buffer still shrinks
+ * however fast the commands come */
+void DmdbAOFManager::AppendRewriteBufIfNeed() {
+    if(_rewrite_tmp_fd < 0) {
+        return;
+    }
+    size_t fedLen = _rewrite_buf.length() - _rewrite_buf_last_len;
+    size_t len = std::min(_rewrite_buf.length() - _rewrite_buf_written, std::max(AOF_REWRITE_APPEND_CHUNK_SIZE, 2 * fedLen));
+    if(!WriteAll(_rewrite_tmp_fd, _rewrite_buf.data() + _rewrite_buf_written, len)) {
+        DmdbAOFRequiredComponents components;
+        GetDmdbAOFRequiredComponents(components);
+        components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                    "Failed to append the rewrite buffer to temp AOF file:%s! Error info:%s",
+                                                    _rewrite_tmp_file.c_str(), strerror(errno));
+        AbortRewrite();
+        return;
+    }
+    _rewrite_buf_written += len;
+    _rewrite_buf_last_len = _rewrite_buf.length();
+    if(_rewrite_buf_written == _rewrite_buf.length()) {
+        SwitchToRewrittenFile();
+    }
+}
+
+/* The old file is complete, it's still the AOF */
+void DmdbAOFManager::AbortRewrite() {
+    if(_rewrite_tmp_fd >= 0) {
+        close(_rewrite_tmp_fd);
+        _rewrite_tmp_fd = -1;
+    }
+    unlink(_rewrite_tmp_file.c_str());
+    _is_rewriting = false;
+    _rewrite_buf.clear();
+    _rewrite_buf.shrink_to_fit();
+}
+
+void DmdbAOFManager::SwitchToRewrittenFile() {
+    DmdbAOFRequiredComponents components;
+    GetDmdbAOFRequiredComponents(components);
+    if(rename(_rewrite_tmp_file.c_str(), _aof_file.c_str()) < 0) {
+        components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                    "Failed to rename temp AOF file:%s! Error info:%s",
+                                                    _rewrite_tmp_file.c_str(), strerror(errno));
+        AbortRewrite();
+        return;
+    }
+    int newFd = _rewrite_tmp_fd;
+    _rewrite_tmp_fd = -1;
+    _is_rewriting = false;
+    struct stat fileStat;
+    if(fstat(newFd, &fileStat) == 0) {
+        _aof_current_size = fileStat.st_size;
+        _aof_base_size = fileStat.st_size;
+    }
+    if(_aof_fd >= 0) {
+        /* The old file has been replaced, it's deleted when its last fd is closed */
+        AddBackgroundJob(AOFBackgroundJobType::CLOSE, _aof_fd);
+    }
+    _aof_fd = newFd;
+    /* Everything in _aof_buf is in _rewrite_buf too, it's already in the new file */
+    _aof_buf.clear();
+    _rewrite_buf.clear();
+    _rewrite_buf.shrink_to_fit();
+    if(_fsync_policy == AOFFsyncPolicy::ALWAYS) {
+        fdatasync(_aof_fd);
+    } else if(_fsync_policy == AOFFsyncPolicy::EVERYSEC) {
+        _is_fsync_needed = true;
+    }
+    components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE,
+                                                "AOF file:%s has been rewritten successfully", _aof_file.c_str());
+}
+
+void DmdbAOFManager::AddBackgroundJob(AOFBackgroundJobType type, int fd) {
+    {
+        std::lock_guard<std::mutex> lock(_jobs_mutex);
+        _background_jobs.push_back(DmdbAOFBackgroundJob{type, fd});
+    }
+    _jobs_cond.notify_one();
+}
+
+void DmdbAOFManager::BackgroundJobMain() {
+    while(true) {
+        DmdbAOFBackgroundJob job;
+        {
+            std::unique_lock<std::mutex> lock(_jobs_mutex);
+            _jobs_cond.wait(lock, [this]() { return _is_stopping || !_background_jobs.empty(); });
+            /* The jobs left are done before we stop */
+            if(_background_jobs.empty()) {
+                return;
+            }
+            job = _background_jobs.front();
+            _background_jobs.pop_front();
+        }
+        if(job._type == AOFBackgroundJobType::FSYNC) {
+            if(fdatasync(job._fd) < 0) {
+                _last_fsync_errno.store(errno, std::memory_order_relaxed);
+            }
+            _is_fsync_in_progress.store(false, std::memory_order_release);
+        } else {
+            close(job._fd);
+        }
+    }
+}
+
+DmdbAOFManager::DmdbAOFManager(const std::string &file) {
+    _aof_file = file;
+    _is_aof_enabled = false;
+    _is_loading = false;
+    _fsync_policy = AOFFsyncPolicy::EVERYSEC;
+    _aof_fd = -1;
+    _is_fsync_needed = false;
+    _last_fsync_ms = 0;
+    _aof_current_size = 0;
+    _aof_base_size = 0;
+    _rewrite_percentage = 100;
+    _rewrite_min_size = 64*1024*1024;
+    _is_rewriting = false;
+    _rewrite_tmp_fd = -1;
+    _rewrite_buf_written = 0;
+    _rewrite_buf_last_len = 0;
+    _is_stopping = false;
+    _is_fsync_in_progress.store(false);
+    _last_fsync_errno.store(0);
+}
+
+DmdbAOFManager::~DmdbAOFManager() {
+    StopAppendOnly();
+}
+
+}
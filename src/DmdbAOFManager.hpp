@@ -0,0 +1,136 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+
+namespace Dmdb {
+
+class DmdbServerLogger;
+class DmdbDatabaseManager;
+class DmdbRDBManager;
+class DmdbCommand;
+enum class SaveRetCode;
+enum class RequestParseState;
+
+struct DmdbAOFRequiredComponents {
+    DmdbServerLogger* _server_logger;
+    DmdbDatabaseManager* _database_manager;
+    DmdbRDBManager* _rdb_manager;
+    /* The rewritten AOF starts with an RDB snapshot, see DmdbAOFManager::RewriteAppendOnlyFile() */
+    bool* _is_preamble;
+};
+
+enum class AOFFsyncPolicy {
+    /* fsync after every write, a reply is sent only after its command is on the disk */
+    ALWAYS,
+    /* fsync once a second in the background thread */
+    EVERYSEC,
+    /* Never fsync, the kernel decides when the data is on the disk */
+    NO
+};
+
+enum class AOFBackgroundJobType {
+    FSYNC,
+    /* Closing the fd of a replaced AOF deletes the old file, it may take a long time */
+    CLOSE
+};
+
+struct DmdbAOFBackgroundJob {
+    AOFBackgroundJobType _type;
+    int _fd;
+};
+
+/* Write commands are appended to _aof_buf in the RESP format, _aof_buf is written to the file before
+ * the replies are sent(see DmdbServer::DoService()), so a client never sees a reply of a command
+ * which is not in the file. The file is rewritten by the RDB child, the commands executed while the
+ * child is running are kept in _rewrite_buf and appended to the new file in chunks after the child exits */
+class DmdbAOFManager {
+public:
+    static DmdbAOFManager* GetUniqueAOFManagerInstance(const std::string &file);
+    static bool String2FsyncPolicy(const std::string &str, AOFFsyncPolicy &policy);
+    void SetAOFEnabled(bool isEnabled);
+    bool IsAOFEnabled();
+    void SetFsyncPolicy(AOFFsyncPolicy policy);
+    void SetRewritePercentage(uint64_t percentage);
+    void SetRewriteMinSize(uint64_t minSize);
+    std::string GetAOFFile();
+    bool IsAOFFileExisting();
+    bool LoadAppendOnlyFile();
+    bool StartAppendOnly();
+    void StopAppendOnly();
+    /* rawRequest is the request received from the client, it's empty if the command isn't from a client */
+    void FeedCommand(DmdbCommand* command, const std::vector<std::string_view> &argv, std::string_view rawRequest);
+    void CatCommand(std::string &dst, DmdbCommand* command, const std::vector<std::string_view> &argv, std::string_view rawRequest);
+    void FeedRawData(std::string_view data);
+    void FlushAppendOnlyFile();
+    void RewriteIfNeed();
+    /* The functions below are called by DmdbRDBManager for the rewrite child */
+    std::string GetRewriteTmpFile(pid_t childPid, uint64_t childStartMs);
+    SaveRetCode RewriteAppendOnlyFile(const std::string &tmpFile);
+    void StartRewriteBuf();
+    void HandleRewriteOver(bool isOk, const std::string &tmpFile);
+    /* The child has exited, but the rewrite buffer isn't all in the new file yet */
+    bool IsRewriteFinishing();
+    ~DmdbAOFManager();
+private:
+    DmdbAOFManager(const std::string &file);
+    DmdbAOFManager(const DmdbAOFManager&);
+    DmdbAOFManager& operator=(const DmdbAOFManager&);
+    static void CatMultiBulk(std::string &dst, const std::vector<std::string_view> &argv);
+    RequestParseState ParseCommand(const std::string &buf, size_t &pos, std::string &commandName,
+                                   std::vector<std::string> &parameters);
+    RequestParseState ParseNumberLine(const std::string &buf, size_t &cur, char prefix, long long &num);
+    bool WriteAll(int fd, const char* data, size_t len);
+    void AppendRewriteBufIfNeed();
+    void AbortRewrite();
+    void SwitchToRewrittenFile();
+    void AddBackgroundJob(AOFBackgroundJobType type, int fd);
+    void BackgroundJobMain();
+    static thread_local DmdbAOFManager* _instance;
+    std::string _aof_file;
+    bool _is_aof_enabled;
+    bool _is_loading;
+    AOFFsyncPolicy _fsync_policy;
+    int _aof_fd;
+    std::string _aof_buf;
+    /* Bytes written to the file but not fsynced yet */
+    bool _is_fsync_needed;
+    uint64_t _last_fsync_ms;
+    uint64_t _aof_current_size;
+    /* The size after the last rewrite, the file is rewritten when it grows _rewrite_percentage
+     * percent bigger than it and isn't smaller than _rewrite_min_size. 0 percent means never */
+    uint64_t _aof_base_size;
+    uint64_t _rewrite_percentage;
+    uint64_t _rewrite_min_size;
+    bool _is_rewriting;
+    std::string _rewrite_buf;
+    /* The new file the rewrite buffer is being appended to, it's -1 if the child isn't over */
+    int _rewrite_tmp_fd;
+    std::string _rewrite_tmp_file;
+    size_t _rewrite_buf_written;
+    /* The length of _rewrite_buf after the last append */
+    size_t _rewrite_buf_last_len;
+    /* The background thread runs the jobs in order, so the fd of an old file is
+     * closed after all the fsync of it */
+    std::thread _background_thread;
+    std::mutex _jobs_mutex;
+    std::condition_variable _jobs_cond;
+    std::deque<DmdbAOFBackgroundJob> _background_jobs;
+    bool _is_stopping;
+    std::atomic<bool> _is_fsync_in_progress;
+    /* Set by the background thread, it's logged by the main thread */
+    std::atomic<int> _last_fsync_errno;
+};
+
+}
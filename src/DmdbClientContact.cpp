@@ -1,28 +1,65 @@
+#include <stdlib.h>
+
 #include "DmdbClientContact.hpp"
 #include "DmdbServerFriends.hpp"
 #include "DmdbClientManager.hpp"
 #include "DmdbServerLogger.hpp"
 #include "DmdbReplicationManager.hpp"
 #include "DmdbCommand.hpp"
+#include "DmdbUtil.hpp"
+#include "DmdbSharedString.hpp"
+#include "DmdbReplBufBlock.hpp"
+#include "DmdbEventProcessor.hpp"
+#include "DmdbShardManager.hpp"
+#include "DmdbAOFManager.hpp"
+#include "DmdbDatabaseManager.hpp"
 
 
 namespace Dmdb {
 
 const size_t PROTO_MULTI_MAX_SIZE = 64*1024;
-
-DmdbClientContact::DmdbClientContact(int fd, const std::string &ip, int port) {
+const long long PROTO_MULTIBULK_MAX_LEN = 1024*1024;
+const long long PROTO_BULK_MAX_LEN = 512*1024*1024;
+/* The default size of a read and of the input buffer */
+const size_t PROTO_IOBUF_LEN = 16*1024;
+const size_t PROTO_READ_MAX_SIZE = 1024*1024;
+/* Bulk arguments not smaller than it are read with one read() if possible */
+const size_t PROTO_MBULK_BIG_ARG = 32*1024;
+/* Processed bytes are moved out of the input buffer only when there are so many of them,
+ * or when we need room for reading */
+const size_t INPUT_BUF_COMPACT_THRESHOLD = 64*1024;
+const size_t REPLY_BLOCK_SIZE = 16*1024;
+
+DmdbClientContact::DmdbClientContact(int fd, const std::string &ip, int port, uint64_t clientId) {
     _client_socket = fd;
+    _client_id = clientId;
     _client_ip = ip;
     _client_port = port;
     _client_name = ip+":"+std::to_string(port);
     _client_status = 0;
+    _input_buf = nullptr;
+    _input_buf_capacity = 0;
+    _input_buf_length = 0;
     _process_pos_of_input_buf = 0;
+    _input_read_size = PROTO_IOBUF_LEN;
+    _parse_pos = 0;
+    _parse_multibulk_len = 0;
+    _parse_bulk_len = -1;
+    _protocol_error_log = nullptr;
+    _is_request_parsed_ahead = false;
+    _parsed_ahead_state = RequestParseState::INCOMPLETE;
+    _parsed_ahead_end = 0;
+    _reply_sent_pos = 0;
+    _reply_bytes = 0;
+    _last_io_state = ClientIOState::OK;
+    _last_io_errno = 0;
     _is_chekced = false;
     _is_multi_state = false;
 }
 
 DmdbClientContact::~DmdbClientContact() {
-
+    free(_input_buf);
+    ClearRepliedData(_reply_bytes);
 }
 
 std::string DmdbClientContact::GetClientName() {
@@ -34,153 +71,451 @@ int DmdbClientContact::GetClientSocket() {
     return _client_socket;
 }
 
+uint64_t DmdbClientContact::GetClientId() {
+    return _client_id;
+}
+
 
 void DmdbClientContact::AddReplyData2Client(const std::string &replyData) {
-    _client_output_buffer.append(replyData);
+    AddReplyData2Client(replyData.data(), replyData.length());
+}
+
+/* Copy data into the reply blocks, a new block is added when the last one is full */
+void DmdbClientContact::AddReplyData2Client(const char* data, size_t len) {
+    PutIntoPendingWriteIfNeed();
+    while(len > 0) {
+        if(_reply_nodes.empty() || _reply_nodes.back()._block == nullptr || _reply_nodes.back()._used == REPLY_BLOCK_SIZE) {
+            _reply_nodes.push_back({new char[REPLY_BLOCK_SIZE], nullptr, 0, nullptr, 0});
+        }
+        DmdbReplyNode &node = _reply_nodes.back();
+        size_t copyLen = std::min(len, REPLY_BLOCK_SIZE - node._used);
+        memcpy(node._block + node._used, data, copyLen);
+        node._used += copyLen;
+        data += copyLen;
+        len -= copyLen;
+        _reply_bytes += copyLen;
+    }
+}
+
+/* Reply the content of sharedStr without copying it, the output buffer holds a reference of it */
+void DmdbClientContact::AddReplySharedString2Client(DmdbSharedString* sharedStr) {
+    if(sharedStr->GetLength() == 0) {
+        return;
+    }
+    PutIntoPendingWriteIfNeed();
+    sharedStr->IncrRefCount();
+    _reply_nodes.push_back({nullptr, sharedStr, sharedStr->GetLength(), nullptr, 0});
+    _reply_bytes += sharedStr->GetLength();
+}
+
+void DmdbClientContact::AddReplyReplBlock2Client(DmdbReplBufBlock* block, size_t pos, size_t len) {
+    if(len == 0) {
+        return;
+    }
+    PutIntoPendingWriteIfNeed();
+    _reply_bytes += len;
+    if(!_reply_nodes.empty()) {
+        DmdbReplyNode &node = _reply_nodes.back();
+        if(node._repl_block == block && node._repl_block_pos + node._used == pos) {
+            node._used += len;
+            return;
+        }
+    }
+    block->IncrRefCount();
+    _reply_nodes.push_back({nullptr, nullptr, len, block, pos});
+}
+
+const char* DmdbClientContact::GetReplyNodeData(const DmdbReplyNode &node) {
+    if(node._block != nullptr) {
+        return node._block;
+    }
+    if(node._shared_str != nullptr) {
+        return node._shared_str->GetData();
+    }
+    return node._repl_block->GetData() + node._repl_block_pos;
+}
+
+/* DmdbClientManager will write the replies to the socket before it waits for events again,
+ * so we needn't register EPOLLOUT for every reply */
+void DmdbClientContact::PutIntoPendingWriteIfNeed() {
+    if(_client_socket < 0 || (_client_status & static_cast<uint32_t>(ClientStatus::PENDING_WRITE))) {
+        return;
+    }
+    DmdbClientContactRequiredComponent components;
+    GetDmdbClientContactRequiredComponent(components);
+    components._client_manager->AddClientToPendingWrite(this);
 }
 
 size_t DmdbClientContact::GetInputBufLength() {
-    return _client_input_buffer.length();
+    return _input_buf_length - _process_pos_of_input_buf;
 }
 
 size_t DmdbClientContact::GetOutputBufLength() {
-    return _client_output_buffer.length();
-} 
+    return _reply_bytes;
+}
 
-const char* DmdbClientContact::GetOutputBuf() {
-    return _client_output_buffer.c_str();
-} 
+/* Fill iov with the unsent data, returns the number of iovecs filled */
+int DmdbClientContact::GetOutputIovecs(struct iovec* iov, int maxIovCnt) {
+    int iovCnt = 0;
+    size_t skip = _reply_sent_pos;
+    for(std::deque<DmdbReplyNode>::iterator it = _reply_nodes.begin(); it != _reply_nodes.end() && iovCnt < maxIovCnt; ++it) {
+        const char* data = GetReplyNodeData(*it);
+        iov[iovCnt].iov_base = const_cast<char*>(data + skip);
+        iov[iovCnt].iov_len = it->_used - skip;
+        skip = 0;
+        iovCnt++;
+    }
+    return iovCnt;
+}
 
-void DmdbClientContact::AppendDataToInputBuf(char* data) {
-    _client_input_buffer += data;
+/* Read until the socket is drained or the input buffer is full */
+ClientIOState DmdbClientContact::ReadFromSocket() {
+    _last_io_state = ClientIOState::OK;
+    while(!IsInputBufFull()) {
+        size_t freeSize = 0;
+        char* buf = GetInputBufFreeSpace(freeSize);
+        ssize_t ret = read(_client_socket, buf, freeSize);
+        if(ret < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                _last_io_errno = errno;
+                _last_io_state = ClientIOState::FAILED;
+            }
+            break;
+        } else if(ret == 0) {
+            _last_io_state = ClientIOState::CLOSED;
+            break;
+        }
+        IncreaseInputBufLength(static_cast<size_t>(ret));
+    }
+    return _last_io_state;
 }
 
-void DmdbClientContact::ClearRepliedData(size_t repliedLen) {
-    if(repliedLen == _client_output_buffer.length()) {
-        _client_output_buffer.clear();
+/* Write as much as the socket accepts */
+ClientIOState DmdbClientContact::WriteToSocket() {
+    _last_io_state = ClientIOState::OK;
+    struct iovec iov[REPLY_IOV_MAX];
+    while(_reply_bytes > 0) {
+        int iovCnt = GetOutputIovecs(iov, REPLY_IOV_MAX);
+        if(iovCnt == 0) {
+            break;
+        }
+        size_t expectedLen = 0;
+        for(int i = 0; i < iovCnt; ++i) {
+            expectedLen += iov[i].iov_len;
+        }
+        ssize_t ret = writev(_client_socket, iov, iovCnt);
+        if(ret < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                _last_io_errno = errno;
+                _last_io_state = ClientIOState::FAILED;
+            }
+            break;
+        }
+        ClearRepliedData(static_cast<size_t>(ret));
+        /* The socket buffer is full */
+        if(static_cast<size_t>(ret) < expectedLen) {
+            break;
+        }
+    }
+    return _last_io_state;
+}
+
+ClientIOState DmdbClientContact::GetLastIOState() {
+    return _last_io_state;
+}
+
+int DmdbClientContact::GetLastIOErrno() {
+    return _last_io_errno;
+}
+
+/* Make sure there is room for a read and return where the data should be read to */
+char* DmdbClientContact::GetInputBufFreeSpace(size_t &freeSize) {
+    size_t readSize = _input_read_size;
+    /* If we are waiting for a big bulk argument, try to read the rest of it at once */
+    if(_parse_bulk_len >= static_cast<long long>(PROTO_MBULK_BIG_ARG)) {
+        size_t bulkEnd = _parse_pos + static_cast<size_t>(_parse_bulk_len) + 2;
+        if(bulkEnd > _input_buf_length && bulkEnd - _input_buf_length > readSize) {
+            readSize = bulkEnd - _input_buf_length;
+        }
+    }
+    MakeRoomForInputBuf(readSize);
+    freeSize = _input_buf_capacity - _input_buf_length;
+    return _input_buf + _input_buf_length;
+}
+
+void DmdbClientContact::IncreaseInputBufLength(size_t readLen) {
+    /* A read filling the whole space means more data is waiting, so read more next time */
+    if(readLen >= _input_read_size && _input_read_size < PROTO_READ_MAX_SIZE) {
+        _input_read_size *= 2;
+    } else if(readLen < _input_read_size / 4 && _input_read_size > PROTO_IOBUF_LEN) {
+        _input_read_size /= 2;
+    }
+    _input_buf_length += readLen;
+}
+
+/* Stop reading when too much data is waiting to be processed, the rest stays in the socket
+ * and will be read after we have processed some of it */
+bool DmdbClientContact::IsInputBufFull() {
+    return GetInputBufLength() >= PROTO_READ_MAX_SIZE;
+}
+
+void DmdbClientContact::MakeRoomForInputBuf(size_t needSize) {
+    if(_input_buf_capacity - _input_buf_length >= needSize) {
         return;
     }
-    _client_output_buffer = _client_output_buffer.substr(repliedLen, _client_output_buffer.length()-repliedLen);
+    if(_process_pos_of_input_buf > 0) {
+        CompactInputBuf();
+        if(_input_buf_capacity - _input_buf_length >= needSize) {
+            return;
+        }
+    }
+    size_t newCapacity = _input_buf_capacity == 0 ? PROTO_IOBUF_LEN : _input_buf_capacity * 2;
+    if(newCapacity < _input_buf_length + needSize) {
+        newCapacity = _input_buf_length + needSize;
+    }
+    char* newBuf = static_cast<char*>(realloc(_input_buf, newCapacity));
+    DmdbUtil::ServerAssert(newBuf != nullptr, "realloc input buffer");
+    _input_buf = newBuf;
+    _input_buf_capacity = newCapacity;
 }
 
-void DmdbClientContact::ClearProcessedData() {
-    if(_process_pos_of_input_buf == _client_input_buffer.length()) {
-        _client_input_buffer.clear();
-    } else {
-        _client_input_buffer = _client_input_buffer.substr(_process_pos_of_input_buf, _client_input_buffer.length()-_process_pos_of_input_buf);
+/* Move the unprocessed data to the beginning of the input buffer */
+void DmdbClientContact::CompactInputBuf() {
+    size_t shift = _process_pos_of_input_buf;
+    if(shift == 0) {
+        return;
     }
+    memmove(_input_buf, _input_buf + shift, _input_buf_length - shift);
+    _input_buf_length -= shift;
     _process_pos_of_input_buf = 0;
+    if(_parse_multibulk_len > 0 || _is_request_parsed_ahead) {
+        _parse_pos -= shift;
+        for(size_t i = 0; i < _request_args.size(); ++i) {
+            _request_args[i]._offset -= shift;
+        }
+    }
+    if(_is_request_parsed_ahead) {
+        _parsed_ahead_end -= shift;
+    }
+}
+
+/* Drop the nodes which have been sent completely */
+void DmdbClientContact::ClearRepliedData(size_t repliedLen) {
+    _reply_bytes -= repliedLen;
+    while(repliedLen > 0 && !_reply_nodes.empty()) {
+        DmdbReplyNode &node = _reply_nodes.front();
+        size_t leftLen = node._used - _reply_sent_pos;
+        if(repliedLen < leftLen) {
+            _reply_sent_pos += repliedLen;
+            return;
+        }
+        repliedLen -= leftLen;
+        if(node._block != nullptr) {
+            delete[] node._block;
+        } else if(node._shared_str != nullptr) {
+            node._shared_str->DecrRefCount();
+        } else {
+            node._repl_block->DecrRefCount();
+        }
+        _reply_nodes.pop_front();
+        _reply_sent_pos = 0;
+    }
+}
+
+std::string DmdbClientContact::TakeReplyData() {
+    std::string replyData;
+    replyData.reserve(_reply_bytes);
+    size_t skip = _reply_sent_pos;
+    for(std::deque<DmdbReplyNode>::iterator it = _reply_nodes.begin(); it != _reply_nodes.end(); ++it) {
+        const char* data = GetReplyNodeData(*it);
+        replyData.append(data + skip, it->_used - skip);
+        skip = 0;
+    }
+    ClearRepliedData(_reply_bytes);
+    return replyData;
+}
+
+void DmdbClientContact::ClearProcessedData() {
+    if(_process_pos_of_input_buf == _input_buf_length) {
+        _input_buf_length = 0;
+        _process_pos_of_input_buf = 0;
+        /* Give back the memory taken by a big request */
+        if(_input_buf_capacity > PROTO_IOBUF_LEN && _input_read_size == PROTO_IOBUF_LEN) {
+            free(_input_buf);
+            _input_buf = nullptr;
+            _input_buf_capacity = 0;
+        }
+    } else if(_process_pos_of_input_buf >= INPUT_BUF_COMPACT_THRESHOLD) {
+        CompactInputBuf();
+    }
+}
+
+RequestParseState DmdbClientContact::SetProtocolError(const std::string &errMsg, const char* logMsg) {
+    _protocol_error_reply = errMsg;
+    _protocol_error_log = logMsg;
+    return RequestParseState::FAILED;
 }
 
-bool DmdbClientContact::ProcessOneMultiProtocolRequest(size_t &startPos) {
+void DmdbClientContact::ReplyProtocolErrorAndClose() {
     DmdbClientContactRequiredComponent components;
     GetDmdbClientContactRequiredComponent(components);
-    if(_client_input_buffer[startPos] != '*') {
-        std::string errMsg = "-ERR Protocol error: invalid start character\r\n";
-        AddReplyData2Client(errMsg);
-        components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE, 
-                                                    "Client %s sent a request with invalid protocol start character",
-                                                    _client_name.c_str());
-        _client_status |= static_cast<uint32_t>(ClientStatus::CLOSE_AFTER_REPLY);
+    AddReplyData2Client(_protocol_error_reply);
+    components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE, _protocol_error_log, _client_name.c_str());
+    _client_status |= static_cast<uint32_t>(ClientStatus::CLOSE_AFTER_REPLY);
+}
+
+/* Parse the decimal number in [start, end) of the input buffer, an optional '-' is allowed */
+bool DmdbClientContact::ParseProtocolNumber(size_t start, size_t end, long long &num) {
+    bool isNegative = false;
+    if(start < end && _input_buf[start] == '-') {
+        isNegative = true;
+        start++;
+    }
+    /* 18 digits can't overflow long long, and protocol numbers never need more */
+    if(start == end || end - start > 18) {
         return false;
     }
-    size_t lineEndPos = _client_input_buffer.find("\r\n", startPos+1);
-    if(lineEndPos == _client_input_buffer.npos) {
-        /* If <= PROTO_MULTI_MAX_SIZE, maybe the remaining data hasn't been received, 
-         * so we can't judge it is a protocol err */
-        if(_client_input_buffer.size() - startPos > PROTO_MULTI_MAX_SIZE) {
-            std::string errMsg = "-ERR Protocol error: too big mbulk count string\r\n";
-            AddReplyData2Client(errMsg);
-            components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE, 
-                                                        "Client %s sent a request with too big mbulk count string",
-                                                        _client_name.c_str());
-            _client_status |= static_cast<uint32_t>(ClientStatus::CLOSE_AFTER_REPLY);
-            return false;            
+    long long result = 0;
+    for(size_t i = start; i < end; ++i) {
+        if(_input_buf[i] < '0' || _input_buf[i] > '9') {
+            return false;
         }
+        result = result * 10 + (_input_buf[i] - '0');
     }
-    std::string strParaNum = _client_input_buffer.substr(startPos+1, lineEndPos-startPos-1);
-    uint32_t paraNum = strtoul(strParaNum.c_str(), nullptr, 10);
-    if(paraNum>1024*1024 || errno==ERANGE) {
-        std::string errMsg = "-ERR Protocol error: invalid multibulk length\r\n";
-        AddReplyData2Client(errMsg);
-        components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE,
-                                                    "Client %s sent a request with invalid multibulk length",
-                                                    _client_name.c_str());
-        _client_status |= static_cast<uint32_t>(ClientStatus::CLOSE_AFTER_REPLY);
-        return false;
-    }
-    startPos = lineEndPos+2;
-    uint32_t i = 0;
-    for(; i < paraNum && startPos < _client_input_buffer.size(); ++i) {
-        if(_client_input_buffer[startPos] != '$') {
-            std::string errMsg = "-ERR Protocol error: expected '$', got ";
-            errMsg.push_back(_client_input_buffer[startPos]);
-            AddReplyData2Client(errMsg);
-            components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE,
-                                                        "Client %s sent a request with format error",
-                                                        _client_name.c_str());
-            _client_status |= static_cast<uint32_t>(ClientStatus::CLOSE_AFTER_REPLY);
-            return false;            
-        } 
-        lineEndPos = _client_input_buffer.find("\r\n", startPos);
-        if(lineEndPos == _client_input_buffer.npos) {
-            if(_client_input_buffer.size() - startPos > PROTO_MULTI_MAX_SIZE) {
-                std::string errMsg = "-ERR Protocol error: too big bulk count string\r\n";
-                AddReplyData2Client(errMsg);
-                components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE, 
-                                                            "Client %s sent a request with too big bulk count string",
-                                                            _client_name.c_str());
-                _client_status |= static_cast<uint32_t>(ClientStatus::CLOSE_AFTER_REPLY);
-                return false;            
+    num = isNegative ? -result : result;
+    return true;
+}
+
+/* Parse one request of RESP multibulk format from _process_pos_of_input_buf. When a request
+ * is complete, its arguments are put into _argv as string_views pointing into the input buffer,
+ * and _process_pos_of_input_buf moves to the end of it. If the data isn't complete, the state
+ * is kept in _parse_xxx members, so we continue from where we stopped next time */
+RequestParseState DmdbClientContact::ProcessOneMultiProtocolRequest() {
+    if(_parse_multibulk_len == 0) {
+        _parse_pos = _process_pos_of_input_buf;
+        _request_args.clear();
+        if(_input_buf[_parse_pos] != '*') {
+            return SetProtocolError("-ERR Protocol error: invalid start character\r\n",
+                                    "Client %s sent a request with invalid protocol start character");
+        }
+        const char* lineEnd = static_cast<const char*>(memchr(_input_buf + _parse_pos, '\r', _input_buf_length - _parse_pos));
+        if(lineEnd == nullptr) {
+            /* If <= PROTO_MULTI_MAX_SIZE, maybe the remaining data hasn't been received, 
+             * so we can't judge it is a protocol err */
+            if(_input_buf_length - _parse_pos > PROTO_MULTI_MAX_SIZE) {
+                return SetProtocolError("-ERR Protocol error: too big mbulk count string\r\n",
+                                        "Client %s sent a request with too big mbulk count string");
             }
+            return RequestParseState::INCOMPLETE;
         }
-        std::string strBulkLen = _client_input_buffer.substr(startPos+1, lineEndPos-startPos-1);
-        uint32_t bulkLen = strtoul(strBulkLen.c_str(), nullptr, 10);
-        if(errno == ERANGE || bulkLen > 512*1024*1024) {
-            std::string errMsg = "-ERR Protocol error: invalid bulk length\r\n";
-            AddReplyData2Client(errMsg);
-            components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE,
-                                                        "Client %s sent a request with invalid bulk length",
-                                                        _client_name.c_str());
-            _client_status |= static_cast<uint32_t>(ClientStatus::CLOSE_AFTER_REPLY);
-            return false;
+        size_t lineEndPos = lineEnd - _input_buf;
+        if(lineEndPos + 1 >= _input_buf_length) {
+            return RequestParseState::INCOMPLETE;
         }
-        startPos = lineEndPos+2;
-        lineEndPos = _client_input_buffer.find("\r\n", startPos);
-        if((lineEndPos-startPos) != bulkLen) {
-            std::string errMsg = "-ERR Protocol error: the parameter's length doesn't equal bulk length\r\n";
-            AddReplyData2Client(errMsg);
-            components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE,
-                                                        "Client %s sent a request whose parameter's length doesn't equal its bulk length",
-                                                        _client_name.c_str());
-            _client_status |= static_cast<uint32_t>(ClientStatus::CLOSE_AFTER_REPLY);
-            return false;
-        }        
-        std::string parameter = _client_input_buffer.substr(startPos, lineEndPos-startPos);
-        if(i == 0) {
-            /* Factory pattern */
-            _current_command = DmdbCommand::GenerateCommandByName(parameter);
-            if(_current_command == nullptr) {
-                AddReplyData2Client("-ERR Unknown command:" + parameter + "\r\n");
-            } 
+        long long paraNum = 0;
+        if(!ParseProtocolNumber(_parse_pos + 1, lineEndPos, paraNum) || paraNum > PROTO_MULTIBULK_MAX_LEN) {
+            return SetProtocolError("-ERR Protocol error: invalid multibulk length\r\n",
+                                    "Client %s sent a request with invalid multibulk length");
+        }
+        _parse_pos = lineEndPos + 2;
+        if(paraNum <= 0) {
+            /* An empty request, just skip it */
+            _argv.clear();
+            _process_pos_of_input_buf = _parse_pos;
+            return RequestParseState::COMPLETE;
+        }
+        _parse_multibulk_len = paraNum;
+        _parse_bulk_len = -1;
+    }
 
-        } else {
-            if(_current_command != nullptr)
-                _current_command->AppendCommandPara(parameter);
+    while(_parse_multibulk_len > 0) {
+        if(_parse_bulk_len == -1) {
+            if(_parse_pos >= _input_buf_length) {
+                return RequestParseState::INCOMPLETE;
+            }
+            if(_input_buf[_parse_pos] != '$') {
+                std::string errMsg = "-ERR Protocol error: expected '$', got ";
+                errMsg.push_back(_input_buf[_parse_pos]);
+                errMsg += "\r\n";
+                return SetProtocolError(errMsg, "Client %s sent a request with format error");
+            }
+            const char* lineEnd = static_cast<const char*>(memchr(_input_buf + _parse_pos, '\r', _input_buf_length - _parse_pos));
+            if(lineEnd == nullptr) {
+                if(_input_buf_length - _parse_pos > PROTO_MULTI_MAX_SIZE) {
+                    return SetProtocolError("-ERR Protocol error: too big bulk count string\r\n",
+                                            "Client %s sent a request with too big bulk count string");
+                }
+                return RequestParseState::INCOMPLETE;
+            }
+            size_t lineEndPos = lineEnd - _input_buf;
+            if(lineEndPos + 1 >= _input_buf_length) {
+                return RequestParseState::INCOMPLETE;
+            }
+            long long bulkLen = 0;
+            if(!ParseProtocolNumber(_parse_pos + 1, lineEndPos, bulkLen) || bulkLen < 0 || bulkLen > PROTO_BULK_MAX_LEN) {
+                return SetProtocolError("-ERR Protocol error: invalid bulk length\r\n",
+                                        "Client %s sent a request with invalid bulk length");
+            }
+            _parse_pos = lineEndPos + 2;
+            _parse_bulk_len = bulkLen;
         }
-        startPos = lineEndPos+2;
-    }
-    if(i != paraNum) {
-        std::string errMsg = "-ERR Protocol error: the parameter's number doesn't equal mbulk length\r\n";
-        AddReplyData2Client(errMsg);
-        components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE,
-                                                    "Client %s sent a request whose parameter's number doesn't equal mbulk length",
-                                                    _client_name.c_str());
-        _client_status |= static_cast<uint32_t>(ClientStatus::CLOSE_AFTER_REPLY);
-        return false;
+        size_t bulkLen = static_cast<size_t>(_parse_bulk_len);
+        if(_input_buf_length - _parse_pos < bulkLen + 2) {
+            return RequestParseState::INCOMPLETE;
+        }
+        if(_input_buf[_parse_pos + bulkLen] != '\r' || _input_buf[_parse_pos + bulkLen + 1] != '\n') {
+            return SetProtocolError("-ERR Protocol error: the parameter's length doesn't equal bulk length\r\n",
+                                    "Client %s sent a request whose parameter's length doesn't equal its bulk length");
+        }
+        _request_args.push_back({_parse_pos, bulkLen});
+        _parse_pos += bulkLen + 2;
+        _parse_bulk_len = -1;
+        _parse_multibulk_len--;
     }
 
-    return true;
+    FillArgvOfRequest();
+    _process_pos_of_input_buf = _parse_pos;
+    return RequestParseState::COMPLETE;
+}
+
+void DmdbClientContact::FillArgvOfRequest() {
+    _argv.clear();
+    for(size_t i = 0; i < _request_args.size(); ++i) {
+        _argv.emplace_back(_input_buf + _request_args[i]._offset, _request_args[i]._length);
+    }
+}
+
+/* Called by I/O threads after reading, so the main thread only executes the first request.
+ * Only one request is parsed ahead, the others are parsed when they are executed */
+void DmdbClientContact::ParseRequestAhead() {
+    if(_is_request_parsed_ahead || _input_buf_length <= _process_pos_of_input_buf) {
+        return;
+    }
+    size_t requestStart = _process_pos_of_input_buf;
+    RequestParseState state = ProcessOneMultiProtocolRequest();
+    if(state == RequestParseState::INCOMPLETE) {
+        return;
+    }
+    _is_request_parsed_ahead = true;
+    _parsed_ahead_state = state;
+    _parsed_ahead_end = _process_pos_of_input_buf;
+    _process_pos_of_input_buf = requestStart;
+}
+
+RequestParseState DmdbClientContact::ParseNextRequest() {
+    if(_is_request_parsed_ahead) {
+        _is_request_parsed_ahead = false;
+        if(_parsed_ahead_state == RequestParseState::COMPLETE) {
+            /* The input buffer may have been moved since it was parsed */
+            FillArgvOfRequest();
+            _process_pos_of_input_buf = _parsed_ahead_end;
+        }
+        return _parsed_ahead_state;
+    }
+    if(_input_buf_length <= _process_pos_of_input_buf) {
+        return RequestParseState::INCOMPLETE;
+    }
+    return ProcessOneMultiProtocolRequest();
 }
 
 void DmdbClientContact::SetChecked() {
@@ -199,6 +534,10 @@ void DmdbClientContact::SetStatus(uint32_t status) {
     _client_status |= status;
 }
 
+void DmdbClientContact::ClearStatus(uint32_t status) {
+    _client_status &= ~status;
+}
+
 uint32_t DmdbClientContact::GetStatus() {
     return _client_status;
 }
@@ -207,36 +546,47 @@ size_t DmdbClientContact::GetMultiQueueSize() {
     return _exec_command_queue.size();
 }
 
-DmdbCommand* DmdbClientContact::PopCommandOfExec() {
-    DmdbCommand* command = nullptr;
-    if(_exec_command_queue.size() > 0) {
-        command = _exec_command_queue.front();
-        _exec_command_queue.pop();
+bool DmdbClientContact::PopCommandOfExec(DmdbQueuedCommand &queuedCommand) {
+    if(_exec_command_queue.empty()) {
+        return false;
     }
-    return command;
+    queuedCommand._command = _exec_command_queue.front()._command;
+    queuedCommand._parameters.swap(_exec_command_queue.front()._parameters);
+    _exec_command_queue.pop();
+    return true;
 }
 
 bool DmdbClientContact::ProcessClientRequest() {
     DmdbClientContactRequiredComponent components;
     GetDmdbClientContactRequiredComponent(components);
     size_t lastProcessedPos = _process_pos_of_input_buf;
+    RequestParseState parseState = RequestParseState::INCOMPLETE;
 
     /* We shouldn't pause the replication from master */
     while(!components._repl_manager->IsWaitting(this) && 
+          !(_client_status & static_cast<uint32_t>(ClientStatus::WAITING_SHARDS)) &&
           (!components._client_manager->AreClientsPaused() || components._repl_manager->IsMyMaster(this->GetClientName())) &&
-          _client_input_buffer.length() > _process_pos_of_input_buf && 
-          ProcessOneMultiProtocolRequest(_process_pos_of_input_buf) == true) {
+          (parseState = ParseNextRequest()) == RequestParseState::COMPLETE) {
+        if(_argv.empty()) {
+            lastProcessedPos = _process_pos_of_input_buf;
+            continue;
+        }
+        _current_command = DmdbCommand::LookupCommand(_argv[0]);
         if(_current_command == nullptr) {
+            AddReplyData2Client("-ERR Unknown command:" + std::string(_argv[0]) + "\r\n");
             lastProcessedPos = _process_pos_of_input_buf;
             continue;
         }
-            
-        std::string commandNameLower = _current_command->GetName();
-        std::transform(commandNameLower.begin(), commandNameLower.end(), commandNameLower.begin(), tolower);        
+        /* assign() reuses the capacity of the strings left by the last request */
+        _command_paras.resize(_argv.size() - 1);
+        for(size_t i = 1; i < _argv.size(); ++i) {
+            _command_paras[i - 1].assign(_argv[i].data(), _argv[i].size());
+        }
+        const std::string &commandName = _current_command->GetName();
         /* If this is a master client, _is_chekced will be set to true once the connection is created,
          * and master client won't replicate auth command to its replicas */
         if(!_is_chekced) {
-            if(commandNameLower != "auth") {
+            if(commandName != "auth") {
                 std::string errMsg = "-ERR unauthenticated\r\n";
                 AddReplyData2Client(errMsg);
                 components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE,
@@ -248,7 +598,7 @@ bool DmdbClientContact::ProcessClientRequest() {
                                 
             } else {
                 /* If Auth command executes successfully, it will set _is_checked to true */
-                _current_command->Execute(*this);
+                _current_command->Execute(*this, _command_paras);
                 if(!_is_chekced) {
                     components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE,
                                                                 "Client %s failed to authenticate",
@@ -261,47 +611,109 @@ bool DmdbClientContact::ProcessClientRequest() {
             }
             lastProcessedPos = _process_pos_of_input_buf;
         } else {
-            bool isWCommand = DmdbCommand::IsWCommand(_current_command->GetName());
+            if(!_current_command->IsArityOk(_argv.size())) {
+                AddReplyData2Client(_current_command->GetWrongArityMsg());
+                _current_command = nullptr;
+                lastProcessedPos = _process_pos_of_input_buf;
+                continue;
+            }
+            bool isWCommand = _current_command->HasFlag(CommandFlag::WRITE);
             
             if(!components._is_myself_master && isWCommand && components._repl_manager->GetMasterClientContact() != this) {
-                AddReplyData2Client("-ERR Command:" + _current_command->GetName() + " is forbidden in slave\r\n");
-                delete _current_command;
+                AddReplyData2Client("-ERR Command:" + commandName + " is forbidden in slave\r\n");
+                _current_command = nullptr;
+                lastProcessedPos = _process_pos_of_input_buf;
+                continue;
+            }
+            if(_current_command->HasFlag(CommandFlag::READONLY) && !components._repl_manager->IsDataServable()) {
+                AddReplyData2Client("-MASTERDOWN Link with master is down and replica_serve_stale_data is false\r\n");
+                _current_command = nullptr;
+                lastProcessedPos = _process_pos_of_input_buf;
+                continue;
+            }
+            /* In shard mode the keys may be owned by other shards, then the request is sent to them,
+             * and we stop here until all of them reply */
+            if(components._shard_manager->IsShardMode() && components._shard_manager->DispatchRequest(this, _current_command, _argv)) {
+                _current_command = nullptr;
+                lastProcessedPos = _process_pos_of_input_buf;
+                continue;
+            }
+            /* The commands from master are never refused, the master evicts keys for us */
+            if(_current_command->HasFlag(CommandFlag::DENYOOM) && !components._repl_manager->IsMyMaster(_client_name) &&
+               !FreeMemoryIfNeed()) {
+                AddReplyData2Client(OOM_ERR_REPLY);
                 _current_command = nullptr;
                 lastProcessedPos = _process_pos_of_input_buf;
                 continue;
             }
             /* If it is in multi state, we don't have to record lastProcessedPos because we will replicate the whole multi-exec
              * block if I am a master. First, replicate multi, then replicate the remaining. */
-            if(_is_multi_state && commandNameLower != "exec") {
-                _exec_command_queue.push(_current_command);
+            if(_is_multi_state && commandName != "exec") {
+                _exec_command_queue.push(DmdbQueuedCommand{_current_command, _command_paras});
                 if(!components._repl_manager->IsMyMaster(_client_name))
                     AddReplyData2Client("+QUEUED\r\n");
                 else
                     components._repl_manager->AddReplayOkSize(_process_pos_of_input_buf - lastProcessedPos);
                 if(components._is_myself_master) {
-                    components._repl_manager->ReplicateDataToSlaves(_client_input_buffer.substr(lastProcessedPos, _process_pos_of_input_buf - lastProcessedPos));
-                }              
+                    components._repl_manager->ReplicateDataToSlaves(_input_buf + lastProcessedPos, _process_pos_of_input_buf - lastProcessedPos);
+                }
+                /* The transaction is appended to the AOF as a whole when EXEC comes, so it won't be mixed with
+                 * the commands of other clients */
+                if(isWCommand && components._aof_manager->IsAOFEnabled()) {
+                    components._aof_manager->CatCommand(_aof_multi_buf, _current_command, _argv,
+                                                        std::string_view(_input_buf + lastProcessedPos, _process_pos_of_input_buf - lastProcessedPos));
+                }
                 lastProcessedPos = _process_pos_of_input_buf;
                 _current_command = nullptr;
                 continue;
             }
-            _current_command->Execute(*this);
-            if (components._is_myself_master && (_current_command->GetName() == "multi" || _current_command->GetName() == "exec" || isWCommand)) {
-                components._repl_manager->ReplicateDataToSlaves(_client_input_buffer.substr(lastProcessedPos, _process_pos_of_input_buf - lastProcessedPos));
+            _current_command->Execute(*this, _command_paras);
+            if (components._is_myself_master && (commandName == "multi" || commandName == "exec" || isWCommand)) {
+                components._repl_manager->ReplicateDataToSlaves(_input_buf + lastProcessedPos, _process_pos_of_input_buf - lastProcessedPos);
             }
 
-            if(components._repl_manager->IsMyMaster(this->GetClientName()) && (isWCommand || _current_command->GetName() == "multi" || _current_command->GetName() == "exec")) {
+            if(components._repl_manager->IsMyMaster(this->GetClientName()) && (isWCommand || commandName == "multi" || commandName == "exec")) {
                 components._repl_manager->AddReplayOkSize(_process_pos_of_input_buf - lastProcessedPos);
             }
+            if(components._aof_manager->IsAOFEnabled()) {
+                if(commandName == "exec" && !_aof_multi_buf.empty()) {
+                    components._aof_manager->FeedRawData("*1\r\n$5\r\nmulti\r\n");
+                    components._aof_manager->FeedRawData(_aof_multi_buf);
+                    components._aof_manager->FeedRawData("*1\r\n$4\r\nexec\r\n");
+                    _aof_multi_buf.clear();
+                } else if(isWCommand) {
+                    components._aof_manager->FeedCommand(_current_command, _argv,
+                                                         std::string_view(_input_buf + lastProcessedPos, _process_pos_of_input_buf - lastProcessedPos));
+                }
+            }
             lastProcessedPos = _process_pos_of_input_buf;
         }
-        delete _current_command;
         _current_command = nullptr;
     }
+    if(parseState == RequestParseState::FAILED) {
+        ReplyProtocolErrorAndClose();
+    }
     ClearProcessedData();
     return true;
 }
 
+bool DmdbClientContact::FreeMemoryIfNeed() {
+    DmdbClientContactRequiredComponent components;
+    GetDmdbClientContactRequiredComponent(components);
+    std::vector<std::string> evictedKeys;
+    bool isOk = components._database_manager->EvictKeysIfNeed(evictedKeys);
+    for(size_t i = 0; i < evictedKeys.size(); ++i) {
+        std::string command = "*2\r\n$3\r\ndel\r\n$" + std::to_string(evictedKeys[i].length()) + "\r\n" + evictedKeys[i] + "\r\n";
+        if(components._is_myself_master) {
+            components._repl_manager->ReplicateDataToSlaves(command.data(), command.length());
+        }
+        if(components._aof_manager->IsAOFEnabled()) {
+            components._aof_manager->FeedRawData(command);
+        }
+    }
+    return isOk;
+}
+
 bool DmdbClientContact::IsChecked() {
     return _is_chekced;
 }
@@ -1,9 +1,13 @@
 #pragma once
 #include <unistd.h>
 #include <string.h>
+#include <sys/uio.h>
 
 
 #include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
 #include <queue>
 
 namespace Dmdb {
@@ -12,60 +16,183 @@ class DmdbCommand;
 class DmdbServerLogger;
 class DmdbClientManager;
 class DmdbReplicationManager;
+class DmdbSharedString;
+class DmdbReplBufBlock;
+class DmdbShardManager;
+class DmdbAOFManager;
+class DmdbDatabaseManager;
 
 struct DmdbClientContactRequiredComponent {
     DmdbServerLogger* _server_logger;
     DmdbClientManager* _client_manager;
     DmdbReplicationManager* _repl_manager;
+    DmdbShardManager* _shard_manager;
+    DmdbAOFManager* _aof_manager;
+    DmdbDatabaseManager* _database_manager;
     bool _is_myself_master;
 };
 
+/* The reply of a write command refused because the used memory is over maxmemory */
+const char OOM_ERR_REPLY[] = "-OOM command not allowed when used memory > 'maxmemory'\r\n";
+
 /* We use _client_staus & ClientStatus to get client's status */
 enum class ClientStatus{
-    CLOSE_AFTER_REPLY = 1
+    CLOSE_AFTER_REPLY = 1,
+    /* The client is in the pending process list of DmdbClientManager */
+    PENDING_PROCESS = 2,
+    /* The client is in the pending write list of DmdbClientManager */
+    PENDING_WRITE = 4,
+    /* EPOLLOUT is registered for the client's socket */
+    WRITE_EVENT_ARMED = 8,
+    /* Someone else is writing to the socket(e.g. the rdb child), we mustn't write to it */
+    WRITE_PAUSED = 16,
+    /* The client is readable, it will be read by I/O threads later */
+    PENDING_READ = 32,
+    /* Its request was sent to other shards, it can't go on until all of them reply */
+    WAITING_SHARDS = 64
+};
+
+/* The result of the last read or write of the socket */
+enum class ClientIOState {
+    OK,
+    CLOSED,
+    FAILED
+};
+
+enum class RequestParseState {
+    COMPLETE,
+    INCOMPLETE,
+    FAILED
 };
 
+/* An argument of the request being parsed, we keep offsets rather than pointers
+ * because the input buffer may be moved by realloc or compaction */
+struct DmdbRequestArg {
+    size_t _offset;
+    size_t _length;
+};
+
+/* A command in MULTI is executed by EXEC later, so its parameters are copied */
+struct DmdbQueuedCommand {
+    DmdbCommand* _command;
+    std::vector<std::string> _parameters;
+};
+
+/* A node of the output buffer is either a reply block owned by the client, a reference
+ * to a big value which is shared with the database, or a part of a block of the replication
+ * stream which is shared by all the replicas(starting from _repl_block_pos) */
+struct DmdbReplyNode {
+    char* _block;
+    DmdbSharedString* _shared_str;
+    size_t _used;
+    DmdbReplBufBlock* _repl_block;
+    size_t _repl_block_pos;
+};
 
 class DmdbClientContact
 {
 public:
-    DmdbClientContact(int fd, const std::string &ip, int port);
+    DmdbClientContact(int fd, const std::string &ip, int port, uint64_t clientId = 0);
     ~DmdbClientContact();
     std::string GetClientName();
     int GetClientSocket();
+    uint64_t GetClientId();
     void AddReplyData2Client(const std::string &replyData);
-    void AppendDataToInputBuf(char* data);
+    void AddReplyData2Client(const char* data, size_t len);
+    void AddReplySharedString2Client(DmdbSharedString* sharedStr);
+    /* Reply len bytes of block from pos, it extends the last node if the data follows it */
+    void AddReplyReplBlock2Client(DmdbReplBufBlock* block, size_t pos, size_t len);
+    char* GetInputBufFreeSpace(size_t &freeSize);
+    void IncreaseInputBufLength(size_t readLen);
+    bool IsInputBufFull();
     size_t GetInputBufLength();
-    const char* GetOutputBuf();
+    int GetOutputIovecs(struct iovec* iov, int maxIovCnt);
     size_t GetOutputBufLength();
     void ClearRepliedData(size_t repliedLen);
-    bool ProcessOneMultiProtocolRequest(size_t &startPos);
+    /* Move all the replies out, it's used by the clients without a socket */
+    std::string TakeReplyData();
+    /* The 3 functions below only touch the client itself, so they can be called in I/O threads */
+    ClientIOState ReadFromSocket();
+    ClientIOState WriteToSocket();
+    void ParseRequestAhead();
+    ClientIOState GetLastIOState();
+    int GetLastIOErrno();
+    RequestParseState ProcessOneMultiProtocolRequest();
     bool ProcessClientRequest();
+    /* Evicts keys if the used memory is over maxmemory, the evictions are replicated and appended
+     * to the AOF as DEL. Returns false if the write command must be refused */
+    bool FreeMemoryIfNeed();
     void SetChecked();
     bool IsChecked();
     void SetMultiState(bool state);
     void SetStatus(uint32_t status);
+    void ClearStatus(uint32_t status);
     uint32_t GetStatus();
     bool IsMultiState();
-    DmdbCommand* PopCommandOfExec();
+    bool PopCommandOfExec(DmdbQueuedCommand &queuedCommand);
     std::string GetIp();
     int GetPort();
     size_t GetMultiQueueSize();
 
 private:
+    void PutIntoPendingWriteIfNeed();
+    static const char* GetReplyNodeData(const DmdbReplyNode &node);
     void ClearProcessedData();
+    void MakeRoomForInputBuf(size_t needSize);
+    void CompactInputBuf();
+    RequestParseState ParseNextRequest();
+    void FillArgvOfRequest();
+    RequestParseState SetProtocolError(const std::string &errMsg, const char* logMsg);
+    void ReplyProtocolErrorAndClose();
+    bool ParseProtocolNumber(size_t start, size_t end, long long &num);
     int _client_socket;
+    /* fd may be reused by a new client after the client is closed, but id won't */
+    uint64_t _client_id;
     std::string _client_ip;
     int _client_port;
     std::string _client_name;
-    std::string _client_input_buffer;
+    /* The input buffer is a plain byte array, so requests are binary safe. Bytes before
+     * _process_pos_of_input_buf have been processed, they are dropped by compaction */
+    char* _input_buf;
+    size_t _input_buf_capacity;
+    size_t _input_buf_length;
     size_t _process_pos_of_input_buf;
-    std::string _client_output_buffer;
+    /* How many bytes we try to read next time, it grows when reads fill the buffer */
+    size_t _input_read_size;
+    /* The parsing state of the current request, so a request arriving in many reads
+     * won't be parsed again from its start */
+    size_t _parse_pos;
+    long long _parse_multibulk_len;
+    long long _parse_bulk_len;
+    std::vector<DmdbRequestArg> _request_args;
+    /* The parser doesn't reply protocol errors by itself because it may run in I/O threads,
+     * the error is replied in ProcessClientRequest() */
+    std::string _protocol_error_reply;
+    const char* _protocol_error_log;
+    /* A request parsed by I/O threads before it's executed. _process_pos_of_input_buf stays at
+     * the start of it until the main thread takes it, so we can still replicate it */
+    bool _is_request_parsed_ahead;
+    RequestParseState _parsed_ahead_state;
+    size_t _parsed_ahead_end;
+    /* Arguments of the last parsed request, they point into _input_buf and are valid
+     * until we read data into the buffer again */
+    std::vector<std::string_view> _argv;
+    /* The output buffer is a chain of fixed size blocks and references, it's flushed with writev().
+     * _reply_sent_pos is how many bytes of the first node have been sent */
+    std::deque<DmdbReplyNode> _reply_nodes;
+    size_t _reply_sent_pos;
+    size_t _reply_bytes;
+    ClientIOState _last_io_state;
+    int _last_io_errno;
     uint32_t _client_status;
-    /* DmdbCommand* will be destructed immediately after DmdbCommand executed rather than
-     * after ~DmdbClientContact() executed */
+    /* The command of the request being executed, it points into the command table */
     DmdbCommand*  _current_command = nullptr;
-    std::queue<DmdbCommand*> _exec_command_queue;
+    /* The parameters of the request being executed, the vector and its strings are reused
+     * by the next request, so we needn't allocate memory for every request */
+    std::vector<std::string> _command_paras;
+    std::queue<DmdbQueuedCommand> _exec_command_queue;
+    /* The write commands of the transaction, they are appended to the AOF after EXEC */
+    std::string _aof_multi_buf;
     bool _is_chekced;
     bool _is_multi_state;
 };
@@ -6,10 +6,11 @@
 #include "DmdbEventManagerCommon.hpp"
 #include "DmdbServerFriends.hpp"
 #include "DmdbReplicationManager.hpp"
+#include "DmdbIOThreadManager.hpp"
 
 namespace Dmdb {
 
-DmdbClientManager* DmdbClientManager::_client_manager_instance = nullptr;
+thread_local DmdbClientManager* DmdbClientManager::_client_manager_instance = nullptr;
 
 /* The 3 functions below isn't necessary to be called before using DmdbClientManager actually */
 void DmdbClientManager::SetPortForClient(int portForClient) {
@@ -36,6 +37,10 @@ size_t DmdbClientManager::GetInBufMaxSizeForClient() {
     return _client_input_buf_max_size;
 }
 
+void DmdbClientManager::SetReusePortForClient(bool isReusePort) {
+    _is_reuse_port = isReusePort;
+}
+
 
 bool DmdbClientManager::StartToListenIPV4() {
     DmdbClientManagerRequiredComponent requiredComponents;
@@ -48,6 +53,16 @@ bool DmdbClientManager::StartToListenIPV4() {
         DmdbUtil::ServerHandleStartListenFailure(0);
         return false;
     }
+    if(_is_reuse_port) {
+        int val = 1;
+        if(setsockopt(serverIPV4Sock, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val)) == -1) {
+            requiredComponents._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING, 
+                                                                "Failed to set SO_REUSEPORT! Error info: %s",
+                                                                strerror(errno));
+            DmdbUtil::ServerHandleStartListenFailure(serverIPV4Sock);
+            return false;
+        }
+    }
     struct sockaddr_in address;
     bzero(&address, sizeof(address));
     address.sin_family = AF_INET;
@@ -83,6 +98,8 @@ DmdbClientManager::DmdbClientManager() {
     _is_clients_paused = false;
     _clients_pause_end_time = 0;
     _password = "123456";
+    _is_reuse_port = false;
+    _next_client_id = 1;
 }
 
 
@@ -110,12 +127,12 @@ int DmdbClientManager::GetListenedIPV4Fd() {
 }
 
 void DmdbClientManager::HandleConnForClient(int fd, const std::string &ip, int port) {
-    DmdbClientContact *clientContact = new DmdbClientContact(fd, ip, port);
+    DmdbClientContact *clientContact = new DmdbClientContact(fd, ip, port, _next_client_id++);
     _fd_client_map[fd] = clientContact;
     DmdbClientManagerRequiredComponent requiredComponents;
     GetDmdbClientManagerRequiredComponent(requiredComponents);
+    /* EPOLLOUT is only registered when the replies can't be written at once */
     requiredComponents._event_manager->AddEvent4Fd(fd, EpollEvent::IN, EventProcessorType::INTERACT);
-    requiredComponents._event_manager->AddEvent4Fd(fd, EpollEvent::OUT, EventProcessorType::INTERACT);
 }
 
 bool DmdbClientManager::DelIfExistsInToClose(int fd) {
@@ -194,31 +211,77 @@ DmdbClientContact* DmdbClientManager::GetClientContactByName(const std::string &
 }
 
 
-bool DmdbClientManager::AppendDataToClientInputBuf(int fd, char* data) {
-    std::unordered_map<int, DmdbClientContact*>::iterator it = _fd_client_map.find(fd);
-    if(it != _fd_client_map.end()) {
-        if(it->second->GetInputBufLength()+strlen(data) > _client_input_buf_max_size ) {
-            DmdbClientManagerRequiredComponent requiredComponents;
-            GetDmdbClientManagerRequiredComponent(requiredComponents);
-            requiredComponents._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
-                                                                  "Close client for exceeding the input buffer max size: %d, the current size: %d, request data size: %d", 
-                                                                  _client_input_buf_max_size, it->second->GetInputBufLength(), strlen(data));
-            DisconnectClient(fd);
-            return false;
+/* If I/O threads are enabled, the client is read later with other readable clients in parallel */
+void DmdbClientManager::ReadDataFromClient(int fd) {
+    DmdbClientManagerRequiredComponent requiredComponents;
+    GetDmdbClientManagerRequiredComponent(requiredComponents);
+    DmdbClientContact* clientContact = GetClientContactByFd(fd);
+    if(clientContact == nullptr) {
+        return;
+    }
+    if(requiredComponents._io_thread_manager->IsIOThreadsEnabled()) {
+        if(!(clientContact->GetStatus() & static_cast<uint32_t>(ClientStatus::PENDING_READ))) {
+            clientContact->SetStatus(static_cast<uint32_t>(ClientStatus::PENDING_READ));
+            _clients_pending_read.push_back(fd);
         }
-        it->second->AppendDataToInputBuf(data);
-        return true;
+        return;
     }
-    return false;
+    clientContact->ReadFromSocket();
+    HandleClientAfterReading(clientContact);
 }
 
-const char* DmdbClientManager::GetClientOutputBuf(int fd, size_t &bufLen) {
-    std::unordered_map<int, DmdbClientContact*>::iterator it = _fd_client_map.find(fd);
-    if(it != _fd_client_map.end()) {
-        bufLen = it->second->GetOutputBufLength();
-        return it->second->GetOutputBuf();
+size_t DmdbClientManager::HandleClientsWithPendingReads() {
+    if(_clients_pending_read.empty()) {
+        return 0;
     }
-    return nullptr;
+    DmdbClientManagerRequiredComponent requiredComponents;
+    GetDmdbClientManagerRequiredComponent(requiredComponents);
+    std::vector<DmdbClientContact*> clients;
+    for(size_t i = 0; i < _clients_pending_read.size(); ++i) {
+        DmdbClientContact* clientContact = GetClientContactByFd(_clients_pending_read[i]);
+        if(clientContact != nullptr) {
+            clientContact->ClearStatus(static_cast<uint32_t>(ClientStatus::PENDING_READ));
+            clients.push_back(clientContact);
+        }
+    }
+    _clients_pending_read.clear();
+    requiredComponents._io_thread_manager->ReadAndParseClients(clients);
+    for(size_t i = 0; i < clients.size(); ++i) {
+        HandleClientAfterReading(clients[i]);
+    }
+    return clients.size();
+}
+
+/* Returns false if the client is disconnected */
+bool DmdbClientManager::HandleClientAfterReading(DmdbClientContact* clientContact) {
+    DmdbClientManagerRequiredComponent requiredComponents;
+    GetDmdbClientManagerRequiredComponent(requiredComponents);
+    int fd = clientContact->GetClientSocket();
+    if(clientContact->GetLastIOState() == ClientIOState::FAILED) {
+        requiredComponents._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                            "Failed to read data from fd: %d, error info: %s",
+                                                            fd, strerror(clientContact->GetLastIOErrno()));
+        DisconnectClient(fd);
+        return false;
+    }
+    if(clientContact->GetLastIOState() == ClientIOState::CLOSED) {
+        requiredComponents._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE,
+                                                            "Client: %s closed the connection",
+                                                            clientContact->GetClientName().c_str());
+        DisconnectClient(fd);
+        return false;
+    }
+    if(clientContact->GetInputBufLength() > _client_input_buf_max_size) {
+        requiredComponents._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                            "Close client for exceeding the input buffer max size: %zu, the current size: %zu", 
+                                                            _client_input_buf_max_size, clientContact->GetInputBufLength());
+        DisconnectClient(fd);
+        return false;
+    }
+    if(clientContact->GetInputBufLength() > 0) {
+        AddClientToPendingProcess(clientContact);
+    }
+    return true;
 }
 
 std::string DmdbClientManager::GetNameOfClient(int fd) {
@@ -237,35 +300,152 @@ DmdbClientContact* DmdbClientManager::GetClientContactByFd(int fd) {
     return nullptr;    
 }
 
-void DmdbClientManager::HandleClientAfterWritting(int fd, size_t writedLen) {
+void DmdbClientManager::AddClientToPendingProcess(DmdbClientContact* clientContact) {
+    if(clientContact->GetStatus() & static_cast<uint32_t>(ClientStatus::PENDING_PROCESS)) {
+        return;
+    }
+    clientContact->SetStatus(static_cast<uint32_t>(ClientStatus::PENDING_PROCESS));
+    _clients_pending_process.push_back(clientContact->GetClientSocket());
+}
+
+void DmdbClientManager::AddClientToPendingWrite(DmdbClientContact* clientContact) {
+    if(clientContact->GetStatus() & static_cast<uint32_t>(ClientStatus::PENDING_WRITE)) {
+        return;
+    }
+    clientContact->SetStatus(static_cast<uint32_t>(ClientStatus::PENDING_WRITE));
+    _clients_pending_write.push_back(clientContact->GetClientSocket());
+}
+
+bool DmdbClientManager::WriteDataToClient(int fd) {
     std::unordered_map<int, DmdbClientContact*>::iterator it = _fd_client_map.find(fd);
     if(it != _fd_client_map.end()) {
-        it->second->ClearRepliedData(writedLen);
+        return WriteDataToClient(it->second);
     }
+    return false;
+}
+
+/* Write as much as the socket accepts. Returns false if the client is disconnected */
+bool DmdbClientManager::WriteDataToClient(DmdbClientContact* clientContact) {
+    if(clientContact->GetStatus() & static_cast<uint32_t>(ClientStatus::WRITE_PAUSED)) {
+        return true;
+    }
+    clientContact->WriteToSocket();
+    return HandleClientAfterWriting(clientContact);
+}
+
+/* EPOLLOUT is registered only if some data is left, and it's removed once the output buffer
+ * is drained. Returns false if the client is disconnected */
+bool DmdbClientManager::HandleClientAfterWriting(DmdbClientContact* clientContact) {
+    DmdbClientManagerRequiredComponent requiredComponents;
+    GetDmdbClientManagerRequiredComponent(requiredComponents);
+    int fd = clientContact->GetClientSocket();
+    if(clientContact->GetLastIOState() == ClientIOState::FAILED) {
+        requiredComponents._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING, 
+                                                            "Failed to write data for fd: %d, error info: %s",
+                                                            fd, strerror(clientContact->GetLastIOErrno()));
+        DisconnectClient(fd);
+        return false;
+    }
+    bool isArmed = clientContact->GetStatus() & static_cast<uint32_t>(ClientStatus::WRITE_EVENT_ARMED);
+    if(clientContact->GetOutputBufLength() > 0 && !isArmed) {
+        requiredComponents._event_manager->AddEvent4Fd(fd, EpollEvent::OUT, EventProcessorType::INTERACT);
+        clientContact->SetStatus(static_cast<uint32_t>(ClientStatus::WRITE_EVENT_ARMED));
+    } else if(clientContact->GetOutputBufLength() == 0 && isArmed) {
+        requiredComponents._event_manager->DelEvent4Fd(fd, EpollEvent::OUT);
+        clientContact->ClearStatus(static_cast<uint32_t>(ClientStatus::WRITE_EVENT_ARMED));
+    }
+    return true;
+}
+
+/* Try to write the replies directly before we return to epoll_wait(), most replies are
+ * small and the socket can take them at once, so we needn't a writable event for them */
+size_t DmdbClientManager::HandleClientsWithPendingWrites() {
+    if(_clients_pending_write.empty()) {
+        return 0;
+    }
+    DmdbClientManagerRequiredComponent requiredComponents;
+    GetDmdbClientManagerRequiredComponent(requiredComponents);
+    std::vector<DmdbClientContact*> clients;
+    for(size_t i = 0; i < _clients_pending_write.size(); ++i) {
+        DmdbClientContact* clientContact = GetClientContactByFd(_clients_pending_write[i]);
+        if(clientContact == nullptr) {
+            continue;
+        }
+        clientContact->ClearStatus(static_cast<uint32_t>(ClientStatus::PENDING_WRITE));
+        /* If EPOLLOUT is armed, the socket buffer was full just now, let the writable event handle it */
+        if(clientContact->GetStatus() & (static_cast<uint32_t>(ClientStatus::WRITE_EVENT_ARMED) | 
+                                         static_cast<uint32_t>(ClientStatus::WRITE_PAUSED))) {
+            continue;
+        }
+        if(clientContact->GetOutputBufLength() == 0) {
+            continue;
+        }
+        clients.push_back(clientContact);
+    }
+    _clients_pending_write.clear();
+    requiredComponents._io_thread_manager->WriteToClients(clients);
+    for(size_t i = 0; i < clients.size(); ++i) {
+        HandleClientAfterWriting(clients[i]);
+    }
+    return clients.size();
+}
+
+/* Used when the socket is taken over by someone else, e.g. the rdb child sending the RDB to a replica.
+ * The replies are kept in the output buffer until ResumeWritingToClient() */
+void DmdbClientManager::PauseWritingToClient(DmdbClientContact* clientContact) {
+    clientContact->SetStatus(static_cast<uint32_t>(ClientStatus::WRITE_PAUSED));
+    if(clientContact->GetStatus() & static_cast<uint32_t>(ClientStatus::WRITE_EVENT_ARMED)) {
+        DmdbClientManagerRequiredComponent requiredComponents;
+        GetDmdbClientManagerRequiredComponent(requiredComponents);
+        requiredComponents._event_manager->DelEvent4Fd(clientContact->GetClientSocket(), EpollEvent::OUT);
+        clientContact->ClearStatus(static_cast<uint32_t>(ClientStatus::WRITE_EVENT_ARMED));
+    }
+}
+
+void DmdbClientManager::ResumeWritingToClient(DmdbClientContact* clientContact) {
+    clientContact->ClearStatus(static_cast<uint32_t>(ClientStatus::WRITE_PAUSED));
+    if(clientContact->GetOutputBufLength() > 0) {
+        AddClientToPendingWrite(clientContact);
+    }
+}
+
+/* The client may have nothing to read, so we put it into _clients_to_close directly */
+void DmdbClientManager::CloseClientAfterReply(DmdbClientContact* clientContact) {
+    clientContact->SetStatus(static_cast<uint32_t>(ClientStatus::CLOSE_AFTER_REPLY));
+    InsertToCloseIfNotExists(clientContact);
 }
 
 size_t DmdbClientManager::ProcessClientsRequest() {
     size_t processedNum = 0;
     DmdbClientManagerRequiredComponent requiredComponents;
     GetDmdbClientManagerRequiredComponent(requiredComponents);
-    for(std::unordered_map<int, DmdbClientContact*>::iterator it = _fd_client_map.begin();
-        it != _fd_client_map.end();
-        it++) {
+    std::vector<int> pendingFds;
+    pendingFds.swap(_clients_pending_process);
+    for(size_t i = 0; i < pendingFds.size(); ++i) {
+        DmdbClientContact* clientContact = GetClientContactByFd(pendingFds[i]);
+        if(clientContact == nullptr) {
+            continue;
+        }
+        clientContact->ClearStatus(static_cast<uint32_t>(ClientStatus::PENDING_PROCESS));
+        if(clientContact->GetStatus() & static_cast<uint32_t>(ClientStatus::CLOSE_AFTER_REPLY)) {
+            InsertToCloseIfNotExists(clientContact);
+            continue;
+        }
         /* we shouldn't pause replication from master */
-        if(!_is_clients_paused || requiredComponents._repl_manager->IsMyMaster(it->second->GetClientName())) {
-            if(it->second->GetStatus() & static_cast<uint32_t>(ClientStatus::CLOSE_AFTER_REPLY)) {
-                InsertToCloseIfNotExists(it->second);
-            } else {
-                it->second->ProcessClientRequest();
-            }
+        bool isMaster = requiredComponents._repl_manager->IsMyMaster(clientContact->GetClientName());
+        if(isMaster || !AreClientsPaused()) {
+            clientContact->ProcessClientRequest();
             processedNum++;
-        } else {
-            uint64_t currentMs = DmdbUtil::GetCurrentMs();
-            if(currentMs >= static_cast<uint64_t>(_clients_pause_end_time)) {
-                UnpauseClients();
-            } else {
-                return processedNum;
-            }
+        }
+        if(clientContact->GetStatus() & static_cast<uint32_t>(ClientStatus::CLOSE_AFTER_REPLY)) {
+            InsertToCloseIfNotExists(clientContact);
+            continue;
+        }
+        /* The client is blocked by WAIT or CLIENT PAUSE with requests left in its input buffer, 
+         * nothing will be read from it maybe, so we check it again in the next loop */
+        if(clientContact->GetInputBufLength() > 0 && 
+           (requiredComponents._repl_manager->IsWaitting(clientContact) || (!isMaster && AreClientsPaused()))) {
+            AddClientToPendingProcess(clientContact);
         }
     }
     return processedNum;
@@ -286,7 +466,8 @@ size_t DmdbClientManager::CloseInvalidClients() {
     std::list<DmdbClientContact*>::iterator it = _clients_to_close.begin();
     std::list<DmdbClientContact*>::iterator toDel = it;
     while(it != _clients_to_close.end()) {
-        if((*it)->GetOutputBufLength() > 0) {
+        /* Wait for the replies being written unless nobody can write them */
+        if((*it)->GetOutputBufLength() > 0 && !((*it)->GetStatus() & static_cast<uint32_t>(ClientStatus::WRITE_PAUSED))) {
             it++;
             continue;
         }
@@ -299,7 +480,9 @@ size_t DmdbClientManager::CloseInvalidClients() {
 }
 
 void DmdbClientManager::ProcessClients() {
+    HandleClientsWithPendingReads();
     ProcessClientsRequest();
+    HandleClientsWithPendingWrites();
     CloseInvalidClients();
 }
 
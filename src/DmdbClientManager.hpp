@@ -1,10 +1,12 @@
 #pragma once
 
 #include <stddef.h>
+#include <sys/uio.h>
 
 #include <string>
 #include <unordered_map>
 #include <list>
+#include <vector>
 
 namespace Dmdb {
 
@@ -12,6 +14,7 @@ class DmdbEventManager;
 class DmdbClientContact;
 class DmdbServerLogger;
 class DmdbReplicationManager;
+class DmdbIOThreadManager;
 /* All these members matches a member of DmdbServer, they may be necessary for 
  * DmdbClientManger's operations, the pointer members can affect DmdbServer's 
  * members */
@@ -19,6 +22,7 @@ struct DmdbClientManagerRequiredComponent {
     DmdbEventManager *_event_manager;
     DmdbServerLogger *_server_logger;
     DmdbReplicationManager *_repl_manager;
+    DmdbIOThreadManager *_io_thread_manager;
     std::string _server_ipv4;
     int _server_tcp_backlog;
 
@@ -32,15 +36,24 @@ public:
     bool DisconnectClientByName(const std::string &name);
     DmdbClientContact* GetClientContactByName(const std::string &name);
     static DmdbClientManager* GetUniqueClientManagerInstance();
-    bool AppendDataToClientInputBuf(int fd, char* data);
-    const char* GetClientOutputBuf(int fd, size_t &bufLen);
-    void HandleClientAfterWritting(int fd, size_t writedLen);
+    void ReadDataFromClient(int fd);
+    size_t HandleClientsWithPendingReads();
+    bool WriteDataToClient(int fd);
+    bool WriteDataToClient(DmdbClientContact* clientContact);
+    void AddClientToPendingProcess(DmdbClientContact* clientContact);
+    void AddClientToPendingWrite(DmdbClientContact* clientContact);
+    size_t HandleClientsWithPendingWrites();
+    void PauseWritingToClient(DmdbClientContact* clientContact);
+    void ResumeWritingToClient(DmdbClientContact* clientContact);
+    void CloseClientAfterReply(DmdbClientContact* clientContact);
     int GetListenedIPV4Fd();
     bool StartToListenIPV4();
     void SetPortForClient(int portForClient);
     void SetTimeoutForClient(int timeoutSeconds);
     void SetInBufMaxSizeForClient(size_t inBufMaxSize);
     void SetPassword(const std::string &password);
+    /* Every shard listens on the same port in shard mode */
+    void SetReusePortForClient(bool isReusePort);
     std::string GetNameOfClient(int fd);
     DmdbClientContact* GetClientContactByFd(int fd);
     int GetPortForClient();
@@ -56,17 +69,27 @@ public:
     ~DmdbClientManager();
 private:
     DmdbClientManager();
+    bool HandleClientAfterReading(DmdbClientContact* clientContact);
+    bool HandleClientAfterWriting(DmdbClientContact* clientContact);
     bool DelIfExistsInToClose(int fd);
     bool InsertToCloseIfNotExists(DmdbClientContact* clientContact);
-    static DmdbClientManager* _client_manager_instance;
+    static thread_local DmdbClientManager* _client_manager_instance;
     std::unordered_map<int, DmdbClientContact*> _fd_client_map;
     size_t _client_input_buf_max_size;
     int _port_for_client;
     int _bind_ipv4_fd_for_client;
+    bool _is_reuse_port;
+    uint64_t _next_client_id;
     bool _is_clients_paused;
     uint64_t _clients_pause_end_time;
     int _client_timeout_seconds;
     std::list<DmdbClientContact*> _clients_to_close;
+    /* Only the clients in these lists have work to do, so we needn't iterate all the clients
+     * in every loop. We keep fds rather than pointers, a client may be freed while it is
+     * still in the lists */
+    std::vector<int> _clients_pending_read;
+    std::vector<int> _clients_pending_process;
+    std::vector<int> _clients_pending_write;
     std::string _password;
 };
 
@@ -1,3 +1,5 @@
+#include <strings.h>
+
 #include <algorithm>
 
 
@@ -9,73 +11,124 @@
 #include "DmdbRDBManager.hpp"
 #include "DmdbClientManager.hpp"
 #include "DmdbReplicationManager.hpp"
+#include "DmdbAOFManager.hpp"
+#include "DmdbShardManager.hpp"
 
 
 namespace Dmdb {
 
-DmdbCommand* DmdbCommand::GenerateCommandByName(const std::string &name) {
-    std::string lowerName = name;
-    std::transform(lowerName.begin(), lowerName.end(), lowerName.begin(), tolower);
-    if(lowerName == "auth") {
-        return new DmdbAuthCommand(lowerName);
-    } else if(lowerName == "multi") {
-        return new DmdbMultiCommand(lowerName);
-    } else if(lowerName == "exec") {
-        return new DmdbExecCommand(lowerName);
-    } else if(lowerName == "set") {
-        return new DmdbSetCommand(lowerName);
-    } else if(lowerName == "get") {
-        return new DmdbGetCommand(lowerName);
-    } else if(lowerName == "del") {
-        return new DmdbDelCommand(lowerName);
-    } else if(lowerName == "exists") {
-        return new DmdbExistsCommand(lowerName);
-    } else if(lowerName == "mset") {
-        return new DmdbMSetCommand(lowerName);
-    } else if(lowerName == "expire") {
-        return new DmdbExpireCommand(lowerName);
-    } else if(lowerName == "keys") {
-        return new DmdbKeysCommand(lowerName);
-    } else if(lowerName == "dbsize") {
-        return new DmdbDbsizeCommand(lowerName);
-    } else if(lowerName == "ping") {
-        return new DmdbPingCommand(lowerName);
-    } else if(lowerName == "echo") {
-        return new DmdbEchoCommand(lowerName);
-    } else if(lowerName == "save") {
-        return new DmdbSaveCommand(lowerName);
-    } else if(lowerName == "type") {
-        return new DmdbTypeCommand(lowerName);
-    } else if(lowerName == "pttl") {
-        return new DmdbPTTLCommand(lowerName);
-    } else if(lowerName == "persist") {
-        return new DmdbPersistCommand(lowerName);
-    } else if(lowerName == "client") {
-        return new DmdbClientCommand(lowerName);
-    } else if(lowerName == "sync") {
-        return new DmdbSyncCommand(lowerName);
-    } else if(lowerName == "replconf") {
-        return new DmdbReplconfCommand(lowerName);
-    } else if(lowerName == "bgsave") {
-        return new DmdbBgSaveCommand(lowerName);
-    } else if(lowerName == "shutdown") {
-        return new DmdbShutdownCommand(lowerName);
-    } else if(lowerName == "role") {
-        return new DmdbRoleCommand(lowerName);
-    } else if(lowerName == "wait") {
-        return new DmdbWaitCommand(lowerName);
-    }
-    return nullptr;
-}
-
-bool DmdbCommand::IsWCommand(const std::string &commandName) {
-    std::string lowerName = commandName;
-    std::transform(lowerName.begin(), lowerName.end(), lowerName.begin(), tolower);
-    if(lowerName == "set" || lowerName == "del" || lowerName == "mset" || lowerName == "expire" ||
-       lowerName == "persist") {
-        return true;
+/* Values not smaller than it are referenced by the output buffer instead of being copied */
+const size_t REPLY_SHARED_MIN_SIZE = 16*1024;
+/* COUNT of SCAN is limited, so one call never blocks the others for long */
+const uint64_t SCAN_COUNT_MAX = 100000;
+
+DmdbCommandTable::DmdbCommandTable() {
+    uint32_t write = static_cast<uint32_t>(CommandFlag::WRITE);
+    uint32_t readonly = static_cast<uint32_t>(CommandFlag::READONLY);
+    uint32_t admin = static_cast<uint32_t>(CommandFlag::ADMIN);
+    uint32_t denyoom = static_cast<uint32_t>(CommandFlag::DENYOOM);
+    _commands = {
+        new DmdbAuthCommand("auth", -2, 0),
+        new DmdbMultiCommand("multi", 1, 0),
+        new DmdbExecCommand("exec", 1, 0),
+        new DmdbSetCommand("set", -3, write|denyoom),
+        new DmdbGetCommand("get", 2, readonly),
+        new DmdbDelCommand("del", -2, write),
+        new DmdbUnlinkCommand("unlink", -2, write),
+        new DmdbExistsCommand("exists", -2, readonly),
+        new DmdbMSetCommand("mset", -3, write|denyoom),
+        new DmdbExpireCommand("expire", 3, write),
+        new DmdbPExpireAtCommand("pexpireat", 3, write),
+        new DmdbKeysCommand("keys", 2, readonly),
+        new DmdbScanCommand("scan", -2, readonly),
+        new DmdbRangeKeysCommand("rangekeys", -3, readonly),
+        new DmdbDbsizeCommand("dbsize", 1, readonly),
+        new DmdbFlushAllCommand("flushall", -1, write),
+        new DmdbFlushAllCommand("flushdb", -1, write),
+        new DmdbPingCommand("ping", -1, 0),
+        new DmdbEchoCommand("echo", -1, 0),
+        new DmdbSaveCommand("save", 1, admin),
+        new DmdbTypeCommand("type", 2, readonly),
+        new DmdbPTTLCommand("pttl", 2, readonly),
+        new DmdbPersistCommand("persist", 2, write),
+        new DmdbClientCommand("client", -2, admin),
+        new DmdbSyncCommand("sync", 1, admin),
+        new DmdbPSyncCommand("psync", 3, admin),
+        new DmdbReplconfCommand("replconf", -2, admin),
+        new DmdbBgSaveCommand("bgsave", 1, admin),
+        new DmdbShutdownCommand("shutdown", -1, admin),
+        new DmdbRoleCommand("role", -1, admin),
+        new DmdbWaitCommand("wait", 3, 0),
+        new DmdbBgRewriteAOFCommand("bgrewriteaof", 1, admin)
+    };
+    _seed = 0;
+    while(!BuildSlots(_seed)) {
+        _seed++;
     }
-    return false;
+}
+
+DmdbCommandTable::~DmdbCommandTable() {
+    for(size_t i = 0; i < _commands.size(); ++i) {
+        delete _commands[i];
+    }
+}
+
+/* FNV-1a of the lowercase name */
+uint64_t DmdbCommandTable::HashName(std::string_view name, uint64_t seed) {
+    uint64_t hash = 14695981039346656037ULL ^ seed;
+    for(size_t i = 0; i < name.length(); ++i) {
+        hash ^= static_cast<uint8_t>(tolower(static_cast<unsigned char>(name[i])));
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* The low bits of FNV-1a only depend on the low bits of the seed, so the slot is taken from the high bits */
+size_t DmdbCommandTable::GetSlot(std::string_view name, uint64_t seed) {
+    return HashName(name, seed) >> (64 - COMMAND_TABLE_BITS);
+}
+
+/* Returns false if two commands fall into the same slot with this seed */
+bool DmdbCommandTable::BuildSlots(uint64_t seed) {
+    std::fill(_slots, _slots + COMMAND_TABLE_SIZE, nullptr);
+    for(size_t i = 0; i < _commands.size(); ++i) {
+        size_t slot = GetSlot(_commands[i]->GetName(), seed);
+        if(_slots[slot] != nullptr) {
+            return false;
+        }
+        _slots[slot] = _commands[i];
+    }
+    return true;
+}
+
+DmdbCommand* DmdbCommandTable::Lookup(std::string_view name) {
+    DmdbCommand* command = _slots[GetSlot(name, _seed)];
+    if(command == nullptr || command->GetName().length() != name.length() ||
+       strncasecmp(command->GetName().data(), name.data(), name.length()) != 0) {
+        return nullptr;
+    }
+    return command;
+}
+
+DmdbCommand* DmdbCommand::LookupCommand(std::string_view name) {
+    /* It's built when it's used first time, the initialization of a static local is thread safe */
+    static DmdbCommandTable commandTable;
+    return commandTable.Lookup(name);
+}
+
+bool DmdbCommand::HasFlag(CommandFlag flag) {
+    return _flags & static_cast<uint32_t>(flag);
+}
+
+bool DmdbCommand::IsArityOk(size_t argc) {
+    if(_arity >= 0) {
+        return argc == static_cast<size_t>(_arity);
+    }
+    return argc >= static_cast<size_t>(-_arity);
+}
+
+std::string DmdbCommand::GetWrongArityMsg() {
+    return "-ERR wrong number of arguments for '" + _command_name + "' command\r\n";
 }
 
 void DmdbCommand::AddExecuteRetToClientIfNeed(const std::string &msg, DmdbClientContact &clientContact, bool isForce = false) {
@@ -86,12 +139,28 @@ void DmdbCommand::AddExecuteRetToClientIfNeed(const std::string &msg, DmdbClient
     }
 }
 
-std::string DmdbCommand::GetName() {
-    return _command_name;
+/* Reply value as a bulk string */
+void DmdbCommand::AddValueRetToClientIfNeed(DmdbValue* value, DmdbClientContact &clientContact) {
+    DmdbCommandRequiredComponent components;
+    GetDmdbCommandRequiredComponents(components);
+    if(components._repl_manager->IsMyMaster(clientContact.GetClientName())) {
+        return;
+    }
+    DmdbSharedString* sharedStr = value->GetSharedString();
+    if(sharedStr != nullptr && sharedStr->GetLength() >= REPLY_SHARED_MIN_SIZE) {
+        clientContact.AddReplyData2Client("$" + std::to_string(sharedStr->GetLength()) + "\r\n");
+        clientContact.AddReplySharedString2Client(sharedStr);
+        clientContact.AddReplyData2Client("\r\n", 2);
+        return;
+    }
+    std::string valueStr = value->GetValueString();
+    clientContact.AddReplyData2Client("$" + std::to_string(valueStr.length()) + "\r\n");
+    clientContact.AddReplyData2Client(valueStr);
+    clientContact.AddReplyData2Client("\r\n", 2);
 }
 
-void DmdbCommand::AppendCommandPara(const std::string &para) {
-    _parameters.emplace_back(para);
+const std::string& DmdbCommand::GetName() {
+    return _command_name;
 }
 
 std::string DmdbCommand::FormatHelpMsgFromArray(const std::vector<std::string> &vec) {
@@ -105,7 +174,7 @@ std::string DmdbCommand::FormatHelpMsgFromArray(const std::vector<std::string> &
     return ret;
 }
 
-DmdbCommand::DmdbCommand(std::string name) : _command_name(name) {
+DmdbCommand::DmdbCommand(std::string name, int arity, uint32_t flags) : _command_name(name), _arity(arity), _flags(flags) {
 
 }
 
@@ -115,7 +184,7 @@ DmdbCommand::~DmdbCommand() {
 }
 
 
-DmdbAuthCommand::DmdbAuthCommand(std::string name) : DmdbCommand::DmdbCommand(name) {
+DmdbAuthCommand::DmdbAuthCommand(std::string name, int arity, uint32_t flags) : DmdbCommand::DmdbCommand(name, arity, flags) {
 
 }
 
@@ -123,18 +192,18 @@ DmdbAuthCommand::~DmdbAuthCommand() {
 
 }
 
-bool DmdbAuthCommand::Execute(DmdbClientContact &clientContact) {
+bool DmdbAuthCommand::Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters) {
     DmdbCommandRequiredComponent components;
     GetDmdbCommandRequiredComponents(components);
     if(components._repl_manager->IsMyMaster(clientContact.GetClientName())) {
         return true;
     }
     std::string msg;
-    if(_parameters.size() < 1) {
+    if(parameters.size() < 1) {
         msg = "-ERR too few parameters\r\n";
         AddExecuteRetToClientIfNeed(msg, clientContact);
         return false;
-    } else if(components._server_client_manager->GetServerPassword() != _parameters[0]) {
+    } else if(components._server_client_manager->GetServerPassword() != parameters[0]) {
         msg = "-ERR invalid password\r\n";           
         AddExecuteRetToClientIfNeed(msg, clientContact);
         return false;
@@ -147,7 +216,7 @@ bool DmdbAuthCommand::Execute(DmdbClientContact &clientContact) {
 }
 
 
-DmdbMultiCommand::DmdbMultiCommand(std::string name) : DmdbCommand::DmdbCommand(name) {
+DmdbMultiCommand::DmdbMultiCommand(std::string name, int arity, uint32_t flags) : DmdbCommand::DmdbCommand(name, arity, flags) {
 
 }
 
@@ -155,7 +224,7 @@ DmdbMultiCommand::~DmdbMultiCommand() {
 
 }
 
-bool DmdbMultiCommand::Execute(DmdbClientContact &clientContact) {
+bool DmdbMultiCommand::Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters) {
     if(clientContact.IsMultiState()) {
         std::string errMsg = "-ERR MULTI calls can not be nested\r\n";
         AddExecuteRetToClientIfNeed(errMsg, clientContact);
@@ -168,7 +237,7 @@ bool DmdbMultiCommand::Execute(DmdbClientContact &clientContact) {
 }
 
 
-DmdbExecCommand::DmdbExecCommand(std::string name) : DmdbCommand::DmdbCommand(name) {
+DmdbExecCommand::DmdbExecCommand(std::string name, int arity, uint32_t flags) : DmdbCommand::DmdbCommand(name, arity, flags) {
 
 }
 
@@ -176,7 +245,7 @@ DmdbExecCommand::~DmdbExecCommand() {
 
 }
 
-bool DmdbExecCommand::Execute(DmdbClientContact &clientContact) {
+bool DmdbExecCommand::Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters) {
     if(!clientContact.IsMultiState()) {
         std::string errMsg = "-ERR EXEC without MULTI\r\n";
         AddExecuteRetToClientIfNeed(errMsg, clientContact);
@@ -184,18 +253,16 @@ bool DmdbExecCommand::Execute(DmdbClientContact &clientContact) {
     }
     std::string msg = "*" + std::to_string(clientContact.GetMultiQueueSize()) + "\r\n";
     AddExecuteRetToClientIfNeed(msg, clientContact);
-    DmdbCommand* command = clientContact.PopCommandOfExec();
-    while(command != nullptr) {
-        command->Execute(clientContact);
-        delete command;
-        command = clientContact.PopCommandOfExec();
+    DmdbQueuedCommand queuedCommand;
+    while(clientContact.PopCommandOfExec(queuedCommand)) {
+        queuedCommand._command->Execute(clientContact, queuedCommand._parameters);
     }
     clientContact.SetMultiState(false);
     return true;
 }
 
 
-DmdbSetCommand::DmdbSetCommand(std::string name) : DmdbCommand::DmdbCommand(name) {
+DmdbSetCommand::DmdbSetCommand(std::string name, int arity, uint32_t flags) : DmdbCommand::DmdbCommand(name, arity, flags) {
 
 }
 
@@ -203,15 +270,15 @@ DmdbSetCommand::~DmdbSetCommand() {
 
 }
 
-bool DmdbSetCommand::Execute(DmdbClientContact &clientContact) {
+bool DmdbSetCommand::Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters) {
     DmdbCommandRequiredComponent components;
     GetDmdbCommandRequiredComponents(components);
-    if(_parameters.size() < 2) {
+    if(parameters.size() < 2) {
         std::string errMsg = "-ERR too few parameters\r\n";
         AddExecuteRetToClientIfNeed(errMsg, clientContact);
         return false;        
     }
-    if(_parameters.size() > 5) {
+    if(parameters.size() > 5) {
         std::string errMsg = "-ERR too many parameters\r\n";
         AddExecuteRetToClientIfNeed(errMsg, clientContact);
         return false;
@@ -220,19 +287,19 @@ bool DmdbSetCommand::Execute(DmdbClientContact &clientContact) {
     bool isNx = false;
     bool isXx = false;
 
-    for (size_t i = 2; i < _parameters.size(); ++i)
+    for (size_t i = 2; i < parameters.size(); ++i)
     {
-        std::string upperPara = _parameters[i];
+        std::string upperPara = parameters[i];
         std::transform(upperPara.begin(), upperPara.end(), upperPara.begin(), toupper);
-        if (upperPara == "EX" || upperPara == "PX")
+        if (upperPara == "EX" || upperPara == "PX" || upperPara == "PXAT")
         {
-            if (i + 1 == _parameters.size())
+            if (i + 1 == parameters.size())
             {
                 std::string errMsg = "-ERR too few parameters\r\n";
                 AddExecuteRetToClientIfNeed(errMsg, clientContact);
                 return false;
             }
-            expireTime = strtoull(_parameters[i + 1].c_str(), nullptr, 10);
+            expireTime = strtoull(parameters[i + 1].c_str(), nullptr, 10);
             if (errno == ERANGE)
             {
                 std::string errMsg = "-ERR invalid parameter\r\n";
@@ -242,7 +309,9 @@ bool DmdbSetCommand::Execute(DmdbClientContact &clientContact) {
             if (upperPara == "EX")
                 expireTime *= 1000;
             i++;
-            expireTime += DmdbUtil::GetCurrentMs();
+            /* PXAT is an absolute time, the AOF saves EX and PX in this way */
+            if (upperPara != "PXAT")
+                expireTime += DmdbUtil::GetCurrentMs();
         }
         else if (upperPara == "NX")
         {
@@ -260,18 +329,22 @@ bool DmdbSetCommand::Execute(DmdbClientContact &clientContact) {
         }
     }
 
-    DmdbValue* value = components._server_database_manager->GetValueByKey(_parameters[0]);
     std::vector<std::string> valArray;
-    valArray.emplace_back(_parameters[1]);
+    valArray.emplace_back(parameters[1]);
     std::string msg;
 
+    /* A plain SET doesn't need to look up the key before overwriting it */
+    DmdbValue* value = nullptr;
+    if(isNx || isXx) {
+        value = components._server_database_manager->GetValueByKey(parameters[0]);
+    }
     if((isNx&&value!=nullptr) || (isXx&&value==nullptr) ) {
         msg = "$-1\r\n";
         AddExecuteRetToClientIfNeed(msg, clientContact);
         return false;
     }
 
-    components._server_database_manager->SetKeyValuePair(_parameters[0], valArray,
+    components._server_database_manager->SetKeyValuePair(parameters[0], valArray,
                                                          DmdbValueType::STRING, expireTime);
 
     msg = "+OK\r\n";
@@ -280,7 +353,7 @@ bool DmdbSetCommand::Execute(DmdbClientContact &clientContact) {
 }
 
 
-DmdbGetCommand::DmdbGetCommand(std::string name) : DmdbCommand::DmdbCommand(name) {
+DmdbGetCommand::DmdbGetCommand(std::string name, int arity, uint32_t flags) : DmdbCommand::DmdbCommand(name, arity, flags) {
 
 }
 
@@ -288,18 +361,18 @@ DmdbGetCommand::~DmdbGetCommand() {
 
 }
 
-bool DmdbGetCommand::Execute(DmdbClientContact &clientContact) {
+bool DmdbGetCommand::Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters) {
     DmdbCommandRequiredComponent components;
     GetDmdbCommandRequiredComponents(components);
     if(components._repl_manager->IsMyMaster(clientContact.GetClientName())) {
         return true;
     }
-    if(_parameters.size() != 1) {
+    if(parameters.size() != 1) {
         std::string errMsg = "-ERR too few or many parameters\r\n";
         AddExecuteRetToClientIfNeed(errMsg, clientContact);
         return false;        
     }
-    DmdbValue* value = components._server_database_manager->GetValueByKey(_parameters[0]);
+    DmdbValue* value = components._server_database_manager->GetValueByKey(parameters[0]);
     std::string msgResult;
     if(value != nullptr) {
         if(value->GetValueType() != DmdbValueType::STRING) {
@@ -307,8 +380,7 @@ bool DmdbGetCommand::Execute(DmdbClientContact &clientContact) {
             AddExecuteRetToClientIfNeed(msgResult, clientContact);
             return false;
         }
-        msgResult = "$" + std::to_string(value->GetValueString().length()) + "\r\n" + value->GetValueString() + "\r\n";
-        AddExecuteRetToClientIfNeed(msgResult, clientContact);
+        AddValueRetToClientIfNeed(value, clientContact);
         return true; 
     } else {
         msgResult = "$-1\r\n";
@@ -319,7 +391,7 @@ bool DmdbGetCommand::Execute(DmdbClientContact &clientContact) {
 }
 
 
-DmdbDelCommand::DmdbDelCommand(std::string name) : DmdbCommand::DmdbCommand(name) {
+DmdbDelCommand::DmdbDelCommand(std::string name, int arity, uint32_t flags) : DmdbCommand::DmdbCommand(name, arity, flags) {
 
 }
 
@@ -327,13 +399,13 @@ DmdbDelCommand::~DmdbDelCommand() {
 
 }
 
-bool DmdbDelCommand::Execute(DmdbClientContact &clientContact) {
+bool DmdbDelCommand::Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters) {
     DmdbCommandRequiredComponent components;
     GetDmdbCommandRequiredComponents(components);
     std::string msgResult;
     size_t delNum = 0;
-    for(size_t i = 0; i < _parameters.size(); ++i) {
-        bool deleted = components._server_database_manager->DelKey(_parameters[i]);
+    for(size_t i = 0; i < parameters.size(); ++i) {
+        bool deleted = components._server_database_manager->DelKey(parameters[i]);
         if(deleted) {
             delNum++;
         }
@@ -345,7 +417,29 @@ bool DmdbDelCommand::Execute(DmdbClientContact &clientContact) {
     return false;
 }
 
-DmdbExistsCommand::DmdbExistsCommand(std::string name) : DmdbCommand::DmdbCommand(name) {
+DmdbUnlinkCommand::DmdbUnlinkCommand(std::string name, int arity, uint32_t flags) : DmdbCommand::DmdbCommand(name, arity, flags) {
+
+}
+
+DmdbUnlinkCommand::~DmdbUnlinkCommand() {
+
+}
+
+bool DmdbUnlinkCommand::Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters) {
+    DmdbCommandRequiredComponent components;
+    GetDmdbCommandRequiredComponents(components);
+    size_t delNum = 0;
+    for(size_t i = 0; i < parameters.size(); ++i) {
+        if(components._server_database_manager->DelKey(parameters[i], true)) {
+            delNum++;
+        }
+    }
+    std::string msgResult = ":" + std::to_string(delNum) + "\r\n";
+    AddExecuteRetToClientIfNeed(msgResult, clientContact);
+    return delNum > 0;
+}
+
+DmdbExistsCommand::DmdbExistsCommand(std::string name, int arity, uint32_t flags) : DmdbCommand::DmdbCommand(name, arity, flags) {
 
 }
 
@@ -353,13 +447,13 @@ DmdbExistsCommand::~DmdbExistsCommand() {
 
 }
 
-bool DmdbExistsCommand::Execute(DmdbClientContact &clientContact) {
+bool DmdbExistsCommand::Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters) {
     DmdbCommandRequiredComponent components;
     GetDmdbCommandRequiredComponents(components);
     std::string msgResult;
     size_t existsNum = 0;
-    for(size_t i = 0; i < _parameters.size(); ++i) {
-        DmdbValue* value = components._server_database_manager->GetValueByKey(_parameters[i]);
+    for(size_t i = 0; i < parameters.size(); ++i) {
+        DmdbValue* value = components._server_database_manager->GetValueByKey(parameters[i]);
         if(value != nullptr) {
             existsNum++;
         }
@@ -371,7 +465,7 @@ bool DmdbExistsCommand::Execute(DmdbClientContact &clientContact) {
     return false;
 }
 
-DmdbMSetCommand::DmdbMSetCommand(std::string name) : DmdbCommand::DmdbCommand(name) {
+DmdbMSetCommand::DmdbMSetCommand(std::string name, int arity, uint32_t flags) : DmdbCommand::DmdbCommand(name, arity, flags) {
 
 }
 
@@ -379,19 +473,19 @@ DmdbMSetCommand::~DmdbMSetCommand() {
 
 }
 
-bool DmdbMSetCommand::Execute(DmdbClientContact &clientContact) {
+bool DmdbMSetCommand::Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters) {
     DmdbCommandRequiredComponent components;
     GetDmdbCommandRequiredComponents(components);
     std::string msgResult;
-    if(_parameters.size()%2 != 0) {
+    if(parameters.size()%2 != 0) {
         msgResult = "-ERR wrong number of arguments for MSET\r\n";
         AddExecuteRetToClientIfNeed(msgResult, clientContact);
         return false;
     }
     std::vector<std::string> valArr;
-    for(size_t i = 0; i < _parameters.size(); i+=2) {
-        valArr.emplace_back(_parameters[i+1]);
-        components._server_database_manager->SetKeyValuePair(_parameters[i], valArr, DmdbValueType::STRING, 0);
+    for(size_t i = 0; i < parameters.size(); i+=2) {
+        valArr.emplace_back(parameters[i+1]);
+        components._server_database_manager->SetKeyValuePair(parameters[i], valArr, DmdbValueType::STRING, 0);
         valArr.clear();
     }
     msgResult = "+OK\r\n";
@@ -400,7 +494,7 @@ bool DmdbMSetCommand::Execute(DmdbClientContact &clientContact) {
 }
 
 
-DmdbExpireCommand::DmdbExpireCommand(std::string name) : DmdbCommand::DmdbCommand(name) {
+DmdbExpireCommand::DmdbExpireCommand(std::string name, int arity, uint32_t flags) : DmdbCommand::DmdbCommand(name, arity, flags) {
 
 }
 
@@ -408,16 +502,16 @@ DmdbExpireCommand::~DmdbExpireCommand() {
 
 }
 
-bool DmdbExpireCommand::Execute(DmdbClientContact &clientContact) {
+bool DmdbExpireCommand::Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters) {
     DmdbCommandRequiredComponent components;
     GetDmdbCommandRequiredComponents(components);
     std::string msgResult;
-    if(_parameters.size() != 2) {
+    if(parameters.size() != 2) {
         msgResult = "-ERR wrong number of arguments for Expire\r\n";
         AddExecuteRetToClientIfNeed(msgResult, clientContact);        
         return false;
     }
-    uint64_t expireTime = strtoull(_parameters[1].c_str(), nullptr, 10);
+    uint64_t expireTime = strtoull(parameters[1].c_str(), nullptr, 10);
     if(errno == ERANGE) {
         msgResult = "-ERR invalid parameter\r\n";
         AddExecuteRetToClientIfNeed(msgResult, clientContact);
@@ -425,7 +519,35 @@ bool DmdbExpireCommand::Execute(DmdbClientContact &clientContact) {
     }
     expireTime *= 1000;
     expireTime += DmdbUtil::GetCurrentMs();
-    bool isOk = components._server_database_manager->SetKeyExpireTime(_parameters[0], expireTime);
+    bool isOk = components._server_database_manager->SetKeyExpireTime(parameters[0], expireTime);
+    if(isOk)
+        msgResult = ":1\r\n";
+    else
+        msgResult = ":0\r\n";
+    AddExecuteRetToClientIfNeed(msgResult, clientContact);
+    return isOk;
+}
+
+DmdbPExpireAtCommand::DmdbPExpireAtCommand(std::string name, int arity, uint32_t flags) : DmdbCommand::DmdbCommand(name, arity, flags) {
+
+}
+
+DmdbPExpireAtCommand::~DmdbPExpireAtCommand() {
+
+}
+
+bool DmdbPExpireAtCommand::Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters) {
+    DmdbCommandRequiredComponent components;
+    GetDmdbCommandRequiredComponents(components);
+    std::string msgResult;
+    errno = 0;
+    uint64_t expireTime = strtoull(parameters[1].c_str(), nullptr, 10);
+    if(errno == ERANGE) {
+        msgResult = "-ERR invalid parameter\r\n";
+        AddExecuteRetToClientIfNeed(msgResult, clientContact);
+        return false;
+    }
+    bool isOk = components._server_database_manager->SetKeyExpireTime(parameters[0], expireTime);
     if(isOk)
         msgResult = ":1\r\n";
     else
@@ -434,7 +556,7 @@ bool DmdbExpireCommand::Execute(DmdbClientContact &clientContact) {
     return isOk;
 }
 
-DmdbKeysCommand::DmdbKeysCommand(std::string name) : DmdbCommand::DmdbCommand(name) {
+DmdbKeysCommand::DmdbKeysCommand(std::string name, int arity, uint32_t flags) : DmdbCommand::DmdbCommand(name, arity, flags) {
 
 }
 
@@ -442,20 +564,20 @@ DmdbKeysCommand::~DmdbKeysCommand() {
 
 }
 
-bool DmdbKeysCommand::Execute(DmdbClientContact &clientContact) {
+bool DmdbKeysCommand::Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters) {
     DmdbCommandRequiredComponent components;
     GetDmdbCommandRequiredComponents(components);
     if(components._repl_manager->IsMyMaster(clientContact.GetClientName())) {
         return true;
     }
     std::string msgResult;
-    if(_parameters.size() > 1) {
+    if(parameters.size() > 1) {
         msgResult = "-ERR too many parameters\r\n";
         AddExecuteRetToClientIfNeed(msgResult, clientContact);
         return false;        
     }
     std::vector<DmdbKey> keys;
-    components._server_database_manager->GetKeysByPattern(_parameters[0], keys);
+    components._server_database_manager->GetKeysByPattern(parameters[0], keys);
     msgResult = "*" + std::to_string(keys.size()) + "\r\n";
     for(size_t i = 0; i < keys.size(); ++i) {
         msgResult += "$" + std::to_string(keys[i].GetName().length()) + "\r\n";
@@ -467,7 +589,151 @@ bool DmdbKeysCommand::Execute(DmdbClientContact &clientContact) {
     return false;
 }
 
-DmdbDbsizeCommand::DmdbDbsizeCommand(std::string name) : DmdbCommand::DmdbCommand(name) {
+DmdbScanCommand::DmdbScanCommand(std::string name, int arity, uint32_t flags) : DmdbCommand::DmdbCommand(name, arity, flags) {
+
+}
+
+DmdbScanCommand::~DmdbScanCommand() {
+
+}
+
+/* scan cursor [MATCH pattern] [COUNT count] [TYPE type]. In shard mode the high bits of the
+ * cursor are the shard being scanned, the shards are scanned one by one */
+bool DmdbScanCommand::Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters) {
+    DmdbCommandRequiredComponent components;
+    GetDmdbCommandRequiredComponents(components);
+    if(components._repl_manager->IsMyMaster(clientContact.GetClientName())) {
+        return true;
+    }
+    std::string msgResult;
+    char* endPtr = nullptr;
+    errno = 0;
+    uint64_t cursor = strtoull(parameters[0].c_str(), &endPtr, 10);
+    if(errno == ERANGE || endPtr == parameters[0].c_str() || *endPtr != '\0') {
+        msgResult = "-ERR invalid cursor\r\n";
+        AddExecuteRetToClientIfNeed(msgResult, clientContact);
+        return false;
+    }
+    std::string patternStr;
+    std::string typeStr;
+    uint64_t count = 10;
+    for(size_t i = 1; i < parameters.size(); i += 2) {
+        std::string upperPara = parameters[i];
+        std::transform(upperPara.begin(), upperPara.end(), upperPara.begin(), toupper);
+        if(i + 1 == parameters.size() || (upperPara != "MATCH" && upperPara != "COUNT" && upperPara != "TYPE")) {
+            msgResult = "-ERR syntax error\r\n";
+            AddExecuteRetToClientIfNeed(msgResult, clientContact);
+            return false;
+        }
+        if(upperPara == "MATCH") {
+            /* Like KEYS, "*" means all the keys */
+            patternStr = parameters[i + 1] == "*" ? "" : parameters[i + 1];
+        } else if(upperPara == "TYPE") {
+            typeStr = parameters[i + 1];
+            std::transform(typeStr.begin(), typeStr.end(), typeStr.begin(), tolower);
+        } else {
+            errno = 0;
+            count = strtoull(parameters[i + 1].c_str(), &endPtr, 10);
+            if(errno == ERANGE || endPtr == parameters[i + 1].c_str() || *endPtr != '\0' || count == 0 ||
+               count > SCAN_COUNT_MAX) {
+                msgResult = "-ERR invalid count\r\n";
+                AddExecuteRetToClientIfNeed(msgResult, clientContact);
+                return false;
+            }
+        }
+    }
+    uint64_t shardOfCursor = 0;
+    if(components._is_shard_mode) {
+        shardOfCursor = cursor >> SCAN_CURSOR_SHARD_SHIFT;
+        cursor &= (1ULL << SCAN_CURSOR_SHARD_SHIFT) - 1;
+        if(shardOfCursor != static_cast<uint64_t>(components._shard_id)) {
+            msgResult = "-ERR invalid cursor\r\n";
+            AddExecuteRetToClientIfNeed(msgResult, clientContact);
+            return false;
+        }
+    }
+    std::vector<std::string> keys;
+    cursor = components._server_database_manager->ScanKeys(cursor, count, patternStr, typeStr, keys);
+    if(components._is_shard_mode) {
+        if(cursor != 0) {
+            cursor |= shardOfCursor << SCAN_CURSOR_SHARD_SHIFT;
+        } else if(shardOfCursor + 1 < static_cast<uint64_t>(components._shards_num)) {
+            cursor = (shardOfCursor + 1) << SCAN_CURSOR_SHARD_SHIFT;
+        }
+    }
+    std::string cursorStr = std::to_string(cursor);
+    msgResult = "*2\r\n$" + std::to_string(cursorStr.length()) + "\r\n" + cursorStr + "\r\n";
+    msgResult += "*" + std::to_string(keys.size()) + "\r\n";
+    for(size_t i = 0; i < keys.size(); ++i) {
+        msgResult += "$" + std::to_string(keys[i].length()) + "\r\n";
+        msgResult += keys[i] + "\r\n";
+    }
+    AddExecuteRetToClientIfNeed(msgResult, clientContact);
+    return true;
+}
+
+DmdbRangeKeysCommand::DmdbRangeKeysCommand(std::string name, int arity, uint32_t flags) : DmdbCommand::DmdbCommand(name, arity, flags) {
+
+}
+
+DmdbRangeKeysCommand::~DmdbRangeKeysCommand() {
+
+}
+
+/* rangekeys min max [LIMIT count], the bounds are like ZRANGEBYLEX. The keys are returned in
+ * lexicographic order, the next page starts from "(" and the last key returned */
+bool DmdbRangeKeysCommand::Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters) {
+    DmdbCommandRequiredComponent components;
+    GetDmdbCommandRequiredComponents(components);
+    if(components._repl_manager->IsMyMaster(clientContact.GetClientName())) {
+        return true;
+    }
+    std::string msgResult;
+    if(!components._server_database_manager->IsKeyIndexEnabled()) {
+        msgResult = "-ERR RANGEKEYS needs is_key_index_enabled to be true\r\n";
+        AddExecuteRetToClientIfNeed(msgResult, clientContact);
+        return false;
+    }
+    DmdbLexBound min;
+    DmdbLexBound max;
+    if(!DmdbRadixTree::ParseLexBound(parameters[0], min) || !DmdbRadixTree::ParseLexBound(parameters[1], max)) {
+        msgResult = "-ERR min or max not valid string range item\r\n";
+        AddExecuteRetToClientIfNeed(msgResult, clientContact);
+        return false;
+    }
+    size_t limit = SIZE_MAX;
+    if(parameters.size() > 2) {
+        std::string upperPara = parameters[2];
+        std::transform(upperPara.begin(), upperPara.end(), upperPara.begin(), toupper);
+        char* endPtr = nullptr;
+        errno = 0;
+        if(parameters.size() != 4 || upperPara != "LIMIT") {
+            msgResult = "-ERR syntax error\r\n";
+            AddExecuteRetToClientIfNeed(msgResult, clientContact);
+            return false;
+        }
+        limit = strtoull(parameters[3].c_str(), &endPtr, 10);
+        if(errno == ERANGE || endPtr == parameters[3].c_str() || *endPtr != '\0' || parameters[3][0] == '-') {
+            msgResult = "-ERR invalid limit\r\n";
+            AddExecuteRetToClientIfNeed(msgResult, clientContact);
+            return false;
+        }
+    }
+    std::vector<std::string> keys;
+    /* "+" as min or "-" as max is an empty range */
+    if(!(parameters[0] == "+" || parameters[1] == "-")) {
+        components._server_database_manager->GetKeysInRange(min, max, limit, keys);
+    }
+    msgResult = "*" + std::to_string(keys.size()) + "\r\n";
+    for(size_t i = 0; i < keys.size(); ++i) {
+        msgResult += "$" + std::to_string(keys[i].length()) + "\r\n";
+        msgResult += keys[i] + "\r\n";
+    }
+    AddExecuteRetToClientIfNeed(msgResult, clientContact);
+    return true;
+}
+
+DmdbDbsizeCommand::DmdbDbsizeCommand(std::string name, int arity, uint32_t flags) : DmdbCommand::DmdbCommand(name, arity, flags) {
 
 }
 
@@ -475,7 +741,7 @@ DmdbDbsizeCommand::~DmdbDbsizeCommand() {
 
 }
 
-bool DmdbDbsizeCommand::Execute(DmdbClientContact &clientContact) {
+bool DmdbDbsizeCommand::Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters) {
     DmdbCommandRequiredComponent components;
     GetDmdbCommandRequiredComponents(components);
     if(components._repl_manager->IsMyMaster(clientContact.GetClientName())) {
@@ -488,7 +754,42 @@ bool DmdbDbsizeCommand::Execute(DmdbClientContact &clientContact) {
 }
 
 
-DmdbPingCommand::DmdbPingCommand(std::string name) : DmdbCommand::DmdbCommand(name) {
+DmdbFlushAllCommand::DmdbFlushAllCommand(std::string name, int arity, uint32_t flags) : DmdbCommand::DmdbCommand(name, arity, flags) {
+
+}
+
+DmdbFlushAllCommand::~DmdbFlushAllCommand() {
+
+}
+
+/* FLUSHALL [ASYNC|SYNC], with ASYNC the keys are gone at once and freed by the lazy free thread */
+bool DmdbFlushAllCommand::Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters) {
+    DmdbCommandRequiredComponent components;
+    GetDmdbCommandRequiredComponents(components);
+    std::string msgResult;
+    bool isAsync = false;
+    if(parameters.size() > 1) {
+        msgResult = "-ERR syntax error\r\n";
+        AddExecuteRetToClientIfNeed(msgResult, clientContact);
+        return false;
+    }
+    if(parameters.size() == 1) {
+        std::string upperPara = parameters[0];
+        std::transform(upperPara.begin(), upperPara.end(), upperPara.begin(), toupper);
+        if(upperPara != "ASYNC" && upperPara != "SYNC") {
+            msgResult = "-ERR syntax error\r\n";
+            AddExecuteRetToClientIfNeed(msgResult, clientContact);
+            return false;
+        }
+        isAsync = upperPara == "ASYNC";
+    }
+    components._server_database_manager->Flush(isAsync);
+    msgResult = "+OK\r\n";
+    AddExecuteRetToClientIfNeed(msgResult, clientContact);
+    return true;
+}
+
+DmdbPingCommand::DmdbPingCommand(std::string name, int arity, uint32_t flags) : DmdbCommand::DmdbCommand(name, arity, flags) {
 
 }
 
@@ -496,7 +797,7 @@ DmdbPingCommand::~DmdbPingCommand() {
 
 }
 
-bool DmdbPingCommand::Execute(DmdbClientContact &clientContact) {
+bool DmdbPingCommand::Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters) {
     /* We don't process ping command from master currently, but may process in the future */
     DmdbCommandRequiredComponent components;
     GetDmdbCommandRequiredComponents(components);
@@ -510,7 +811,7 @@ bool DmdbPingCommand::Execute(DmdbClientContact &clientContact) {
 }
 
 
-DmdbEchoCommand::DmdbEchoCommand(std::string name) : DmdbCommand::DmdbCommand(name) {
+DmdbEchoCommand::DmdbEchoCommand(std::string name, int arity, uint32_t flags) : DmdbCommand::DmdbCommand(name, arity, flags) {
 
 }
 
@@ -518,15 +819,15 @@ DmdbEchoCommand::~DmdbEchoCommand() {
 
 }
 
-bool DmdbEchoCommand::Execute(DmdbClientContact &clientContact) {
+bool DmdbEchoCommand::Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters) {
     DmdbCommandRequiredComponent components;
     GetDmdbCommandRequiredComponents(components);
     if(components._repl_manager->IsMyMaster(clientContact.GetClientName())) {
         return true;
     }
     std::string msgResult = "$";
-    if(_parameters.size() > 0) {
-        msgResult += std::to_string(_parameters[0].length()) + "\r\n" + _parameters[0] + "\r\n";
+    if(parameters.size() > 0) {
+        msgResult += std::to_string(parameters[0].length()) + "\r\n" + parameters[0] + "\r\n";
     } else {
         msgResult += "0\r\n\r\n";
     }
@@ -534,7 +835,7 @@ bool DmdbEchoCommand::Execute(DmdbClientContact &clientContact) {
     return true;
 }
 
-DmdbSaveCommand::DmdbSaveCommand(std::string name) : DmdbCommand::DmdbCommand(name) {
+DmdbSaveCommand::DmdbSaveCommand(std::string name, int arity, uint32_t flags) : DmdbCommand::DmdbCommand(name, arity, flags) {
 
 }
 
@@ -542,7 +843,7 @@ DmdbSaveCommand::~DmdbSaveCommand() {
 
 }
 
-bool DmdbSaveCommand::Execute(DmdbClientContact &clientContact) {
+bool DmdbSaveCommand::Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters) {
     DmdbCommandRequiredComponent components;
     GetDmdbCommandRequiredComponents(components);
     std::string msg = "";
@@ -557,7 +858,7 @@ bool DmdbSaveCommand::Execute(DmdbClientContact &clientContact) {
     return true;
 }
 
-DmdbTypeCommand::DmdbTypeCommand(std::string name) : DmdbCommand::DmdbCommand(name) {
+DmdbTypeCommand::DmdbTypeCommand(std::string name, int arity, uint32_t flags) : DmdbCommand::DmdbCommand(name, arity, flags) {
 
 }
 
@@ -565,19 +866,19 @@ DmdbTypeCommand::~DmdbTypeCommand() {
 
 }
 
-bool DmdbTypeCommand::Execute(DmdbClientContact &clientContact) {
+bool DmdbTypeCommand::Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters) {
     DmdbCommandRequiredComponent components;
     GetDmdbCommandRequiredComponents(components);
     if(components._repl_manager->IsMyMaster(clientContact.GetClientName())) {
         return true;
     }
     std::string msg = "";
-    if(_parameters.size() != 1) {
+    if(parameters.size() != 1) {
         msg = "-ERR wrong number of arguments for Type\r\n";
         AddExecuteRetToClientIfNeed(msg, clientContact);
         return false;        
     }
-    DmdbValue* value = components._server_database_manager->GetValueByKey(_parameters[0]);
+    DmdbValue* value = components._server_database_manager->GetValueByKey(parameters[0]);
     msg = "+";
     if(value != nullptr) {
         msg += value->GetValueTypeString();
@@ -589,7 +890,7 @@ bool DmdbTypeCommand::Execute(DmdbClientContact &clientContact) {
     return value != nullptr;
 }
 
-DmdbPTTLCommand::DmdbPTTLCommand(std::string name) : DmdbCommand::DmdbCommand(name) {
+DmdbPTTLCommand::DmdbPTTLCommand(std::string name, int arity, uint32_t flags) : DmdbCommand::DmdbCommand(name, arity, flags) {
 
 }
 
@@ -597,25 +898,24 @@ DmdbPTTLCommand::~DmdbPTTLCommand() {
 
 }
 
-bool DmdbPTTLCommand::Execute(DmdbClientContact &clientContact) {
+bool DmdbPTTLCommand::Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters) {
     DmdbCommandRequiredComponent components;
     GetDmdbCommandRequiredComponents(components);
     if(components._repl_manager->IsMyMaster(clientContact.GetClientName())) {
         return true;
     }
     std::string msg = "";
-    if(_parameters.size() != 1) {
+    if(parameters.size() != 1) {
         msg = "-ERR wrong number of arguments for PTTL\r\n";
         AddExecuteRetToClientIfNeed(msg, clientContact);
         return false;        
     }
-    DmdbKey key("");
-    bool isExist = components._server_database_manager->GetKeyByName(_parameters[0], key);
+    uint64_t expireTime = 0;
+    bool isExist = components._server_database_manager->GetExpireTimeByKey(parameters[0], expireTime);
     msg = ":";
     if(!isExist) {
         msg = "-2";
     } else {
-        uint64_t expireTime = key.GetExpireTime();
         if(expireTime == 0) {
             msg += "-1";
         } else {
@@ -627,7 +927,7 @@ bool DmdbPTTLCommand::Execute(DmdbClientContact &clientContact) {
     return isExist;
 }
 
-DmdbPersistCommand::DmdbPersistCommand(std::string name) : DmdbCommand::DmdbCommand(name) {
+DmdbPersistCommand::DmdbPersistCommand(std::string name, int arity, uint32_t flags) : DmdbCommand::DmdbCommand(name, arity, flags) {
 
 }
 
@@ -635,16 +935,16 @@ DmdbPersistCommand::~DmdbPersistCommand() {
 
 }
 
-bool DmdbPersistCommand::Execute(DmdbClientContact &clientContact) {
+bool DmdbPersistCommand::Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters) {
     DmdbCommandRequiredComponent components;
     GetDmdbCommandRequiredComponents(components);
     std::string msg = "";
-    if(_parameters.size() != 1) {
+    if(parameters.size() != 1) {
         msg = "-ERR Wrong number of arguments for Type\r\n";
         AddExecuteRetToClientIfNeed(msg, clientContact);
         return false;        
     }
-    bool isExist = components._server_database_manager->SetKeyExpireTime(_parameters[0], 0);
+    bool isExist = components._server_database_manager->SetKeyExpireTime(parameters[0], 0);
     msg = ":";
     if(!isExist) {
         msg += "0";
@@ -656,7 +956,7 @@ bool DmdbPersistCommand::Execute(DmdbClientContact &clientContact) {
     return isExist;
 }
 
-DmdbClientCommand::DmdbClientCommand(std::string name) : DmdbCommand::DmdbCommand(name) {
+DmdbClientCommand::DmdbClientCommand(std::string name, int arity, uint32_t flags) : DmdbCommand::DmdbCommand(name, arity, flags) {
 
 }
 
@@ -664,7 +964,7 @@ DmdbClientCommand::~DmdbClientCommand() {
 
 }
 
-bool DmdbClientCommand::Execute(DmdbClientContact &clientContact) {
+bool DmdbClientCommand::Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters) {
     DmdbCommandRequiredComponent components;
     GetDmdbCommandRequiredComponents(components);
     if(components._repl_manager->IsMyMaster(clientContact.GetClientName())) {
@@ -677,16 +977,16 @@ bool DmdbClientCommand::Execute(DmdbClientContact &clientContact) {
 "     addr <ip:port>                      -- Kill connection made from <ip:port>",
 "pause <timeout>        -- Suspend all Redis clients for <timout> milliseconds."};
 
-    if(_parameters.size() == 1 && _parameters[0] == "help") {
+    if(parameters.size() == 1 && parameters[0] == "help") {
         msg = FormatHelpMsgFromArray(helpStrVec);
         AddExecuteRetToClientIfNeed(msg, clientContact);
         return true;        
     }
-    if(_parameters.size() == 1 && _parameters[0] == "getname") {
+    if(parameters.size() == 1 && parameters[0] == "getname") {
         msg = clientContact.GetClientName();
         msg = ("$" + std::to_string(msg.length()) + "\r\n" + msg + "\r\n");
-    } else if(_parameters.size() == 2 && _parameters[0] == "pause") {
-        uint64_t pauseMs = strtoull(_parameters[1].c_str(), nullptr, 10);
+    } else if(parameters.size() == 2 && parameters[0] == "pause") {
+        uint64_t pauseMs = strtoull(parameters[1].c_str(), nullptr, 10);
         if(errno == ERANGE) {
             msg = "-ERR invalid parameter\r\n";
             AddExecuteRetToClientIfNeed(msg, clientContact);
@@ -694,18 +994,18 @@ bool DmdbClientCommand::Execute(DmdbClientContact &clientContact) {
         }
         components._server_client_manager->PauseClients(pauseMs);
         msg = "+OK\r\n";
-    } else if(_parameters.size() >= 3 && _parameters[0] == "kill") {
+    } else if(parameters.size() >= 3 && parameters[0] == "kill") {
         /* For this command, currently we only support option "addr" */
-        if(_parameters[1] == "addr") {
-            /* Because we use unordered_map ot traverse all the DmdbClientContacts, so we can't disconnect
-             * DmdbClientContact directly for avoiding iterator failure */
-            DmdbClientContact *targetClient = components._server_client_manager->GetClientContactByName(_parameters[2]);
+        if(parameters[1] == "addr") {
+            /* The target may be the client being processed, so we can't disconnect it directly, 
+             * DmdbClientManager will close it after its replies are sent */
+            DmdbClientContact *targetClient = components._server_client_manager->GetClientContactByName(parameters[2]);
             if(targetClient == nullptr) {
                 msg = "-ERR No such client\r\n";
                 AddExecuteRetToClientIfNeed(msg, clientContact);
                 return false;
             } else {
-                targetClient->SetStatus(static_cast<uint32_t>(ClientStatus::CLOSE_AFTER_REPLY));
+                components._server_client_manager->CloseClientAfterReply(targetClient);
                 msg = "+OK\r\n";
             }
         }
@@ -718,7 +1018,7 @@ bool DmdbClientCommand::Execute(DmdbClientContact &clientContact) {
     return true;
 }
 
-DmdbSyncCommand::DmdbSyncCommand(std::string name) : DmdbCommand::DmdbCommand(name) {
+DmdbSyncCommand::DmdbSyncCommand(std::string name, int arity, uint32_t flags) : DmdbCommand::DmdbCommand(name, arity, flags) {
 
 }
 
@@ -727,7 +1027,7 @@ DmdbSyncCommand::~DmdbSyncCommand() {
 }
 
 /* This command is only processed for replica by master */
-bool DmdbSyncCommand::Execute(DmdbClientContact &clientContact) {
+bool DmdbSyncCommand::Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters) {
     DmdbCommandRequiredComponent components;
     GetDmdbCommandRequiredComponents(components);
     std::string replyToSlaveMsg;
@@ -737,24 +1037,82 @@ bool DmdbSyncCommand::Execute(DmdbClientContact &clientContact) {
         return false;
     }
 
+    /* Every shard only has a part of the keys */
+    if(components._is_shard_mode) {
+        replyToSlaveMsg = "-ERR You can't sync with a server in shard mode\r\n";
+        AddExecuteRetToClientIfNeed(replyToSlaveMsg, clientContact);
+        return false;
+    }
+
     if(!clientContact.IsChecked()) {
         replyToSlaveMsg = "-ERR You must authenticate before sync\r\n";
         AddExecuteRetToClientIfNeed(replyToSlaveMsg, clientContact);
         return false;
     }
 
-    if(components._server_rdb_manager->IsRDBChildAlive()) {
-        replyToSlaveMsg = "-ERR RDB child process is running, please try later\r\n";
+    /* +FULLRESYNC is sent when the RDB child is created, so the offset matches the RDB data */
+    if(!components._repl_manager->FullSyncDataToReplica(&clientContact)) {
+        replyToSlaveMsg = "-ERR Full sync is in progress\r\n";
         AddExecuteRetToClientIfNeed(replyToSlaveMsg, clientContact);
-        return false;        
+        return false;
     }
-    long long myCurReplOffset = components._repl_manager->GetReplOffset();
-    AddExecuteRetToClientIfNeed("+FULLRESYNC " + std::to_string(myCurReplOffset) + "\r\n", clientContact);
-    components._repl_manager->FullSyncDataToReplica(&clientContact);
     return true;
 }
 
-DmdbReplconfCommand::DmdbReplconfCommand(std::string name) : DmdbCommand::DmdbCommand(name) {
+DmdbPSyncCommand::DmdbPSyncCommand(std::string name, int arity, uint32_t flags) : DmdbCommand::DmdbCommand(name, arity, flags) {
+
+}
+
+DmdbPSyncCommand::~DmdbPSyncCommand() {
+
+}
+
+/* PSYNC <replid> <offset>, offset is the replication offset the replica has processed. If we can't
+ * continue from there, it's the same as SYNC */
+bool DmdbPSyncCommand::Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters) {
+    DmdbCommandRequiredComponent components;
+    GetDmdbCommandRequiredComponents(components);
+    std::string replyToSlaveMsg;
+    if(!components._is_myself_master) {
+        replyToSlaveMsg = "-ERR You can't sync with a replica\r\n";
+        AddExecuteRetToClientIfNeed(replyToSlaveMsg, clientContact);
+        return false;
+    }
+
+    if(components._is_shard_mode) {
+        replyToSlaveMsg = "-ERR You can't sync with a server in shard mode\r\n";
+        AddExecuteRetToClientIfNeed(replyToSlaveMsg, clientContact);
+        return false;
+    }
+
+    if(!clientContact.IsChecked()) {
+        replyToSlaveMsg = "-ERR You must authenticate before sync\r\n";
+        AddExecuteRetToClientIfNeed(replyToSlaveMsg, clientContact);
+        return false;
+    }
+
+    char* endPtr = nullptr;
+    errno = 0;
+    long long offset = strtoll(parameters[1].c_str(), &endPtr, 10);
+    if(errno == ERANGE || endPtr == parameters[1].c_str() || *endPtr != '\0') {
+        replyToSlaveMsg = "-ERR Invalid offset\r\n";
+        AddExecuteRetToClientIfNeed(replyToSlaveMsg, clientContact);
+        return false;
+    }
+
+    if(components._repl_manager->PartialSyncToReplica(&clientContact, parameters[0], offset)) {
+        return true;
+    }
+
+    if(!components._repl_manager->FullSyncDataToReplica(&clientContact)) {
+        replyToSlaveMsg = "-ERR Full sync is in progress\r\n";
+        AddExecuteRetToClientIfNeed(replyToSlaveMsg, clientContact);
+        return false;
+    }
+    return true;
+}
+
+DmdbReplconfCommand::DmdbReplconfCommand(std::string name, int arity, uint32_t flags) : DmdbCommand::DmdbCommand(name, arity, flags) {
 
 }
 
@@ -763,17 +1121,17 @@ DmdbReplconfCommand::~DmdbReplconfCommand() {
 }
 
 /* This command is only processed for replica or master client */
-bool DmdbReplconfCommand::Execute(DmdbClientContact &clientContact) {
+bool DmdbReplconfCommand::Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters) {
     DmdbCommandRequiredComponent components;
     GetDmdbCommandRequiredComponents(components);
     std::string msg = "";
     if(!components._is_myself_master) {
-        if(_parameters.size() != 1) {
+        if(parameters.size() != 1) {
             msg = "-ERR Wrong number of arguments when I am a replica\r\n";
             AddExecuteRetToClientIfNeed(msg, clientContact);
             return false;
         }
-        if(_parameters[0] != "getack") {
+        if(parameters[0] != "getack") {
             msg = "-ERR Invalid parameter\r\n";
             AddExecuteRetToClientIfNeed(msg, clientContact);
             return false;            
@@ -785,12 +1143,12 @@ bool DmdbReplconfCommand::Execute(DmdbClientContact &clientContact) {
         }
         components._repl_manager->ReportToMasterMyReplayOkSize();
     } else {
-        if(_parameters.size() != 2) {
+        if(parameters.size() != 2) {
             msg = "-ERR Wrong number of arguments when I am a master\r\n";
             AddExecuteRetToClientIfNeed(msg, clientContact);
             return false;
         }
-        if(_parameters[0] != "ack") {
+        if(parameters[0] != "ack") {
             msg = "-ERR Invalid parameter\r\n";
             AddExecuteRetToClientIfNeed(msg, clientContact);
             return false;            
@@ -800,7 +1158,7 @@ bool DmdbReplconfCommand::Execute(DmdbClientContact &clientContact) {
             AddExecuteRetToClientIfNeed(msg, clientContact);
             return false;
         }
-        long long replicaReplayOkSize = strtoll(_parameters[1].c_str(), nullptr, 10);
+        long long replicaReplayOkSize = strtoll(parameters[1].c_str(), nullptr, 10);
         if(errno == ERANGE) {
             msg = "-ERR Invalid parameter\r\n";
             AddExecuteRetToClientIfNeed(msg, clientContact);
@@ -812,7 +1170,7 @@ bool DmdbReplconfCommand::Execute(DmdbClientContact &clientContact) {
 }
 
 
-DmdbBgSaveCommand::DmdbBgSaveCommand(std::string name) : DmdbCommand::DmdbCommand(name) {
+DmdbBgSaveCommand::DmdbBgSaveCommand(std::string name, int arity, uint32_t flags) : DmdbCommand::DmdbCommand(name, arity, flags) {
 
 }
 
@@ -820,7 +1178,7 @@ DmdbBgSaveCommand::~DmdbBgSaveCommand() {
 
 }
 
-bool DmdbBgSaveCommand::Execute(DmdbClientContact &clientContact) {
+bool DmdbBgSaveCommand::Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters) {
     DmdbCommandRequiredComponent components;
     GetDmdbCommandRequiredComponents(components);
     std::string msg = "";
@@ -830,13 +1188,13 @@ bool DmdbBgSaveCommand::Execute(DmdbClientContact &clientContact) {
         AddExecuteRetToClientIfNeed(msg, clientContact);
         return false;
     }
-    components._server_rdb_manager->SetBackgroundSavePlan(clientContact.GetClientSocket(), -1);
+    components._server_rdb_manager->SetBackgroundSavePlan(clientContact.GetClientSocket());
     msg = "+Background saving started\r\n";
     AddExecuteRetToClientIfNeed(msg, clientContact);        
     return true;
 }
 
-DmdbShutdownCommand::DmdbShutdownCommand(std::string name) : DmdbCommand::DmdbCommand(name) {
+DmdbShutdownCommand::DmdbShutdownCommand(std::string name, int arity, uint32_t flags) : DmdbCommand::DmdbCommand(name, arity, flags) {
 
 }
 
@@ -844,14 +1202,14 @@ DmdbShutdownCommand::~DmdbShutdownCommand() {
 
 }
 
-bool DmdbShutdownCommand::Execute(DmdbClientContact &clientContact) {
+bool DmdbShutdownCommand::Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters) {
     DmdbCommandRequiredComponent components;
     GetDmdbCommandRequiredComponents(components);
     *components._is_plan_to_shutdown = true;        
     return true;
 }
 
-DmdbRoleCommand::DmdbRoleCommand(std::string name) : DmdbCommand::DmdbCommand(name) {
+DmdbRoleCommand::DmdbRoleCommand(std::string name, int arity, uint32_t flags) : DmdbCommand::DmdbCommand(name, arity, flags) {
 
 }
 
@@ -859,7 +1217,7 @@ DmdbRoleCommand::~DmdbRoleCommand() {
 
 }
 
-bool DmdbRoleCommand::Execute(DmdbClientContact &clientContact) {
+bool DmdbRoleCommand::Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters) {
     DmdbCommandRequiredComponent components;
     GetDmdbCommandRequiredComponents(components);
     std::string msg = "";
@@ -876,7 +1234,7 @@ bool DmdbRoleCommand::Execute(DmdbClientContact &clientContact) {
     return true;
 }
 
-DmdbWaitCommand::DmdbWaitCommand(std::string name) : DmdbCommand::DmdbCommand(name) {
+DmdbWaitCommand::DmdbWaitCommand(std::string name, int arity, uint32_t flags) : DmdbCommand::DmdbCommand(name, arity, flags) {
 
 }
 
@@ -884,7 +1242,7 @@ DmdbWaitCommand::~DmdbWaitCommand() {
 
 }
 
-bool DmdbWaitCommand::Execute(DmdbClientContact &clientContact) {
+bool DmdbWaitCommand::Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters) {
     DmdbCommandRequiredComponent components;
     GetDmdbCommandRequiredComponents(components);
     std::string msg;
@@ -893,12 +1251,12 @@ bool DmdbWaitCommand::Execute(DmdbClientContact &clientContact) {
         AddExecuteRetToClientIfNeed(msg, clientContact);
         return false;
     }
-    if(_parameters.size() != 2) {
+    if(parameters.size() != 2) {
         msg = "-ERR Wrong number of arguments.\r\n";
         AddExecuteRetToClientIfNeed(msg, clientContact);
         return false;
     }
-    uint64_t numOfReplicasToWait = strtoul(_parameters[0].c_str(), nullptr, 10);
+    uint64_t numOfReplicasToWait = strtoul(parameters[0].c_str(), nullptr, 10);
     if(errno == ERANGE) {
         msg = "-ERR Invalid parameter.\r\n";
         AddExecuteRetToClientIfNeed(msg, clientContact);
@@ -909,7 +1267,7 @@ bool DmdbWaitCommand::Execute(DmdbClientContact &clientContact) {
         AddExecuteRetToClientIfNeed(msg, clientContact);
         return false;        
     }
-    uint64_t numOfMsToWait = strtoull(_parameters[1].c_str(), nullptr, 10);
+    uint64_t numOfMsToWait = strtoull(parameters[1].c_str(), nullptr, 10);
     if(errno == ERANGE) {
         msg = "-ERR Invalid parameter.\r\n";
         AddExecuteRetToClientIfNeed(msg, clientContact);
@@ -925,4 +1283,37 @@ bool DmdbWaitCommand::Execute(DmdbClientContact &clientContact) {
 }
 
 
+DmdbBgRewriteAOFCommand::DmdbBgRewriteAOFCommand(std::string name, int arity, uint32_t flags) : DmdbCommand::DmdbCommand(name, arity, flags) {
+
+}
+
+DmdbBgRewriteAOFCommand::~DmdbBgRewriteAOFCommand() {
+
+}
+
+bool DmdbBgRewriteAOFCommand::Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters) {
+    DmdbCommandRequiredComponent components;
+    GetDmdbCommandRequiredComponents(components);
+    std::string msg = "";
+    if(!components._server_aof_manager->IsAOFEnabled()) {
+        msg = "-ERR AOF is disabled\r\n";
+        AddExecuteRetToClientIfNeed(msg, clientContact);
+        return false;
+    }
+    if(components._server_rdb_manager->IsAOFRewriteChildAlive()) {
+        msg = "-ERR Background AOF rewriting is already in progress\r\n";
+        AddExecuteRetToClientIfNeed(msg, clientContact);
+        return false;
+    }
+    components._server_rdb_manager->SetAOFRewritePlan();
+    /* It starts after the running rdb child exits */
+    if(components._server_rdb_manager->IsRDBChildAlive()) {
+        msg = "+Background AOF rewriting scheduled\r\n";
+    } else {
+        msg = "+Background AOF rewriting started\r\n";
+    }
+    AddExecuteRetToClientIfNeed(msg, clientContact);
+    return true;
+}
+
 }
\ No newline at end of file
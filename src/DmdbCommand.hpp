@@ -1,7 +1,11 @@
 
 #pragma once
 
+#include <stdint.h>
+#include <stddef.h>
+
 #include <string>
+#include <string_view>
 #include <vector>
 
 
@@ -10,201 +14,298 @@ namespace Dmdb {
 class DmdbDatabaseManager;
 class DmdbClientContact;
 class DmdbRDBManager;
+class DmdbAOFManager;
 class DmdbClientManager;
 class DmdbReplicationManager;
+class DmdbValue;
 
 struct DmdbCommandRequiredComponent {
     DmdbDatabaseManager* _server_database_manager;
     DmdbRDBManager* _server_rdb_manager;
+    DmdbAOFManager* _server_aof_manager;
     DmdbClientManager* _server_client_manager;
     DmdbReplicationManager* _repl_manager; 
     bool _is_myself_master;
+    bool _is_shard_mode;
+    int _shard_id;
+    int _shards_num;
     bool* _is_plan_to_shutdown;
 };
 
+/* We use _flags & CommandFlag to get command's flags */
+enum class CommandFlag {
+    /* It may modify the database, so it's replicated */
+    WRITE = 1,
+    /* It only reads the database */
+    READONLY = 2,
+    /* It works on the server rather than the keys */
+    ADMIN = 4,
+    /* It may use more memory, so it's refused when the memory is over maxmemory and can't be freed */
+    DENYOOM = 8
+};
+
+/* A command object keeps nothing of a request, the parameters are passed to Execute(), so
+ * there is only one object for every command, they are in a static table built once */
 class DmdbCommand {
 public:
-    static DmdbCommand* GenerateCommandByName(const std::string &name);
-    static bool IsWCommand(const std::string &commandName);
-    std::string GetName();
-    void AppendCommandPara(const std::string &para);
+    /* The name is case insensitive, returns nullptr if there is no such command */
+    static DmdbCommand* LookupCommand(std::string_view name);
+    const std::string& GetName();
+    bool HasFlag(CommandFlag flag);
+    /* argc includes the command name */
+    bool IsArityOk(size_t argc);
+    std::string GetWrongArityMsg();
     void AddExecuteRetToClientIfNeed(const std::string &msg, DmdbClientContact &clientContact, bool isForce);
-    virtual bool Execute(DmdbClientContact &clientContact) = 0;
+    virtual bool Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters) = 0;
     virtual ~DmdbCommand();
 protected:
-    DmdbCommand(std::string name);
+    DmdbCommand(std::string name, int arity, uint32_t flags);
     std::string FormatHelpMsgFromArray(const std::vector<std::string> &vec);
+    void AddValueRetToClientIfNeed(DmdbValue* value, DmdbClientContact &clientContact);
     std::string _command_name;
-    std::vector<std::string> _parameters;
-    
+    /* The number of arguments including the command name, -N means N at least */
+    int _arity;
+    uint32_t _flags;
+};
+
+const size_t COMMAND_TABLE_BITS = 7;
+const size_t COMMAND_TABLE_SIZE = 1 << COMMAND_TABLE_BITS;
+
+/* A perfect hash table of the commands: the seed of the hash is chosen when the table is built
+ * so that no two commands share a slot, a lookup is one hash and one comparison */
+class DmdbCommandTable {
+public:
+    DmdbCommandTable();
+    ~DmdbCommandTable();
+    DmdbCommand* Lookup(std::string_view name);
+private:
+    DmdbCommandTable(const DmdbCommandTable&);
+    DmdbCommandTable& operator=(const DmdbCommandTable&);
+    static uint64_t HashName(std::string_view name, uint64_t seed);
+    static size_t GetSlot(std::string_view name, uint64_t seed);
+    bool BuildSlots(uint64_t seed);
+    std::vector<DmdbCommand*> _commands;
+    DmdbCommand* _slots[COMMAND_TABLE_SIZE];
+    uint64_t _seed;
 };
 
 class DmdbAuthCommand : public DmdbCommand {
 public:
-    virtual bool Execute(DmdbClientContact &clientContact);
-    DmdbAuthCommand(std::string name);
+    virtual bool Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters);
+    DmdbAuthCommand(std::string name, int arity, uint32_t flags);
     ~DmdbAuthCommand();
 };
 
 class DmdbMultiCommand : public DmdbCommand {
 public:
-    virtual bool Execute(DmdbClientContact &clientContact);
-    DmdbMultiCommand(std::string name);
+    virtual bool Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters);
+    DmdbMultiCommand(std::string name, int arity, uint32_t flags);
     ~DmdbMultiCommand();
 };
 
 class DmdbExecCommand : public DmdbCommand {
 public:
-    virtual bool Execute(DmdbClientContact &clientContact);
-    DmdbExecCommand(std::string name);
+    virtual bool Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters);
+    DmdbExecCommand(std::string name, int arity, uint32_t flags);
     ~DmdbExecCommand();
 };
 
 class DmdbSetCommand : public DmdbCommand {
 public:
-    virtual bool Execute(DmdbClientContact &clientContact);
-    DmdbSetCommand(std::string name);
+    virtual bool Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters);
+    DmdbSetCommand(std::string name, int arity, uint32_t flags);
     ~DmdbSetCommand();
 };
 
 class DmdbGetCommand : public DmdbCommand {
 public:
-    virtual bool Execute(DmdbClientContact &clientContact);
-    DmdbGetCommand(std::string name);
+    virtual bool Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters);
+    DmdbGetCommand(std::string name, int arity, uint32_t flags);
     ~DmdbGetCommand();
 };
 
 class DmdbDelCommand : public DmdbCommand {
 public:
-    virtual bool Execute(DmdbClientContact &clientContact);
-    DmdbDelCommand(std::string name);
+    virtual bool Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters);
+    DmdbDelCommand(std::string name, int arity, uint32_t flags);
     ~DmdbDelCommand();
 };
 
+/* Like DEL, but a big value is freed by the lazy free thread */
+class DmdbUnlinkCommand : public DmdbCommand {
+public:
+    virtual bool Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters);
+    DmdbUnlinkCommand(std::string name, int arity, uint32_t flags);
+    ~DmdbUnlinkCommand();
+};
+
 class DmdbExistsCommand : public DmdbCommand {
 public:
-    virtual bool Execute(DmdbClientContact &clientContact);
-    DmdbExistsCommand(std::string name);
+    virtual bool Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters);
+    DmdbExistsCommand(std::string name, int arity, uint32_t flags);
     ~DmdbExistsCommand();
 };
 
 class DmdbMSetCommand : public DmdbCommand {
 public:
-    virtual bool Execute(DmdbClientContact &clientContact);
-    DmdbMSetCommand(std::string name);
+    virtual bool Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters);
+    DmdbMSetCommand(std::string name, int arity, uint32_t flags);
     ~DmdbMSetCommand();
 };
 
 class DmdbExpireCommand : public DmdbCommand {
 public:
-    virtual bool Execute(DmdbClientContact &clientContact);
-    DmdbExpireCommand(std::string name);
+    virtual bool Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters);
+    DmdbExpireCommand(std::string name, int arity, uint32_t flags);
     ~DmdbExpireCommand();
 };
 
+class DmdbPExpireAtCommand : public DmdbCommand {
+public:
+    virtual bool Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters);
+    DmdbPExpireAtCommand(std::string name, int arity, uint32_t flags);
+    ~DmdbPExpireAtCommand();
+};
+
 class DmdbKeysCommand : public DmdbCommand {
 public:
-    virtual bool Execute(DmdbClientContact &clientContact);
-    DmdbKeysCommand(std::string name);
+    virtual bool Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters);
+    DmdbKeysCommand(std::string name, int arity, uint32_t flags);
     ~DmdbKeysCommand();
 };
 
+class DmdbScanCommand : public DmdbCommand {
+public:
+    virtual bool Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters);
+    DmdbScanCommand(std::string name, int arity, uint32_t flags);
+    ~DmdbScanCommand();
+};
+
+class DmdbRangeKeysCommand : public DmdbCommand {
+public:
+    virtual bool Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters);
+    DmdbRangeKeysCommand(std::string name, int arity, uint32_t flags);
+    ~DmdbRangeKeysCommand();
+};
+
 class DmdbDbsizeCommand : public DmdbCommand {
 public:
-    virtual bool Execute(DmdbClientContact &clientContact);
-    DmdbDbsizeCommand(std::string name);
+    virtual bool Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters);
+    DmdbDbsizeCommand(std::string name, int arity, uint32_t flags);
     ~DmdbDbsizeCommand();
 };
 
+/* There is only one database, so FLUSHDB is the same as FLUSHALL */
+class DmdbFlushAllCommand : public DmdbCommand {
+public:
+    virtual bool Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters);
+    DmdbFlushAllCommand(std::string name, int arity, uint32_t flags);
+    ~DmdbFlushAllCommand();
+};
+
 class DmdbPingCommand : public DmdbCommand {
 public:
-    virtual bool Execute(DmdbClientContact &clientContact);
-    DmdbPingCommand(std::string name);
+    virtual bool Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters);
+    DmdbPingCommand(std::string name, int arity, uint32_t flags);
     ~DmdbPingCommand();
 };
 
 class DmdbEchoCommand : public DmdbCommand {
 public:
-    virtual bool Execute(DmdbClientContact &clientContact);
-    DmdbEchoCommand(std::string name);
+    virtual bool Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters);
+    DmdbEchoCommand(std::string name, int arity, uint32_t flags);
     ~DmdbEchoCommand();
 };
 
 class DmdbSaveCommand : public DmdbCommand {
 public:
-    virtual bool Execute(DmdbClientContact &clientContact);
-    DmdbSaveCommand(std::string name);
+    virtual bool Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters);
+    DmdbSaveCommand(std::string name, int arity, uint32_t flags);
     ~DmdbSaveCommand();
 };
 
 class DmdbTypeCommand : public DmdbCommand {
 public:
-    virtual bool Execute(DmdbClientContact &clientContact);
-    DmdbTypeCommand(std::string name);
+    virtual bool Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters);
+    DmdbTypeCommand(std::string name, int arity, uint32_t flags);
     ~DmdbTypeCommand();
 };
 
 class DmdbPTTLCommand : public DmdbCommand {
 public:
-    virtual bool Execute(DmdbClientContact &clientContact);
-    DmdbPTTLCommand(std::string name);
+    virtual bool Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters);
+    DmdbPTTLCommand(std::string name, int arity, uint32_t flags);
     ~DmdbPTTLCommand();
 };
 
 class DmdbPersistCommand : public DmdbCommand {
 public:
-    virtual bool Execute(DmdbClientContact &clientContact);
-    DmdbPersistCommand(std::string name);
+    virtual bool Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters);
+    DmdbPersistCommand(std::string name, int arity, uint32_t flags);
     ~DmdbPersistCommand();
 };
 
 class DmdbClientCommand : public DmdbCommand {
 public:
-    virtual bool Execute(DmdbClientContact &clientContact);
-    DmdbClientCommand(std::string name);
+    virtual bool Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters);
+    DmdbClientCommand(std::string name, int arity, uint32_t flags);
     ~DmdbClientCommand();
 };
 
 class DmdbSyncCommand : public DmdbCommand {
 public:
-    virtual bool Execute(DmdbClientContact &clientContact);
-    DmdbSyncCommand(std::string name);
+    virtual bool Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters);
+    DmdbSyncCommand(std::string name, int arity, uint32_t flags);
     ~DmdbSyncCommand();
 };
 
+class DmdbPSyncCommand : public DmdbCommand {
+public:
+    virtual bool Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters);
+    DmdbPSyncCommand(std::string name, int arity, uint32_t flags);
+    ~DmdbPSyncCommand();
+};
+
 class DmdbReplconfCommand : public DmdbCommand {
 public:
-    virtual bool Execute(DmdbClientContact &clientContact);
-    DmdbReplconfCommand(std::string name);
+    virtual bool Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters);
+    DmdbReplconfCommand(std::string name, int arity, uint32_t flags);
     ~DmdbReplconfCommand();
 };
 
 class DmdbBgSaveCommand : public DmdbCommand {
 public:
-    virtual bool Execute(DmdbClientContact &clientContact);
-    DmdbBgSaveCommand(std::string name);
+    virtual bool Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters);
+    DmdbBgSaveCommand(std::string name, int arity, uint32_t flags);
     ~DmdbBgSaveCommand();
 };
 
 class DmdbShutdownCommand : public DmdbCommand {
 public:
-    virtual bool Execute(DmdbClientContact &clientContact);
-    DmdbShutdownCommand(std::string name);
+    virtual bool Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters);
+    DmdbShutdownCommand(std::string name, int arity, uint32_t flags);
     ~DmdbShutdownCommand();
 };
 
 class DmdbRoleCommand : public DmdbCommand {
 public:
-    virtual bool Execute(DmdbClientContact &clientContact);
-    DmdbRoleCommand(std::string name);
+    virtual bool Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters);
+    DmdbRoleCommand(std::string name, int arity, uint32_t flags);
     ~DmdbRoleCommand();
 };
 
 class DmdbWaitCommand : public DmdbCommand {
 public:
-    virtual bool Execute(DmdbClientContact &clientContact);
-    DmdbWaitCommand(std::string name);
+    virtual bool Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters);
+    DmdbWaitCommand(std::string name, int arity, uint32_t flags);
     ~DmdbWaitCommand();
 };
 
+class DmdbBgRewriteAOFCommand : public DmdbCommand {
+public:
+    virtual bool Execute(DmdbClientContact &clientContact, const std::vector<std::string> &parameters);
+    DmdbBgRewriteAOFCommand(std::string name, int arity, uint32_t flags);
+    ~DmdbBgRewriteAOFCommand();
+};
+
 }
\ No newline at end of file
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+namespace Dmdb {
+
+/* The CRC-64/Jones of redis: reflected, initial value is the crc passed in, no final xor.
+ * All the variants have the same output, Crc64() uses the fastest one the CPU supports */
+class DmdbCrc64 {
+public:
+    static uint64_t Crc64(uint64_t crc, const unsigned char *s, uint64_t l);
+    /* The variants below are public for the benchmark */
+    static uint64_t Crc64Bytewise(uint64_t crc, const unsigned char *s, uint64_t l);
+    static uint64_t Crc64Slicing8(uint64_t crc, const unsigned char *s, uint64_t l);
+    static uint64_t Crc64Slicing16(uint64_t crc, const unsigned char *s, uint64_t l);
+    /* It works only if IsClmulSupported() returns true */
+    static uint64_t Crc64Clmul(uint64_t crc, const unsigned char *s, uint64_t l);
+    static bool IsClmulSupported();
+private:
+    DmdbCrc64();
+    static const DmdbCrc64& GetInstance();
+    static uint64_t XPowModPoly(size_t n);
+    /* _slicing_tables[k][b] is the crc of byte b followed by k zero bytes */
+    uint64_t _slicing_tables[16][256];
+    /* Constants of carry-less multiplication folding, see Crc64Clmul() */
+    uint64_t _fold_128_low;
+    uint64_t _fold_128_high;
+    uint64_t _fold_512_low;
+    uint64_t _fold_512_high;
+    bool _is_clmul_supported;
+};
+
+}
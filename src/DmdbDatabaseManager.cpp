@@ -1,54 +1,199 @@
 #include <time.h>
+#include <string.h>
 
-#include <regex>
+#include <algorithm>
 
 #include "DmdbDatabaseManager.hpp"
+#include "DmdbLazyFreeManager.hpp"
+#include "DmdbGlobPattern.hpp"
 #include "DmdbUtil.hpp"
 
 
 namespace Dmdb {
 
-DmdbKey::DmdbKey(std::string name) : _key_name(name), _expire_ms(0) {
+/* Active expiring deletes keys in rounds of this size, and keeps going while rounds are
+ * full and the time budget of the cycle isn't used up */
+const size_t EXPIRE_KEYS_PER_ROUND = 20;
+const uint64_t EXPIRE_CYCLE_BUDGET_US = 1000;
+/* The LFU settings are the defaults of redis */
+const uint32_t LFU_INIT_COUNTER = 5;
+const uint32_t LFU_LOG_FACTOR = 10;
+const uint64_t LFU_MINUTES_MASK = 0xFFFF;
 
+DmdbKey::DmdbKey(std::string name) : _key_name(name) {
+
+}
+
+const std::string& DmdbKey::GetName() const {
+    return _key_name;
 }
 
-DmdbKey::DmdbKey(std::string name, uint64_t ms) : _key_name(name), _expire_ms(ms) {
+DmdbKey::~DmdbKey() {
 
 }
 
-std::string DmdbKey::GetName() const {
-    return _key_name;
+/* Returns the encoding a string value should use */
+DmdbValueEncoding DmdbValue::ChooseStringEncoding(const std::string &str, int64_t &intVal) {
+    if(ParseCanonicalInt64(str, intVal)) {
+        return DmdbValueEncoding::INT;
+    }
+    if(str.length() <= EMBSTR_MAX_SIZE) {
+        return DmdbValueEncoding::EMBSTR;
+    }
+    return DmdbValueEncoding::RAW;
 }
 
-void DmdbKey::SetExpireTime(uint64_t expireTime) {
-    _expire_ms = expireTime;
+/* Only strings which can be printed back byte by byte identically are taken, like "-12",
+ * while "+12", "012", "-0" and " 12" are not */
+bool DmdbValue::ParseCanonicalInt64(const std::string &str, int64_t &intVal) {
+    size_t len = str.length();
+    if(len == 0 || len > INT_ENCODING_MAX_DIGITS) {
+        return false;
+    }
+    size_t pos = 0;
+    bool isNegative = false;
+    if(str[0] == '-') {
+        isNegative = true;
+        pos++;
+        if(len == 1) {
+            return false;
+        }
+    }
+    if(str[pos] == '0' && (len - pos > 1 || isNegative)) {
+        return false;
+    }
+    /* Accumulate it as a negative number, so INT64_MIN can be parsed too */
+    int64_t result = 0;
+    const int64_t minDiv10 = INT64_MIN / 10;
+    for(; pos < len; ++pos) {
+        if(str[pos] < '0' || str[pos] > '9') {
+            return false;
+        }
+        int digit = str[pos] - '0';
+        if(result < minDiv10 || (result == minDiv10 && digit > -(INT64_MIN % 10))) {
+            return false;
+        }
+        result = result * 10 - digit;
+    }
+    if(!isNegative) {
+        if(result == INT64_MIN) {
+            return false;
+        }
+        result = -result;
+    }
+    intVal = result;
+    return true;
+}
+
+/* Write the decimal digits of val to buf from right to left, returns the length */
+size_t DmdbValue::Int64ToChars(int64_t val, char* buf) {
+    char tmp[INT_ENCODING_MAX_DIGITS];
+    size_t len = 0;
+    uint64_t absVal = val < 0 ? (~static_cast<uint64_t>(val) + 1) : static_cast<uint64_t>(val);
+    do {
+        tmp[len++] = '0' + absVal % 10;
+        absVal /= 10;
+    } while(absVal > 0);
+    size_t total = 0;
+    if(val < 0) {
+        buf[total++] = '-';
+    }
+    while(len > 0) {
+        buf[total++] = tmp[--len];
+    }
+    return total;
 }
 
-uint64_t DmdbKey::GetExpireTime() const {
-    return _expire_ms;
+size_t DmdbValue::GetMemoryUsage() {
+    switch(_encoding) {
+        case DmdbValueEncoding::RAW: {
+            return sizeof(DmdbValue) + _shared_str->GetMemoryUsage();
+        }
+        case DmdbValueEncoding::EMBSTR: {
+            return sizeof(DmdbValue) + _embstr_capacity;
+        }
+        case DmdbValueEncoding::INT: {
+            return sizeof(DmdbValue);
+        }
+    }
+    return sizeof(DmdbValue);
 }
 
-DmdbKey::~DmdbKey() {
+char* DmdbValue::GetEmbeddedData() {
+    return reinterpret_cast<char*>(this + 1);
+}
 
+/* A short string is stored right behind the DmdbValue header in the same allocation, while
+ * an integer is stored in the header itself, so neither of them needs a std::string */
+DmdbValue* DmdbValue::CreateStringValue(const std::string &str) {
+    int64_t intVal = 0;
+    DmdbValueEncoding encoding = ChooseStringEncoding(str, intVal);
+    switch(encoding) {
+        case DmdbValueEncoding::INT: {
+            DmdbValue* value = new DmdbValue(DmdbValueType::STRING, encoding);
+            value->_int_val = intVal;
+            return value;
+        }
+        case DmdbValueEncoding::EMBSTR: {
+            /* Leave a few spare bytes so that overwriting with a slightly longer string can be done in place */
+            size_t capacity = std::min(EMBSTR_MAX_SIZE, (str.length() + 7) & ~static_cast<size_t>(7));
+            void* mem = ::operator new(sizeof(DmdbValue) + capacity);
+            DmdbValue* value = new(mem) DmdbValue(DmdbValueType::STRING, encoding);
+            value->_embstr_len = static_cast<uint8_t>(str.length());
+            value->_embstr_capacity = static_cast<uint8_t>(capacity);
+            memcpy(value->GetEmbeddedData(), str.data(), str.length());
+            return value;
+        }
+        case DmdbValueEncoding::RAW: {
+            DmdbValue* value = new DmdbValue(DmdbValueType::STRING, encoding);
+            value->_shared_str = DmdbSharedString::Create(str);
+            return value;
+        }
+    }
+    return nullptr;
+}
+
+void DmdbValue::Release(DmdbValue* value) {
+    if(value == nullptr) {
+        return;
+    }
+    if(value->_encoding == DmdbValueEncoding::EMBSTR) {
+        value->~DmdbValue();
+        ::operator delete(value);
+        return;
+    }
+    delete value;
 }
 
 /* Here you must ensure that buf's size is bigger than value's */
 size_t DmdbValue::GetValueRawData(uint8_t* buf) {
-    size_t getSize = GetValueSize();
-    switch(_val_type) {
-        case DmdbValueType::STRING: {
-            memcpy(buf, static_cast<std::string*>(_value_ptr)->c_str(), getSize);
-            return getSize;
+    switch(_encoding) {
+        case DmdbValueEncoding::RAW: {
+            memcpy(buf, _shared_str->GetData(), _shared_str->GetLength());
+            return _shared_str->GetLength();
+        }
+        case DmdbValueEncoding::EMBSTR: {
+            memcpy(buf, GetEmbeddedData(), _embstr_len);
+            return _embstr_len;
+        }
+        case DmdbValueEncoding::INT: {
+            return Int64ToChars(_int_val, reinterpret_cast<char*>(buf));
         }
     }
     return 0;
 }
 
 size_t DmdbValue::GetValueSize() {
-    switch(_val_type) {
-        case DmdbValueType::STRING: {
-            return static_cast<std::string*>(_value_ptr)->length();
-            break;
+    switch(_encoding) {
+        case DmdbValueEncoding::RAW: {
+            return _shared_str->GetLength();
+        }
+        case DmdbValueEncoding::EMBSTR: {
+            return _embstr_len;
+        }
+        case DmdbValueEncoding::INT: {
+            char buf[INT_ENCODING_MAX_DIGITS];
+            return Int64ToChars(_int_val, buf);
         }
     }
     return 0;
@@ -58,6 +203,18 @@ DmdbValueType DmdbValue::GetValueType() {
     return _val_type;
 }
 
+DmdbValueEncoding DmdbValue::GetValueEncoding() {
+    return _encoding;
+}
+
+/* Returns nullptr unless the value is RAW encoded */
+DmdbSharedString* DmdbValue::GetSharedString() {
+    if(_encoding == DmdbValueEncoding::RAW) {
+        return _shared_str;
+    }
+    return nullptr;
+}
+
 std::string DmdbValue::GetValueTypeString() {
     switch(_val_type) {
         case DmdbValueType::STRING: {
@@ -70,164 +227,621 @@ std::string DmdbValue::GetValueTypeString() {
 
 std::string DmdbValue::GetValueString() {
     std::string msgResult;
-    switch(_val_type) {
-        case DmdbValueType::STRING:{
-            msgResult = *static_cast<std::string*>(_value_ptr);
+    switch(_encoding) {
+        case DmdbValueEncoding::RAW: {
+            msgResult.assign(_shared_str->GetData(), _shared_str->GetLength());
+            break;
+        }
+        case DmdbValueEncoding::EMBSTR: {
+            msgResult.assign(GetEmbeddedData(), _embstr_len);
+            break;
+        }
+        case DmdbValueEncoding::INT: {
+            char buf[INT_ENCODING_MAX_DIGITS];
+            msgResult.assign(buf, Int64ToChars(_int_val, buf));
             break;
         }
     }
     return msgResult; 
 }
 
-DmdbValue::DmdbValue(void* value):_value_ptr(value) {
-
+/* Overwrite the value in place if str takes the same encoding and fits into the current
+ * buffer, std::string::assign() reuses the buffer if its capacity is enough.
+ * Returns false if a new value has to be created */
+bool DmdbValue::SetValueString(const std::string &str) {
+    int64_t intVal = 0;
+    DmdbValueEncoding encoding = ChooseStringEncoding(str, intVal);
+    if(encoding != _encoding) {
+        return false;
+    }
+    switch(_encoding) {
+        case DmdbValueEncoding::RAW: {
+            /* The old content may still be waiting in the output buffers of clients */
+            if(_shared_str->IsShared()) {
+                return false;
+            }
+            _shared_str->Assign(str);
+            return true;
+        }
+        case DmdbValueEncoding::EMBSTR: {
+            if(str.length() > _embstr_capacity) {
+                return false;
+            }
+            memcpy(GetEmbeddedData(), str.data(), str.length());
+            _embstr_len = static_cast<uint8_t>(str.length());
+            return true;
+        }
+        case DmdbValueEncoding::INT: {
+            _int_val = intVal;
+            return true;
+        }
+    }
+    return false;
 }
 
-DmdbValue::DmdbValue(void* value, DmdbValueType valType):_value_ptr(value), _val_type(valType) {
+DmdbValue::DmdbValue(DmdbValueType valType, DmdbValueEncoding encoding) : _val_type(valType), _encoding(encoding),
+                                                                        _embstr_len(0), _embstr_capacity(0),
+                                                                        _shared_str(nullptr) {
 
 }
 
-
 DmdbValue::~DmdbValue() {
-    switch(_val_type) {
-        case DmdbValueType::STRING: {
-           delete static_cast<std::string*>(_value_ptr);
-           break; 
-        }
-    } 
+    if(_encoding == DmdbValueEncoding::RAW) {
+        _shared_str->DecrRefCount();
+    }
 }
 
 
-DmdbDatabaseManager::DmdbDatabaseManager() : _last_expire_ms(DmdbUtil::GetCurrentMs()), _expire_interval_ms(1000) {}
+DmdbDictEntry::DmdbDictEntry(const std::string &name, DmdbValue* value) : _key(name), _expire_ms(0),
+                                                                       _expire_heap_index(EXPIRE_HEAP_INDEX_NONE), _value(value),
+                                                                       _access_info(0) {
+
+}
+
+DmdbDatabaseManager::DmdbDatabaseManager() : _save_iterator(&_database), _save_next_entry(nullptr),
+                                             _key_index(nullptr), _is_expire_backlogged(false),
+                                             _last_expire_ms(DmdbUtil::GetCurrentMs()), _expire_interval_ms(1000),
+                                             _entries_memory(0), _max_memory(0), _eviction_policy(EvictionPolicy::NO_EVICTION),
+                                             _eviction_samples(EVICTION_SAMPLES_DEFAULT), _lazy_free_manager(nullptr),
+                                             _is_lazy_expire(false), _is_lazy_eviction(false) {}
 
 DmdbDatabaseManager::~DmdbDatabaseManager() {
-    std::unordered_map<DmdbKey, DmdbValue*, HashFunction<DmdbKey>, EqualFunction<DmdbKey>>::iterator it;
-    while((it = _database.begin()) != _database.end()) {
-        DelKey(it->first.GetName());
+    Destroy();
+    delete _key_index;
+}
+
+/* The memory is taken off when the entry leaves the keyspace, even if the value is freed later */
+void DmdbDatabaseManager::FreeEntry(DmdbDictEntry* entry, bool isLazy) {
+    _entries_memory -= GetEntryMemoryUsage(entry);
+    if(isLazy && _lazy_free_manager != nullptr) {
+        _lazy_free_manager->FreeValueLazily(entry->_value);
+    } else {
+        DmdbValue::Release(entry->_value);
+    }
+    delete entry;
+}
+
+void DmdbDatabaseManager::DelEntry(DmdbDictEntry* entry, bool isLazy) {
+    _database.Unlink(entry->_key.GetName());
+    if(_key_index != nullptr) {
+        _key_index->Remove(entry->_key.GetName());
     }
+    if(entry->_expire_heap_index != EXPIRE_HEAP_INDEX_NONE) {
+        _expire_heap.Remove(entry);
+    }
+    FreeEntry(entry, isLazy);
+}
+
+/* Keep the expire heap in step with the expire time of entry, ms == 0 means no TTL */
+void DmdbDatabaseManager::SetEntryExpireTime(DmdbDictEntry* entry, uint64_t ms) {
+    entry->_expire_ms = ms;
+    if(ms == 0) {
+        if(entry->_expire_heap_index != EXPIRE_HEAP_INDEX_NONE) {
+            _expire_heap.Remove(entry);
+        }
+    } else if(entry->_expire_heap_index == EXPIRE_HEAP_INDEX_NONE) {
+        _expire_heap.Push(entry, ms);
+    } else {
+        _expire_heap.Update(entry, ms);
+    }
+}
+
+bool DmdbDatabaseManager::IsEntryExpired(DmdbDictEntry* entry, uint64_t currentMs) {
+    return entry->_expire_ms != 0 && entry->_expire_ms <= currentMs;
 }
 
+/* Free entries by walking the tables directly, there is no need to look up every key again */
 void DmdbDatabaseManager::Destroy() {
-    std::unordered_map<DmdbKey, DmdbValue*, HashFunction<DmdbKey>, EqualFunction<DmdbKey>>::iterator it;
-    while((it = _database.begin()) != _database.end()) {
-        DelKey(it->first.GetName());
-    }    
+    _save_iterator.Reset();
+    _save_next_entry = nullptr;
+    _expire_heap.Clear();
+    DmdbDictIterator it(&_database);
+    DmdbDictEntry* entry = nullptr;
+    while((entry = it.Next()) != nullptr) {
+        FreeEntry(entry, false);
+    }
+    it.Reset();
+    _database.Clear();
+    if(_key_index != nullptr) {
+        _key_index->Clear();
+    }
+    _eviction_pool.clear();
+}
+
+void DmdbDatabaseManager::Flush(bool isLazy) {
+    if(!isLazy || _lazy_free_manager == nullptr || _database.Size() == 0) {
+        Destroy();
+        return;
+    }
+    DmdbDatabaseManager* oldDatabase = new DmdbDatabaseManager();
+    if(_key_index != nullptr) {
+        oldDatabase->EnableKeyIndex();
+    }
+    Swap(*oldDatabase);
+    _lazy_free_manager->FreeDatabaseLazily(oldDatabase);
+}
+
+void DmdbDatabaseManager::SetLazyFree(DmdbLazyFreeManager* lazyFreeManager, bool isLazyExpire, bool isLazyEviction) {
+    _lazy_free_manager = lazyFreeManager;
+    _is_lazy_expire = isLazyExpire;
+    _is_lazy_eviction = isLazyEviction;
 }
 
-bool DmdbDatabaseManager::GetKeyByName(const std::string &name, DmdbKey &key) {
-    DmdbKey keyTmp(name);
-    std::unordered_map<DmdbKey, DmdbValue*, HashFunction<DmdbKey>, EqualFunction<DmdbKey>>::iterator it = _database.find(keyTmp);
-    if(it == _database.end()) {
+void DmdbDatabaseManager::Swap(DmdbDatabaseManager &other) {
+    _save_iterator.Reset();
+    _save_next_entry = nullptr;
+    other._save_iterator.Reset();
+    other._save_next_entry = nullptr;
+    _database.Swap(other._database);
+    _expire_heap.Swap(other._expire_heap);
+    /* The index is a part of the data, both of them are expected to have it enabled or disabled */
+    std::swap(_key_index, other._key_index);
+    std::swap(_is_expire_backlogged, other._is_expire_backlogged);
+    std::swap(_entries_memory, other._entries_memory);
+    /* The candidates are names, they are meaningless in the other database */
+    _eviction_pool.clear();
+    other._eviction_pool.clear();
+}
+
+bool DmdbDatabaseManager::GetExpireTimeByKey(const std::string &keyStr, uint64_t &ms) {
+    DmdbDictEntry* entry = _database.Find(keyStr);
+    if(entry == nullptr) {
         return false;
     }
-    key = it->first;
+    /* Active expiring works within a time budget, so we also expire keys when they are accessed */
+    uint64_t currentMs = DmdbUtil::GetCurrentMs();
+    if(IsEntryExpired(entry, currentMs)) {
+        DelEntry(entry, _is_lazy_expire);
+        return false;
+    }
+    TouchEntry(entry, currentMs);
+    ms = entry->_expire_ms;
     return true;
 }
 
 DmdbValue* DmdbDatabaseManager::GetValueByKey(const std::string &keyStr) {
-    DmdbKey key(keyStr);
-    std::unordered_map<DmdbKey, DmdbValue*, HashFunction<DmdbKey>, EqualFunction<DmdbKey>>::iterator it = _database.find(key);  
-    if (it != _database.end()) {
-        return it->second;
+    DmdbDictEntry* entry = _database.Find(keyStr);
+    if(entry == nullptr) {
+        return nullptr;
+    }
+    uint64_t currentMs = DmdbUtil::GetCurrentMs();
+    if(IsEntryExpired(entry, currentMs)) {
+        DelEntry(entry, _is_lazy_expire);
+        return nullptr;
     }
-    return nullptr;      
+    TouchEntry(entry, currentMs);
+    return entry->_value;
 }
 
-bool DmdbDatabaseManager::DelKey(const std::string &keyStr) {
-    DmdbKey key(keyStr);
-    std::unordered_map<DmdbKey, DmdbValue*, HashFunction<DmdbKey>, EqualFunction<DmdbKey>>::iterator it = _database.find(key);
-    if (it != _database.end()) {
-        delete it->second;
-        _database.erase(key);
+bool DmdbDatabaseManager::DelKey(const std::string &keyStr, bool isLazy) {
+    DmdbDictEntry* entry = _database.Unlink(keyStr);
+    if(entry != nullptr) {
+        if(_key_index != nullptr) {
+            _key_index->Remove(keyStr);
+        }
+        if(entry->_expire_heap_index != EXPIRE_HEAP_INDEX_NONE) {
+            _expire_heap.Remove(entry);
+        }
+        FreeEntry(entry, isLazy);
         return true;
     }
     return false;
 }
 
 bool DmdbDatabaseManager::SetKeyValuePair(const std::string& keyStr, const std::vector<std::string> &valVec, DmdbValueType valType, uint64_t ms) {
-    if(ms!=0 && ms<=DmdbUtil::GetCurrentMs()) {
+    uint64_t currentMs = DmdbUtil::GetCurrentMs();
+    if(ms!=0 && ms<=currentMs) {
         DelKey(keyStr);
         return false;
     }
-    DmdbKey key(keyStr, ms);
-    std::unordered_map<DmdbKey, DmdbValue*, HashFunction<DmdbKey>, EqualFunction<DmdbKey>>::iterator it = _database.find(key);
+    /* Overwriting an existing key updates its entry in place and reuses the value buffer */
+    DmdbDictEntry* entry = _database.Find(keyStr);
+    if(entry != nullptr) {
+        _entries_memory -= GetEntryMemoryUsage(entry);
+        TouchEntry(entry, currentMs);
+    }
+    /* Here we assume that valVec.size() > 0 */
+    if(entry != nullptr && entry->_value->GetValueType() == valType && entry->_value->SetValueString(valVec[0])) {
+        SetEntryExpireTime(entry, ms);
+        _entries_memory += GetEntryMemoryUsage(entry);
+        return true;
+    }
     DmdbValue *val = nullptr;
     switch (valType) {
         case DmdbValueType::STRING: {
-            /* Here we assume that valVec.size() > 0 */
-            std::string *strPointer = new std::string(valVec[0]);
-            val = new DmdbValue(strPointer, valType);
+            val = DmdbValue::CreateStringValue(valVec[0]);
             break;
         }
     }
-    if(it != _database.end()) {
-        delete it->second;
-        _database.erase(it);
+    if(entry != nullptr) {
+        DmdbValue::Release(entry->_value);
+        entry->_value = val;
+        SetEntryExpireTime(entry, ms);
+        _entries_memory += GetEntryMemoryUsage(entry);
+        return true;
+    }
+    entry = new DmdbDictEntry(keyStr, val);
+    _database.Add(entry);
+    if(_key_index != nullptr) {
+        _key_index->Insert(keyStr);
     }
-    _database[key] = val;
+    SetEntryExpireTime(entry, ms);
+    InitEntryAccessInfo(entry, currentMs);
+    _entries_memory += GetEntryMemoryUsage(entry);
     return true;
 }
 
+void DmdbDatabaseManager::CreateLoadedPair(const std::string &keyStr, const std::string &valStr, DmdbValueType type,
+                                           uint64_t ms, DmdbLoadedPair &pair) {
+    DmdbValue *val = nullptr;
+    switch (type) {
+        case DmdbValueType::STRING: {
+            val = DmdbValue::CreateStringValue(valStr);
+            break;
+        }
+    }
+    pair._entry = new DmdbDictEntry(keyStr, val);
+    pair._hash = DmdbDict::HashKey(keyStr);
+    pair._expire_ms = ms;
+}
+
+void DmdbDatabaseManager::ReleaseLoadedPair(DmdbLoadedPair &pair) {
+    DmdbValue::Release(pair._entry->_value);
+    delete pair._entry;
+    pair._entry = nullptr;
+}
+
+/* Like SetKeyValuePair(), the pair is dropped if it has expired and an existing key is replaced */
+void DmdbDatabaseManager::AddLoadedPair(DmdbLoadedPair &pair) {
+    uint64_t currentMs = DmdbUtil::GetCurrentMs();
+    if(pair._expire_ms!=0 && pair._expire_ms<=currentMs) {
+        ReleaseLoadedPair(pair);
+        return;
+    }
+    /* The hash has been computed by the loading thread */
+    DmdbDictEntry* oldEntry = _database.Find(pair._entry->_key.GetName(), pair._hash);
+    if(oldEntry != nullptr) {
+        DelEntry(oldEntry, false);
+    }
+    _database.Add(pair._entry, pair._hash);
+    if(_key_index != nullptr) {
+        _key_index->Insert(pair._entry->_key.GetName());
+    }
+    SetEntryExpireTime(pair._entry, pair._expire_ms);
+    InitEntryAccessInfo(pair._entry, currentMs);
+    _entries_memory += GetEntryMemoryUsage(pair._entry);
+    pair._entry = nullptr;
+}
+
+void DmdbDatabaseManager::ReserveForLoading(size_t pairsNum) {
+    _database.Expand(_database.Size() + pairsNum);
+}
+
 bool DmdbDatabaseManager::SetKeyExpireTime(const std::string& keyStr, uint64_t ms) {
-    DmdbKey key(keyStr, ms);
-    std::unordered_map<DmdbKey, DmdbValue*, HashFunction<DmdbKey>, EqualFunction<DmdbKey>>::iterator it = _database.find(key);
-    if(it == _database.end()) {
+    DmdbDictEntry* entry = _database.Find(keyStr);
+    if(entry == nullptr) {
         return false;
     }
-    if((ms!=0 && ms<=DmdbUtil::GetCurrentMs()) || (it->first.GetExpireTime() != 0 && it->first.GetExpireTime() <= DmdbUtil::GetCurrentMs())) {
-        DelKey(keyStr);
+    uint64_t currentMs = DmdbUtil::GetCurrentMs();
+    if((ms!=0 && ms<=currentMs) || IsEntryExpired(entry, currentMs)) {
+        DelEntry(entry, _is_lazy_expire);
         return true;
     }
-    DmdbValue* value = it->second;
-    _database.erase(it);
-    _database[key] = value;
+    SetEntryExpireTime(entry, ms);
     return true;    
 }
 
 void DmdbDatabaseManager::GetKeysByPattern(const std::string &patternStr, std::vector<DmdbKey> &keys) {
-    std::regex regexPattern(patternStr);
-    std::unordered_map<DmdbKey, DmdbValue*, HashFunction<DmdbKey>, EqualFunction<DmdbKey>>::iterator it = _database.begin();
-    while(it != _database.end()) {
-        if(std::regex_search(it->first.GetName(), regexPattern)) {
-            if(it->first.GetExpireTime() == 0 || it->first.GetExpireTime() > DmdbUtil::GetCurrentMs()) {
-                keys.emplace_back(it->first);
+    DmdbGlobPattern pattern(patternStr);
+    uint64_t currentMs = DmdbUtil::GetCurrentMs();
+    /* Only the keys under the literal prefix are visited */
+    if(_key_index != nullptr && !pattern.GetLiteralPrefix().empty()) {
+        std::vector<std::string> names;
+        _key_index->GetKeysByPrefix(pattern.GetLiteralPrefix(), names);
+        for(size_t i = 0; i < names.size(); ++i) {
+            DmdbDictEntry* entry = _database.Find(names[i]);
+            if(entry != nullptr && !IsEntryExpired(entry, currentMs) && pattern.Match(names[i])) {
+                keys.emplace_back(entry->_key);
+            }
+        }
+        return;
+    }
+    DmdbDictIterator it(&_database);
+    DmdbDictEntry* entry = nullptr;
+    while((entry = it.Next()) != nullptr) {
+        if(pattern.Match(entry->_key.GetName())) {
+            if(!IsEntryExpired(entry, currentMs)) {
+                keys.emplace_back(entry->_key);
+            }
+        }
+    }
+}
+
+uint64_t DmdbDatabaseManager::ScanKeys(uint64_t cursor, size_t count, const std::string &patternStr,
+                                       const std::string &typeStr, std::vector<std::string> &keys) {
+    DmdbGlobPattern pattern(patternStr);
+    std::vector<DmdbDictEntry*> entries;
+    size_t maxBuckets = count * 10;
+    do {
+        cursor = _database.Scan(cursor, entries);
+    } while(cursor != 0 && --maxBuckets > 0 && entries.size() < count);
+    uint64_t currentMs = DmdbUtil::GetCurrentMs();
+    for(size_t i = 0; i < entries.size(); ++i) {
+        DmdbDictEntry* entry = entries[i];
+        if(IsEntryExpired(entry, currentMs)) {
+            continue;
+        }
+        if(!typeStr.empty() && entry->_value->GetValueTypeString() != typeStr) {
+            continue;
+        }
+        if(!patternStr.empty() && !pattern.Match(entry->_key.GetName())) {
+            continue;
+        }
+        keys.push_back(entry->_key.GetName());
+    }
+    return cursor;
+}
+
+/* The expired keys are skipped, so we go on from the last key until limit keys are found */
+void DmdbDatabaseManager::GetKeysInRange(const DmdbLexBound &min, const DmdbLexBound &max, size_t limit,
+                                         std::vector<std::string> &keys) {
+    DmdbLexBound from = min;
+    uint64_t currentMs = DmdbUtil::GetCurrentMs();
+    while(keys.size() < limit) {
+        std::vector<std::string> names;
+        size_t expectedNum = limit - keys.size();
+        _key_index->GetKeysInRange(from, max, expectedNum, names);
+        for(size_t i = 0; i < names.size(); ++i) {
+            DmdbDictEntry* entry = _database.Find(names[i]);
+            if(entry != nullptr && !IsEntryExpired(entry, currentMs)) {
+                keys.push_back(names[i]);
             }
         }
-        it++;
+        if(names.size() < expectedNum) {
+            break;
+        }
+        from._key = names.back();
+        from._is_inclusive = false;
+        from._is_infinite = false;
     }
 }
 
 size_t DmdbDatabaseManager::GetDatabaseSize() {
-    return _database.size();
+    return _database.Size();
+}
+
+void DmdbDatabaseManager::IncrementallyRehash(uint64_t ms) {
+    _database.RehashMilliseconds(ms);
 }
 
 /* This size we compute is for saving rdb database */
 uint64_t DmdbDatabaseManager::GetTotalBytesOfPairsWhenSave() {
     uint64_t totalBytes = 0;
-    std::unordered_map<DmdbKey, DmdbValue*, HashFunction<DmdbKey>, EqualFunction<DmdbKey>>::iterator it = _database.begin();
-    while(it != _database.end()) {
+    DmdbDictIterator it(&_database);
+    DmdbDictEntry* entry = nullptr;
+    while((entry = it.Next()) != nullptr) {
         /* Expire time size */
         totalBytes += sizeof(uint64_t);
         /* Key length size */
         totalBytes += sizeof(uint32_t);
         /* Key size */
-        totalBytes += it->first.GetName().size();
+        totalBytes += entry->_key.GetName().size();
         /* Value type size */
         totalBytes += 1;
         /* Value length size */
         totalBytes += sizeof(uint32_t);
         /* Value size */
-        totalBytes += it->second->GetValueSize();
-        it++;
+        totalBytes += entry->_value->GetValueSize();
     }
     return totalBytes;
 }
 
+void DmdbDatabaseManager::EnableKeyIndex() {
+    if(_key_index == nullptr) {
+        _key_index = new DmdbRadixTree();
+    }
+}
+
+bool DmdbDatabaseManager::IsKeyIndexEnabled() {
+    return _key_index != nullptr;
+}
+
 void DmdbDatabaseManager::SetExpireIntervalForDB(uint64_t ms) {
     _expire_interval_ms = ms;
 }
 
-/* When using this funcion, modifying _database should be forbidden to avoid invalid iterator.  
+void DmdbDatabaseManager::SetMaxMemory(size_t maxMemory, EvictionPolicy policy, size_t samples) {
+    _max_memory = maxMemory;
+    _eviction_policy = policy;
+    _eviction_samples = samples;
+}
+
+EvictionPolicy DmdbDatabaseManager::GetEvictionPolicy() {
+    return _eviction_policy;
+}
+
+size_t DmdbDatabaseManager::GetEvictionSamples() {
+    return _eviction_samples;
+}
+
+size_t DmdbDatabaseManager::GetUsedMemory() {
+    return _entries_memory + _database.GetMemoryUsage() + _expire_heap.GetMemoryUsage();
+}
+
+size_t DmdbDatabaseManager::GetEntryMemoryUsage(DmdbDictEntry* entry) {
+    return sizeof(DmdbDictEntry) + DmdbUtil::GetStringHeapSize(entry->_key.GetName()) + entry->_value->GetMemoryUsage();
+}
+
+void DmdbDatabaseManager::InitEntryAccessInfo(DmdbDictEntry* entry, uint64_t currentMs) {
+    if(_eviction_policy == EvictionPolicy::ALLKEYS_LFU) {
+        entry->_access_info = (((currentMs / 60000) & LFU_MINUTES_MASK) << 8) | LFU_INIT_COUNTER;
+    } else {
+        entry->_access_info = currentMs;
+    }
+}
+
+/* Like redis, the LFU counter grows logarithmically: the bigger it is, the less likely an access increments it */
+void DmdbDatabaseManager::TouchEntry(DmdbDictEntry* entry, uint64_t currentMs) {
+    if(_eviction_policy != EvictionPolicy::ALLKEYS_LFU) {
+        entry->_access_info = currentMs;
+        return;
+    }
+    uint32_t counter = GetDecayedLFUCounter(entry, currentMs);
+    if(counter < 255) {
+        double baseVal = counter > LFU_INIT_COUNTER ? counter - LFU_INIT_COUNTER : 0;
+        if(static_cast<double>(rand()) / RAND_MAX < 1.0 / (baseVal * LFU_LOG_FACTOR + 1)) {
+            counter++;
+        }
+    }
+    entry->_access_info = (((currentMs / 60000) & LFU_MINUTES_MASK) << 8) | counter;
+}
+
+/* The counter is decremented by one for every minute without access */
+uint8_t DmdbDatabaseManager::GetDecayedLFUCounter(DmdbDictEntry* entry, uint64_t currentMs) {
+    uint64_t minutes = (currentMs / 60000) & LFU_MINUTES_MASK;
+    uint64_t lastMinutes = (entry->_access_info >> 8) & LFU_MINUTES_MASK;
+    uint64_t elapsed = (minutes - lastMinutes) & LFU_MINUTES_MASK;
+    uint64_t counter = entry->_access_info & 0xFF;
+    return static_cast<uint8_t>(elapsed >= counter ? 0 : counter - elapsed);
+}
+
+uint64_t DmdbDatabaseManager::GetEvictionScore(DmdbDictEntry* entry, uint64_t currentMs) {
+    if(_eviction_policy == EvictionPolicy::ALLKEYS_LFU) {
+        return 255 - GetDecayedLFUCounter(entry, currentMs);
+    }
+    return currentMs > entry->_access_info ? currentMs - entry->_access_info : 0;
+}
+
+/* The pool is sorted by score in ascending order, the best candidate is at the back */
+void DmdbDatabaseManager::PopulateEvictionPool(uint64_t currentMs) {
+    std::vector<DmdbDictEntry*> samples;
+    if(_eviction_policy == EvictionPolicy::VOLATILE_LRU) {
+        for(size_t i = 0; i < _eviction_samples; ++i) {
+            DmdbDictEntry* entry = _expire_heap.GetRandomEntry();
+            if(entry != nullptr) {
+                samples.push_back(entry);
+            }
+        }
+    } else {
+        _database.GetSomeEntries(_eviction_samples, samples);
+    }
+    for(size_t i = 0; i < samples.size(); ++i) {
+        uint64_t score = GetEvictionScore(samples[i], currentMs);
+        if(_eviction_pool.size() == EVICTION_POOL_SIZE && score <= _eviction_pool[0]._score) {
+            continue;
+        }
+        const std::string &key = samples[i]->_key.GetName();
+        bool isInPool = false;
+        for(size_t j = 0; j < _eviction_pool.size() && !isInPool; ++j) {
+            isInPool = _eviction_pool[j]._key == key;
+        }
+        if(isInPool) {
+            continue;
+        }
+        if(_eviction_pool.size() == EVICTION_POOL_SIZE) {
+            _eviction_pool.erase(_eviction_pool.begin());
+        }
+        std::vector<DmdbEvictionCandidate>::iterator it = _eviction_pool.begin();
+        while(it != _eviction_pool.end() && it->_score < score) {
+            ++it;
+        }
+        _eviction_pool.insert(it, DmdbEvictionCandidate{score, key});
+    }
+}
+
+/* Returns nullptr if there is no key to evict by the policy */
+DmdbDictEntry* DmdbDatabaseManager::ChooseEntryToEvict() {
+    switch(_eviction_policy) {
+        case EvictionPolicy::NO_EVICTION: {
+            return nullptr;
+        }
+        case EvictionPolicy::VOLATILE_TTL: {
+            /* The heap gives the exact key which is the nearest to expire, no need to sample */
+            uint64_t expireMs = 0;
+            return _expire_heap.Top(expireMs);
+        }
+        case EvictionPolicy::ALLKEYS_RANDOM: {
+            std::vector<DmdbDictEntry*> samples;
+            while(samples.empty() && _database.Size() > 0) {
+                _database.GetSomeEntries(1, samples);
+            }
+            return samples.empty() ? nullptr : samples[0];
+        }
+        default: {
+            break;
+        }
+    }
+    uint64_t currentMs = DmdbUtil::GetCurrentMs();
+    bool isVolatile = _eviction_policy == EvictionPolicy::VOLATILE_LRU;
+    while(isVolatile ? _expire_heap.Size() > 0 : _database.Size() > 0) {
+        PopulateEvictionPool(currentMs);
+        /* The candidates may have been deleted or lost their TTL since they were sampled */
+        while(!_eviction_pool.empty()) {
+            DmdbDictEntry* entry = _database.Find(_eviction_pool.back()._key);
+            _eviction_pool.pop_back();
+            if(entry != nullptr && (!isVolatile || entry->_expire_heap_index != EXPIRE_HEAP_INDEX_NONE)) {
+                return entry;
+            }
+        }
+    }
+    return nullptr;
+}
+
+bool DmdbDatabaseManager::EvictKeysIfNeed(std::vector<std::string> &evictedKeys) {
+    if(_max_memory == 0) {
+        return true;
+    }
+    while(GetUsedMemory() > _max_memory) {
+        DmdbDictEntry* entry = ChooseEntryToEvict();
+        if(entry == nullptr) {
+            return false;
+        }
+        evictedKeys.push_back(entry->_key.GetName());
+        DelEntry(entry, _is_lazy_eviction);
+    }
+    return true;
+}
+
+bool DmdbDatabaseManager::String2EvictionPolicy(const std::string &str, EvictionPolicy &policy) {
+    if(str == "noeviction") {
+        policy = EvictionPolicy::NO_EVICTION;
+    } else if(str == "allkeys-lru") {
+        policy = EvictionPolicy::ALLKEYS_LRU;
+    } else if(str == "allkeys-lfu") {
+        policy = EvictionPolicy::ALLKEYS_LFU;
+    } else if(str == "volatile-lru") {
+        policy = EvictionPolicy::VOLATILE_LRU;
+    } else if(str == "volatile-ttl") {
+        policy = EvictionPolicy::VOLATILE_TTL;
+    } else if(str == "allkeys-random") {
+        policy = EvictionPolicy::ALLKEYS_RANDOM;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/* When using this funcion, modifying _database should be forbidden to avoid invalid iterator.
  * The format of a pair is as below:
  * Expire_time: 8 bytes
  * Key_length: 4 bytes
@@ -237,16 +851,15 @@ void DmdbDatabaseManager::SetExpireIntervalForDB(uint64_t ms) {
  * value_raw_data: */ 
 bool DmdbDatabaseManager::GetNPairsFormatRawSequential(uint8_t* buf, size_t bufLen, size_t &copiedSize,
                                                        size_t expectedAmount, size_t &actualAmount) {
-    // static size_t pairsAmount = 0;
     actualAmount = 0;
     copiedSize = 0;
-    static std::unordered_map<DmdbKey, DmdbValue*, HashFunction<DmdbKey>, EqualFunction<DmdbKey>>::iterator it = _database.begin();
+    DmdbDictEntry* entry = _save_next_entry != nullptr ? _save_next_entry : _save_iterator.Next();
 
-    while(it != _database.end() && actualAmount < expectedAmount) {
-        uint64_t expireTime = it->first.GetExpireTime();
-        uint32_t keyLength = static_cast<uint32_t>(it->first.GetName().length());
+    while(entry != nullptr && actualAmount < expectedAmount) {
+        uint64_t expireTime = entry->_expire_ms;
+        uint32_t keyLength = static_cast<uint32_t>(entry->_key.GetName().length());
 
-        uint32_t valLength = static_cast<uint32_t>(it->second->GetValueSize());
+        uint32_t valLength = static_cast<uint32_t>(entry->_value->GetValueSize());
 
         size_t pairTotalSize = 17+keyLength+valLength;
         if(bufLen - copiedSize < pairTotalSize) {
@@ -256,47 +869,92 @@ bool DmdbDatabaseManager::GetNPairsFormatRawSequential(uint8_t* buf, size_t bufL
         copiedSize += sizeof(expireTime);
         memcpy(buf+copiedSize, &keyLength, sizeof(keyLength));
         copiedSize += sizeof(keyLength);
-        memcpy(buf+copiedSize, it->first.GetName().c_str(), keyLength);
+        memcpy(buf+copiedSize, entry->_key.GetName().c_str(), keyLength);
         copiedSize += keyLength;
-        uint8_t valType = static_cast<uint8_t>(it->second->GetValueType());
+        uint8_t valType = static_cast<uint8_t>(entry->_value->GetValueType());
         memcpy(buf+copiedSize, &valType, sizeof(valType));
         copiedSize += sizeof(valType);
         memcpy(buf+copiedSize, &valLength, sizeof(valLength));
         copiedSize += sizeof(valLength);
-        it->second->GetValueRawData(buf+copiedSize);
+        entry->_value->GetValueRawData(buf+copiedSize);
         copiedSize += valLength;
 
         actualAmount++;
-        it++;
+        entry = _save_iterator.Next();
     }
 
-    if(it == _database.end()) {
-        it = _database.begin();
+    if(entry == nullptr) {
+        _save_iterator.Reset();
+        _save_next_entry = nullptr;
         return true;
     }
+    _save_next_entry = entry;
     return false;
 }
 
+/* Like GetNPairsFormatRawSequential(), but every pair is appended to buf as a SET command
+ * with an absolute expire time, it's used by the AOF rewrite */
+bool DmdbDatabaseManager::GetNPairsFormatCommandSequential(std::string &buf, size_t expectedAmount, size_t &actualAmount) {
+    actualAmount = 0;
+    DmdbDictEntry* entry = _save_next_entry != nullptr ? _save_next_entry : _save_iterator.Next();
+
+    while(entry != nullptr && actualAmount < expectedAmount) {
+        const std::string &keyName = entry->_key.GetName();
+        std::string valueStr = entry->_value->GetValueString();
+        buf += entry->_expire_ms != 0 ? "*5\r\n$3\r\nSET\r\n" : "*3\r\n$3\r\nSET\r\n";
+        buf += "$" + std::to_string(keyName.length()) + "\r\n";
+        buf += keyName;
+        buf += "\r\n$" + std::to_string(valueStr.length()) + "\r\n";
+        buf += valueStr;
+        buf += "\r\n";
+        if(entry->_expire_ms != 0) {
+            std::string expireStr = std::to_string(entry->_expire_ms);
+            buf += "$4\r\nPXAT\r\n$" + std::to_string(expireStr.length()) + "\r\n" + expireStr + "\r\n";
+        }
+        actualAmount++;
+        entry = _save_iterator.Next();
+    }
+
+    if(entry == nullptr) {
+        _save_iterator.Reset();
+        _save_next_entry = nullptr;
+        return true;
+    }
+    _save_next_entry = entry;
+    return false;
+}
+
+/* Expired keys are taken from the top of the expire heap, so we never scan keys without TTL.
+ * If a cycle runs out of its time budget, the next one starts in the next loop of
+ * DmdbServer::DoService() instead of waiting for _expire_interval_ms */
 size_t DmdbDatabaseManager::RemoveExpiredKeys() {
     size_t deletedNum = 0;
+    if(_expire_heap.Size() == 0) {
+        _is_expire_backlogged = false;
+        return deletedNum;
+    }
     uint64_t currentMs = DmdbUtil::GetCurrentMs();
-    if(_last_expire_ms + _expire_interval_ms > currentMs) {
+    if(!_is_expire_backlogged && _last_expire_ms + _expire_interval_ms > currentMs) {
         return deletedNum;
     }
-    std::unordered_map<DmdbKey, DmdbValue*, HashFunction<DmdbKey>, EqualFunction<DmdbKey>>::iterator it = _database.begin();
-    /* Use it to delete keys to avoid invalid iterator */
-    std::vector<std::string> delKeys;
-
-    while(it != _database.end()) {
-        if(it->first.GetExpireTime() != 0 && it->first.GetExpireTime() <= currentMs) {
-            delKeys.emplace_back(it->first.GetName());
+    uint64_t startUs = DmdbUtil::GetCurrentUs();
+    _is_expire_backlogged = false;
+    while(true) {
+        size_t deletedThisRound = 0;
+        uint64_t expireMs = 0;
+        DmdbDictEntry* entry = nullptr;
+        while(deletedThisRound < EXPIRE_KEYS_PER_ROUND && (entry = _expire_heap.Top(expireMs)) != nullptr
+              && expireMs <= currentMs) {
+            DelEntry(entry, _is_lazy_expire);
+            deletedThisRound++;
         }
-        it++;
-    }
-
-    for(size_t i = 0; i < delKeys.size(); ++i) {
-        if(DelKey(delKeys[i]) == true) {
-            deletedNum++;
+        deletedNum += deletedThisRound;
+        if(deletedThisRound < EXPIRE_KEYS_PER_ROUND) {
+            break;
+        }
+        if(DmdbUtil::GetCurrentUs() - startUs >= EXPIRE_CYCLE_BUDGET_US) {
+            _is_expire_backlogged = true;
+            break;
         }
     }
     _last_expire_ms = DmdbUtil::GetCurrentMs();
@@ -1,84 +1,204 @@
 #pragma once
 
-#include <unordered_map>
 #include <string>
 #include <vector>
 
+#include "DmdbDict.hpp"
+#include "DmdbExpireHeap.hpp"
+#include "DmdbRadixTree.hpp"
+#include "DmdbSharedString.hpp"
 
-namespace Dmdb{
 
-template<class T>
-class EqualFunction {
-public:
-    bool operator()(const T &key1, const T &key2) const {
-        return key1._key_name == key2._key_name;
-    }  
-};
+namespace Dmdb{
 
-template<class T>
-class HashFunction {
-public:
-    size_t operator()(const T &key) const {
-        std::hash<std::string> hash;
-        return hash(key._key_name);
-    }
-};
+class DmdbLazyFreeManager;
 
 class DmdbKey {
 public:
-    void SetExpireTime(uint64_t expireTime);
-    uint64_t GetExpireTime() const;
-    std::string GetName() const;
+    const std::string& GetName() const;
     DmdbKey(std::string name);
-    DmdbKey(std::string name, uint64_t ms);
     ~DmdbKey();
-    
-    friend class HashFunction<DmdbKey>;
-    friend class EqualFunction<DmdbKey>;
 private:
     std::string _key_name;
-    uint64_t _expire_ms;
 };
 
-enum class DmdbValueType {
+enum class DmdbValueType : uint8_t {
     STRING
 };
 
+/* How a value is stored in memory, it's never saved to the rdb file */
+enum class DmdbValueEncoding : uint8_t {
+    RAW,
+    EMBSTR,
+    INT
+};
+
+/* Strings not longer than it are embedded in the same allocation as the DmdbValue header */
+const size_t EMBSTR_MAX_SIZE = 48;
+/* Enough for the digits and the sign of INT64_MIN */
+const size_t INT_ENCODING_MAX_DIGITS = 20;
+
+/* A DmdbValue must be created by CreateStringValue() and freed by Release(), because
+ * the EMBSTR encoding allocates extra bytes behind the object */
 class DmdbValue {
 public:
     size_t GetValueSize();
     size_t GetValueRawData(uint8_t* buf);
     DmdbValueType GetValueType();
+    DmdbValueEncoding GetValueEncoding();
+    /* The bytes allocated for the value */
+    size_t GetMemoryUsage();
+    DmdbSharedString* GetSharedString();
     std::string GetValueTypeString();
     std::string GetValueString();
-    DmdbValue(void* value);
-    DmdbValue(void* value, DmdbValueType valType);
-    ~DmdbValue();
+    bool SetValueString(const std::string &str);
+    static DmdbValue* CreateStringValue(const std::string &str);
+    static void Release(DmdbValue* value);
 private:
-    void* _value_ptr;
+    DmdbValue(DmdbValueType valType, DmdbValueEncoding encoding);
+    ~DmdbValue();
+    DmdbValue(const DmdbValue&);
+    DmdbValue& operator=(const DmdbValue&);
+    char* GetEmbeddedData();
+    static DmdbValueEncoding ChooseStringEncoding(const std::string &str, int64_t &intVal);
+    static bool ParseCanonicalInt64(const std::string &str, int64_t &intVal);
+    static size_t Int64ToChars(int64_t val, char* buf);
     DmdbValueType _val_type;
+    DmdbValueEncoding _encoding;
+    uint8_t _embstr_len;
+    uint8_t _embstr_capacity;
+    union {
+        /* For RAW encoding */
+        DmdbSharedString* _shared_str;
+        int64_t _int_val;
+    };
+};
+
+/* An entry of the keyspace, it is owned by DmdbDatabaseManager. The TTL lives in the entry
+ * rather than in the key, so it can be changed in place */
+struct DmdbDictEntry {
+    DmdbKey _key;
+    uint64_t _expire_ms;
+    size_t _expire_heap_index;
+    DmdbValue* _value;
+    /* The ms of the last access for LRU, or for LFU, the minutes of the last decrement in
+     * the high bits and the logarithmic access counter in the low 8 bits */
+    uint64_t _access_info;
+    DmdbDictEntry(const std::string &name, DmdbValue* value);
+};
+
+/* A pair decoded by a loading thread of the RDB manager, the entry isn't in the keyspace
+ * until DmdbDatabaseManager::AddLoadedPair() is called in the thread of the database */
+struct DmdbLoadedPair {
+    DmdbDictEntry* _entry;
+    uint64_t _hash;
+    uint64_t _expire_ms;
+};
+
+/* How the keys are chosen when the used memory is over maxmemory */
+enum class EvictionPolicy : uint8_t {
+    NO_EVICTION = 0,
+    ALLKEYS_LRU,
+    ALLKEYS_LFU,
+    VOLATILE_LRU,
+    VOLATILE_TTL,
+    ALLKEYS_RANDOM
+};
+
+const size_t EVICTION_POOL_SIZE = 16;
+const size_t EVICTION_SAMPLES_DEFAULT = 5;
+
+/* The sampled keys are kept in the pool ordered by their scores, so a good candidate found by an
+ * earlier sampling can still be evicted later */
+struct DmdbEvictionCandidate {
+    /* The bigger the better: the idle ms for LRU, 255 minus the counter for LFU */
+    uint64_t _score;
+    std::string _key;
 };
 
 class DmdbDatabaseManager {
 public:
+    /* CreateLoadedPair() and ReleaseLoadedPair() don't touch the database, any thread can call them */
+    static void CreateLoadedPair(const std::string &keyStr, const std::string &valStr, DmdbValueType type,
+                                 uint64_t ms, DmdbLoadedPair &pair);
+    static void ReleaseLoadedPair(DmdbLoadedPair &pair);
+    void AddLoadedPair(DmdbLoadedPair &pair);
+    void ReserveForLoading(size_t pairsNum);
     bool SetKeyValuePair(const std::string& keyStr, const std::vector<std::string> &valVec, DmdbValueType type, uint64_t ms);
     bool SetKeyExpireTime(const std::string& keyStr, uint64_t ms); 
-    bool DelKey(const std::string &keyStr);
+    /* If isLazy is true, a big value is freed by the lazy free thread */
+    bool DelKey(const std::string &keyStr, bool isLazy = false);
     DmdbValue* GetValueByKey(const std::string &keyStr);
-    bool GetKeyByName(const std::string &name, DmdbKey &key);
+    bool GetExpireTimeByKey(const std::string &keyStr, uint64_t &ms);
     void GetKeysByPattern(const std::string &patternStr, std::vector<DmdbKey> &keys);
+    /* At most count*10 buckets are visited in one call, an empty patternStr or typeStr matches
+     * all the keys. Returns the cursor of the next call, 0 means the scan is over */
+    uint64_t ScanKeys(uint64_t cursor, size_t count, const std::string &patternStr, const std::string &typeStr,
+                      std::vector<std::string> &keys);
+    /* The key index must be enabled, at most limit keys are returned in lexicographic order */
+    void GetKeysInRange(const DmdbLexBound &min, const DmdbLexBound &max, size_t limit, std::vector<std::string> &keys);
     size_t GetDatabaseSize();
     bool GetNPairsFormatRawSequential(uint8_t* buf, size_t bufLen, size_t &copiedSize, size_t expectedAmount, size_t &actualAmount);
+    bool GetNPairsFormatCommandSequential(std::string &buf, size_t expectedAmount, size_t &actualAmount);
     size_t RemoveExpiredKeys();
     uint64_t GetTotalBytesOfPairsWhenSave();
     void SetExpireIntervalForDB(uint64_t ms);
+    /* maxMemory == 0 means there is no limit */
+    void SetMaxMemory(size_t maxMemory, EvictionPolicy policy, size_t samples);
+    EvictionPolicy GetEvictionPolicy();
+    size_t GetEvictionSamples();
+    /* The bytes of the entries with their keys and values, and the bytes of the tables */
+    size_t GetUsedMemory();
+    /* Evicts keys by the policy until the used memory isn't over maxmemory, the names of the evicted
+     * keys are appended to evictedKeys. Returns false if the memory can't be freed */
+    bool EvictKeysIfNeed(std::vector<std::string> &evictedKeys);
+    static bool String2EvictionPolicy(const std::string &str, EvictionPolicy &policy);
+    /* The key index makes prefix KEYS and RANGEKEYS fast, it must be enabled before any key is added */
+    void EnableKeyIndex();
+    bool IsKeyIndexEnabled();
+    void IncrementallyRehash(uint64_t ms);
     void Destroy();
+    /* Like Destroy(), but if isLazy is true, the data is detached at once and freed by the lazy free thread */
+    void Flush(bool isLazy);
+    /* lazyFreeManager == nullptr means everything is freed at once */
+    void SetLazyFree(DmdbLazyFreeManager* lazyFreeManager, bool isLazyExpire, bool isLazyEviction);
+    /* Only the data is swapped, the settings stay */
+    void Swap(DmdbDatabaseManager &other);
     DmdbDatabaseManager();
     ~DmdbDatabaseManager();
 private:
-    std::unordered_map<DmdbKey, DmdbValue*, HashFunction<DmdbKey>, EqualFunction<DmdbKey>> _database;
+    void FreeEntry(DmdbDictEntry* entry, bool isLazy);
+    void DelEntry(DmdbDictEntry* entry, bool isLazy);
+    void SetEntryExpireTime(DmdbDictEntry* entry, uint64_t ms);
+    bool IsEntryExpired(DmdbDictEntry* entry, uint64_t currentMs);
+    static size_t GetEntryMemoryUsage(DmdbDictEntry* entry);
+    void InitEntryAccessInfo(DmdbDictEntry* entry, uint64_t currentMs);
+    void TouchEntry(DmdbDictEntry* entry, uint64_t currentMs);
+    static uint8_t GetDecayedLFUCounter(DmdbDictEntry* entry, uint64_t currentMs);
+    uint64_t GetEvictionScore(DmdbDictEntry* entry, uint64_t currentMs);
+    void PopulateEvictionPool(uint64_t currentMs);
+    DmdbDictEntry* ChooseEntryToEvict();
+    DmdbDict _database;
+    /* Used by GetNPairsFormatRawSequential() to remember where it stops */
+    DmdbDictIterator _save_iterator;
+    DmdbDictEntry* _save_next_entry;
+    DmdbExpireHeap _expire_heap;
+    /* The names of all the keys in order, it's nullptr if the key index is disabled */
+    DmdbRadixTree* _key_index;
+    /* It's true if the last active expire cycle ran out of time with keys left to expire */
+    bool _is_expire_backlogged;
     uint64_t _last_expire_ms;
     uint64_t _expire_interval_ms;
+    /* The sum of GetEntryMemoryUsage() of all the entries */
+    size_t _entries_memory;
+    size_t _max_memory;
+    EvictionPolicy _eviction_policy;
+    size_t _eviction_samples;
+    std::vector<DmdbEvictionCandidate> _eviction_pool;
+    DmdbLazyFreeManager* _lazy_free_manager;
+    /* Whether the keys expired or evicted are freed lazily */
+    bool _is_lazy_expire;
+    bool _is_lazy_eviction;
 };
 
 }
\ No newline at end of file
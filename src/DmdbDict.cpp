@@ -0,0 +1,422 @@
+#include <stdlib.h>
+
+#include <algorithm>
+#include <functional>
+#include <utility>
+
+#include "DmdbDict.hpp"
+#include "DmdbDatabaseManager.hpp"
+#include "DmdbUtil.hpp"
+
+
+namespace Dmdb {
+
+const uint64_t DICT_INIT_SIZE = 16;
+/* How many slots of the old table we visit for every Find/Add/Unlink during rehashing.
+ * An Add fills at most one new slot of the new table, and the new table is at least
+ * twice as big as the live entries, so this keeps rehashing well ahead of insertions */
+const uint64_t DICT_REHASH_SLOTS_PER_OP = 8;
+const uint64_t DICT_REHASH_SLOTS_PER_BATCH = 1000;
+
+/* Only the address of it matters, it marks a slot whose entry has been unlinked */
+static uint8_t dictTombstoneMark;
+static DmdbDictEntry* const DICT_TOMBSTONE = reinterpret_cast<DmdbDictEntry*>(&dictTombstoneMark);
+
+static inline bool IsLiveSlot(const DmdbDictSlot &slot) {
+    return slot._entry != nullptr && slot._entry != DICT_TOMBSTONE;
+}
+
+DmdbDictIterator::DmdbDictIterator(DmdbDict* dict) : _dict(dict), _table_index(0), _slot_index(0),
+                                                      _is_started(false) {
+
+}
+
+DmdbDictIterator::~DmdbDictIterator() {
+    Reset();
+}
+
+/* Returns nullptr when there is no entry left */
+DmdbDictEntry* DmdbDictIterator::Next() {
+    if(!_is_started) {
+        _is_started = true;
+        _table_index = 0;
+        _slot_index = 0;
+    }
+    while(_table_index < 2) {
+        DmdbDictTable &table = _dict->_tables[_table_index];
+        while(_slot_index < table._size) {
+            DmdbDictSlot &slot = table._slots[_slot_index++];
+            if(IsLiveSlot(slot)) {
+                return slot._entry;
+            }
+        }
+        if(_table_index == 0 && !_dict->IsRehashing()) {
+            break;
+        }
+        _table_index++;
+        _slot_index = 0;
+    }
+    _table_index = 2;
+    return nullptr;
+}
+
+/* After Reset(), the next call of Next() starts from the beginning again */
+void DmdbDictIterator::Reset() {
+    _is_started = false;
+}
+
+DmdbDict::DmdbDict() : _rehash_index(-1) {
+    ResetTable(_tables[0]);
+    ResetTable(_tables[1]);
+}
+
+DmdbDict::~DmdbDict() {
+    Clear();
+}
+
+uint64_t DmdbDict::HashKey(std::string_view key) {
+    return std::hash<std::string_view>{}(key);
+}
+
+size_t DmdbDict::Size() {
+    return _tables[0]._used + _tables[1]._used;
+}
+
+bool DmdbDict::IsRehashing() {
+    return _rehash_index != -1;
+}
+
+void DmdbDict::ResetTable(DmdbDictTable &table) {
+    table._slots = nullptr;
+    table._size = 0;
+    table._size_mask = 0;
+    table._used = 0;
+    table._tombstones = 0;
+}
+
+bool DmdbDict::AllocTable(DmdbDictTable &table, uint64_t size) {
+    DmdbDictSlot* slots = static_cast<DmdbDictSlot*>(calloc(size, sizeof(DmdbDictSlot)));
+    if(slots == nullptr) {
+        return false;
+    }
+    table._slots = slots;
+    table._size = size;
+    table._size_mask = size - 1;
+    table._used = 0;
+    table._tombstones = 0;
+    return true;
+}
+
+void DmdbDict::FreeTable(DmdbDictTable &table) {
+    free(table._slots);
+    ResetTable(table);
+}
+
+uint64_t DmdbDict::NextPower(uint64_t size) {
+    uint64_t power = DICT_INIT_SIZE;
+    while(power < size) {
+        power <<= 1;
+    }
+    return power;
+}
+
+/* Only entries are dropped here, freeing them is the job of the owner */
+void DmdbDict::Clear() {
+    FreeTable(_tables[0]);
+    FreeTable(_tables[1]);
+    _rehash_index = -1;
+}
+
+void DmdbDict::Swap(DmdbDict &other) {
+    std::swap(_tables[0], other._tables[0]);
+    std::swap(_tables[1], other._tables[1]);
+    std::swap(_rehash_index, other._rehash_index);
+}
+
+/* With linear probing an entry may be behind its home slot, but never behind an empty slot
+ * after its home, so we walk from the bucket to the first empty slot */
+void DmdbDict::ScanBucket(DmdbDictTable &table, uint64_t bucket, std::vector<DmdbDictEntry*> &entries) {
+    uint64_t index = bucket;
+    while(table._slots[index]._entry != nullptr) {
+        DmdbDictSlot &slot = table._slots[index];
+        if(slot._entry != DICT_TOMBSTONE && (slot._hash & table._size_mask) == bucket) {
+            entries.push_back(slot._entry);
+        }
+        index = (index + 1) & table._size_mask;
+    }
+}
+
+uint64_t DmdbDict::ReverseBits(uint64_t v) {
+    v = ((v >> 1) & 0x5555555555555555ULL) | ((v & 0x5555555555555555ULL) << 1);
+    v = ((v >> 2) & 0x3333333333333333ULL) | ((v & 0x3333333333333333ULL) << 2);
+    v = ((v >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((v & 0x0F0F0F0F0F0F0F0FULL) << 4);
+    v = ((v >> 8) & 0x00FF00FF00FF00FFULL) | ((v & 0x00FF00FF00FF00FFULL) << 8);
+    v = ((v >> 16) & 0x0000FFFF0000FFFFULL) | ((v & 0x0000FFFF0000FFFFULL) << 16);
+    return (v >> 32) | (v << 32);
+}
+
+/* Increase the bits covered by sizeMask from the highest one */
+uint64_t DmdbDict::NextScanCursor(uint64_t cursor, uint64_t sizeMask) {
+    cursor |= ~sizeMask;
+    cursor = ReverseBits(cursor);
+    cursor++;
+    return ReverseBits(cursor);
+}
+
+uint64_t DmdbDict::Scan(uint64_t cursor, std::vector<DmdbDictEntry*> &entries) {
+    if(Size() == 0) {
+        return 0;
+    }
+    if(!IsRehashing()) {
+        ScanBucket(_tables[0], cursor & _tables[0]._size_mask, entries);
+        return NextScanCursor(cursor, _tables[0]._size_mask);
+    }
+    /* The table may be growing or shrinking */
+    DmdbDictTable* smallTable = &_tables[0];
+    DmdbDictTable* largeTable = &_tables[1];
+    if(smallTable->_size > largeTable->_size) {
+        std::swap(smallTable, largeTable);
+    }
+    uint64_t smallMask = smallTable->_size_mask;
+    uint64_t largeMask = largeTable->_size_mask;
+    ScanBucket(*smallTable, cursor & smallMask, entries);
+    /* All the buckets of the large table which are expanded from the bucket of the small table */
+    do {
+        ScanBucket(*largeTable, cursor & largeMask, entries);
+        cursor = NextScanCursor(cursor, largeMask);
+    } while(cursor & (smallMask ^ largeMask));
+    return cursor;
+}
+
+size_t DmdbDict::GetSomeEntries(size_t count, std::vector<DmdbDictEntry*> &entries) {
+    count = std::min(count, Size());
+    if(count == 0) {
+        return 0;
+    }
+    int tablesNum = IsRehashing() ? 2 : 1;
+    uint64_t maxMask = std::max(_tables[0]._size_mask, tablesNum == 2 ? _tables[1]._size_mask : 0);
+    uint64_t index = ((static_cast<uint64_t>(rand()) << 31) ^ rand()) & maxMask;
+    uint64_t maxSteps = count * 10;
+    size_t found = 0;
+    size_t emptyRun = 0;
+    for(uint64_t step = 0; step < maxSteps && found < count; ++step) {
+        bool isEmpty = true;
+        for(int i = 0; i < tablesNum && found < count; ++i) {
+            /* The small table of a rehash doesn't have this slot */
+            if(index >= _tables[i]._size || !IsLiveSlot(_tables[i]._slots[index])) {
+                continue;
+            }
+            entries.push_back(_tables[i]._slots[index]._entry);
+            found++;
+            isEmpty = false;
+        }
+        /* Jump away from a long run of empty slots */
+        emptyRun = isEmpty ? emptyRun + 1 : 0;
+        if(emptyRun >= 5 && emptyRun > count) {
+            index = ((static_cast<uint64_t>(rand()) << 31) ^ rand()) & maxMask;
+            emptyRun = 0;
+        } else {
+            index = (index + 1) & maxMask;
+        }
+    }
+    return found;
+}
+
+size_t DmdbDict::GetMemoryUsage() {
+    return (_tables[0]._size + _tables[1]._size) * sizeof(DmdbDictSlot);
+}
+
+DmdbDictSlot* DmdbDict::FindSlot(DmdbDictTable &table, uint64_t hash, std::string_view key) {
+    if(table._size == 0) {
+        return nullptr;
+    }
+    uint64_t index = hash & table._size_mask;
+    /* The load factor is always below 1, so there must be an empty slot to stop at */
+    while(table._slots[index]._entry != nullptr) {
+        DmdbDictSlot &slot = table._slots[index];
+        if(slot._entry != DICT_TOMBSTONE && slot._hash == hash && slot._entry->_key.GetName() == key) {
+            return &slot;
+        }
+        index = (index + 1) & table._size_mask;
+    }
+    return nullptr;
+}
+
+void DmdbDict::InsertIntoTable(DmdbDictTable &table, uint64_t hash, DmdbDictEntry* entry) {
+    uint64_t index = hash & table._size_mask;
+    while(IsLiveSlot(table._slots[index])) {
+        index = (index + 1) & table._size_mask;
+    }
+    if(table._slots[index]._entry == DICT_TOMBSTONE) {
+        table._tombstones--;
+    }
+    table._slots[index]._hash = hash;
+    table._slots[index]._entry = entry;
+    table._used++;
+}
+
+/* Start moving entries to a new table of the given size, we can also rehash into a table
+ * with the same size just to clean up tombstones */
+bool DmdbDict::StartRehash(uint64_t size) {
+    if(IsRehashing()) {
+        return false;
+    }
+    if(_tables[0]._size == 0) {
+        return AllocTable(_tables[0], size);
+    }
+    if(!AllocTable(_tables[1], size)) {
+        return false;
+    }
+    _rehash_index = 0;
+    return true;
+}
+
+/* Returns true if there are still slots to move */
+bool DmdbDict::RehashStep(uint64_t slotsToVisit) {
+    if(!IsRehashing()) {
+        return false;
+    }
+    DmdbDictTable &oldTable = _tables[0];
+    while(slotsToVisit-- > 0 && static_cast<uint64_t>(_rehash_index) < oldTable._size) {
+        DmdbDictSlot &slot = oldTable._slots[_rehash_index];
+        if(IsLiveSlot(slot)) {
+            InsertIntoTable(_tables[1], slot._hash, slot._entry);
+            oldTable._used--;
+            /* Entries behind it in the same probe chain may not have been moved yet */
+            slot._entry = DICT_TOMBSTONE;
+            oldTable._tombstones++;
+        }
+        _rehash_index++;
+    }
+    if(static_cast<uint64_t>(_rehash_index) < oldTable._size) {
+        return true;
+    }
+    FreeTable(_tables[0]);
+    _tables[0] = _tables[1];
+    ResetTable(_tables[1]);
+    _rehash_index = -1;
+    return false;
+}
+
+void DmdbDict::RehashStepIfNeed() {
+    if(IsRehashing()) {
+        RehashStep(DICT_REHASH_SLOTS_PER_OP);
+    }
+}
+
+void DmdbDict::FinishRehash() {
+    while(RehashStep(DICT_REHASH_SLOTS_PER_BATCH));
+}
+
+/* Rehash for at most ms milliseconds, returns how many batches we have done */
+int DmdbDict::RehashMilliseconds(uint64_t ms) {
+    int batches = 0;
+    uint64_t startMs = DmdbUtil::GetCurrentMs();
+    while(RehashStep(DICT_REHASH_SLOTS_PER_BATCH)) {
+        batches++;
+        if(DmdbUtil::GetCurrentMs() - startMs >= ms) {
+            break;
+        }
+    }
+    return batches;
+}
+
+/* Both live entries and tombstones lengthen probe chains, so both are counted in the load */
+void DmdbDict::ExpandIfNeed() {
+    if(IsRehashing()) {
+        DmdbDictTable &newTable = _tables[1];
+        if((newTable._used + newTable._tombstones + 1) * 4 <= newTable._size * 3) {
+            return;
+        }
+        /* Rehashing falls behind the inserts, we have to finish it now, since a full
+         * table can't work */
+        FinishRehash();
+    }
+    DmdbDictTable &table = _tables[0];
+    if(table._size == 0) {
+        StartRehash(DICT_INIT_SIZE);
+        return;
+    }
+    if((table._used + table._tombstones + 1) * 4 > table._size * 3) {
+        StartRehash(NextPower((table._used + 1) * 2));
+    }
+}
+
+void DmdbDict::Expand(uint64_t size) {
+    if(IsRehashing()) {
+        FinishRehash();
+    }
+    uint64_t targetSize = NextPower((size + 1) * 2);
+    if(targetSize > _tables[0]._size) {
+        StartRehash(targetSize);
+    }
+}
+
+void DmdbDict::ShrinkIfNeed() {
+    if(IsRehashing() || _tables[0]._size <= DICT_INIT_SIZE) {
+        return;
+    }
+    if(_tables[0]._used * 8 < _tables[0]._size) {
+        StartRehash(NextPower(_tables[0]._used * 2));
+    }
+}
+
+DmdbDictEntry* DmdbDict::Find(std::string_view key) {
+    if(Size() == 0) {
+        return nullptr;
+    }
+    return Find(key, HashKey(key));
+}
+
+DmdbDictEntry* DmdbDict::Find(std::string_view key, uint64_t hash) {
+    if(Size() == 0) {
+        return nullptr;
+    }
+    RehashStepIfNeed();
+    for(int i = 0; i < 2; ++i) {
+        DmdbDictSlot* slot = FindSlot(_tables[i], hash, key);
+        if(slot != nullptr) {
+            return slot->_entry;
+        }
+        if(!IsRehashing()) {
+            break;
+        }
+    }
+    return nullptr;
+}
+
+void DmdbDict::Add(DmdbDictEntry* entry) {
+    Add(entry, HashKey(entry->_key.GetName()));
+}
+
+void DmdbDict::Add(DmdbDictEntry* entry, uint64_t hash) {
+    RehashStepIfNeed();
+    ExpandIfNeed();
+    /* New entries always go to the new table during rehashing */
+    InsertIntoTable(IsRehashing() ? _tables[1] : _tables[0], hash, entry);
+}
+
+DmdbDictEntry* DmdbDict::Unlink(std::string_view key) {
+    if(Size() == 0) {
+        return nullptr;
+    }
+    RehashStepIfNeed();
+    uint64_t hash = HashKey(key);
+    for(int i = 0; i < 2; ++i) {
+        DmdbDictSlot* slot = FindSlot(_tables[i], hash, key);
+        if(slot != nullptr) {
+            DmdbDictEntry* entry = slot->_entry;
+            slot->_entry = DICT_TOMBSTONE;
+            _tables[i]._used--;
+            _tables[i]._tombstones++;
+            ShrinkIfNeed();
+            return entry;
+        }
+        if(!IsRehashing()) {
+            break;
+        }
+    }
+    return nullptr;
+}
+
+}
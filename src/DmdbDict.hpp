@@ -0,0 +1,109 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string_view>
+#include <vector>
+
+
+namespace Dmdb {
+
+/* DmdbDictEntry is defined by the owner of the dict(see DmdbDatabaseManager.hpp),
+ * the dict only keeps pointers to entries and never allocates or frees them */
+struct DmdbDictEntry;
+
+/* We keep the whole hash code beside the entry pointer, so most mismatches during
+ * probing can be resolved in the slot array without touching the entry itself */
+struct DmdbDictSlot {
+    uint64_t _hash;
+    DmdbDictEntry* _entry;
+};
+
+struct DmdbDictTable {
+    DmdbDictSlot* _slots;
+    uint64_t _size;
+    uint64_t _size_mask;
+    uint64_t _used;
+    uint64_t _tombstones;
+};
+
+class DmdbDict;
+
+/* An iterator can only be used when the dict won't be modified, since any change may
+ * move entries by rehashing */
+class DmdbDictIterator {
+public:
+    DmdbDictEntry* Next();
+    void Reset();
+    DmdbDictIterator(DmdbDict* dict);
+    ~DmdbDictIterator();
+private:
+    DmdbDict* _dict;
+    int _table_index;
+    uint64_t _slot_index;
+    bool _is_started;
+};
+
+/* This is an open addressing hash table with linear probing. Like the dict of redis,
+ * it grows and shrinks incrementally: when resizing is needed, we allocate a second
+ * table and move a few slots from the old table to the new one in every operation
+ * and in DmdbServer::DoService(), so we never stall the event loop for a full rehash.
+ * Deleted slots are marked as tombstones to keep probe chains unbroken, they are
+ * cleared when the table is rehashed. */
+class DmdbDict {
+public:
+    DmdbDictEntry* Find(std::string_view key);
+    /* hash must be HashKey() of the key */
+    DmdbDictEntry* Find(std::string_view key, uint64_t hash);
+    /* The caller must make sure that the key of entry doesn't exist in the dict */
+    void Add(DmdbDictEntry* entry);
+    /* hash must be HashKey() of the key, it can be computed by another thread */
+    void Add(DmdbDictEntry* entry, uint64_t hash);
+    /* Make room for size entries, so adding them won't resize the table again and again */
+    void Expand(uint64_t size);
+    DmdbDictEntry* Unlink(std::string_view key);
+    size_t Size();
+    bool IsRehashing();
+    int RehashMilliseconds(uint64_t ms);
+    void Clear();
+    /* No iterator of either dict may be in use */
+    void Swap(DmdbDict &other);
+    /* Adds the entries of one bucket(the slots whose home is the cursor) into entries and returns
+     * the next cursor, 0 means the scan is over. The cursor is increased in reverse binary order
+     * like the dict of redis, so every entry existing during the whole scan is returned at least
+     * once even if the table is resized between calls */
+    uint64_t Scan(uint64_t cursor, std::vector<DmdbDictEntry*> &entries);
+    /* Adds at most count entries from a random position into entries for sampling. The entries next
+     * to each other are taken together, so it's cheap but not perfectly uniform */
+    size_t GetSomeEntries(size_t count, std::vector<DmdbDictEntry*> &entries);
+    /* The bytes of the tables, the entries are not included */
+    size_t GetMemoryUsage();
+    static uint64_t HashKey(std::string_view key);
+    DmdbDict();
+    ~DmdbDict();
+    friend class DmdbDictIterator;
+private:
+    DmdbDict(const DmdbDict&);
+    DmdbDict& operator=(const DmdbDict&);
+    bool RehashStep(uint64_t slotsToVisit);
+    void RehashStepIfNeed();
+    void FinishRehash();
+    void ExpandIfNeed();
+    void ShrinkIfNeed();
+    bool StartRehash(uint64_t size);
+    DmdbDictSlot* FindSlot(DmdbDictTable &table, uint64_t hash, std::string_view key);
+    void InsertIntoTable(DmdbDictTable &table, uint64_t hash, DmdbDictEntry* entry);
+    static bool AllocTable(DmdbDictTable &table, uint64_t size);
+    static void FreeTable(DmdbDictTable &table);
+    static void ResetTable(DmdbDictTable &table);
+    static uint64_t NextPower(uint64_t size);
+    static void ScanBucket(DmdbDictTable &table, uint64_t bucket, std::vector<DmdbDictEntry*> &entries);
+    static uint64_t ReverseBits(uint64_t v);
+    static uint64_t NextScanCursor(uint64_t cursor, uint64_t sizeMask);
+    DmdbDictTable _tables[2];
+    /* -1 means we are not rehashing, otherwise it's the next slot of _tables[0] to move */
+    int64_t _rehash_index;
+};
+
+}
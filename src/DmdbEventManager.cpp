@@ -6,7 +6,7 @@
 #include "DmdbServerFriends.hpp"
 
 namespace Dmdb {
-DmdbEventManager* DmdbEventManager::_event_manager_instance = nullptr;
+thread_local DmdbEventManager* DmdbEventManager::_event_manager_instance = nullptr;
 
 DmdbEventManager::DmdbEventManager(uint16_t maxNum) {
     _max_fd_num = maxNum;
@@ -78,6 +78,22 @@ bool DmdbEventManager::AddEvent4Fd(int fd, EpollEvent event, EventProcessorType
                 eventProcessor = new DmdbInteractEventProcessor(fd, event);
                 break;
             }
+            case EventProcessorType::SHARD_NOTIFY: {
+                eventProcessor = new DmdbShardNotifyEventProcessor(fd, event);
+                break;
+            }
+            case EventProcessorType::RDB_PIPE: {
+                eventProcessor = new DmdbRDBPipeEventProcessor(fd, event);
+                break;
+            }
+            case EventProcessorType::REPLICA_SYNC: {
+                eventProcessor = new DmdbReplicaSyncEventProcessor(fd, event);
+                break;
+            }
+            case EventProcessorType::MASTER_LINK: {
+                eventProcessor = new DmdbMasterLinkEventProcessor(fd, event);
+                break;
+            }
         }
         eventProcessor->GetEvent() = epollEvent;
         _fd_event_processor_map[fd] = eventProcessor;
@@ -101,6 +117,7 @@ bool DmdbEventManager::DelFd(int fd, bool isConnection) {
     tmpEe.events = 0;
     tmpEe.data.fd = fd;
     epoll_ctl(_epfd,EPOLL_CTL_DEL,fd,&tmpEe);
+    delete it->second;
     _fd_event_processor_map.erase(it);
 
     if(isConnection) {
@@ -143,7 +160,9 @@ bool DmdbEventManager::ProcessFiredEvents(int timeout) {
         if(it == _fd_event_processor_map.end()) {
             continue;
         }
-        if(_fired_events[i].events & EPOLLIN) {
+        /* The closed write end of a pipe only fires EPOLLHUP, the reader finds EOF by reading */
+        if((_fired_events[i].events & EPOLLIN) ||
+           ((_fired_events[i].events & (EPOLLHUP|EPOLLERR)) && (it->second->GetEvent().events & EPOLLIN))) {
             _fd_event_processor_map[_fired_events[i].data.fd]->ProcessReadable();
         }
         /* Because it(iterator) may be erased by ProcessReadable() or ProcessWritable(), 
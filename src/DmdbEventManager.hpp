@@ -33,7 +33,7 @@ private:
     DmdbEventManager(uint16_t maxNum);
     bool InitEventManager();
     bool ProcessFiredEvents(int timeout);
-    static DmdbEventManager* _event_manager_instance;
+    static thread_local DmdbEventManager* _event_manager_instance;
     std::unordered_map<int, DmdbEventProcessor*> _fd_event_processor_map;
     epoll_event* _fired_events;
     int _epfd;
@@ -8,6 +8,8 @@ namespace Dmdb {
 
 class DmdbClientManager;
 class DmdbServerLogger;
+class DmdbRDBManager;
+class DmdbReplicationManager;
 
 enum class EpollEvent {
     IN = 1,
@@ -19,6 +21,8 @@ enum class EpollEvent {
 struct DmdbEventMangerRequiredComponent {
     DmdbServerLogger* _required_server_logger;
     DmdbClientManager* _required_client_manager;
+    DmdbRDBManager* _required_rdb_manager;
+    DmdbReplicationManager* _required_repl_manager;
     /* This memeber differs from DmdbEventManager._max_fd_num:
      * This memeber includes client's num and cluster node's num while
      * DmdbEventManager._max_fd_num includes not only this member's num
@@ -2,6 +2,8 @@
 #include "DmdbClientManager.hpp"
 #include "DmdbEventManagerCommon.hpp"
 #include "DmdbServerLogger.hpp"
+#include "DmdbRDBManager.hpp"
+#include "DmdbReplicationManager.hpp"
 #include "DmdbServerFriends.hpp"
 
 namespace Dmdb {
@@ -80,60 +82,18 @@ DmdbAcceptEventProcessor::DmdbAcceptEventProcessor(int fd, EpollEvent event) : D
 
 
 
-bool DmdbInteractEventProcessor::ProcessOneReadable() {
+void DmdbInteractEventProcessor::ProcessReadable() {
+    struct epoll_event event = GetEvent();
     DmdbEventMangerRequiredComponent requiredComponents;
     GetDmdbEventMangerRequiredComponents(requiredComponents); 
-    struct epoll_event event = GetEvent();
-    char buf[1024] = {0};
-    /* We must leave 1 byte for 0 to mark the end of a string */
-    int ret = read(event.data.fd, buf, sizeof(buf)-1);
-    if(ret < 0) {
-        if(errno != EAGAIN && errno != EWOULDBLOCK) {
-            requiredComponents._required_server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
-                                                                "Failed to read data from fd: %d, error info: %s",
-                                                                event.data.fd, strerror(errno));
-            requiredComponents._required_client_manager->DisconnectClient(event.data.fd);            
-        }
-        return false;
-    } else if(ret == 0) {
-        requiredComponents._required_server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE,
-                                                                     "Client: %s closed the connection",
-                                                                     requiredComponents._required_client_manager->GetNameOfClient(event.data.fd).c_str());
-        requiredComponents._required_client_manager->DisconnectClient(event.data.fd);
-        return false;
-    } else {
-        return requiredComponents._required_client_manager->AppendDataToClientInputBuf(event.data.fd, buf);
-    }
-}
-
-void DmdbInteractEventProcessor::ProcessReadable() {
-    while(ProcessOneReadable() != false);
+    requiredComponents._required_client_manager->ReadDataFromClient(event.data.fd);
 }
 
 void DmdbInteractEventProcessor::ProcessWritable() {
     struct epoll_event event = GetEvent();
-    size_t bufLen = 0, writePos = 0;
     DmdbEventMangerRequiredComponent requiredComponents;
     GetDmdbEventMangerRequiredComponents(requiredComponents); 
-    const char* clientOutputBuf = requiredComponents._required_client_manager->GetClientOutputBuf(event.data.fd, bufLen);
-    int ret = 0;
-    while(writePos < bufLen) {
-        ret = write(event.data.fd, clientOutputBuf+writePos, bufLen);
-        if(ret == 0) {
-            break;
-        } else if(ret < 0) {
-            requiredComponents._required_server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING, 
-                                                                "Failed to write data for fd: %d, error info: %s",
-                                                                event.data.fd, strerror(errno));
-            if(errno != EAGAIN && errno != EWOULDBLOCK) {
-                requiredComponents._required_client_manager->DisconnectClient(event.data.fd);
-            }
-            return;                                       
-        } else {
-            writePos += ret;
-        }
-    }
-    requiredComponents._required_client_manager->HandleClientAfterWritting(event.data.fd, writePos);
+    requiredComponents._required_client_manager->WriteDataToClient(event.data.fd);
 }
 
 
@@ -146,6 +106,81 @@ DmdbInteractEventProcessor::~DmdbInteractEventProcessor() {
 
 }
 
+DmdbShardNotifyEventProcessor::DmdbShardNotifyEventProcessor(int fd, EpollEvent event) : DmdbEventProcessor(fd, event){
+
+}
+
+void DmdbShardNotifyEventProcessor::ProcessReadable() {
+    uint64_t counter;
+    ssize_t ret = read(GetEvent().data.fd, &counter, sizeof(counter));
+    (void)ret;
+}
+
+void DmdbShardNotifyEventProcessor::ProcessWritable() {
+
+}
+
+DmdbShardNotifyEventProcessor::~DmdbShardNotifyEventProcessor() {
+
+}
+
+DmdbRDBPipeEventProcessor::DmdbRDBPipeEventProcessor(int fd, EpollEvent event) : DmdbEventProcessor(fd, event){
+
+}
+
+void DmdbRDBPipeEventProcessor::ProcessReadable() {
+    DmdbEventMangerRequiredComponent requiredComponents;
+    GetDmdbEventMangerRequiredComponents(requiredComponents);
+    requiredComponents._required_rdb_manager->ReadFromReplicasPipe();
+}
+
+void DmdbRDBPipeEventProcessor::ProcessWritable() {
+
+}
+
+DmdbRDBPipeEventProcessor::~DmdbRDBPipeEventProcessor() {
+
+}
+
+DmdbReplicaSyncEventProcessor::DmdbReplicaSyncEventProcessor(int fd, EpollEvent event) : DmdbEventProcessor(fd, event){
+
+}
+
+/* Nothing should be read from a replica before the full sync is finished */
+void DmdbReplicaSyncEventProcessor::ProcessReadable() {
+
+}
+
+void DmdbReplicaSyncEventProcessor::ProcessWritable() {
+    DmdbEventMangerRequiredComponent requiredComponents;
+    GetDmdbEventMangerRequiredComponents(requiredComponents);
+    requiredComponents._required_rdb_manager->WriteToSyncingReplica(GetEvent().data.fd);
+}
+
+DmdbReplicaSyncEventProcessor::~DmdbReplicaSyncEventProcessor() {
+
+}
+
+DmdbMasterLinkEventProcessor::DmdbMasterLinkEventProcessor(int fd, EpollEvent event) : DmdbEventProcessor(fd, event){
+
+}
+
+void DmdbMasterLinkEventProcessor::ProcessReadable() {
+    DmdbEventMangerRequiredComponent requiredComponents;
+    GetDmdbEventMangerRequiredComponents(requiredComponents);
+    requiredComponents._required_repl_manager->HandleMasterLinkReadable();
+}
+
+void DmdbMasterLinkEventProcessor::ProcessWritable() {
+    DmdbEventMangerRequiredComponent requiredComponents;
+    GetDmdbEventMangerRequiredComponents(requiredComponents);
+    requiredComponents._required_repl_manager->HandleMasterLinkWritable();
+}
+
+DmdbMasterLinkEventProcessor::~DmdbMasterLinkEventProcessor() {
+
+}
+
 
 
 DmdbEventProcessor::~DmdbEventProcessor() {
@@ -8,6 +8,7 @@
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <netinet/tcp.h>
+#include <sys/uio.h>
 
 #include <string>
 
@@ -16,9 +17,20 @@ namespace Dmdb {
 
 enum class EpollEvent;
 
+/* The max number of buffers we pass to a writev() */
+const int REPLY_IOV_MAX = 64;
+
 enum class EventProcessorType {
     ACCEPT_CONN,
-    INTERACT
+    INTERACT,
+    /* The eventfd written by other shards when they send messages to us */
+    SHARD_NOTIFY,
+    /* The pipe which the RDB child writes the RDB data for replicas into */
+    RDB_PIPE,
+    /* The socket of a replica when the RDB data is being sent to it */
+    REPLICA_SYNC,
+    /* The socket of a replica connecting to its master, before the full sync is finished */
+    MASTER_LINK
 };
 
 class DmdbEventProcessor {
@@ -53,8 +65,39 @@ public:
     virtual void ProcessReadable();
     virtual void ProcessWritable();
     virtual ~DmdbInteractEventProcessor();
-private:
-    bool ProcessOneReadable();
+};
+
+/* It only wakes up epoll_wait(), the messages are processed in the loop of the shard */
+class DmdbShardNotifyEventProcessor : public DmdbEventProcessor {
+public:
+    DmdbShardNotifyEventProcessor(int fd, EpollEvent event);
+    virtual void ProcessReadable();
+    virtual void ProcessWritable();
+    virtual ~DmdbShardNotifyEventProcessor();
+};
+
+class DmdbRDBPipeEventProcessor : public DmdbEventProcessor {
+public:
+    DmdbRDBPipeEventProcessor(int fd, EpollEvent event);
+    virtual void ProcessReadable();
+    virtual void ProcessWritable();
+    virtual ~DmdbRDBPipeEventProcessor();
+};
+
+class DmdbReplicaSyncEventProcessor : public DmdbEventProcessor {
+public:
+    DmdbReplicaSyncEventProcessor(int fd, EpollEvent event);
+    virtual void ProcessReadable();
+    virtual void ProcessWritable();
+    virtual ~DmdbReplicaSyncEventProcessor();
+};
+
+class DmdbMasterLinkEventProcessor : public DmdbEventProcessor {
+public:
+    DmdbMasterLinkEventProcessor(int fd, EpollEvent event);
+    virtual void ProcessReadable();
+    virtual void ProcessWritable();
+    virtual ~DmdbMasterLinkEventProcessor();
 };
 
 
@@ -0,0 +1,123 @@
+#include <stdlib.h>
+
+#include "DmdbExpireHeap.hpp"
+#include "DmdbDatabaseManager.hpp"
+
+
+namespace Dmdb {
+
+DmdbExpireHeap::DmdbExpireHeap() {
+
+}
+
+DmdbExpireHeap::~DmdbExpireHeap() {
+
+}
+
+size_t DmdbExpireHeap::Size() {
+    return _nodes.size();
+}
+
+DmdbDictEntry* DmdbExpireHeap::GetRandomEntry() {
+    if(_nodes.empty()) {
+        return nullptr;
+    }
+    return _nodes[static_cast<size_t>(rand()) % _nodes.size()]._entry;
+}
+
+size_t DmdbExpireHeap::GetMemoryUsage() {
+    return _nodes.capacity() * sizeof(DmdbExpireHeapNode);
+}
+
+/* Entries are not freed here, they only forget their positions */
+void DmdbExpireHeap::Clear() {
+    for(size_t i = 0; i < _nodes.size(); ++i) {
+        _nodes[i]._entry->_expire_heap_index = EXPIRE_HEAP_INDEX_NONE;
+    }
+    std::vector<DmdbExpireHeapNode>().swap(_nodes);
+}
+
+/* The heap indexes of the entries stay valid, they are positions in _nodes */
+void DmdbExpireHeap::Swap(DmdbExpireHeap &other) {
+    _nodes.swap(other._nodes);
+}
+
+void DmdbExpireHeap::PlaceNode(size_t index, const DmdbExpireHeapNode &node) {
+    _nodes[index] = node;
+    node._entry->_expire_heap_index = index;
+}
+
+void DmdbExpireHeap::SiftUp(size_t index) {
+    DmdbExpireHeapNode node = _nodes[index];
+    while(index > 0) {
+        size_t parent = (index - 1) / 2;
+        if(_nodes[parent]._expire_ms <= node._expire_ms) {
+            break;
+        }
+        PlaceNode(index, _nodes[parent]);
+        index = parent;
+    }
+    PlaceNode(index, node);
+}
+
+void DmdbExpireHeap::SiftDown(size_t index) {
+    DmdbExpireHeapNode node = _nodes[index];
+    size_t size = _nodes.size();
+    while(true) {
+        size_t child = index * 2 + 1;
+        if(child >= size) {
+            break;
+        }
+        if(child + 1 < size && _nodes[child + 1]._expire_ms < _nodes[child]._expire_ms) {
+            child++;
+        }
+        if(node._expire_ms <= _nodes[child]._expire_ms) {
+            break;
+        }
+        PlaceNode(index, _nodes[child]);
+        index = child;
+    }
+    PlaceNode(index, node);
+}
+
+void DmdbExpireHeap::Push(DmdbDictEntry* entry, uint64_t expireMs) {
+    _nodes.push_back({expireMs, entry});
+    SiftUp(_nodes.size() - 1);
+}
+
+void DmdbExpireHeap::Update(DmdbDictEntry* entry, uint64_t expireMs) {
+    size_t index = entry->_expire_heap_index;
+    uint64_t oldExpireMs = _nodes[index]._expire_ms;
+    _nodes[index]._expire_ms = expireMs;
+    if(expireMs < oldExpireMs) {
+        SiftUp(index);
+    } else {
+        SiftDown(index);
+    }
+}
+
+void DmdbExpireHeap::Remove(DmdbDictEntry* entry) {
+    size_t index = entry->_expire_heap_index;
+    entry->_expire_heap_index = EXPIRE_HEAP_INDEX_NONE;
+    DmdbExpireHeapNode last = _nodes.back();
+    _nodes.pop_back();
+    if(index == _nodes.size()) {
+        return;
+    }
+    PlaceNode(index, last);
+    if(index > 0 && _nodes[(index - 1) / 2]._expire_ms > last._expire_ms) {
+        SiftUp(index);
+    } else {
+        SiftDown(index);
+    }
+}
+
+DmdbDictEntry* DmdbExpireHeap::Top(uint64_t &expireMs) {
+    if(_nodes.empty()) {
+        return nullptr;
+    }
+    expireMs = _nodes[0]._expire_ms;
+    return _nodes[0]._entry;
+}
+
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <vector>
+
+
+namespace Dmdb {
+
+struct DmdbDictEntry;
+
+const size_t EXPIRE_HEAP_INDEX_NONE = static_cast<size_t>(-1);
+
+/* The expire time is copied into the node, so comparing nodes never touches the entries */
+struct DmdbExpireHeapNode {
+    uint64_t _expire_ms;
+    DmdbDictEntry* _entry;
+};
+
+/* A binary min-heap which only contains the keys with a TTL. Every entry remembers its
+ * position in the heap(DmdbDictEntry::_expire_heap_index), so updating or removing the
+ * TTL of a key is O(log n) without searching */
+class DmdbExpireHeap {
+public:
+    void Push(DmdbDictEntry* entry, uint64_t expireMs);
+    void Update(DmdbDictEntry* entry, uint64_t expireMs);
+    void Remove(DmdbDictEntry* entry);
+    /* Returns nullptr if the heap is empty */
+    DmdbDictEntry* Top(uint64_t &expireMs);
+    size_t Size();
+    /* Returns nullptr if the heap is empty */
+    DmdbDictEntry* GetRandomEntry();
+    size_t GetMemoryUsage();
+    void Clear();
+    void Swap(DmdbExpireHeap &other);
+    DmdbExpireHeap();
+    ~DmdbExpireHeap();
+private:
+    void SiftUp(size_t index);
+    void SiftDown(size_t index);
+    void PlaceNode(size_t index, const DmdbExpireHeapNode &node);
+    std::vector<DmdbExpireHeapNode> _nodes;
+};
+
+}
@@ -0,0 +1,206 @@
+#include <string.h>
+
+#include <utility>
+
+#include "DmdbGlobPattern.hpp"
+
+
+namespace Dmdb {
+
+DmdbGlobPattern::DmdbGlobPattern(const std::string &pattern) : _pattern(pattern) {
+    const char* p = _pattern.c_str();
+    size_t len = _pattern.length();
+    bool hasWildcard = false;
+    bool hasOtherWildcard = false;
+    /* The literals after the first wildcard, if they are all in the suffix, the pattern is "*suffix" */
+    size_t literalsAfterWildcard = 0;
+    size_t pos = 0;
+    while(pos < len) {
+        char literal = 0;
+        bool isLiteral = true;
+        bool dummy;
+        if(p[pos] == '*' || p[pos] == '?') {
+            hasOtherWildcard = hasOtherWildcard || p[pos] == '?';
+            isLiteral = false;
+            pos++;
+        } else if(p[pos] == '[' && MatchClass(p, len, pos, 0, dummy) != std::string::npos) {
+            hasOtherWildcard = true;
+            isLiteral = false;
+            pos = MatchClass(p, len, pos, 0, dummy);
+        } else if(p[pos] == '\\' && pos+1 < len) {
+            literal = p[pos+1];
+            pos += 2;
+        } else {
+            /* An unterminated "[" is a literal as well */
+            literal = p[pos];
+            pos++;
+        }
+        if(!isLiteral) {
+            hasWildcard = true;
+            _suffix.clear();
+            continue;
+        }
+        if(hasWildcard) {
+            _suffix.push_back(literal);
+            literalsAfterWildcard++;
+        } else {
+            _prefix.push_back(literal);
+        }
+    }
+    if(!hasWildcard) {
+        _kind = PatternKind::EXACT;
+    } else if(hasOtherWildcard) {
+        _kind = PatternKind::GENERAL;
+    } else if(literalsAfterWildcard == 0) {
+        _kind = _prefix.empty() ? PatternKind::ALL : PatternKind::PREFIX;
+    } else if(_prefix.empty() && literalsAfterWildcard == _suffix.length()) {
+        _kind = PatternKind::SUFFIX;
+    } else {
+        _kind = PatternKind::GENERAL;
+    }
+}
+
+bool DmdbGlobPattern::Match(const char* str, size_t len) const {
+    size_t prefixLen = _prefix.length();
+    size_t suffixLen = _suffix.length();
+    switch(_kind) {
+        case PatternKind::ALL: {
+            return true;
+        }
+        case PatternKind::EXACT: {
+            return len == prefixLen && memcmp(str, _prefix.data(), len) == 0;
+        }
+        case PatternKind::PREFIX: {
+            return len >= prefixLen && memcmp(str, _prefix.data(), prefixLen) == 0;
+        }
+        case PatternKind::SUFFIX: {
+            return len >= suffixLen && memcmp(str + len - suffixLen, _suffix.data(), suffixLen) == 0;
+        }
+        default: {
+            break;
+        }
+    }
+    /* The literal parts of the pattern can't overlap, most of the keys are rejected here */
+    if(len < prefixLen + suffixLen || memcmp(str, _prefix.data(), prefixLen) != 0 ||
+       memcmp(str + len - suffixLen, _suffix.data(), suffixLen) != 0) {
+        return false;
+    }
+    return GlobMatch(_pattern.data(), _pattern.length(), str, len);
+}
+
+bool DmdbGlobPattern::Match(const std::string &str) const {
+    return Match(str.data(), str.length());
+}
+
+const std::string& DmdbGlobPattern::GetLiteralPrefix() const {
+    return _prefix;
+}
+
+/* The matcher goes back to the last star when it fails, the earlier stars never need to be retried,
+ * so the cost is O(patternLen*strLen) at most instead of exponential like backtracking */
+bool DmdbGlobPattern::GlobMatch(const char* pattern, size_t patternLen, const char* str, size_t strLen) {
+    size_t p = 0;
+    size_t s = 0;
+    size_t starPos = std::string::npos;
+    size_t starStr = 0;
+    while(s < strLen) {
+        if(p < patternLen) {
+            bool isMatched = false;
+            size_t next = p + 1;
+            switch(pattern[p]) {
+                case '*': {
+                    while(p < patternLen && pattern[p] == '*') {
+                        p++;
+                    }
+                    if(p == patternLen) {
+                        return true;
+                    }
+                    starPos = p;
+                    starStr = s;
+                    continue;
+                }
+                case '?': {
+                    isMatched = true;
+                    break;
+                }
+                case '[': {
+                    next = MatchClass(pattern, patternLen, p, str[s], isMatched);
+                    if(next == std::string::npos) {
+                        isMatched = str[s] == '[';
+                        next = p + 1;
+                    }
+                    break;
+                }
+                case '\\': {
+                    if(p+1 < patternLen) {
+                        next = p + 2;
+                        isMatched = pattern[p+1] == str[s];
+                    } else {
+                        isMatched = str[s] == '\\';
+                    }
+                    break;
+                }
+                default: {
+                    isMatched = pattern[p] == str[s];
+                    break;
+                }
+            }
+            if(isMatched) {
+                p = next;
+                s++;
+                continue;
+            }
+        }
+        if(starPos == std::string::npos) {
+            return false;
+        }
+        /* The last star takes one more byte */
+        p = starPos;
+        s = ++starStr;
+    }
+    while(p < patternLen && pattern[p] == '*') {
+        p++;
+    }
+    return p == patternLen;
+}
+
+/* pos is the position of "[", the position after "]" is returned, npos is returned if there is no "]" */
+size_t DmdbGlobPattern::MatchClass(const char* pattern, size_t patternLen, size_t pos, char c, bool &isMatched) {
+    size_t p = pos + 1;
+    bool isNegated = false;
+    bool isFound = false;
+    if(p < patternLen && pattern[p] == '^') {
+        isNegated = true;
+        p++;
+    }
+    while(p < patternLen && pattern[p] != ']') {
+        if(pattern[p] == '\\' && p+1 < patternLen) {
+            p++;
+        }
+        unsigned char low = static_cast<unsigned char>(pattern[p]);
+        unsigned char high = low;
+        p++;
+        if(p+1 < patternLen && pattern[p] == '-' && pattern[p+1] != ']') {
+            p++;
+            if(pattern[p] == '\\' && p+1 < patternLen) {
+                p++;
+            }
+            high = static_cast<unsigned char>(pattern[p]);
+            p++;
+            if(low > high) {
+                std::swap(low, high);
+            }
+        }
+        unsigned char uc = static_cast<unsigned char>(c);
+        if(uc >= low && uc <= high) {
+            isFound = true;
+        }
+    }
+    if(p >= patternLen) {
+        return std::string::npos;
+    }
+    isMatched = isFound != isNegated;
+    return p + 1;
+}
+
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+
+
+namespace Dmdb {
+
+/* The glob pattern of KEYS and SCAN, the syntax is the same as redis:
+ * "*" matches any bytes, "?" matches one byte, "[a-z]" and "[^abc]" match one byte in or not in the set,
+ * "\" escapes the next byte. The literal prefix and suffix of the pattern are taken out when it's built,
+ * so the common patterns like "user:*" are matched by a memcmp, and Match() never allocates */
+class DmdbGlobPattern {
+public:
+    DmdbGlobPattern(const std::string &pattern);
+    bool Match(const char* str, size_t len) const;
+    bool Match(const std::string &str) const;
+    /* The keys matched all start with it */
+    const std::string& GetLiteralPrefix() const;
+    /* The matcher without the literal acceleration, it's public for the benchmark */
+    static bool GlobMatch(const char* pattern, size_t patternLen, const char* str, size_t strLen);
+private:
+    enum class PatternKind : uint8_t {
+        ALL = 0,    /* Only stars */
+        EXACT,      /* No wildcard, the pattern is a literal */
+        PREFIX,     /* A literal followed by stars */
+        SUFFIX,     /* Stars followed by a literal */
+        GENERAL
+    };
+    static size_t MatchClass(const char* pattern, size_t patternLen, size_t pos, char c, bool &isMatched);
+    std::string _pattern;
+    std::string _prefix;
+    std::string _suffix;
+    PatternKind _kind;
+};
+
+}
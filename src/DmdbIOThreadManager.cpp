@@ -0,0 +1,146 @@
+#include <signal.h>
+#include <pthread.h>
+
+#include "DmdbIOThreadManager.hpp"
+#include "DmdbClientContact.hpp"
+
+
+namespace Dmdb {
+
+thread_local DmdbIOThreadManager* DmdbIOThreadManager::_io_thread_manager_instance = nullptr;
+
+DmdbIOThreadManager* DmdbIOThreadManager::GetUniqueIOThreadManagerInstance() {
+    if(_io_thread_manager_instance == nullptr) {
+        _io_thread_manager_instance = new DmdbIOThreadManager();
+    }
+    return _io_thread_manager_instance;
+}
+
+DmdbIOThreadManager::DmdbIOThreadManager() {
+    _io_threads_num = 1;
+    _is_started = false;
+    _io_operation = IOThreadOperation::READ;
+    _jobs_generation = 0;
+    _is_stopping = false;
+    _unfinished_threads_num = 0;
+    _io_threads_jobs.resize(1);
+}
+
+DmdbIOThreadManager::~DmdbIOThreadManager() {
+    StopIOThreads();
+}
+
+/* It must be called before StartIOThreads() */
+void DmdbIOThreadManager::SetIOThreadsNum(int threadsNum) {
+    _io_threads_num = threadsNum;
+}
+
+int DmdbIOThreadManager::GetIOThreadsNum() {
+    return _io_threads_num;
+}
+
+bool DmdbIOThreadManager::IsIOThreadsEnabled() {
+    return _is_started;
+}
+
+bool DmdbIOThreadManager::StartIOThreads() {
+    if(_is_started || _io_threads_num <= 1) {
+        return false;
+    }
+    _io_threads_jobs.resize(_io_threads_num);
+    /* Signals should be handled by the main thread only, the I/O threads inherit this mask */
+    sigset_t blockSet, oldSet;
+    sigfillset(&blockSet);
+    pthread_sigmask(SIG_BLOCK, &blockSet, &oldSet);
+    for(int i = 1; i < _io_threads_num; ++i) {
+        _io_threads.emplace_back(&DmdbIOThreadManager::IOThreadMain, this, i);
+    }
+    pthread_sigmask(SIG_SETMASK, &oldSet, nullptr);
+    _is_started = true;
+    return true;
+}
+
+void DmdbIOThreadManager::StopIOThreads() {
+    if(!_is_started) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(_jobs_mutex);
+        _is_stopping = true;
+    }
+    _jobs_cond.notify_all();
+    for(size_t i = 0; i < _io_threads.size(); ++i) {
+        _io_threads[i].join();
+    }
+    _io_threads.clear();
+    _is_started = false;
+}
+
+void DmdbIOThreadManager::ReadAndParseClients(const std::vector<DmdbClientContact*> &clients) {
+    DistributeJobsAndWait(clients, IOThreadOperation::READ);
+}
+
+void DmdbIOThreadManager::WriteToClients(const std::vector<DmdbClientContact*> &clients) {
+    DistributeJobsAndWait(clients, IOThreadOperation::WRITE);
+}
+
+void DmdbIOThreadManager::DistributeJobsAndWait(const std::vector<DmdbClientContact*> &clients, IOThreadOperation operation) {
+    if(clients.empty()) {
+        return;
+    }
+    _io_operation = operation;
+    if(!_is_started || clients.size() < IO_THREADS_MIN_CLIENTS_PER_THREAD * _io_threads_num) {
+        _io_threads_jobs[0] = clients;
+        ProcessJobsOfThread(0);
+        return;
+    }
+
+    /* Fan out */
+    for(size_t i = 0; i < clients.size(); ++i) {
+        _io_threads_jobs[i % _io_threads_num].push_back(clients[i]);
+    }
+    _unfinished_threads_num.store(_io_threads_num - 1);
+    {
+        std::lock_guard<std::mutex> lock(_jobs_mutex);
+        _jobs_generation++;
+    }
+    _jobs_cond.notify_all();
+    ProcessJobsOfThread(0);
+
+    /* Fan in, the jobs are short, so we spin rather than sleep */
+    while(_unfinished_threads_num.load(std::memory_order_acquire) != 0) {
+        std::this_thread::yield();
+    }
+}
+
+void DmdbIOThreadManager::ProcessJobsOfThread(int threadId) {
+    std::vector<DmdbClientContact*> &jobs = _io_threads_jobs[threadId];
+    for(size_t i = 0; i < jobs.size(); ++i) {
+        if(_io_operation == IOThreadOperation::READ) {
+            if(jobs[i]->ReadFromSocket() == ClientIOState::OK) {
+                jobs[i]->ParseRequestAhead();
+            }
+        } else {
+            jobs[i]->WriteToSocket();
+        }
+    }
+    jobs.clear();
+}
+
+void DmdbIOThreadManager::IOThreadMain(int threadId) {
+    uint64_t doneGeneration = 0;
+    while(true) {
+        {
+            std::unique_lock<std::mutex> lock(_jobs_mutex);
+            _jobs_cond.wait(lock, [&]() { return _is_stopping || _jobs_generation != doneGeneration; });
+            if(_is_stopping) {
+                return;
+            }
+            doneGeneration = _jobs_generation;
+        }
+        ProcessJobsOfThread(threadId);
+        _unfinished_threads_num.fetch_sub(1, std::memory_order_release);
+    }
+}
+
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace Dmdb {
+
+class DmdbClientContact;
+
+const int IO_THREADS_MAX_NUM = 64;
+/* If there are only a few clients to handle, the main thread does it alone, waking up
+ * the I/O threads costs more than the job itself */
+const size_t IO_THREADS_MIN_CLIENTS_PER_THREAD = 2;
+
+enum class IOThreadOperation {
+    READ,
+    WRITE
+};
+
+/* I/O threads only read/parse requests and write replies, commands are still executed by the
+ * main thread. Every batch is a fan-out/fan-in barrier: the main thread hands out the clients,
+ * handles its own share as thread 0, and waits until all the I/O threads are done. So the clients
+ * are never touched by two threads at the same time. "io_threads_num = 1" means no I/O thread
+ * is created and the main thread does everything as before */
+class DmdbIOThreadManager {
+public:
+    static DmdbIOThreadManager* GetUniqueIOThreadManagerInstance();
+    void SetIOThreadsNum(int threadsNum);
+    int GetIOThreadsNum();
+    bool IsIOThreadsEnabled();
+    bool StartIOThreads();
+    void StopIOThreads();
+    void ReadAndParseClients(const std::vector<DmdbClientContact*> &clients);
+    void WriteToClients(const std::vector<DmdbClientContact*> &clients);
+    ~DmdbIOThreadManager();
+private:
+    DmdbIOThreadManager();
+    void DistributeJobsAndWait(const std::vector<DmdbClientContact*> &clients, IOThreadOperation operation);
+    void ProcessJobsOfThread(int threadId);
+    void IOThreadMain(int threadId);
+    static thread_local DmdbIOThreadManager* _io_thread_manager_instance;
+    int _io_threads_num;
+    bool _is_started;
+    std::vector<std::thread> _io_threads;
+    std::vector<std::vector<DmdbClientContact*>> _io_threads_jobs;
+    IOThreadOperation _io_operation;
+    /* The members below are protected by _jobs_mutex, a new batch is published by
+     * increasing _jobs_generation */
+    std::mutex _jobs_mutex;
+    std::condition_variable _jobs_cond;
+    uint64_t _jobs_generation;
+    bool _is_stopping;
+    std::atomic<int> _unfinished_threads_num;
+};
+
+}
@@ -0,0 +1,185 @@
+#include <string.h>
+
+#include <vector>
+
+#include "DmdbLZCompressor.hpp"
+
+
+namespace Dmdb {
+
+const size_t LZ_MIN_MATCH = 4;
+/* The last 5 bytes are always literals and the last match starts 12 bytes before the end at
+ * least, like LZ4, so the decompressor can copy in bigger steps safely */
+const size_t LZ_LAST_LITERALS = 5;
+const size_t LZ_MATCH_FIND_LIMIT = 12;
+const size_t LZ_MAX_OFFSET = 65535;
+const size_t LZ_TOKEN_MAX_LEN = 15;
+const int LZ_HASH_LOG = 16;
+/* Every so many misses in a row we move one more byte forward, incompressible data is skipped fast */
+const int LZ_SKIP_TRIGGER = 6;
+
+static inline uint32_t Read32(const uint8_t* p) {
+    uint32_t val;
+    memcpy(&val, p, sizeof(val));
+    return val;
+}
+
+static inline uint32_t Hash32(uint32_t val) {
+    return (val * 2654435761u) >> (32 - LZ_HASH_LOG);
+}
+
+size_t DmdbLZCompressor::CompressBound(size_t srcLen) {
+    return srcLen + srcLen / 255 + 16;
+}
+
+bool DmdbLZCompressor::WriteLength(uint8_t* dst, size_t dstCapacity, size_t &op, size_t len) {
+    while(len >= 255) {
+        if(op >= dstCapacity) {
+            return false;
+        }
+        dst[op++] = 255;
+        len -= 255;
+    }
+    if(op >= dstCapacity) {
+        return false;
+    }
+    dst[op++] = static_cast<uint8_t>(len);
+    return true;
+}
+
+/* matchLen == 0 means the last sequence, which has no match */
+bool DmdbLZCompressor::WriteSequence(const uint8_t* literals, size_t literalLen, size_t offset, size_t matchLen,
+                                     uint8_t* dst, size_t dstCapacity, size_t &op) {
+    if(op >= dstCapacity) {
+        return false;
+    }
+    size_t tokenPos = op++;
+    uint8_t token = static_cast<uint8_t>((literalLen < LZ_TOKEN_MAX_LEN ? literalLen : LZ_TOKEN_MAX_LEN) << 4);
+    if(literalLen >= LZ_TOKEN_MAX_LEN && !WriteLength(dst, dstCapacity, op, literalLen - LZ_TOKEN_MAX_LEN)) {
+        return false;
+    }
+    if(dstCapacity - op < literalLen) {
+        return false;
+    }
+    memcpy(dst + op, literals, literalLen);
+    op += literalLen;
+    if(matchLen > 0) {
+        if(dstCapacity - op < 2) {
+            return false;
+        }
+        dst[op++] = static_cast<uint8_t>(offset & 0xff);
+        dst[op++] = static_cast<uint8_t>(offset >> 8);
+        size_t extraMatchLen = matchLen - LZ_MIN_MATCH;
+        token |= static_cast<uint8_t>(extraMatchLen < LZ_TOKEN_MAX_LEN ? extraMatchLen : LZ_TOKEN_MAX_LEN);
+        if(extraMatchLen >= LZ_TOKEN_MAX_LEN && !WriteLength(dst, dstCapacity, op, extraMatchLen - LZ_TOKEN_MAX_LEN)) {
+            return false;
+        }
+    }
+    dst[tokenPos] = token;
+    return true;
+}
+
+/* Greedy matching with a hash table of the positions of 4 bytes sequences */
+size_t DmdbLZCompressor::Compress(const uint8_t* src, size_t srcLen, uint8_t* dst, size_t dstCapacity) {
+    size_t op = 0;
+    size_t anchor = 0;
+    size_t ip = 0;
+    if(srcLen >= LZ_MATCH_FIND_LIMIT + 1) {
+        std::vector<uint32_t> hashTable(1 << LZ_HASH_LOG, 0);
+        size_t matchLimit = srcLen - LZ_LAST_LITERALS;
+        size_t findLimit = srcLen - LZ_MATCH_FIND_LIMIT;
+        size_t misses = 0;
+        while(ip <= findLimit) {
+            uint32_t sequence = Read32(src + ip);
+            uint32_t hash = Hash32(sequence);
+            size_t ref = hashTable[hash];
+            hashTable[hash] = static_cast<uint32_t>(ip);
+            if(ref >= ip || ip - ref > LZ_MAX_OFFSET || Read32(src + ref) != sequence) {
+                ip += 1 + (misses++ >> LZ_SKIP_TRIGGER);
+                continue;
+            }
+            misses = 0;
+            size_t matchLen = LZ_MIN_MATCH;
+            while(ip + matchLen < matchLimit && src[ref + matchLen] == src[ip + matchLen]) {
+                matchLen++;
+            }
+            if(!WriteSequence(src + anchor, ip - anchor, ip - ref, matchLen, dst, dstCapacity, op)) {
+                return 0;
+            }
+            ip += matchLen;
+            anchor = ip;
+            if(ip <= findLimit) {
+                /* The position right before the next search helps to find the next match */
+                hashTable[Hash32(Read32(src + ip - 2))] = static_cast<uint32_t>(ip - 2);
+            }
+        }
+    }
+    if(!WriteSequence(src + anchor, srcLen - anchor, 0, 0, dst, dstCapacity, op)) {
+        return 0;
+    }
+    return op;
+}
+
+bool DmdbLZCompressor::ReadLength(const uint8_t* src, size_t srcLen, size_t &ip, size_t &len) {
+    uint8_t byte = 0;
+    do {
+        if(ip >= srcLen) {
+            return false;
+        }
+        byte = src[ip++];
+        len += byte;
+    } while(byte == 255);
+    return true;
+}
+
+/* Every length and offset is checked, a corrupted block never makes us read or write out of range */
+bool DmdbLZCompressor::Decompress(const uint8_t* src, size_t srcLen, uint8_t* dst, size_t dstLen) {
+    size_t ip = 0;
+    size_t op = 0;
+    while(true) {
+        if(ip >= srcLen) {
+            return false;
+        }
+        uint8_t token = src[ip++];
+        size_t literalLen = token >> 4;
+        if(literalLen == LZ_TOKEN_MAX_LEN && !ReadLength(src, srcLen, ip, literalLen)) {
+            return false;
+        }
+        if(literalLen > srcLen - ip || literalLen > dstLen - op) {
+            return false;
+        }
+        memcpy(dst + op, src + ip, literalLen);
+        ip += literalLen;
+        op += literalLen;
+        if(ip == srcLen) {
+            return op == dstLen;
+        }
+        if(srcLen - ip < 2) {
+            return false;
+        }
+        size_t offset = src[ip] | (static_cast<size_t>(src[ip + 1]) << 8);
+        ip += 2;
+        if(offset == 0 || offset > op) {
+            return false;
+        }
+        size_t matchLen = token & LZ_TOKEN_MAX_LEN;
+        if(matchLen == LZ_TOKEN_MAX_LEN && !ReadLength(src, srcLen, ip, matchLen)) {
+            return false;
+        }
+        matchLen += LZ_MIN_MATCH;
+        if(matchLen > dstLen - op) {
+            return false;
+        }
+        if(offset >= matchLen) {
+            memcpy(dst + op, dst + op - offset, matchLen);
+        } else {
+            /* The match overlaps the bytes it's producing, e.g. a run of the same byte */
+            for(size_t i = 0; i < matchLen; ++i) {
+                dst[op + i] = dst[op + i - offset];
+            }
+        }
+        op += matchLen;
+    }
+}
+
+}
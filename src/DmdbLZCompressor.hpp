@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+namespace Dmdb {
+
+/* A block compressor of the LZ77 family, the output is in the LZ4 block format: a sequence is a
+ * token byte(4 bits of literal length and 4 bits of match length), the extra bytes of the literal
+ * length, the literals, a 2 bytes little endian offset and the extra bytes of the match length.
+ * The last sequence has literals only. Every block is compressed on its own, so the blocks of
+ * an RDB file can be decompressed by different threads */
+class DmdbLZCompressor {
+public:
+    /* The biggest size of the output when compressing srcLen bytes */
+    static size_t CompressBound(size_t srcLen);
+    /* Returns the size of the output, 0 means dst is too small */
+    static size_t Compress(const uint8_t* src, size_t srcLen, uint8_t* dst, size_t dstCapacity);
+    /* dstLen must be the size before compressing, returns false if src is corrupted */
+    static bool Decompress(const uint8_t* src, size_t srcLen, uint8_t* dst, size_t dstLen);
+private:
+    static bool WriteLength(uint8_t* dst, size_t dstCapacity, size_t &op, size_t len);
+    static bool WriteSequence(const uint8_t* literals, size_t literalLen, size_t offset, size_t matchLen,
+                              uint8_t* dst, size_t dstCapacity, size_t &op);
+    static bool ReadLength(const uint8_t* src, size_t srcLen, size_t &ip, size_t &len);
+};
+
+}
@@ -0,0 +1,109 @@
+#include <signal.h>
+#include <pthread.h>
+
+#include <algorithm>
+
+#include "DmdbLazyFreeManager.hpp"
+#include "DmdbDatabaseManager.hpp"
+
+
+namespace Dmdb {
+
+thread_local DmdbLazyFreeManager* DmdbLazyFreeManager::_lazy_free_manager_instance = nullptr;
+
+DmdbLazyFreeManager* DmdbLazyFreeManager::GetUniqueLazyFreeManagerInstance() {
+    if(_lazy_free_manager_instance == nullptr) {
+        _lazy_free_manager_instance = new DmdbLazyFreeManager();
+    }
+    return _lazy_free_manager_instance;
+}
+
+DmdbLazyFreeManager::DmdbLazyFreeManager() : _is_started(false), _values_queue(LAZY_FREE_VALUES_QUEUE_CAPACITY),
+                                             _databases_queue(LAZY_FREE_DATABASES_QUEUE_CAPACITY),
+                                             _pending_objects_num(0), _is_stopping(false) {
+
+}
+
+DmdbLazyFreeManager::~DmdbLazyFreeManager() {
+    StopLazyFreeThread();
+}
+
+bool DmdbLazyFreeManager::StartLazyFreeThread() {
+    if(_is_started) {
+        return false;
+    }
+    /* Signals should be handled by the main thread only */
+    sigset_t blockSet, oldSet;
+    sigfillset(&blockSet);
+    pthread_sigmask(SIG_BLOCK, &blockSet, &oldSet);
+    _lazy_free_thread = std::thread(&DmdbLazyFreeManager::LazyFreeThreadMain, this);
+    pthread_sigmask(SIG_SETMASK, &oldSet, nullptr);
+    _is_started = true;
+    return true;
+}
+
+void DmdbLazyFreeManager::StopLazyFreeThread() {
+    if(!_is_started) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(_wake_mutex);
+        _is_stopping = true;
+    }
+    _wake_cond.notify_one();
+    _lazy_free_thread.join();
+    _is_started = false;
+    _is_stopping = false;
+}
+
+void DmdbLazyFreeManager::FreeValueLazily(DmdbValue* value) {
+    if(!_is_started || value->GetMemoryUsage() < LAZY_FREE_VALUE_MIN_SIZE || !_values_queue.Push(value)) {
+        DmdbValue::Release(value);
+        return;
+    }
+    WakeUpLazyFreeThread();
+}
+
+void DmdbLazyFreeManager::FreeDatabaseLazily(DmdbDatabaseManager* database) {
+    if(!_is_started || !_databases_queue.Push(database)) {
+        delete database;
+        return;
+    }
+    WakeUpLazyFreeThread();
+}
+
+int64_t DmdbLazyFreeManager::GetPendingObjectsNum() {
+    return std::max(_pending_objects_num.load(std::memory_order_relaxed), static_cast<int64_t>(0));
+}
+
+/* The mutex is only taken when the thread may be sleeping, so it can't miss the wakeup */
+void DmdbLazyFreeManager::WakeUpLazyFreeThread() {
+    if(_pending_objects_num.fetch_add(1, std::memory_order_acq_rel) == 0) {
+        std::lock_guard<std::mutex> lock(_wake_mutex);
+        _wake_cond.notify_one();
+    }
+}
+
+void DmdbLazyFreeManager::LazyFreeThreadMain() {
+    while(true) {
+        DmdbValue* value = nullptr;
+        while((value = _values_queue.Pop()) != nullptr) {
+            DmdbValue::Release(value);
+            _pending_objects_num.fetch_sub(1, std::memory_order_acq_rel);
+        }
+        DmdbDatabaseManager* database = nullptr;
+        while((database = _databases_queue.Pop()) != nullptr) {
+            delete database;
+            _pending_objects_num.fetch_sub(1, std::memory_order_acq_rel);
+        }
+        std::unique_lock<std::mutex> lock(_wake_mutex);
+        if(_is_stopping && _pending_objects_num.load(std::memory_order_acquire) <= 0) {
+            return;
+        }
+        _wake_cond.wait(lock, [this]() {
+            return _is_stopping || _pending_objects_num.load(std::memory_order_acquire) > 0;
+        });
+    }
+}
+
+}
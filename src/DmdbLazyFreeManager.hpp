@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "DmdbSpscQueue.hpp"
+
+
+namespace Dmdb {
+
+class DmdbValue;
+class DmdbDatabaseManager;
+
+/* A value smaller than it is freed at once, handing it to the thread costs more than freeing it */
+const size_t LAZY_FREE_VALUE_MIN_SIZE = 64 * 1024;
+const size_t LAZY_FREE_VALUES_QUEUE_CAPACITY = 64 * 1024;
+const size_t LAZY_FREE_DATABASES_QUEUE_CAPACITY = 16;
+
+/* Every shard has a lazy free thread, the shard detaches big values and flushed databases from
+ * the keyspace and pushes them to the lock-free queues, so the event loop never stalls on freeing
+ * them. Before the thread is started, or when a queue is full, the objects are freed at once */
+class DmdbLazyFreeManager {
+public:
+    static DmdbLazyFreeManager* GetUniqueLazyFreeManagerInstance();
+    bool StartLazyFreeThread();
+    /* The objects left in the queues are freed before the thread exits */
+    void StopLazyFreeThread();
+    /* They are only called by the thread of the shard */
+    void FreeValueLazily(DmdbValue* value);
+    void FreeDatabaseLazily(DmdbDatabaseManager* database);
+    /* The objects pushed but not freed yet */
+    int64_t GetPendingObjectsNum();
+    ~DmdbLazyFreeManager();
+private:
+    DmdbLazyFreeManager();
+    DmdbLazyFreeManager(const DmdbLazyFreeManager&);
+    DmdbLazyFreeManager& operator=(const DmdbLazyFreeManager&);
+    void WakeUpLazyFreeThread();
+    void LazyFreeThreadMain();
+    static thread_local DmdbLazyFreeManager* _lazy_free_manager_instance;
+    bool _is_started;
+    std::thread _lazy_free_thread;
+    DmdbSpscQueue<DmdbValue> _values_queue;
+    DmdbSpscQueue<DmdbDatabaseManager> _databases_queue;
+    /* It's increased after an object is pushed and decreased after it's freed, so it may be -1
+     * for a moment. The thread sleeps only when it isn't positive, the shard wakes it up when
+     * it goes from 0 to 1 */
+    std::atomic<int64_t> _pending_objects_num;
+    std::mutex _wake_mutex;
+    std::condition_variable _wake_cond;
+    bool _is_stopping;
+};
+
+}
@@ -1,7 +1,8 @@
 #include "DmdbServer.hpp"
 
 namespace Dmdb{
-DmdbServer* serverInstance = nullptr; 
+/* Every shard thread runs its own server */
+thread_local DmdbServer* serverInstance = nullptr;
 }
 
 int main(int argc, char**argv) {
@@ -7,9 +7,13 @@
 #include "DmdbEventManager.hpp"
 #include "DmdbEventManagerCommon.hpp"
 #include "DmdbEventProcessor.hpp"
+#include "DmdbServerLogger.hpp"
+#include "DmdbReplBufBlock.hpp"
 
 namespace Dmdb {
 
+const size_t REPL_BUF_BLOCK_SIZE = 16*1024;
+
 void DmdbMasterReplicationManager::GenerateRelicationID() {
     _current_replication_id = std::to_string(DmdbUtil::GetCurrentMs());
     for(uint8_t i = 0; i < 10; ++i) {
@@ -21,11 +25,54 @@ DmdbClientContact* DmdbMasterReplicationManager::GetMasterClientContact() {
     return nullptr;
 }
 
-void DmdbMasterReplicationManager::ReplicateDataToSlaves(const std::string &data) {
-    for(std::list<DmdbClientContact*>::iterator it = _replicas.begin() ; it != _replicas.end(); ++it) {
-        (*it)->AddReplyData2Client(data);
+/* The data is appended to the replication buffer once, every replica only references it */
+void DmdbMasterReplicationManager::ReplicateDataToSlaves(const char* data, size_t len) {
+    if(!_is_backlog_created) {
+        _current_repl_offset += len;
+        return;
+    }
+    while(len > 0) {
+        if(_repl_buf_blocks.empty() || _repl_buf_blocks.back()->GetFreeSize() == 0) {
+            _repl_buf_blocks.push_back(DmdbReplBufBlock::Create(REPL_BUF_BLOCK_SIZE, _current_repl_offset));
+        }
+        DmdbReplBufBlock* block = _repl_buf_blocks.back();
+        size_t pos = block->GetUsed();
+        size_t appendLen = block->Append(data, len);
+        for(std::list<DmdbClientContact*>::iterator it = _replicas.begin() ; it != _replicas.end(); ++it) {
+            (*it)->AddReplyReplBlock2Client(block, pos, appendLen);
+        }
+        data += appendLen;
+        len -= appendLen;
+        _current_repl_offset += appendLen;
+        _repl_buf_len += appendLen;
+    }
+    TrimBacklog();
+}
+
+void DmdbMasterReplicationManager::CreateBacklogIfNeed() {
+    _is_backlog_created = true;
+}
+
+/* The blocks out of the backlog are released by us, they are freed after the replicas referencing them
+ * have sent them */
+void DmdbMasterReplicationManager::TrimBacklog() {
+    while(_repl_buf_blocks.size() > 1 && _repl_buf_len - _repl_buf_blocks.front()->GetUsed() >= _backlog_size) {
+        _repl_buf_len -= _repl_buf_blocks.front()->GetUsed();
+        _repl_buf_blocks.front()->DecrRefCount();
+        _repl_buf_blocks.pop_front();
+    }
+}
+
+/* The data of [offset, _current_repl_offset) is added to the output buffer of replica */
+void DmdbMasterReplicationManager::AddBacklogToReplica(DmdbClientContact* replica, long long offset) {
+    for(std::deque<DmdbReplBufBlock*>::iterator it = _repl_buf_blocks.begin(); it != _repl_buf_blocks.end(); ++it) {
+        long long blockEndOffset = (*it)->GetStartOffset() + static_cast<long long>((*it)->GetUsed());
+        if(blockEndOffset <= offset) {
+            continue;
+        }
+        size_t pos = offset > (*it)->GetStartOffset() ? static_cast<size_t>(offset - (*it)->GetStartOffset()) : 0;
+        replica->AddReplyReplBlock2Client(*it, pos, (*it)->GetUsed() - pos);
     }
-    _current_repl_offset += data.length();
 }
 
 bool DmdbMasterReplicationManager::IsOneOfMySlaves(DmdbClientContact* client) {
@@ -62,46 +109,89 @@ bool DmdbMasterReplicationManager::RemoveMasterOrReplica(DmdbClientContact* clie
     return false;    
 }
 
-void DmdbMasterReplicationManager::ReplyAllBufferToReplica(DmdbClientContact* client) {
+/* Returns false if we failed to send data to the replica */
+bool DmdbMasterReplicationManager::ReplyAllBufferToReplica(DmdbClientContact* client) {
     DmdbRepilcationManagerRequiredComponents components;
     GetDmdbRepilcationManagerRequiredComponents(components);    
-    size_t bufLen = client->GetOutputBufLength(), writePos = 0;
-    while(writePos < bufLen) {
-        int ret = write(client->GetClientSocket(), client->GetOutputBuf()+writePos, bufLen-writePos);
+    struct iovec iov[REPLY_IOV_MAX];
+    while(client->GetOutputBufLength() > 0) {
+        int iovCnt = client->GetOutputIovecs(iov, REPLY_IOV_MAX);
+        ssize_t ret = writev(client->GetClientSocket(), iov, iovCnt);
         if(ret < 0) {
-            components._client_manager->DisconnectClient(client->GetClientSocket());
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                continue;
+            }
+            /* We may be in the middle of executing a command of the client, so it can't be freed here */
+            client->ClearRepliedData(client->GetOutputBufLength());
+            client->SetStatus(static_cast<uint32_t>(ClientStatus::CLOSE_AFTER_REPLY));
+            return false;
         }
-        writePos += ret;       
+        client->ClearRepliedData(static_cast<size_t>(ret));
     }
-    client->ClearRepliedData(writePos);
+    return true;
 }
 
 bool DmdbMasterReplicationManager::FullSyncDataToReplica(DmdbClientContact* client) {
     DmdbRepilcationManagerRequiredComponents components;
     GetDmdbRepilcationManagerRequiredComponents(components);
 
-    /* We should delete these events to avoid affecting rdb child sending data to replica */
-    components._event_manager->DelEvent4Fd(client->GetClientSocket(), EpollEvent::OUT);
+    if(IsOneOfMySlaves(client) || components._rdb_manager->IsReplicaWaitingForSync(client->GetClientSocket())) {
+        return false;
+    }
+
+    /* The commands after the RDB data are kept from now on, the replica may ask for them by PSYNC later */
+    CreateBacklogIfNeed();
+
+    /* We should stop writing and reading to avoid affecting the RDB data sent to replica */
+    components._client_manager->PauseWritingToClient(client);
     components._event_manager->DelEvent4Fd(client->GetClientSocket(), EpollEvent::IN);
 
     /* We have removed all events of client's socket, before we set replication plan, we need to reply all the remaining data 
      * in the replica's output buffer to the replica */
-    ReplyAllBufferToReplica(client);
+    if(!ReplyAllBufferToReplica(client)) {
+        return false;
+    }
 
-    _replicas.push_back(client);
-    components._rdb_manager->SetBackgroundSavePlan(client->GetClientSocket(), client->GetClientSocket());
+    /* It becomes one of my replicas when the RDB child is created, the replicas arriving together share one child */
+    components._rdb_manager->AddReplicaWaitingForSync(client->GetClientSocket(), client->GetClientId());
 
     return true;
 }
 
+bool DmdbMasterReplicationManager::PartialSyncToReplica(DmdbClientContact* client, const std::string &replId,
+                                                        long long offset) {
+    DmdbRepilcationManagerRequiredComponents components;
+    GetDmdbRepilcationManagerRequiredComponents(components);
+    if(!_is_backlog_created || replId != _current_replication_id || IsOneOfMySlaves(client)) {
+        return false;
+    }
+    long long backlogStartOffset = _repl_buf_blocks.empty() ? _current_repl_offset : _repl_buf_blocks.front()->GetStartOffset();
+    if(offset < backlogStartOffset || offset > _current_repl_offset) {
+        components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE,
+                                                    "Replica:%s asked for offset:%lld out of the backlog[%lld, %lld], full sync is needed",
+                                                    client->GetClientName().c_str(), offset,
+                                                    backlogStartOffset, _current_repl_offset);
+        return false;
+    }
+    client->AddReplyData2Client("+CONTINUE " + _current_replication_id + "\r\n");
+    AddBacklogToReplica(client, offset);
+    _replicas.push_back(client);
+    _replicas_supplementary[client]._replay_ok_size = offset;
+    components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE,
+                                                "Partial resynchronization with replica:%s is accepted, %lld bytes are sent from the backlog",
+                                                client->GetClientName().c_str(), _current_repl_offset - offset);
+    return true;
+}
+
 bool DmdbMasterReplicationManager::HandleFullSyncOver(int fd, bool isSuccess, bool isDisconnected) {
     DmdbRepilcationManagerRequiredComponents components;
     GetDmdbRepilcationManagerRequiredComponents(components);
 
     /* We can only receive data from the replica during the period that full sync is finished but the replication offset hasn't
-     * be received. If we add OUT event now, it may mix the accumulative commands when syncing and the RDB data sent at last. 
-     * We can add OUT event for the replica only after we receive its replication offset. */
+     * be received. If we write to it now, it may mix the accumulative commands when syncing and the RDB data sent at last. 
+     * We can resume writing to the replica only after we receive its replication offset. */
     if(isSuccess) {
+        components._event_manager->DelFd(fd, false);
         components._event_manager->AddEvent4Fd(fd, EpollEvent::IN, EventProcessorType::INTERACT);
         return true;
     }
@@ -124,10 +214,22 @@ void DmdbMasterReplicationManager::AddReplicaByFd(int fd) {
     }    
 }
 
-bool DmdbMasterReplicationManager::FullSyncFromMater() {
+bool DmdbMasterReplicationManager::ConnectToMaster() {
     return false;
 }
 
+void DmdbMasterReplicationManager::HandleMasterLinkReadable() {
+
+}
+
+void DmdbMasterReplicationManager::HandleMasterLinkWritable() {
+
+}
+
+bool DmdbMasterReplicationManager::IsDataServable() {
+    return true;
+}
+
 long long DmdbMasterReplicationManager::GetReplayOkSize() {
     return 0;
 }
@@ -159,7 +261,7 @@ void DmdbMasterReplicationManager::SetReplicaReplayOkSize(DmdbClientContact* rep
     if(_replicas_supplementary.find(replica) == _replicas_supplementary.end()) {
         DmdbRepilcationManagerRequiredComponents components;
         GetDmdbRepilcationManagerRequiredComponents(components);        
-        components._event_manager->AddEvent4Fd(replica->GetClientSocket(), EpollEvent::OUT, EventProcessorType::INTERACT);
+        components._client_manager->ResumeWritingToClient(replica);
     }
     _replicas_supplementary[replica]._replay_ok_size = size;
 }
@@ -172,6 +274,14 @@ void DmdbMasterReplicationManager::SetReplOffset(long long offset) {
     _current_repl_offset = offset;
 }
 
+std::string DmdbMasterReplicationManager::GetReplicationId() {
+    return _current_replication_id;
+}
+
+void DmdbMasterReplicationManager::SetBacklogSize(size_t size) {
+    _backlog_size = size;
+}
+
 std::string DmdbMasterReplicationManager::GetMultiBulkOfReplicasOrMaster() {
     std::string multiBulk = "*" + std::to_string(_replicas.size()) + "\r\n";
     for(std::list<DmdbClientContact*>::iterator it = _replicas.begin(); it != _replicas.end(); ++it) {
@@ -262,11 +372,20 @@ DmdbMasterReplicationManager::DmdbMasterReplicationManager() {
     _full_sync_max_ms = 60*1000;
     _last_timely_exe_ms = 0;
     _repl_timely_task_interval = 1000;
+    _repl_timeout_ms = 60*1000;
+    _is_serve_stale_data = true;
     _current_repl_offset = 0;
     _last_sample_repl_offset = 0;
+    _repl_buf_len = 0;
+    _backlog_size = 1024*1024;
+    _is_backlog_created = false;
+    GenerateRelicationID();
 }
 
 DmdbMasterReplicationManager::~DmdbMasterReplicationManager() {
+    for(size_t i = 0; i < _repl_buf_blocks.size(); ++i) {
+        _repl_buf_blocks[i]->DecrRefCount();
+    }
 
 }
 
@@ -3,6 +3,7 @@
 #include <string>
 #include <list>
 #include <unordered_map>
+#include <deque>
 
 #include "DmdbReplicationManager.hpp"
 
@@ -11,6 +12,7 @@
 namespace Dmdb {
 
 class DmdbClientContact;
+class DmdbReplBufBlock;
 
 struct ReplicaSupplementary {
     long long _replay_ok_size;
@@ -24,7 +26,7 @@ struct WaitInfoOfClient {
 class DmdbMasterReplicationManager : public DmdbReplicationManager {
 public:
     virtual DmdbClientContact* GetMasterClientContact();
-    virtual void ReplicateDataToSlaves(const std::string &data);
+    virtual void ReplicateDataToSlaves(const char* data, size_t len);
     virtual bool IsOneOfMySlaves(DmdbClientContact* client);
     virtual bool IsMyMaster(const std::string clientName);
     virtual void SetMyMasterClientContact(DmdbClientContact* master);
@@ -33,13 +35,19 @@ public:
     virtual bool RemoveMasterOrReplica(DmdbClientContact* client);
     virtual void AddReplicaByFd(int fd);
     virtual bool FullSyncDataToReplica(DmdbClientContact* client);
+    virtual bool PartialSyncToReplica(DmdbClientContact* client, const std::string &replId, long long offset);
     virtual bool HandleFullSyncOver(int fd, bool isSuccess, bool isDisconnected);
-    virtual bool FullSyncFromMater();
+    virtual bool ConnectToMaster();
+    virtual void HandleMasterLinkReadable();
+    virtual void HandleMasterLinkWritable();
+    virtual bool IsDataServable();
     virtual void AskReplicaForReplayOkSize(DmdbClientContact* replica);
     virtual void ReportToMasterMyReplayOkSize();
     virtual void SetReplicaReplayOkSize(DmdbClientContact* replica, long long size);
     virtual long long GetReplOffset();
     virtual void SetReplOffset(long long offset);
+    virtual std::string GetReplicationId();
+    virtual void SetBacklogSize(size_t size);
     virtual std::string GetMultiBulkOfReplicasOrMaster();
     virtual void TimelyTask();
     virtual void SetMasterPassword(const std::string &pwd);
@@ -54,13 +62,23 @@ public:
     virtual ~DmdbMasterReplicationManager();
 private:
     void GenerateRelicationID();
-    void ReplyAllBufferToReplica(DmdbClientContact* client);
+    bool ReplyAllBufferToReplica(DmdbClientContact* client);
+    void CreateBacklogIfNeed();
+    void TrimBacklog();
+    void AddBacklogToReplica(DmdbClientContact* replica, long long offset);
     std::list<DmdbClientContact*> _replicas;
     std::unordered_map<DmdbClientContact*, ReplicaSupplementary> _replicas_supplementary;
     std::unordered_map<DmdbClientContact*, WaitInfoOfClient> _clients_wait_n_replicas;
     std::string _current_replication_id;
     long long _current_repl_offset;
     long long _last_sample_repl_offset;
+    /* The replication stream is kept in a list of blocks since the first replica syncs with us. The replicas
+     * reference the blocks they haven't sent, and we keep the latest _backlog_size bytes at least as the backlog,
+     * it holds the data of offset [_repl_buf_blocks.front()->GetStartOffset(), _current_repl_offset) */
+    std::deque<DmdbReplBufBlock*> _repl_buf_blocks;
+    size_t _repl_buf_len;
+    size_t _backlog_size;
+    bool _is_backlog_created;
 };
 
 }
\ No newline at end of file
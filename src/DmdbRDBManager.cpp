@@ -1,15 +1,17 @@
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <signal.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <wait.h>
-
-#ifdef MAKE_TEST
 #include <fcntl.h>
-#endif
+#include <pthread.h>
 
 
+#include <algorithm>
 #include <fstream>
+#include <thread>
 
 #include "DmdbRDBManager.hpp"
 #include "DmdbServerFriends.hpp"
@@ -20,18 +22,36 @@
 #include "DmdbReplicationManager.hpp"
 #include "DmdbServer.hpp"
 #include "DmdbClientContact.hpp"
+#include "DmdbAOFManager.hpp"
+#include "DmdbLZCompressor.hpp"
+#include "DmdbEventManager.hpp"
+#include "DmdbEventManagerCommon.hpp"
+#include "DmdbEventProcessor.hpp"
+#include "DmdbLazyFreeManager.hpp"
 
 namespace Dmdb {
 
 const std::string DMDB_MARK = "Dmdb";
-const uint8_t RDB_VERSION = 1;
+const uint8_t RDB_VERSION = 2;
+/* Version 1 files have no chunks, they are loaded pair by pair */
+const uint8_t RDB_VERSION_CHUNKED = 2;
 const uint8_t DMDB_EOF = 255;
+const uint8_t RDB_CHUNK_RAW = 1;
+const uint8_t RDB_CHUNK_LZ = 2;
+const size_t RDB_CHUNK_HEADER_SIZE = 17;
+/* The compressed chunk has the raw data length after the common header */
+const size_t RDB_CHUNK_LZ_HEADER_SIZE = 21;
+const int RDB_LOAD_THREADS_MAX = 16;
+const size_t RDB_LOAD_CHUNKS_AHEAD_PER_THREAD = 4;
+const uint64_t RDB_LOAD_PROGRESS_INTERVAL_MS = 1000;
+/* The default capacity of a pipe */
+const size_t RDB_REPLICAS_PIPE_BUF_SIZE = 64*1024;
 
 const uint8_t TIME_STAMP_LENGTH = 8;
 const uint8_t PREAMBLE_LEN = 1;
 const uint32_t BUF_SIZE = 1024*1024;
 
-DmdbRDBManager* DmdbRDBManager::_instance = nullptr;
+thread_local DmdbRDBManager* DmdbRDBManager::_instance = nullptr;
 
 bool DmdbRDBManager::IsRDBChildAlive() {
     return _rdb_child_pid > 0;
@@ -42,7 +62,13 @@ bool DmdbRDBManager::IsMyselfRDBChild() {
 }
 
 bool DmdbRDBManager::RemoveRdbChildTmpFile() {
-    if(_rdb_child_pid > 0 && _rdb_child_for_replica_fd > 0) {
+    if(_rdb_child_pid > 0 && _is_rdb_child_for_aof) {
+        DmdbRDBRequiredComponents components;
+        GetDmdbRDBRequiredComponents(components);
+        unlink(components._aof_manager->GetRewriteTmpFile(_rdb_child_pid, _rdb_child_start_ms).c_str());
+        return true;
+    }
+    if(_rdb_child_pid > 0 && !_is_rdb_child_for_replicas) {
         std::string tmpFile = std::to_string(_rdb_child_pid) + "_" + std::to_string(_rdb_child_start_ms) + ".rdb";
         unlink(tmpFile.c_str());
         return true;
@@ -55,31 +81,42 @@ bool DmdbRDBManager::KillChildProcessIfAlive() {
         int statLoc;
         kill(_rdb_child_pid, SIGTERM);
         waitpid(_rdb_child_pid, &statLoc, WSTOPPED);
-        if(_rdb_child_for_replica_fd > 0) {
+        DmdbRDBRequiredComponents components;
+        GetDmdbRDBRequiredComponents(components);
+        if(_is_rdb_child_for_aof) {
+            components._aof_manager->HandleRewriteOver(false, components._aof_manager->GetRewriteTmpFile(_rdb_child_pid, _rdb_child_start_ms));
+            /* The rewrite plan is kept, it starts again later */
+            _is_rdb_child_for_aof = false;
+        } else if(_is_rdb_child_for_replicas) {
+            FinishFullSyncOfReplicas(components, false);
+            _is_rdb_child_for_replicas = false;
+        } else {
             std::string tmpFile = std::to_string(_rdb_child_pid) + "_" + std::to_string(_rdb_child_start_ms) + ".rdb";
             unlink(tmpFile.c_str());            
         }
-        DmdbRDBRequiredComponents components;
-        GetDmdbRDBRequiredComponents(components);
         components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE, 
                                                     "Killed the running RDB child process:%u",
                                                     _rdb_child_pid);
+        /* It is called at runtime too, so clean up like HandleAfterChildExit does */
+        close(_pipe_with_child[0]);
+        _rdb_child_start_ms = 0;
         _rdb_child_pid = -1;
         return true;
     }
     return false;
 }
 
-size_t DmdbRDBManager::GenerateRDBHeader(uint8_t* buf, size_t bufLen, DmdbRDBRequiredComponents &components, bool isForReplica = false) {
+size_t DmdbRDBManager::GenerateRDBHeader(uint8_t* buf, size_t bufLen, DmdbRDBRequiredComponents &components, bool isForReplica = false,
+                                         bool isPreamble = false) {
     size_t genSize = 0;
     uint64_t currentMs = 0;
-    uint8_t isPreamble = 0;
+    uint8_t preambleFlag = 0;
     long long replOffset = 0;
     uint32_t dbSize = 0;
     uint64_t totalTransferBytes = 0;
     size_t planSize = DMDB_MARK.length() + sizeof(_rdb_version) + 
                       sizeof(components._server_version) + sizeof(currentMs) + 
-                      sizeof(isPreamble) + sizeof(replOffset) + sizeof(dbSize);
+                      sizeof(preambleFlag) + sizeof(replOffset) + sizeof(dbSize);
     if(isForReplica)
         planSize += sizeof(totalTransferBytes);
 
@@ -88,7 +125,8 @@ size_t DmdbRDBManager::GenerateRDBHeader(uint8_t* buf, size_t bufLen, DmdbRDBReq
     }
 
     if(isForReplica) {
-        /* The space size of saving all pairs of database */
+        /* The space size of saving all pairs of database, the chunk headers aren't counted,
+         * the replica only uses it to report the progress */
         totalTransferBytes = components._database_manager->GetTotalBytesOfPairsWhenSave();
         /* Header size, EOF and crc checksum size */
         totalTransferBytes += planSize + sizeof(DMDB_EOF) + sizeof(uint64_t);
@@ -108,9 +146,9 @@ size_t DmdbRDBManager::GenerateRDBHeader(uint8_t* buf, size_t bufLen, DmdbRDBReq
     memcpy(buf+genSize, (uint8_t*)&currentMs, sizeof(currentMs));
     genSize += sizeof(currentMs);
 
-    isPreamble = *(components._is_preamble);
-    memcpy(buf+genSize, (uint8_t*)&isPreamble, sizeof(isPreamble));
-    genSize += sizeof(isPreamble);
+    preambleFlag = isPreamble ? 1 : 0;
+    memcpy(buf+genSize, (uint8_t*)&preambleFlag, sizeof(preambleFlag));
+    genSize += sizeof(preambleFlag);
 
     replOffset = components._repl_manager->GetReplOffset();
     memcpy(buf+genSize, (uint8_t*)&replOffset, sizeof(replOffset));
@@ -227,11 +265,393 @@ bool DmdbRDBManager::IsErrorOccurs(const char* replBuf) {
     return false;
 }
 
-/* fd<0 means loading rdb data from rdb file, otherwise replicate rdb data from master */
-bool DmdbRDBManager::LoadDatabase(int fd) {
+/* 0 means it's not a chunk */
+size_t DmdbRDBManager::GetChunkHeaderSize(uint8_t chunkType) {
+    if(chunkType == RDB_CHUNK_RAW) {
+        return RDB_CHUNK_HEADER_SIZE;
+    }
+    if(chunkType == RDB_CHUNK_LZ) {
+        return RDB_CHUNK_LZ_HEADER_SIZE;
+    }
+    return 0;
+}
+
+/* The data must be right after the header in buf, the checksum is of the data as it's saved,
+ * so a corrupted compressed chunk is found before it's decompressed */
+size_t DmdbRDBManager::GenerateChunkHeader(uint8_t* buf, uint8_t chunkType, size_t pairsNum, size_t dataLen, size_t rawLen) {
+    size_t headerSize = GetChunkHeaderSize(chunkType);
+    uint32_t chunkPairsNum = static_cast<uint32_t>(pairsNum);
+    uint32_t chunkDataLen = static_cast<uint32_t>(dataLen);
+    uint64_t dataCrc = DmdbUtil::Crc64(0, buf+headerSize, dataLen);
+    buf[0] = chunkType;
+    memcpy(buf+1, &chunkPairsNum, sizeof(chunkPairsNum));
+    memcpy(buf+5, &chunkDataLen, sizeof(chunkDataLen));
+    memcpy(buf+9, &dataCrc, sizeof(dataCrc));
+    if(chunkType == RDB_CHUNK_LZ) {
+        uint32_t chunkRawLen = static_cast<uint32_t>(rawLen);
+        memcpy(buf+17, &chunkRawLen, sizeof(chunkRawLen));
+    }
+    return headerSize;
+}
+
+void DmdbRDBManager::ParseChunkHeader(const uint8_t* buf, DmdbRDBChunk &chunk) {
+    chunk._type = buf[0];
+    memcpy(&chunk._pairs_num, buf+1, sizeof(chunk._pairs_num));
+    memcpy(&chunk._data_len, buf+5, sizeof(chunk._data_len));
+    memcpy(&chunk._data_crc, buf+9, sizeof(chunk._data_crc));
+    chunk._raw_len = chunk._data_len;
+    if(chunk._type == RDB_CHUNK_LZ) {
+        memcpy(&chunk._raw_len, buf+17, sizeof(chunk._raw_len));
+    }
+}
+
+/* Any thread can call it, the pairs are put into the database by the caller. The pairs decoded
+ * before a corruption is found are left in pairs too */
+bool DmdbRDBManager::DecodeChunk(const uint8_t* data, const DmdbRDBChunk &chunk, std::vector<DmdbLoadedPair> &pairs) {
+    if(DmdbUtil::Crc64(0, data, chunk._data_len) != chunk._data_crc) {
+        return false;
+    }
+    std::vector<uint8_t> rawData;
+    size_t dataLen = chunk._data_len;
+    if(chunk._type == RDB_CHUNK_LZ) {
+        if(chunk._raw_len > BUF_SIZE) {
+            return false;
+        }
+        rawData.resize(chunk._raw_len);
+        if(!DmdbLZCompressor::Decompress(data, chunk._data_len, rawData.data(), chunk._raw_len)) {
+            return false;
+        }
+        data = rawData.data();
+        dataLen = chunk._raw_len;
+    }
+    pairs.reserve(chunk._pairs_num);
+    std::string keyStr;
+    std::string valStr;
+    size_t pos = 0;
+    for(uint32_t i = 0; i < chunk._pairs_num; ++i) {
+        uint64_t expireTime = 0;
+        uint32_t keyLen = 0;
+        uint8_t valType = 0;
+        uint32_t valLen = 0;
+        if(dataLen-pos < sizeof(expireTime)+sizeof(keyLen)) {
+            return false;
+        }
+        memcpy(&expireTime, data+pos, sizeof(expireTime));
+        pos += sizeof(expireTime);
+        memcpy(&keyLen, data+pos, sizeof(keyLen));
+        pos += sizeof(keyLen);
+        if(dataLen-pos < static_cast<size_t>(keyLen)+sizeof(valType)+sizeof(valLen)) {
+            return false;
+        }
+        keyStr.assign(reinterpret_cast<const char*>(data+pos), keyLen);
+        pos += keyLen;
+        valType = data[pos];
+        pos += sizeof(valType);
+        memcpy(&valLen, data+pos, sizeof(valLen));
+        pos += sizeof(valLen);
+        if(dataLen-pos < valLen || static_cast<DmdbValueType>(valType) != DmdbValueType::STRING) {
+            return false;
+        }
+        valStr.assign(reinterpret_cast<const char*>(data+pos), valLen);
+        pos += valLen;
+        pairs.emplace_back();
+        DmdbDatabaseManager::CreateLoadedPair(keyStr, valStr, static_cast<DmdbValueType>(valType), expireTime, pairs.back());
+    }
+    return pos == dataLen;
+}
+
+void DmdbRDBManager::DecodeChunksMain(DmdbRDBParallelLoad* load) {
+    const std::vector<DmdbRDBChunk> &chunks = *load->_chunks;
+    while(true) {
+        size_t index = 0;
+        {
+            std::unique_lock<std::mutex> lock(load->_mutex);
+            load->_merged_cond.wait(lock, [load, &chunks]() {
+                return load->_is_failed || load->_next_chunk >= chunks.size() ||
+                       load->_next_chunk < load->_merged_chunks + load->_max_chunks_ahead;
+            });
+            if(load->_is_failed || load->_next_chunk >= chunks.size()) {
+                return;
+            }
+            index = load->_next_chunk++;
+        }
+        bool isDecodeOk = DecodeChunk(load->_data+chunks[index]._data_offset, chunks[index], load->_decoded_pairs[index]);
+        {
+            std::lock_guard<std::mutex> lock(load->_mutex);
+            load->_chunk_states[index] = isDecodeOk ? RDBChunkState::DECODED : RDBChunkState::FAILED;
+            if(!isDecodeOk) {
+                load->_is_failed = true;
+            }
+        }
+        load->_decoded_cond.notify_all();
+        if(!isDecodeOk) {
+            load->_merged_cond.notify_all();
+        }
+    }
+}
+
+bool DmdbRDBManager::ReadExactly(int fd, uint8_t* buf, size_t len) {
+    size_t readCount = 0;
+    while(readCount < len) {
+        ssize_t ret = read(fd, buf+readCount, len-readCount);
+        if(ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if(ret <= 0) {
+            return false;
+        }
+        readCount += ret;
+    }
+    return true;
+}
+
+void DmdbRDBManager::LogLoadProgress(DmdbRDBRequiredComponents &components, uint64_t loadedBytes, uint64_t totalBytes,
+                                     uint64_t loadedKeys, uint64_t startMs) {
+    uint64_t currentMs = DmdbUtil::GetCurrentMs();
+    if(currentMs - _last_load_progress_ms < RDB_LOAD_PROGRESS_INTERVAL_MS) {
+        return;
+    }
+    _last_load_progress_ms = currentMs;
+    uint64_t etaSeconds = 0;
+    if(loadedBytes > 0 && totalBytes > loadedBytes) {
+        etaSeconds = (currentMs - startMs) * (totalBytes - loadedBytes) / loadedBytes / 1000;
+    }
+    components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE,
+                                                "Loading RDB data: %llu/%llu bytes, %llu keys, ETA %llu seconds",
+                                                static_cast<unsigned long long>(loadedBytes),
+                                                static_cast<unsigned long long>(totalBytes),
+                                                static_cast<unsigned long long>(loadedKeys),
+                                                static_cast<unsigned long long>(etaSeconds));
+}
+
+/* The file is mapped into memory, the chunks are found by hopping from one chunk header to the
+ * next one, so it works for the preamble of an AOF too, whose RDB data isn't at the end of the file.
+ * Then the chunks are decoded by _load_threads_num threads and merged into the database in order */
+bool DmdbRDBManager::LoadChunksFromFile(DmdbRDBRequiredComponents &components, const std::string &file, size_t headerSize,
+                                        uint32_t dbSize, uint64_t crcCode, uint64_t &loadedSize) {
+    int fd = open(file.c_str(), O_RDONLY);
+    struct stat fileStat;
+    if(fd < 0 || fstat(fd, &fileStat) < 0) {
+        components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                    "Failed to open RDB file:%s! Error info:%s",
+                                                    file.c_str(), strerror(errno));
+        if(fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+    size_t fileSize = fileStat.st_size;
+    void* mapped = fileSize > 0 ? mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if(mapped == MAP_FAILED) {
+        components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                    "Failed to map RDB file:%s! Error info:%s",
+                                                    file.c_str(), strerror(errno));
+        return false;
+    }
+    madvise(mapped, fileSize, MADV_SEQUENTIAL);
+    const uint8_t* data = static_cast<const uint8_t*>(mapped);
+    std::vector<DmdbRDBChunk> chunks;
+    uint64_t chunksPairsNum = 0;
+    uint64_t savedCrcCode = 0;
+    size_t pos = headerSize;
+    bool isOk = true;
+    while(pos < fileSize && GetChunkHeaderSize(data[pos]) > 0) {
+        DmdbRDBChunk chunk;
+        size_t chunkHeaderSize = GetChunkHeaderSize(data[pos]);
+        if(fileSize-pos < chunkHeaderSize) {
+            break;
+        }
+        ParseChunkHeader(data+pos, chunk);
+        crcCode = DmdbUtil::Crc64(crcCode, data+pos, chunkHeaderSize);
+        chunk._data_offset = pos+chunkHeaderSize;
+        if(fileSize-chunk._data_offset < chunk._data_len) {
+            break;
+        }
+        pos = chunk._data_offset+chunk._data_len;
+        chunksPairsNum += chunk._pairs_num;
+        chunks.push_back(chunk);
+    }
+    if(pos >= fileSize || data[pos] != DMDB_EOF || fileSize-pos < sizeof(DMDB_EOF)+sizeof(savedCrcCode)) {
+        isOk = false;
+    } else {
+        crcCode = DmdbUtil::Crc64(crcCode, data+pos, sizeof(DMDB_EOF));
+        memcpy(&savedCrcCode, data+pos+sizeof(DMDB_EOF), sizeof(savedCrcCode));
+        loadedSize = pos+sizeof(DMDB_EOF)+sizeof(savedCrcCode);
+        isOk = savedCrcCode == crcCode && chunksPairsNum == dbSize;
+    }
+    if(!isOk) {
+        components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                    "RDB file:%s has been corrupted",
+                                                    file.c_str());
+        munmap(mapped, fileSize);
+        return false;
+    }
+
+    components._database_manager->ReserveForLoading(dbSize);
+    DmdbRDBParallelLoad load;
+    load._data = data;
+    load._chunks = &chunks;
+    load._decoded_pairs.resize(chunks.size());
+    load._chunk_states.assign(chunks.size(), RDBChunkState::PENDING);
+    load._next_chunk = 0;
+    load._merged_chunks = 0;
+    load._is_failed = false;
+    size_t threadsNum = std::min(static_cast<size_t>(_load_threads_num), chunks.size());
+    load._max_chunks_ahead = std::max(threadsNum, static_cast<size_t>(1)) * RDB_LOAD_CHUNKS_AHEAD_PER_THREAD;
+    std::vector<std::thread> threads;
+    if(threadsNum > 1) {
+        /* Signals should be handled by the main thread only */
+        sigset_t blockSet, oldSet;
+        sigfillset(&blockSet);
+        pthread_sigmask(SIG_BLOCK, &blockSet, &oldSet);
+        for(size_t i = 0; i < threadsNum; ++i) {
+            threads.emplace_back(DecodeChunksMain, &load);
+        }
+        pthread_sigmask(SIG_SETMASK, &oldSet, nullptr);
+    }
+
+    uint64_t startMs = DmdbUtil::GetCurrentMs();
+    uint64_t loadedKeys = 0;
+    _last_load_progress_ms = startMs;
+    for(size_t i = 0; i < chunks.size(); ++i) {
+        if(threads.empty()) {
+            bool isDecodeOk = DecodeChunk(data+chunks[i]._data_offset, chunks[i], load._decoded_pairs[i]);
+            load._chunk_states[i] = isDecodeOk ? RDBChunkState::DECODED : RDBChunkState::FAILED;
+        } else {
+            std::unique_lock<std::mutex> lock(load._mutex);
+            load._decoded_cond.wait(lock, [&load, i]() {
+                return load._is_failed || load._chunk_states[i] != RDBChunkState::PENDING;
+            });
+        }
+        if(load._chunk_states[i] != RDBChunkState::DECODED) {
+            isOk = false;
+            break;
+        }
+        std::vector<DmdbLoadedPair> &pairs = load._decoded_pairs[i];
+        for(size_t j = 0; j < pairs.size(); ++j) {
+            components._database_manager->AddLoadedPair(pairs[j]);
+        }
+        loadedKeys += pairs.size();
+        std::vector<DmdbLoadedPair>().swap(pairs);
+        {
+            std::lock_guard<std::mutex> lock(load._mutex);
+            load._merged_chunks = i+1;
+        }
+        load._merged_cond.notify_all();
+        LogLoadProgress(components, chunks[i]._data_offset+chunks[i]._data_len, loadedSize, loadedKeys, startMs);
+    }
+    {
+        std::lock_guard<std::mutex> lock(load._mutex);
+        if(!isOk) {
+            load._is_failed = true;
+        }
+    }
+    load._merged_cond.notify_all();
+    for(size_t i = 0; i < threads.size(); ++i) {
+        threads[i].join();
+    }
+    /* The pairs decoded but not merged when something goes wrong */
+    for(size_t i = 0; i < load._decoded_pairs.size(); ++i) {
+        for(size_t j = 0; j < load._decoded_pairs[i].size(); ++j) {
+            if(load._decoded_pairs[i][j]._entry != nullptr) {
+                DmdbDatabaseManager::ReleaseLoadedPair(load._decoded_pairs[i][j]);
+            }
+        }
+    }
+    munmap(mapped, fileSize);
+    if(!isOk) {
+        components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                    "RDB file:%s has been corrupted",
+                                                    file.c_str());
+    }
+    return isOk;
+}
+
+/* The replica reads exactly one chunk at a time, so the commands the master sends after the RDB
+ * data are left in the socket. totalBytes is the size of the raw pairs, it's only for the
+ * progress log */
+bool DmdbRDBManager::LoadChunksFromSocket(DmdbRDBRequiredComponents &components, int fd, uint64_t totalBytes,
+                                          uint32_t dbSize, uint64_t crcCode) {
+    uint8_t chunkHeader[RDB_CHUNK_LZ_HEADER_SIZE];
+    std::vector<uint8_t> chunkData;
+    std::vector<DmdbLoadedPair> pairs;
+    uint64_t savedCrcCode = 0;
+    uint64_t loadedBytes = 0;
+    uint64_t loadedKeys = 0;
+    uint64_t startMs = DmdbUtil::GetCurrentMs();
+    _last_load_progress_ms = startMs;
+    components._database_manager->ReserveForLoading(dbSize);
+    while(true) {
+        if(!ReadExactly(fd, chunkHeader, sizeof(DMDB_EOF))) {
+            goto read_err;
+        }
+        if(chunkHeader[0] == DMDB_EOF) {
+            break;
+        }
+        size_t chunkHeaderSize = GetChunkHeaderSize(chunkHeader[0]);
+        if(chunkHeaderSize == 0) {
+            goto corrupted_error;
+        }
+        if(!ReadExactly(fd, chunkHeader+1, chunkHeaderSize-1)) {
+            goto read_err;
+        }
+        DmdbRDBChunk chunk;
+        ParseChunkHeader(chunkHeader, chunk);
+        chunk._data_offset = 0;
+        if(chunk._data_len > BUF_SIZE || chunk._raw_len > BUF_SIZE) {
+            goto corrupted_error;
+        }
+        crcCode = DmdbUtil::Crc64(crcCode, chunkHeader, chunkHeaderSize);
+        chunkData.resize(chunk._data_len);
+        if(!ReadExactly(fd, chunkData.data(), chunk._data_len)) {
+            goto read_err;
+        }
+        bool isDecodeOk = DecodeChunk(chunkData.data(), chunk, pairs);
+        for(size_t i = 0; i < pairs.size(); ++i) {
+            if(isDecodeOk) {
+                components._database_manager->AddLoadedPair(pairs[i]);
+            } else {
+                DmdbDatabaseManager::ReleaseLoadedPair(pairs[i]);
+            }
+        }
+        if(!isDecodeOk) {
+            goto corrupted_error;
+        }
+        loadedKeys += pairs.size();
+        loadedBytes += chunk._raw_len;
+        pairs.clear();
+        LogLoadProgress(components, loadedBytes, totalBytes, loadedKeys, startMs);
+    }
+    crcCode = DmdbUtil::Crc64(crcCode, chunkHeader, sizeof(DMDB_EOF));
+    if(!ReadExactly(fd, reinterpret_cast<uint8_t*>(&savedCrcCode), sizeof(savedCrcCode))) {
+        goto read_err;
+    }
+    if(savedCrcCode != crcCode || loadedKeys != dbSize) {
+        goto corrupted_error;
+    }
+    return true;
+
+corrupted_error:
+    components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                "RDB data has been corrupted");
+    return false;
+
+read_err:
+    components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                "Failed to receive RDB data");
+    return false;
+}
+
+/* fd<0 means loading rdb data from rdb file, otherwise replicate rdb data from master.
+ * If the RDB data is the preamble of an AOF, the commands after it are left to the AOF manager */
+bool DmdbRDBManager::LoadDatabase(int fd, const std::string &file, uint64_t* loadedBytes) {
     DmdbRDBRequiredComponents components;
     GetDmdbRDBRequiredComponents(components);    
     std::fstream rdbStream;
+    std::string fileToLoad = file.empty() ? _rdb_file : file;
+    bool isPreamble = false;
+    uint64_t loadedSize = 0;
     char buf[BUF_SIZE] = {0};
     char dmdbMark[5] = {0};
     uint8_t rdbVersion = 0;
@@ -256,7 +676,7 @@ bool DmdbRDBManager::LoadDatabase(int fd) {
     uint8_t headerPos = 0;
 
     if(fd < 0) {
-        rdbStream.open(_rdb_file.c_str(), std::ios::in | std::ios::binary);
+        rdbStream.open(fileToLoad.c_str(), std::ios::in | std::ios::binary);
         if(!rdbStream.is_open()) {
             return false;
         }
@@ -306,13 +726,43 @@ bool DmdbRDBManager::LoadDatabase(int fd) {
     }
     headerPos += sizeof(components._server_version);
     headerPos += TIME_STAMP_LENGTH; /* We dismiss time stamp currently */
-    *components._is_preamble = buf[headerPos]!=0 ? true:false;
+    isPreamble = buf[headerPos]!=0 ? true:false;
     headerPos += PREAMBLE_LEN;
     replOffset = *(long long*)(buf+headerPos);
     headerPos += sizeof(replOffset);
     dbSize = *(uint32_t*)(buf+headerPos);
     headerPos += sizeof(dbSize);
     expectedCrcCode = DmdbUtil::Crc64(expectedCrcCode, (uint8_t*)(buf), headerSize);
+    loadedSize += headerSize;
+
+    if(rdbVersion >= RDB_VERSION_CHUNKED) {
+        bool isLoadOk = false;
+        if(fd < 0) {
+            rdbStream.close();
+            isLoadOk = LoadChunksFromFile(components, fileToLoad, headerSize, dbSize, expectedCrcCode, loadedSize);
+            _is_rdb_loading = false;
+        } else {
+            isLoadOk = LoadChunksFromSocket(components, fd, shouldReadBytesFromMaster, dbSize, expectedCrcCode);
+        }
+        if(!isLoadOk) {
+            components._database_manager->Destroy();
+            return false;
+        }
+        if(loadedBytes != nullptr) {
+            *loadedBytes = loadedSize;
+        }
+        if(fd < 0) {
+            components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE,
+                                                        "RDB %s:%s has been loaded successfully",
+                                                        isPreamble ? "preamble of AOF file" : "file",
+                                                        fileToLoad.c_str());
+        } else {
+            components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE,
+                                                        "RDB data has been received successfully");
+        }
+        components._repl_manager->SetReplOffset(replOffset);
+        return true;
+    }
 
     memset(buf, 0, headerSize);
 
@@ -351,12 +801,14 @@ bool DmdbRDBManager::LoadDatabase(int fd) {
             goto corrupted_error;
         } else if(everyLoadResult == LoadRetCode::NOT_ENOUGH) {
             expectedCrcCode = DmdbUtil::Crc64(expectedCrcCode, (uint8_t*)(buf), processedPos);
+            loadedSize += processedPos;
             memmove(buf, buf+processedPos, dataLen-processedPos);
             expectReadCount = processedPos;
             remainingCountAfterOneProcess = dataLen-processedPos;
         } else {
             /* everyLoadResult == LoadRetCode::END */
             expectedCrcCode = DmdbUtil::Crc64(expectedCrcCode, (uint8_t*)(buf), processedPos);
+            loadedSize += processedPos;
             memmove(buf, buf+processedPos, dataLen-processedPos);
             remainingCountAfterOneProcess = dataLen-processedPos;
             break;
@@ -369,7 +821,8 @@ bool DmdbRDBManager::LoadDatabase(int fd) {
         goto corrupted_error;
     }
 
-    if(static_cast<uint32_t>(remainingCountAfterOneProcess) > sizeof(expectedCrcCode)+sizeof(DMDB_EOF)) {
+    /* The commands of the AOF follow its preamble */
+    if(static_cast<uint32_t>(remainingCountAfterOneProcess) > sizeof(expectedCrcCode)+sizeof(DMDB_EOF) && !isPreamble) {
         goto corrupted_error;
     } else if(static_cast<uint32_t>(remainingCountAfterOneProcess) < sizeof(expectedCrcCode)+sizeof(DMDB_EOF)) {
         needToReadCountWhenEof = sizeof(expectedCrcCode)+sizeof(DMDB_EOF)-remainingCountAfterOneProcess;
@@ -393,10 +846,15 @@ bool DmdbRDBManager::LoadDatabase(int fd) {
     if(expectedCrcCode != savedCrcCode) {
         goto corrupted_error;
     }
+    loadedSize += sizeof(DMDB_EOF) + sizeof(expectedCrcCode);
+    if(loadedBytes != nullptr) {
+        *loadedBytes = loadedSize;
+    }
     if(fd < 0) {
         components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE,
-                                                    "RDB file:%s has been loaded successfully",
-                                                    _rdb_file.c_str());
+                                                    "RDB %s:%s has been loaded successfully",
+                                                    isPreamble ? "preamble of AOF file" : "file",
+                                                    fileToLoad.c_str());
         rdbStream.close();
         _is_rdb_loading = false;        
     } else {
@@ -413,7 +871,7 @@ corrupted_error:
     if(fd < 0) {
         components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
                                                     "RDB file:%s has been corrupted",
-                                                    _rdb_file.c_str());
+                                                    fileToLoad.c_str());
         rdbStream.close();
         _is_rdb_loading = false;                
     } else {
@@ -429,7 +887,7 @@ read_err:
     if(fd < 0) {
         components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
                                                     "Failed to read RDB file:%s",
-                                                    _rdb_file.c_str());
+                                                    fileToLoad.c_str());
         rdbStream.close();
         _is_rdb_loading = false;        
     } else {
@@ -485,16 +943,19 @@ bool DmdbRDBManager::ReceiveRetCodeFromPipe(SaveRetCode &retCode, bool isBgSave)
  * AOF_PREAMBLE: 1 byte
  * Replication offset: 8 bytes
  * DB_SIZE: 4 bytes
- * Key-values: unknown size, format raw data
+ * Chunks: unknown size, every chunk has a header and raw or compressed pairs(see DmdbRDBChunk)
  * EOF: 1 byte unsigned char
- * Checksum: 8 bytes unsigned long long int */
-SaveRetCode DmdbRDBManager::SaveData(int fd, bool isBgSave) {
+ * Checksum: 8 bytes unsigned long long int, it covers the header, the chunk headers and EOF */
+SaveRetCode DmdbRDBManager::SaveData(int fd, bool isBgSave, const std::string &preambleFile) {
     DmdbRDBRequiredComponents components;
     GetDmdbRDBRequiredComponents(components);
     pid_t myPid = getpid();
     std::fstream rdbStream;
     std::string fileToSave = "";
-    if(isBgSave)
+    bool isPreamble = !preambleFile.empty();
+    if(isPreamble)
+        fileToSave = preambleFile;
+    else if(isBgSave)
         fileToSave = std::to_string(myPid) + "_" + std::to_string(_rdb_child_start_ms) + ".rdb";
     else
         fileToSave = _rdb_file;
@@ -512,7 +973,7 @@ SaveRetCode DmdbRDBManager::SaveData(int fd, bool isBgSave) {
 
     uint8_t* pairsRawData = new uint8_t[BUF_SIZE]{0};
     uint64_t crcCode = 0;
-    size_t headerSize = GenerateRDBHeader(pairsRawData, BUF_SIZE, components, fd>0);
+    size_t headerSize = GenerateRDBHeader(pairsRawData, BUF_SIZE, components, fd>0, isPreamble);
     if(fd > 0) {
         if(write(fd, (char*)pairsRawData, headerSize) < 0) {
             WriteDataToPipeIfNeed(std::to_string(static_cast<int>(SaveRetCode::SEND_ERR)), isBgSave);
@@ -532,15 +993,41 @@ SaveRetCode DmdbRDBManager::SaveData(int fd, bool isBgSave) {
     memset(pairsRawData, 0, headerSize);
     size_t pairAmountOfThisCopy = 0, savedPairAmount = 0;
     size_t copiedSize = 0;
+    std::vector<uint8_t> compressedData(_is_compression_enabled ? BUF_SIZE : 0);
     
     while(savedPairAmount < components._database_manager->GetDatabaseSize()) {
-        components._database_manager->GetNPairsFormatRawSequential(pairsRawData, BUF_SIZE, copiedSize, 
-                                                                   100, pairAmountOfThisCopy);
+        /* Every round fills a chunk, its header is generated in front of the pairs */
+        components._database_manager->GetNPairsFormatRawSequential(pairsRawData+RDB_CHUNK_HEADER_SIZE, BUF_SIZE-RDB_CHUNK_HEADER_SIZE,
+                                                                   copiedSize, BUF_SIZE, pairAmountOfThisCopy);
+        if(pairAmountOfThisCopy == 0) {
+            /* A pair bigger than a chunk, we can't save it */
+            components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                        "Failed to save a pair bigger than %u bytes",
+                                                        BUF_SIZE-RDB_CHUNK_HEADER_SIZE);
+            WriteDataToPipeIfNeed(std::to_string(static_cast<int>(SaveRetCode::WRITE_ERR)), isBgSave);
+            delete[] pairsRawData;
+            return SaveRetCode::WRITE_ERR;
+        }
+        /* A chunk is saved compressed only if it becomes smaller, including the bigger header */
+        uint8_t* chunkBuf = pairsRawData;
+        size_t chunkSize = 0;
+        size_t compressedSize = 0;
+        if(_is_compression_enabled && copiedSize > RDB_CHUNK_LZ_HEADER_SIZE) {
+            compressedSize = DmdbLZCompressor::Compress(pairsRawData+RDB_CHUNK_HEADER_SIZE, copiedSize,
+                                                        compressedData.data()+RDB_CHUNK_LZ_HEADER_SIZE,
+                                                        copiedSize-(RDB_CHUNK_LZ_HEADER_SIZE-RDB_CHUNK_HEADER_SIZE));
+        }
+        if(compressedSize > 0) {
+            chunkBuf = compressedData.data();
+            chunkSize = GenerateChunkHeader(chunkBuf, RDB_CHUNK_LZ, pairAmountOfThisCopy, compressedSize, copiedSize) + compressedSize;
+        } else {
+            chunkSize = GenerateChunkHeader(chunkBuf, RDB_CHUNK_RAW, pairAmountOfThisCopy, copiedSize, copiedSize) + copiedSize;
+        }
         size_t writeCountOfThisRound = 0;
         if(fd < 0) {
-            while(writeCountOfThisRound < copiedSize) {
+            while(writeCountOfThisRound < chunkSize) {
                 size_t before = rdbStream.tellp();
-                rdbStream.write((char*)pairsRawData+writeCountOfThisRound, copiedSize-writeCountOfThisRound);
+                rdbStream.write((char*)chunkBuf+writeCountOfThisRound, chunkSize-writeCountOfThisRound);
                 if(rdbStream.bad()) {
                     WriteDataToPipeIfNeed(std::to_string(static_cast<int>(SaveRetCode::WRITE_ERR)), isBgSave);
                     delete[] pairsRawData;
@@ -549,8 +1036,8 @@ SaveRetCode DmdbRDBManager::SaveData(int fd, bool isBgSave) {
                 writeCountOfThisRound += static_cast<size_t>(rdbStream.tellp()) - before;
             }              
         } else {
-            while(writeCountOfThisRound < copiedSize) {
-                int ret = write(fd, (char*)pairsRawData+writeCountOfThisRound, copiedSize-writeCountOfThisRound);
+            while(writeCountOfThisRound < chunkSize) {
+                int ret = write(fd, (char*)chunkBuf+writeCountOfThisRound, chunkSize-writeCountOfThisRound);
                 if(ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
                     WriteDataToPipeIfNeed(std::to_string(static_cast<int>(SaveRetCode::SEND_ERR)), isBgSave);
                     delete[] pairsRawData;
@@ -560,8 +1047,8 @@ SaveRetCode DmdbRDBManager::SaveData(int fd, bool isBgSave) {
                     writeCountOfThisRound += ret;
             }
         }
-        crcCode = DmdbUtil::Crc64(crcCode, pairsRawData, copiedSize);
-        memset(pairsRawData, 0, copiedSize);
+        /* The data is covered by the checksum in the chunk header */
+        crcCode = DmdbUtil::Crc64(crcCode, chunkBuf, GetChunkHeaderSize(chunkBuf[0]));
         copiedSize = 0;
         savedPairAmount += pairAmountOfThisCopy;
         pairAmountOfThisCopy = 0;
@@ -596,7 +1083,7 @@ SaveRetCode DmdbRDBManager::SaveData(int fd, bool isBgSave) {
         }    
         rdbStream.flush();
         rdbStream.close();
-        if(isBgSave)
+        if(isBgSave && !isPreamble)
             rename(fileToSave.c_str(), _rdb_file.c_str());      
     } else {
         /* If it is replica's fd, we can't close it */
@@ -616,6 +1103,14 @@ SaveRetCode DmdbRDBManager::SaveData(int fd, bool isBgSave) {
 bool DmdbRDBManager::BackgroundSave() {
     DmdbRDBRequiredComponents components;
     GetDmdbRDBRequiredComponents(components);
+    int replicasPipe[2] = {-1, -1};
+    if(_is_rdb_child_for_replicas && pipe(replicasPipe) == -1) {
+        components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                    "Failed to create pipes! Error info:%s", 
+                                                    strerror(errno));
+        _rdb_child_pid = -1;
+        return false;
+    }
     if(pipe(_pipe_with_child) == -1) {
         components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
                                                     "Failed to create pipes! Error info:%s", 
@@ -623,6 +1118,10 @@ bool DmdbRDBManager::BackgroundSave() {
         /* The reason why we set _rdb_child_pid=-1 here is that sometimes child is created successfully before but fails to complete its task,
          * if we don't set, CheckRdbChildFinished() may execute wrongly */
         _rdb_child_pid = -1;
+        if(_is_rdb_child_for_replicas) {
+            close(replicasPipe[0]);
+            close(replicasPipe[1]);
+        }
         ClearBackgroundSavePlan();
         return false;
     }
@@ -636,13 +1135,31 @@ bool DmdbRDBManager::BackgroundSave() {
         /* The reason why we set _rdb_child_pid=-1 here is that sometimes child is created successfully before but fails to complete its task,
          * if we don't set, CheckRdbChildFinished() may execute wrongly */
         _rdb_child_pid = -1;
+        close(_pipe_with_child[0]);
+        close(_pipe_with_child[1]);
+        if(_is_rdb_child_for_replicas) {
+            close(replicasPipe[0]);
+            close(replicasPipe[1]);
+        }
         ClearBackgroundSavePlan();
         return false;
     } else if(pid == 0) {
         DmdbServer::ClearSignalHandler();
         _my_parent_pid = parentPid;
         close(_pipe_with_child[0]); /* Close reading fd */
-        bool isSaveOk = SaveData(_rdb_child_for_replica_fd, true) == SaveRetCode::SAVE_OK;
+        bool isSaveOk = false;
+        if(_is_rdb_child_for_aof) {
+            SaveRetCode retCode = components._aof_manager->RewriteAppendOnlyFile(
+                components._aof_manager->GetRewriteTmpFile(getpid(), _rdb_child_start_ms));
+            WriteDataToPipeIfNeed(std::to_string(static_cast<int>(retCode)), true);
+            isSaveOk = retCode == SaveRetCode::SAVE_OK;
+        } else if(_is_rdb_child_for_replicas) {
+            close(replicasPipe[0]);
+            isSaveOk = SaveData(replicasPipe[1], true) == SaveRetCode::SAVE_OK;
+            close(replicasPipe[1]);
+        } else {
+            isSaveOk = SaveData(-1, true) == SaveRetCode::SAVE_OK;
+        }
         close(_pipe_with_child[1]);
         exit(isSaveOk?0:1);
         return isSaveOk;
@@ -650,6 +1167,21 @@ bool DmdbRDBManager::BackgroundSave() {
         /* Close writting fd */
         close(_pipe_with_child[1]);
         _rdb_child_pid = pid;
+        if(_is_rdb_child_for_aof) {
+            /* The commands executed from now on aren't in the child's memory */
+            components._aof_manager->StartRewriteBuf();
+            components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE, "AOF rewrite child process:%d has been created", _rdb_child_pid);
+            return true;
+        }
+        if(_is_rdb_child_for_replicas) {
+            close(replicasPipe[1]);
+            _replicas_pipe_fd = replicasPipe[0];
+            components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE,
+                                                        "RDB child process:%d has been created for %zu replicas",
+                                                        _rdb_child_pid, _replicas_waiting_sync.size());
+            StartFullSyncOfReplicas(components);
+            return true;
+        }
         components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE, "RDB child process:%d has been created", _rdb_child_pid);
         return true;
     }
@@ -661,6 +1193,15 @@ void DmdbRDBManager::CheckRdbChildFinished() {
     int statloc;
     if(_rdb_child_pid < 0)
         return;
+    /* The data left in the pipe must be sent to the replicas before we finish the full sync */
+    if(_replicas_pipe_fd >= 0) {
+        /* The replica we were waiting for may have been disconnected */
+        if(_is_replicas_pipe_paused && IsPipeBufSentToAllReplicas(components)) {
+            components._event_manager->AddEvent4Fd(_replicas_pipe_fd, EpollEvent::IN, EventProcessorType::RDB_PIPE);
+            _is_replicas_pipe_paused = false;
+        }
+        return;
+    }
     /* WNOHANG means non-blocking waiting */
     pid_t checkPid = waitpid(_rdb_child_pid, &statloc, WNOHANG);
 
@@ -696,61 +1237,83 @@ void DmdbRDBManager::HandleAfterChildExit(bool isKilledBySignal) {
     std::string logContent = "";
     SaveRetCode retCode = SaveRetCode::NONE;
     std::string tmpRdbFile;
+
+    if(_is_rdb_child_for_aof) {
+        if(!isKilledBySignal) {
+            ReceiveRetCodeFromPipe(retCode, true);
+        }
+        components._aof_manager->HandleRewriteOver(retCode == SaveRetCode::SAVE_OK,
+                                                   components._aof_manager->GetRewriteTmpFile(_rdb_child_pid, _rdb_child_start_ms));
+        close(_pipe_with_child[0]);
+        ClearBackgroundSavePlan();
+        _rdb_child_start_ms = 0;
+        _rdb_child_pid = -1;
+        return;
+    }
+
+    if(_is_rdb_child_for_replicas) {
+        if(!isKilledBySignal) {
+            ReceiveRetCodeFromPipe(retCode, true);
+        }
+        FinishFullSyncOfReplicas(components, retCode == SaveRetCode::SAVE_OK);
+        close(_pipe_with_child[0]);
+        ClearBackgroundSavePlan();
+        _rdb_child_start_ms = 0;
+        _rdb_child_pid = -1;
+        return;
+    }
     
     if(isKilledBySignal) { /* If rdb child process is killed by signal, we can't read data from pipe */
         logContent = "RDB child process is killed by signal!";
         components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE, logContent.c_str());
-        if(_rdb_child_for_replica_fd == -1) {
-            tmpRdbFile = std::to_string(_rdb_child_pid) + "_" + std::to_string(_rdb_child_start_ms) + ".rdb";
-            unlink(tmpRdbFile.c_str());
-            logContent = "Failed to save RDB data";
-        } else {
-            logContent = "Failed to full sync RDB data to replica:" + components._client_manager->GetNameOfClient(_rdb_child_for_replica_fd);
-        }
     } else {
         ReceiveRetCodeFromPipe(retCode, true);
-        if(retCode == SaveRetCode::SAVE_OK) {
-            if(_rdb_child_for_replica_fd < 0) {
-                
-                logContent = "RDB data have been saved successfully";                
-            } else {
-                logContent = "RDB data have been replicated to replica:" + components._client_manager->GetNameOfClient(_rdb_child_for_replica_fd) +
-                             " successfully";
-            }
-        } else {
-            if(_rdb_child_for_replica_fd < 0) {
-                tmpRdbFile = std::to_string(_rdb_child_pid) + "_" + std::to_string(_rdb_child_start_ms) + ".rdb";
-                unlink(tmpRdbFile.c_str());
-                logContent = "Failed to save RDB data";
-            } else { /* If it failed for replication, the retCode must be SEND_ERR */
-                logContent = "Disconnected with replica:" + components._client_manager->GetNameOfClient(_rdb_child_for_replica_fd);
-                components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE, logContent.c_str());                    
-                logContent = "Failed to full sync RDB data to replica:" + components._client_manager->GetNameOfClient(_rdb_child_for_replica_fd);
-            }
-        } 
     }
-    components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE, logContent.c_str());
-    if(_rdb_child_for_replica_fd > 0) {
-        components._repl_manager->HandleFullSyncOver(_rdb_child_for_replica_fd, retCode==SaveRetCode::SAVE_OK, retCode==SaveRetCode::SEND_ERR);
+    if(retCode == SaveRetCode::SAVE_OK) {
+        logContent = "RDB data have been saved successfully";
+    } else {
+        tmpRdbFile = std::to_string(_rdb_child_pid) + "_" + std::to_string(_rdb_child_start_ms) + ".rdb";
+        unlink(tmpRdbFile.c_str());
+        logContent = "Failed to save RDB data";
     }
+    components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE, logContent.c_str());
     close(_pipe_with_child[0]);
     ClearBackgroundSavePlan();
     _rdb_child_start_ms = 0;
     _rdb_child_pid = -1;
 }
 
-void DmdbRDBManager::SetBackgroundSavePlan(int clientFd, int replicaFd) {
+void DmdbRDBManager::SetBackgroundSavePlan(int clientFd) {
     _rdb_child_for_client_fd = clientFd;
-    _rdb_child_for_replica_fd = replicaFd;
     _is_plan_to_bgsave_rdb = true;
 }
 
 void DmdbRDBManager::ClearBackgroundSavePlan() {
+    if(_is_rdb_child_for_aof) {
+        _is_rdb_child_for_aof = false;
+        _is_plan_to_rewrite_aof = false;
+        return;
+    }
+    if(_is_rdb_child_for_replicas) {
+        _is_rdb_child_for_replicas = false;
+        return;
+    }
     _is_plan_to_bgsave_rdb = false;
-    _rdb_child_for_replica_fd = -1;
     _rdb_child_for_client_fd = -1;
 }
 
+void DmdbRDBManager::SetAOFRewritePlan() {
+    _is_plan_to_rewrite_aof = true;
+}
+
+bool DmdbRDBManager::IsAOFRewritePlanned() {
+    return _is_plan_to_rewrite_aof;
+}
+
+bool DmdbRDBManager::IsAOFRewriteChildAlive() {
+    return _rdb_child_pid > 0 && _is_rdb_child_for_aof;
+}
+
 void DmdbRDBManager::FeedbackToClientOfRdbChild(DmdbRDBRequiredComponents &components, const std::string& feedback) {
     DmdbClientContact* clientContact = components._client_manager->GetClientContactByFd(_rdb_child_for_client_fd);
     if(clientContact != nullptr) {
@@ -758,6 +1321,14 @@ void DmdbRDBManager::FeedbackToClientOfRdbChild(DmdbRDBRequiredComponents &compo
     }    
 }
 
+void DmdbRDBManager::SetCompressionEnabled(bool isEnabled) {
+    _is_compression_enabled = isEnabled;
+}
+
+void DmdbRDBManager::SetLoadThreadsNum(int threadsNum) {
+    _load_threads_num = std::min(std::max(threadsNum, 1), RDB_LOAD_THREADS_MAX);
+}
+
 void DmdbRDBManager::BackgroundSaveIfNeed() {
     DmdbRDBRequiredComponents components;
     GetDmdbRDBRequiredComponents(components);
@@ -765,17 +1336,240 @@ void DmdbRDBManager::BackgroundSaveIfNeed() {
     if(_rdb_child_pid > 0) {
         return;
     }
-    if(!_is_plan_to_bgsave_rdb) {
+    bool isReplicasReady = !_replicas_waiting_sync.empty() &&
+                           DmdbUtil::GetCurrentMs() - _first_replica_waiting_ms >= _replicas_sync_delay_ms;
+    if(!_is_plan_to_bgsave_rdb && !_is_plan_to_rewrite_aof && !isReplicasReady) {
+        return;
+    }
+    /* Full sync goes first since the replicas can do nothing before it, then BGSAVE,
+     * the AOF rewrite waits for the next turn */
+    bool isForAOF = !isReplicasReady && !_is_plan_to_bgsave_rdb;
+    /* The last rewrite buffer is still being appended to the new file */
+    if(isForAOF && components._aof_manager->IsRewriteFinishing()) {
         return;
     }
+    _is_rdb_child_for_replicas = isReplicasReady;
+    _is_rdb_child_for_aof = isForAOF;
     
     bool isCreateChildOk = BackgroundSave();
-    if(!isCreateChildOk) {
-        if (_rdb_child_for_replica_fd > 0)
-            FeedbackToClientOfRdbChild(components, "-ERR Replication can't be finished\r\n");
-        else
-            FeedbackToClientOfRdbChild(components, "-ERR RDB data can't be saved into disk in the background\r\n");
+    if(!isCreateChildOk && isForAOF) {
+        components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING, "Failed to start rewriting the AOF");
+    } else if(!isCreateChildOk && isReplicasReady) {
+        /* The replicas can't get any reply now, they will sync again after reconnecting */
+        for(size_t i = 0; i < _replicas_waiting_sync.size(); ++i) {
+            _replica_targets.push_back(_replicas_waiting_sync[i]);
+        }
+        _replicas_waiting_sync.clear();
+        FinishFullSyncOfReplicas(components, false);
+    } else if(!isCreateChildOk) {
+        FeedbackToClientOfRdbChild(components, "-ERR RDB data can't be saved into disk in the background\r\n");
+    }
+}
+
+void DmdbRDBManager::AddReplicaWaitingForSync(int fd, uint64_t clientId) {
+    if(_replicas_waiting_sync.empty()) {
+        _first_replica_waiting_ms = DmdbUtil::GetCurrentMs();
+    }
+    _replicas_waiting_sync.push_back(DmdbRDBReplicaTarget{fd, clientId, 0, false});
+}
+
+bool DmdbRDBManager::IsReplicaWaitingForSync(int fd) {
+    for(size_t i = 0; i < _replicas_waiting_sync.size(); ++i) {
+        if(_replicas_waiting_sync[i]._fd == fd) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void DmdbRDBManager::SetReplicasSyncDelayMs(uint64_t delayMs) {
+    _replicas_sync_delay_ms = delayMs;
+}
+
+/* Called in the parent after the child is created. The replication offset in +FULLRESYNC is the one in
+ * the RDB data, the commands executed from now on are kept in the output buffers of the replicas, and
+ * they are sent after the full sync(see DmdbMasterReplicationManager::SetReplicaReplayOkSize()) */
+void DmdbRDBManager::StartFullSyncOfReplicas(DmdbRDBRequiredComponents &components) {
+    int oldOption = fcntl(_replicas_pipe_fd, F_GETFL);
+    fcntl(_replicas_pipe_fd, F_SETFL, oldOption|O_NONBLOCK);
+    components._event_manager->AddEvent4Fd(_replicas_pipe_fd, EpollEvent::IN, EventProcessorType::RDB_PIPE);
+    _replicas_pipe_buf.resize(RDB_REPLICAS_PIPE_BUF_SIZE);
+    _replicas_pipe_buf_len = 0;
+    _is_replicas_pipe_paused = false;
+    std::string reply = "+FULLRESYNC " + components._repl_manager->GetReplicationId() + " " +
+                        std::to_string(components._repl_manager->GetReplOffset()) + "\r\n";
+    for(size_t i = 0; i < _replicas_waiting_sync.size(); ++i) {
+        DmdbRDBReplicaTarget &target = _replicas_waiting_sync[i];
+        DmdbClientContact* replica = components._client_manager->GetClientContactByFd(target._fd);
+        if(replica == nullptr || replica->GetClientId() != target._client_id) {
+            continue;
+        }
+        /* The output buffer of the replica has been sent, so the socket can take such a short reply */
+        if(write(target._fd, reply.c_str(), reply.length()) != static_cast<ssize_t>(reply.length())) {
+            components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                        "Failed to send +FULLRESYNC to replica:%s",
+                                                        replica->GetClientName().c_str());
+            components._repl_manager->HandleFullSyncOver(target._fd, false, true);
+            continue;
+        }
+        components._repl_manager->AddReplicaByFd(target._fd);
+        /* The socket is written by us rather than the client manager until the RDB data is sent */
+        components._event_manager->DelFd(target._fd, false);
+        components._event_manager->AddEvent4Fd(target._fd, EpollEvent::OUT, EventProcessorType::REPLICA_SYNC);
+        target._sent_len = 0;
+        target._is_failed = false;
+        _replica_targets.push_back(target);
+    }
+    _replicas_waiting_sync.clear();
+}
+
+/* Returns false if the replica can't take the whole block now, then we wait until it's writable */
+bool DmdbRDBManager::SendPipeBufToReplica(DmdbRDBRequiredComponents &components, DmdbRDBReplicaTarget &target) {
+    DmdbClientContact* replica = components._client_manager->GetClientContactByFd(target._fd);
+    if(replica == nullptr || replica->GetClientId() != target._client_id) {
+        target._is_failed = true;
+        return true;
+    }
+    while(target._sent_len < _replicas_pipe_buf_len) {
+        ssize_t ret = write(target._fd, _replicas_pipe_buf.data()+target._sent_len, _replicas_pipe_buf_len-target._sent_len);
+        if(ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            components._event_manager->AddEvent4Fd(target._fd, EpollEvent::OUT, EventProcessorType::REPLICA_SYNC);
+            return false;
+        }
+        if(ret <= 0) {
+            components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                        "Failed to send RDB data to replica:%s, error info:%s",
+                                                        replica->GetClientName().c_str(), strerror(errno));
+            components._event_manager->DelEvent4Fd(target._fd, EpollEvent::OUT);
+            target._is_failed = true;
+            return true;
+        }
+        target._sent_len += ret;
+    }
+    components._event_manager->DelEvent4Fd(target._fd, EpollEvent::OUT);
+    return true;
+}
+
+bool DmdbRDBManager::IsPipeBufSentToAllReplicas(DmdbRDBRequiredComponents &components) {
+    bool isAllSent = true;
+    for(size_t i = 0; i < _replica_targets.size(); ++i) {
+        DmdbRDBReplicaTarget &target = _replica_targets[i];
+        if(target._is_failed || target._sent_len >= _replicas_pipe_buf_len) {
+            continue;
+        }
+        DmdbClientContact* replica = components._client_manager->GetClientContactByFd(target._fd);
+        if(replica == nullptr || replica->GetClientId() != target._client_id) {
+            target._is_failed = true;
+            continue;
+        }
+        isAllSent = false;
     }
+    return isAllSent;
+}
+
+/* The pipe is readable. A slow replica holds the others back rather than letting the data pile up in
+ * our memory, the child blocks when the pipe is full */
+void DmdbRDBManager::ReadFromReplicasPipe() {
+    DmdbRDBRequiredComponents components;
+    GetDmdbRDBRequiredComponents(components);
+    if(_replicas_pipe_fd < 0 || !IsPipeBufSentToAllReplicas(components)) {
+        return;
+    }
+    ssize_t ret = read(_replicas_pipe_fd, _replicas_pipe_buf.data(), _replicas_pipe_buf.size());
+    if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    if(ret <= 0) {
+        /* The child has exited or closed the pipe, CheckRdbChildFinished() will finish the full sync */
+        if(ret < 0) {
+            components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                        "Failed to read RDB data from the pipe, error info:%s",
+                                                        strerror(errno));
+        }
+        components._event_manager->DelFd(_replicas_pipe_fd, false);
+        close(_replicas_pipe_fd);
+        _replicas_pipe_fd = -1;
+        return;
+    }
+    _replicas_pipe_buf_len = ret;
+    size_t activeNum = 0;
+    bool isAllSent = true;
+    for(size_t i = 0; i < _replica_targets.size(); ++i) {
+        if(_replica_targets[i]._is_failed) {
+            continue;
+        }
+        _replica_targets[i]._sent_len = 0;
+        if(!SendPipeBufToReplica(components, _replica_targets[i])) {
+            isAllSent = false;
+        }
+        if(!_replica_targets[i]._is_failed) {
+            activeNum++;
+        }
+    }
+    if(activeNum == 0) {
+        components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                    "No replica is receiving the RDB data, kill the RDB child process:%d",
+                                                    _rdb_child_pid);
+        kill(_rdb_child_pid, SIGTERM);
+        components._event_manager->DelFd(_replicas_pipe_fd, false);
+        close(_replicas_pipe_fd);
+        _replicas_pipe_fd = -1;
+        return;
+    }
+    if(!isAllSent) {
+        components._event_manager->DelEvent4Fd(_replicas_pipe_fd, EpollEvent::IN);
+        _is_replicas_pipe_paused = true;
+    }
+}
+
+/* The socket of a replica which couldn't take the whole block is writable again */
+void DmdbRDBManager::WriteToSyncingReplica(int fd) {
+    DmdbRDBRequiredComponents components;
+    GetDmdbRDBRequiredComponents(components);
+    for(size_t i = 0; i < _replica_targets.size(); ++i) {
+        if(_replica_targets[i]._fd == fd && !_replica_targets[i]._is_failed) {
+            SendPipeBufToReplica(components, _replica_targets[i]);
+            break;
+        }
+    }
+    if(_replicas_pipe_fd >= 0 && _is_replicas_pipe_paused && IsPipeBufSentToAllReplicas(components)) {
+        components._event_manager->AddEvent4Fd(_replicas_pipe_fd, EpollEvent::IN, EventProcessorType::RDB_PIPE);
+        _is_replicas_pipe_paused = false;
+    }
+}
+
+/* The replicas which failed are disconnected, the others wait for the replication offset and
+ * the commands after the RDB data */
+void DmdbRDBManager::FinishFullSyncOfReplicas(DmdbRDBRequiredComponents &components, bool isSuccess) {
+    if(_replicas_pipe_fd >= 0) {
+        components._event_manager->DelFd(_replicas_pipe_fd, false);
+        close(_replicas_pipe_fd);
+        _replicas_pipe_fd = -1;
+    }
+    std::vector<DmdbRDBReplicaTarget> targets;
+    targets.swap(_replica_targets);
+    for(size_t i = 0; i < targets.size(); ++i) {
+        DmdbClientContact* replica = components._client_manager->GetClientContactByFd(targets[i]._fd);
+        if(replica == nullptr || replica->GetClientId() != targets[i]._client_id) {
+            continue;
+        }
+        bool isOk = isSuccess && !targets[i]._is_failed;
+        if(isOk) {
+            components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE,
+                                                        "RDB data have been replicated to replica:%s successfully",
+                                                        replica->GetClientName().c_str());
+        } else {
+            components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE,
+                                                        "Failed to full sync RDB data to replica:%s",
+                                                        replica->GetClientName().c_str());
+        }
+        components._repl_manager->HandleFullSyncOver(targets[i]._fd, isOk, !isOk);
+    }
+    std::vector<uint8_t>().swap(_replicas_pipe_buf);
+    _replicas_pipe_buf_len = 0;
 }
 
 void DmdbRDBManager::RdbCheckAndFinishJob() {
@@ -785,20 +1579,326 @@ void DmdbRDBManager::RdbCheckAndFinishJob() {
     BackgroundSaveIfNeed();
 }
 
+bool DmdbRDBManager::StartReceivingFromMaster() {
+    DmdbRDBRequiredComponents components;
+    GetDmdbRDBRequiredComponents(components);
+    AbortReceivingFromMaster();
+    _receive_state._tmp_file = std::to_string(getpid()) + "_" + std::to_string(DmdbUtil::GetCurrentMs()) + "_repl.rdb";
+    _receive_state._file_fd = open(_receive_state._tmp_file.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if(_receive_state._file_fd < 0) {
+        components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                    "Failed to open rdb file: %s! Error info: %s",
+                                                    _receive_state._tmp_file.c_str(), strerror(errno));
+        return false;
+    }
+    _receive_state._phase = ReceivePhase::LENGTH;
+    _receive_state._part_len = sizeof(_receive_state._total_bytes);
+    _receive_state._received_part_len = 0;
+    _receive_state._stream_crc_code = 0;
+    _receive_state._file_crc_code = 0;
+    _receive_state._total_bytes = 0;
+    _receive_state._received_bytes = 0;
+    _receive_state._start_ms = DmdbUtil::GetCurrentMs();
+    _last_load_progress_ms = _receive_state._start_ms;
+    return true;
+}
+
+void DmdbRDBManager::AbortReceivingFromMaster() {
+    if(_receive_state._file_fd < 0) {
+        return;
+    }
+    close(_receive_state._file_fd);
+    _receive_state._file_fd = -1;
+    unlink(_receive_state._tmp_file.c_str());
+}
+
+bool DmdbRDBManager::WriteReceivedData(const uint8_t* data, size_t len) {
+    while(len > 0) {
+        ssize_t ret = write(_receive_state._file_fd, data, len);
+        if(ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if(ret <= 0) {
+            return false;
+        }
+        data += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+/* Reads until the socket is drained, only the chunk data is read in big pieces */
+ReceiveRetCode DmdbRDBManager::ReceiveFromMaster(int fd) {
+    DmdbRDBRequiredComponents components;
+    GetDmdbRDBRequiredComponents(components);
+    DmdbRDBReceiveState &state = _receive_state;
+    uint8_t dataBuf[16*1024];
+    while(true) {
+        size_t needLen = state._part_len - state._received_part_len;
+        bool isChunkData = state._phase == ReceivePhase::CHUNK_DATA;
+        uint8_t* dst = isChunkData ? dataBuf : state._part_buf + state._received_part_len;
+        ssize_t ret = read(fd, dst, isChunkData ? std::min(needLen, sizeof(dataBuf)) : needLen);
+        if(ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            LogLoadProgress(components, state._received_bytes, state._total_bytes, 0, state._start_ms);
+            return ReceiveRetCode::AGAIN;
+        }
+        if(ret <= 0) {
+            components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                        "Failed to receive RDB data, error info:%s",
+                                                        ret == 0 ? "connection closed by master" : strerror(errno));
+            return ReceiveRetCode::ERR;
+        }
+        state._received_bytes += ret;
+        state._received_part_len += ret;
+        if(isChunkData && !WriteReceivedData(dataBuf, ret)) {
+            components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                        "Failed to write rdb file: %s! Error info: %s",
+                                                        state._tmp_file.c_str(), strerror(errno));
+            return ReceiveRetCode::ERR;
+        }
+        if(state._received_part_len < state._part_len) {
+            continue;
+        }
+        bool isLastPart = state._phase == ReceivePhase::CRC;
+        if(!HandleReceivedPart(components)) {
+            return ReceiveRetCode::ERR;
+        }
+        if(isLastPart) {
+            return ReceiveRetCode::DONE;
+        }
+    }
+}
+
+/* A part has been received completely, find out what the next one is */
+bool DmdbRDBManager::HandleReceivedPart(DmdbRDBRequiredComponents &components) {
+    DmdbRDBReceiveState &state = _receive_state;
+    size_t headerSize = DMDB_MARK.length() + sizeof(RDB_VERSION) + sizeof(components._server_version) +
+                        TIME_STAMP_LENGTH + PREAMBLE_LEN + sizeof(long long) + sizeof(uint32_t);
+    DmdbRDBChunk chunk;
+    uint64_t savedCrcCode = 0;
+    switch(state._phase) {
+        case ReceivePhase::LENGTH: {
+            /* If master failed to replicate, the data will start with "-ERR " */
+            if(memcmp(state._part_buf, "-ERR", 4) == 0) {
+                components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                            "Master failed to send RDB data");
+                return false;
+            }
+            memcpy(&state._total_bytes, state._part_buf, sizeof(state._total_bytes));
+            state._stream_crc_code = DmdbUtil::Crc64(state._stream_crc_code, state._part_buf, state._part_len);
+            state._phase = ReceivePhase::HEADER;
+            state._part_len = headerSize;
+            break;
+        }
+        case ReceivePhase::HEADER: {
+            /* Older RDB data has no chunk headers, so we can't find where it ends */
+            if(memcmp(state._part_buf, DMDB_MARK.c_str(), DMDB_MARK.length()) != 0 ||
+               state._part_buf[DMDB_MARK.length()] < RDB_VERSION_CHUNKED || state._part_buf[DMDB_MARK.length()] > _rdb_version) {
+                goto corrupted_error;
+            }
+            state._stream_crc_code = DmdbUtil::Crc64(state._stream_crc_code, state._part_buf, state._part_len);
+            state._file_crc_code = DmdbUtil::Crc64(state._file_crc_code, state._part_buf, state._part_len);
+            state._phase = ReceivePhase::CHUNK_TYPE;
+            state._part_len = sizeof(DMDB_EOF);
+            if(!WriteReceivedData(state._part_buf, headerSize)) {
+                goto write_err;
+            }
+            break;
+        }
+        case ReceivePhase::CHUNK_TYPE: {
+            if(state._part_buf[0] == DMDB_EOF) {
+                state._stream_crc_code = DmdbUtil::Crc64(state._stream_crc_code, state._part_buf, sizeof(DMDB_EOF));
+                state._file_crc_code = DmdbUtil::Crc64(state._file_crc_code, state._part_buf, sizeof(DMDB_EOF));
+                if(!WriteReceivedData(state._part_buf, sizeof(DMDB_EOF))) {
+                    goto write_err;
+                }
+                state._phase = ReceivePhase::CRC;
+                state._part_len = sizeof(savedCrcCode);
+                break;
+            }
+            size_t chunkHeaderSize = GetChunkHeaderSize(state._part_buf[0]);
+            if(chunkHeaderSize == 0) {
+                goto corrupted_error;
+            }
+            /* The type is the first byte of the chunk header, we go on receiving the rest */
+            state._phase = ReceivePhase::CHUNK_HEADER;
+            state._part_len = chunkHeaderSize;
+            return true;
+        }
+        case ReceivePhase::CHUNK_HEADER: {
+            ParseChunkHeader(state._part_buf, chunk);
+            if(chunk._data_len > BUF_SIZE || chunk._raw_len > BUF_SIZE) {
+                goto corrupted_error;
+            }
+            state._stream_crc_code = DmdbUtil::Crc64(state._stream_crc_code, state._part_buf, state._part_len);
+            state._file_crc_code = DmdbUtil::Crc64(state._file_crc_code, state._part_buf, state._part_len);
+            if(!WriteReceivedData(state._part_buf, state._part_len)) {
+                goto write_err;
+            }
+            state._phase = chunk._data_len > 0 ? ReceivePhase::CHUNK_DATA : ReceivePhase::CHUNK_TYPE;
+            state._part_len = chunk._data_len > 0 ? chunk._data_len : sizeof(DMDB_EOF);
+            break;
+        }
+        case ReceivePhase::CHUNK_DATA: {
+            state._phase = ReceivePhase::CHUNK_TYPE;
+            state._part_len = sizeof(DMDB_EOF);
+            break;
+        }
+        case ReceivePhase::CRC: {
+            memcpy(&savedCrcCode, state._part_buf, sizeof(savedCrcCode));
+            if(savedCrcCode != state._stream_crc_code) {
+                goto corrupted_error;
+            }
+            if(!WriteReceivedData(reinterpret_cast<uint8_t*>(&state._file_crc_code), sizeof(state._file_crc_code))) {
+                goto write_err;
+            }
+            close(state._file_fd);
+            state._file_fd = -1;
+            components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE,
+                                                        "RDB data has been received successfully, %llu bytes in %llu ms",
+                                                        static_cast<unsigned long long>(state._received_bytes),
+                                                        static_cast<unsigned long long>(DmdbUtil::GetCurrentMs() - state._start_ms));
+            break;
+        }
+    }
+    state._received_part_len = 0;
+    return true;
+
+corrupted_error:
+    components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                "RDB data has been corrupted");
+    return false;
+
+write_err:
+    components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                "Failed to write rdb file: %s! Error info: %s",
+                                                state._tmp_file.c_str(), strerror(errno));
+    return false;
+}
+
+/* Runs in the background thread, components._database_manager is the shadow database */
+void DmdbRDBManager::LoadReceivedDataMain(DmdbRDBRequiredComponents components) {
+    size_t headerSize = DMDB_MARK.length() + sizeof(RDB_VERSION) + sizeof(components._server_version) +
+                        TIME_STAMP_LENGTH + PREAMBLE_LEN + sizeof(long long) + sizeof(uint32_t);
+    uint8_t header[64];
+    uint32_t dbSize = 0;
+    uint64_t loadedSize = 0;
+    bool isOk = false;
+    std::ifstream rdbStream(_receive_state._tmp_file.c_str(), std::ios::in | std::ios::binary);
+    rdbStream.read(reinterpret_cast<char*>(header), headerSize);
+    /* The header has been checked when it was received */
+    if(rdbStream.gcount() == static_cast<std::streamsize>(headerSize)) {
+        rdbStream.close();
+        memcpy(&dbSize, header+headerSize-sizeof(dbSize), sizeof(dbSize));
+        isOk = LoadChunksFromFile(components, _receive_state._tmp_file, headerSize, dbSize,
+                                  DmdbUtil::Crc64(0, header, headerSize), loadedSize);
+    }
+    _is_background_load_ok = isOk;
+    _is_background_load_done.store(true, std::memory_order_release);
+}
+
+bool DmdbRDBManager::StartLoadingReceivedData() {
+    DmdbRDBRequiredComponents components;
+    GetDmdbRDBRequiredComponents(components);
+    JoinBackgroundThreads();
+    _shadow_database_manager = new DmdbDatabaseManager();
+    /* The shadow is swapped with the database, so it must have the same index */
+    if(components._database_manager->IsKeyIndexEnabled()) {
+        _shadow_database_manager->EnableKeyIndex();
+    }
+    /* The access info of the loaded keys is in the format of the eviction policy, LRU or LFU.
+     * maxmemory stays 0, the shadow never evicts while it's being loaded */
+    _shadow_database_manager->SetMaxMemory(0, components._database_manager->GetEvictionPolicy(),
+                                           components._database_manager->GetEvictionSamples());
+    components._database_manager = _shadow_database_manager;
+    _is_background_load_ok = false;
+    _is_background_load_done.store(false, std::memory_order_relaxed);
+    /* Signals should be handled by the main thread only */
+    sigset_t blockSet, oldSet;
+    sigfillset(&blockSet);
+    pthread_sigmask(SIG_BLOCK, &blockSet, &oldSet);
+    _background_load_thread = std::thread(&DmdbRDBManager::LoadReceivedDataMain, this, components);
+    pthread_sigmask(SIG_SETMASK, &oldSet, nullptr);
+    components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE,
+                                                "Loading RDB data from master in the background");
+    return true;
+}
+
+/* The swap is O(1), the old data is freed by the lazy free thread so we never stop serving */
+ReceiveRetCode DmdbRDBManager::CheckLoadingReceivedData() {
+    if(!_is_background_load_done.load(std::memory_order_acquire)) {
+        return ReceiveRetCode::AGAIN;
+    }
+    DmdbRDBRequiredComponents components;
+    GetDmdbRDBRequiredComponents(components);
+    _background_load_thread.join();
+    if(!_is_background_load_ok) {
+        unlink(_receive_state._tmp_file.c_str());
+        delete _shadow_database_manager;
+        _shadow_database_manager = nullptr;
+        return ReceiveRetCode::ERR;
+    }
+    /* The child has the old data, what it saves is useless now */
+    KillChildProcessIfAlive();
+    components._database_manager->Swap(*_shadow_database_manager);
+    components._lazy_free_manager->FreeDatabaseLazily(_shadow_database_manager);
+    _shadow_database_manager = nullptr;
+    if(rename(_receive_state._tmp_file.c_str(), _rdb_file.c_str()) < 0) {
+        components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                    "Failed to rename %s to %s, error info:%s",
+                                                    _receive_state._tmp_file.c_str(), _rdb_file.c_str(), strerror(errno));
+        unlink(_receive_state._tmp_file.c_str());
+    }
+    components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE,
+                                                "RDB data from master has been loaded, %zu keys",
+                                                components._database_manager->GetDatabaseSize());
+    /* The AOF must be rewritten from the new data */
+    if(components._aof_manager->IsAOFEnabled()) {
+        SetAOFRewritePlan();
+    }
+    return ReceiveRetCode::DONE;
+}
+
+void DmdbRDBManager::JoinBackgroundThreads() {
+    if(_background_load_thread.joinable()) {
+        _background_load_thread.join();
+    }
+    delete _shadow_database_manager;
+    _shadow_database_manager = nullptr;
+}
+
 DmdbRDBManager::DmdbRDBManager(const std::string &file) {
     _is_rdb_loading = false;
+    _load_threads_num = std::min(std::max(static_cast<int>(std::thread::hardware_concurrency()), 1), RDB_LOAD_THREADS_MAX);
+    _last_load_progress_ms = 0;
+    _is_compression_enabled = false;
     _rdb_file = file;
     _rdb_version = RDB_VERSION;
     _rdb_child_pid = -1;
     _my_parent_pid = -1;
     _rdb_child_start_ms = 0;
     _is_plan_to_bgsave_rdb = false;
+    _is_plan_to_rewrite_aof = false;
+    _is_rdb_child_for_aof = false;
+    _is_rdb_child_for_replicas = false;
     _rdb_child_for_client_fd = -1;
-    _rdb_child_for_replica_fd = -1;
+    _first_replica_waiting_ms = 0;
+    _replicas_sync_delay_ms = 0;
+    _replicas_pipe_fd = -1;
+    _replicas_pipe_buf_len = 0;
+    _is_replicas_pipe_paused = false;
+    _receive_state._file_fd = -1;
+    _shadow_database_manager = nullptr;
+    _is_background_load_done = false;
+    _is_background_load_ok = false;
 }
 
 DmdbRDBManager::~DmdbRDBManager() {
     KillChildProcessIfAlive();
+    JoinBackgroundThreads();
 }
 
 }
\ No newline at end of file
@@ -1,6 +1,14 @@
 #pragma once
 
+#include <stdint.h>
+#include <stddef.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
 namespace Dmdb {
 
@@ -8,6 +16,10 @@ class DmdbServerLogger;
 class DmdbDatabaseManager;
 class DmdbClientManager;
 class DmdbReplicationManager;
+class DmdbAOFManager;
+class DmdbEventManager;
+class DmdbLazyFreeManager;
+struct DmdbLoadedPair;
 
 
 struct DmdbRDBRequiredComponents {
@@ -15,7 +27,9 @@ struct DmdbRDBRequiredComponents {
     DmdbDatabaseManager* _database_manager;
     DmdbClientManager* _client_manager;
     DmdbReplicationManager* _repl_manager;
-    bool* _is_preamble;
+    DmdbAOFManager* _aof_manager;
+    DmdbEventManager* _event_manager;
+    DmdbLazyFreeManager* _lazy_free_manager;
     uint8_t _server_version;
 };
 
@@ -37,6 +51,91 @@ enum class FieldOfSavedPair {
     VAL
 };
 
+/* The pairs are saved in chunks since RDB version 2, a chunk is:
+ * Type: 1 byte, raw or LZ compressed, it's never DMDB_EOF
+ * Pairs amount: 4 bytes
+ * Data length: 4 bytes
+ * Checksum of the data: 8 bytes
+ * Raw data length: 4 bytes, only the compressed chunks have it
+ * Data: the pairs in the same format as version 1, or the compressed pairs(see DmdbLZCompressor) */
+struct DmdbRDBChunk {
+    size_t _data_offset;
+    uint8_t _type;
+    uint32_t _pairs_num;
+    uint32_t _data_len;
+    uint64_t _data_crc;
+    uint32_t _raw_len;
+};
+
+enum class RDBChunkState : uint8_t {
+    PENDING,
+    DECODED,
+    FAILED
+};
+
+/* Shared by the threads decoding the chunks of an RDB file, the chunks are merged into the
+ * database in order by the thread of the database */
+struct DmdbRDBParallelLoad {
+    const uint8_t* _data;
+    const std::vector<DmdbRDBChunk>* _chunks;
+    std::vector<std::vector<DmdbLoadedPair>> _decoded_pairs;
+    /* The members below are protected by _mutex */
+    std::vector<RDBChunkState> _chunk_states;
+    size_t _next_chunk;
+    size_t _merged_chunks;
+    /* A thread stops decoding when it's so many chunks ahead of the merging, so we don't
+     * keep too many decoded pairs outside the database */
+    size_t _max_chunks_ahead;
+    bool _is_failed;
+    std::mutex _mutex;
+    std::condition_variable _decoded_cond;
+    std::condition_variable _merged_cond;
+};
+
+/* A replica receiving the RDB data from the pipe of the rdb child, the client is checked by its id
+ * too, the fd may belong to another client if the replica is disconnected */
+struct DmdbRDBReplicaTarget {
+    int _fd;
+    uint64_t _client_id;
+    /* Bytes of the current pipe block sent to it */
+    size_t _sent_len;
+    bool _is_failed;
+};
+
+enum class ReceiveRetCode {
+    AGAIN, /* Wait for more data */
+    DONE,
+    ERR
+};
+
+/* Which part of the RDB data is being received from the master */
+enum class ReceivePhase {
+    LENGTH,
+    HEADER,
+    CHUNK_TYPE,
+    CHUNK_HEADER,
+    CHUNK_DATA,
+    CRC
+};
+
+/* The RDB data of a full sync is received into a temporary file without blocking. We find where it ends
+ * by the chunk headers and never read more than the current part, so the commands after it stay in the
+ * socket. The checksum sent by the master covers the length before the header, the file doesn't have it,
+ * so another checksum is computed for the file */
+struct DmdbRDBReceiveState {
+    ReceivePhase _phase;
+    int _file_fd;
+    std::string _tmp_file;
+    uint8_t _part_buf[64];
+    size_t _part_len;
+    size_t _received_part_len;
+    uint64_t _stream_crc_code;
+    uint64_t _file_crc_code;
+    uint64_t _total_bytes;
+    uint64_t _received_bytes;
+    uint64_t _start_ms;
+};
+
 enum class SaveRetCode {
     SAVE_OK,
     OPEN_ERR,
@@ -53,38 +152,105 @@ public:
     bool RemoveRdbChildTmpFile();
     bool KillChildProcessIfAlive();
     bool SaveDatabaseToDisk();
-    bool LoadDatabase(int fd);
+    /* file is the RDB file or an AOF starting with an RDB preamble, loadedBytes is the size of the RDB data */
+    bool LoadDatabase(int fd, const std::string &file = "", uint64_t* loadedBytes = nullptr);
     bool BackgroundSave();
-    SaveRetCode SaveData(int fd, bool isBgSave);
+    /* The data is saved into preambleFile rather than the RDB file if it isn't empty, it's the AOF rewrite */
+    SaveRetCode SaveData(int fd, bool isBgSave, const std::string &preambleFile = "");
     std::string GetRDBFile();
     void CheckRdbChildFinished();
     void HandleAfterChildExit(bool isKilledBySignal); 
     void WriteDataToPipeIfNeed(const std::string& data, bool isBgSave);
     bool ReceiveRetCodeFromPipe(SaveRetCode &retCode, bool isBgSave);
     void BackgroundSaveIfNeed();
-    void SetBackgroundSavePlan(int clientFd, int replicaFd);
+    void SetBackgroundSavePlan(int clientFd);
     void ClearBackgroundSavePlan(); 
+    /* The AOF rewrite is done by the rdb child too, it starts when no rdb child is running */
+    void SetAOFRewritePlan();
+    bool IsAOFRewritePlanned();
+    bool IsAOFRewriteChildAlive();
     void FeedbackToClientOfRdbChild(DmdbRDBRequiredComponents &components, const std::string& feedback);
+    /* All the replicas waiting when the next rdb child starts are served by it, see ReadFromReplicasPipe() */
+    void AddReplicaWaitingForSync(int fd, uint64_t clientId);
+    bool IsReplicaWaitingForSync(int fd);
+    /* The first waiting replica waits so long for the others before the child starts */
+    void SetReplicasSyncDelayMs(uint64_t delayMs);
+    void ReadFromReplicasPipe();
+    void WriteToSyncingReplica(int fd);
+    /* Used by the replica, the old data can still be read while the new data is received and loaded */
+    bool StartReceivingFromMaster();
+    ReceiveRetCode ReceiveFromMaster(int fd);
+    void AbortReceivingFromMaster();
+    /* The received data is loaded into a shadow database by a background thread, the database
+     * is swapped with it when CheckLoadingReceivedData() finds it's done */
+    bool StartLoadingReceivedData();
+    ReceiveRetCode CheckLoadingReceivedData();
+    /* Chunks of an RDB file are decoded by so many threads when loading */
+    void SetLoadThreadsNum(int threadsNum);
+    /* Chunks are compressed when saving if it's enabled, both kinds of chunks can always be loaded */
+    void SetCompressionEnabled(bool isEnabled);
     void RdbCheckAndFinishJob();
     static DmdbRDBManager* GetUniqueRDBManagerInstance(const std::string &file);
     ~DmdbRDBManager();
 private:
-    size_t GenerateRDBHeader(uint8_t* buf, size_t bufLen, DmdbRDBRequiredComponents &components, bool isForReplica);
+    size_t GenerateRDBHeader(uint8_t* buf, size_t bufLen, DmdbRDBRequiredComponents &components, bool isForReplica,
+                             bool isPreamble);
     LoadRetCode GetOnePair(char* buf, size_t bufLen, DmdbRDBRequiredComponents &components, size_t &pos, 
                            FieldOfSavedPair &field, bool isLast);
     bool IsErrorOccurs(const char* replBuf);
+    static size_t GetChunkHeaderSize(uint8_t chunkType);
+    static size_t GenerateChunkHeader(uint8_t* buf, uint8_t chunkType, size_t pairsNum, size_t dataLen, size_t rawLen);
+    static void ParseChunkHeader(const uint8_t* buf, DmdbRDBChunk &chunk);
+    static bool DecodeChunk(const uint8_t* data, const DmdbRDBChunk &chunk, std::vector<DmdbLoadedPair> &pairs);
+    static void DecodeChunksMain(DmdbRDBParallelLoad* load);
+    static bool ReadExactly(int fd, uint8_t* buf, size_t len);
+    bool LoadChunksFromFile(DmdbRDBRequiredComponents &components, const std::string &file, size_t headerSize,
+                            uint32_t dbSize, uint64_t crcCode, uint64_t &loadedSize);
+    bool LoadChunksFromSocket(DmdbRDBRequiredComponents &components, int fd, uint64_t totalBytes,
+                              uint32_t dbSize, uint64_t crcCode);
+    void LogLoadProgress(DmdbRDBRequiredComponents &components, uint64_t loadedBytes, uint64_t totalBytes,
+                         uint64_t loadedKeys, uint64_t startMs);
+    void StartFullSyncOfReplicas(DmdbRDBRequiredComponents &components);
+    bool SendPipeBufToReplica(DmdbRDBRequiredComponents &components, DmdbRDBReplicaTarget &target);
+    bool IsPipeBufSentToAllReplicas(DmdbRDBRequiredComponents &components);
+    void FinishFullSyncOfReplicas(DmdbRDBRequiredComponents &components, bool isSuccess);
+    bool HandleReceivedPart(DmdbRDBRequiredComponents &components);
+    bool WriteReceivedData(const uint8_t* data, size_t len);
+    void LoadReceivedDataMain(DmdbRDBRequiredComponents components);
+    void JoinBackgroundThreads();
     DmdbRDBManager(const std::string &file);
     bool _is_rdb_loading;
+    int _load_threads_num;
+    uint64_t _last_load_progress_ms;
+    bool _is_compression_enabled;
     bool _is_plan_to_bgsave_rdb;
+    bool _is_plan_to_rewrite_aof;
+    bool _is_rdb_child_for_aof; /* The running rdb child or the next one rewrites the AOF */
+    bool _is_rdb_child_for_replicas; /* The running rdb child or the next one sends the RDB data to replicas */
     std::string _rdb_file;
     uint8_t _rdb_version;
     uint64_t _rdb_child_start_ms;
     pid_t _rdb_child_pid;
     pid_t _my_parent_pid;
-    int _rdb_child_for_replica_fd; /* >0 means rdb child created for replica, otherwise for bgsave */
+    std::vector<DmdbRDBReplicaTarget> _replicas_waiting_sync;
+    uint64_t _first_replica_waiting_ms;
+    uint64_t _replicas_sync_delay_ms;
+    /* The rdb child writes the RDB data into a pipe, we read one block at a time and send it to all the
+     * replicas, the next block isn't read until all of them take the current one */
+    std::vector<DmdbRDBReplicaTarget> _replica_targets;
+    int _replicas_pipe_fd;
+    std::vector<uint8_t> _replicas_pipe_buf;
+    size_t _replicas_pipe_buf_len;
+    /* We stop reading the pipe until every replica takes the current block */
+    bool _is_replicas_pipe_paused;
+    DmdbRDBReceiveState _receive_state;
+    DmdbDatabaseManager* _shadow_database_manager;
+    std::thread _background_load_thread;
+    std::atomic<bool> _is_background_load_done;
+    bool _is_background_load_ok;
     int _rdb_child_for_client_fd; /* Client fd that rdb child process is created for */
     int _pipe_with_child[2];
-    static DmdbRDBManager* _instance;
+    static thread_local DmdbRDBManager* _instance;
 };
 
 
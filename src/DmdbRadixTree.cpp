@@ -0,0 +1,234 @@
+#include <algorithm>
+
+#include "DmdbRadixTree.hpp"
+
+
+namespace Dmdb {
+
+DmdbRadixTree::DmdbRadixTree() : _root(new DmdbRadixNode()), _size(0) {
+    _root->_is_key = false;
+}
+
+DmdbRadixTree::~DmdbRadixTree() {
+    Clear();
+    delete _root;
+}
+
+std::vector<DmdbRadixTree::DmdbRadixNode*>::iterator DmdbRadixTree::FindChild(DmdbRadixNode* node, unsigned char c) {
+    return std::lower_bound(node->_children.begin(), node->_children.end(), c,
+                            [](DmdbRadixNode* child, unsigned char c) {
+                                return static_cast<unsigned char>(child->_label[0]) < c;
+                            });
+}
+
+bool DmdbRadixTree::Insert(const std::string &key) {
+    DmdbRadixNode* node = _root;
+    size_t pos = 0;
+    while(true) {
+        if(pos == key.length()) {
+            if(node->_is_key) {
+                return false;
+            }
+            node->_is_key = true;
+            _size++;
+            return true;
+        }
+        std::vector<DmdbRadixNode*>::iterator it = FindChild(node, key[pos]);
+        if(it == node->_children.end() || (*it)->_label[0] != key[pos]) {
+            DmdbRadixNode* leaf = new DmdbRadixNode();
+            leaf->_label = key.substr(pos);
+            leaf->_is_key = true;
+            node->_children.insert(it, leaf);
+            _size++;
+            return true;
+        }
+        DmdbRadixNode* child = *it;
+        const std::string &label = child->_label;
+        size_t common = 0;
+        while(common < label.length() && pos+common < key.length() && label[common] == key[pos+common]) {
+            common++;
+        }
+        if(common < label.length()) {
+            /* The key leaves the label in the middle, the common part becomes a new node */
+            DmdbRadixNode* middle = new DmdbRadixNode();
+            middle->_label = label.substr(0, common);
+            middle->_is_key = false;
+            child->_label.erase(0, common);
+            middle->_children.push_back(child);
+            *it = middle;
+            child = middle;
+        }
+        node = child;
+        pos += common;
+    }
+}
+
+bool DmdbRadixTree::Remove(const std::string &key) {
+    DmdbRadixNode* parent = nullptr;
+    std::vector<DmdbRadixNode*>::iterator parentIt;
+    DmdbRadixNode* node = _root;
+    size_t pos = 0;
+    while(pos < key.length()) {
+        std::vector<DmdbRadixNode*>::iterator it = FindChild(node, key[pos]);
+        if(it == node->_children.end() || key.compare(pos, (*it)->_label.length(), (*it)->_label) != 0) {
+            return false;
+        }
+        parent = node;
+        parentIt = it;
+        node = *it;
+        pos += node->_label.length();
+    }
+    if(!node->_is_key) {
+        return false;
+    }
+    node->_is_key = false;
+    _size--;
+    if(node == _root) {
+        return true;
+    }
+    /* Keep the tree compressed: no empty leaf, and no node with one child unless it's a key */
+    if(node->_children.empty()) {
+        parent->_children.erase(parentIt);
+        delete node;
+        node = parent;
+    }
+    if(node != _root && !node->_is_key && node->_children.size() == 1) {
+        DmdbRadixNode* child = node->_children[0];
+        node->_label += child->_label;
+        node->_is_key = child->_is_key;
+        node->_children.swap(child->_children);
+        delete child;
+    }
+    return true;
+}
+
+size_t DmdbRadixTree::Size() {
+    return _size;
+}
+
+/* The nodes are freed with a stack, a deep tree can't overflow the call stack */
+void DmdbRadixTree::Clear() {
+    std::vector<DmdbRadixNode*> nodes(_root->_children.begin(), _root->_children.end());
+    while(!nodes.empty()) {
+        DmdbRadixNode* node = nodes.back();
+        nodes.pop_back();
+        nodes.insert(nodes.end(), node->_children.begin(), node->_children.end());
+        delete node;
+    }
+    _root->_children.clear();
+    _root->_is_key = false;
+    _size = 0;
+}
+
+void DmdbRadixTree::CollectKeys(DmdbRadixNode* node, std::string &path, std::vector<std::string> &keys) {
+    if(node->_is_key) {
+        keys.push_back(path);
+    }
+    for(size_t i = 0; i < node->_children.size(); ++i) {
+        size_t pathLen = path.length();
+        path += node->_children[i]->_label;
+        CollectKeys(node->_children[i], path, keys);
+        path.resize(pathLen);
+    }
+}
+
+void DmdbRadixTree::GetKeysByPrefix(const std::string &prefix, std::vector<std::string> &keys) {
+    DmdbRadixNode* node = _root;
+    std::string path;
+    size_t pos = 0;
+    while(pos < prefix.length()) {
+        std::vector<DmdbRadixNode*>::iterator it = FindChild(node, prefix[pos]);
+        if(it == node->_children.end()) {
+            return;
+        }
+        const std::string &label = (*it)->_label;
+        /* The prefix may end in the middle of the label */
+        size_t len = std::min(label.length(), prefix.length() - pos);
+        if(prefix.compare(pos, len, label, 0, len) != 0) {
+            return;
+        }
+        path += label;
+        node = *it;
+        pos += label.length();
+    }
+    CollectKeys(node, path, keys);
+}
+
+/* path is the key of node, all the keys below node start with it. Returns false when the keys
+ * after it are out of the range or limit is reached, so the traversal stops */
+bool DmdbRadixTree::CollectKeysInRange(DmdbRadixNode* node, std::string &path, const DmdbLexBound &min, const DmdbLexBound &max,
+                                       bool isAboveMin, size_t limit, std::vector<std::string> &keys) {
+    bool isKeyAboveMin = isAboveMin;
+    if(!isAboveMin) {
+        int ret = path.compare(0, std::string::npos, min._key, 0, path.length());
+        if(ret < 0) {
+            /* All the keys below are less than min */
+            return true;
+        }
+        if(ret > 0) {
+            isAboveMin = true;
+            isKeyAboveMin = true;
+        } else if(path.length() == min._key.length()) {
+            isKeyAboveMin = min._is_inclusive;
+            isAboveMin = true;
+        }
+    }
+    bool isKeyBelowMax = true;
+    bool isLast = false;
+    if(!max._is_infinite) {
+        int ret = path.compare(max._key);
+        if(ret > 0) {
+            return false;
+        }
+        if(ret == 0) {
+            isKeyBelowMax = max._is_inclusive;
+            isLast = true;
+        }
+    }
+    if(node->_is_key && isKeyAboveMin && isKeyBelowMax) {
+        keys.push_back(path);
+        if(keys.size() >= limit) {
+            return false;
+        }
+    }
+    if(isLast) {
+        return false;
+    }
+    for(size_t i = 0; i < node->_children.size(); ++i) {
+        size_t pathLen = path.length();
+        path += node->_children[i]->_label;
+        bool isContinued = CollectKeysInRange(node->_children[i], path, min, max, isAboveMin, limit, keys);
+        path.resize(pathLen);
+        if(!isContinued) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void DmdbRadixTree::GetKeysInRange(const DmdbLexBound &min, const DmdbLexBound &max, size_t limit, std::vector<std::string> &keys) {
+    if(limit == 0) {
+        return;
+    }
+    std::string path;
+    CollectKeysInRange(_root, path, min, max, min._is_infinite, limit, keys);
+}
+
+/* "[key" and "(key" are inclusive and exclusive, "-" and "+" are the infinite ends */
+bool DmdbRadixTree::ParseLexBound(const std::string &str, DmdbLexBound &bound) {
+    if(str == "-" || str == "+") {
+        bound._is_infinite = true;
+        bound._is_inclusive = true;
+        bound._key.clear();
+        return true;
+    }
+    if(str.empty() || (str[0] != '[' && str[0] != '(')) {
+        return false;
+    }
+    bound._is_infinite = false;
+    bound._is_inclusive = str[0] == '[';
+    bound._key = str.substr(1);
+    return true;
+}
+
+}
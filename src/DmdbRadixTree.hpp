@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+
+namespace Dmdb {
+
+/* One end of a lexicographic range, "-" and "+" are the infinite ends like ZRANGEBYLEX */
+struct DmdbLexBound {
+    std::string _key;
+    bool _is_inclusive;
+    bool _is_infinite;
+};
+
+/* A compressed radix tree of key names: a chain of nodes with one child is merged into one node,
+ * so the keys sharing a prefix store it only once. The keys are kept in lexicographic (byte) order,
+ * a prefix or range query costs the length of the prefix plus the keys returned */
+class DmdbRadixTree {
+public:
+    DmdbRadixTree();
+    ~DmdbRadixTree();
+    /* Returns false if the key exists */
+    bool Insert(const std::string &key);
+    /* Returns false if the key doesn't exist */
+    bool Remove(const std::string &key);
+    size_t Size();
+    void Clear();
+    void GetKeysByPrefix(const std::string &prefix, std::vector<std::string> &keys);
+    /* At most limit keys are returned */
+    void GetKeysInRange(const DmdbLexBound &min, const DmdbLexBound &max, size_t limit, std::vector<std::string> &keys);
+    static bool ParseLexBound(const std::string &str, DmdbLexBound &bound);
+private:
+    struct DmdbRadixNode {
+        /* The bytes from the parent to this node */
+        std::string _label;
+        bool _is_key;
+        /* Sorted by the first byte of their labels */
+        std::vector<DmdbRadixNode*> _children;
+    };
+    DmdbRadixTree(const DmdbRadixTree&);
+    DmdbRadixTree& operator=(const DmdbRadixTree&);
+    static std::vector<DmdbRadixNode*>::iterator FindChild(DmdbRadixNode* node, unsigned char c);
+    static void CollectKeys(DmdbRadixNode* node, std::string &path, std::vector<std::string> &keys);
+    static bool CollectKeysInRange(DmdbRadixNode* node, std::string &path, const DmdbLexBound &min, const DmdbLexBound &max,
+                                   bool isAboveMin, size_t limit, std::vector<std::string> &keys);
+    DmdbRadixNode* _root;
+    size_t _size;
+};
+
+}
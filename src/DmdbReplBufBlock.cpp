@@ -0,0 +1,59 @@
+#include <string.h>
+
+#include <algorithm>
+
+#include "DmdbReplBufBlock.hpp"
+
+
+namespace Dmdb {
+
+DmdbReplBufBlock::DmdbReplBufBlock(size_t capacity, long long startOffset) : _ref_count(1),
+                                                                             _data(new char[capacity]),
+                                                                             _capacity(capacity),
+                                                                             _used(0),
+                                                                             _start_offset(startOffset) {
+
+}
+
+DmdbReplBufBlock::~DmdbReplBufBlock() {
+    delete[] _data;
+}
+
+DmdbReplBufBlock* DmdbReplBufBlock::Create(size_t capacity, long long startOffset) {
+    return new DmdbReplBufBlock(capacity, startOffset);
+}
+
+void DmdbReplBufBlock::IncrRefCount() {
+    _ref_count.fetch_add(1, std::memory_order_relaxed);
+}
+
+void DmdbReplBufBlock::DecrRefCount() {
+    if(_ref_count.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete this;
+    }
+}
+
+size_t DmdbReplBufBlock::Append(const char* data, size_t len) {
+    size_t appendLen = std::min(len, _capacity - _used);
+    memcpy(_data + _used, data, appendLen);
+    _used += appendLen;
+    return appendLen;
+}
+
+const char* DmdbReplBufBlock::GetData() {
+    return _data;
+}
+
+size_t DmdbReplBufBlock::GetUsed() {
+    return _used;
+}
+
+size_t DmdbReplBufBlock::GetFreeSize() {
+    return _capacity - _used;
+}
+
+long long DmdbReplBufBlock::GetStartOffset() {
+    return _start_offset;
+}
+
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <atomic>
+
+
+namespace Dmdb {
+
+/* A block of the replication stream. The master appends the stream to its last block, and the output
+ * buffers of the replicas reference the blocks rather than copy the stream, so every replica only holds
+ * where it has been sent to. The master keeps the latest blocks as the backlog too. The bytes appended
+ * are never changed. The reference count is atomic because the replies may be written by I/O threads */
+class DmdbReplBufBlock {
+public:
+    static DmdbReplBufBlock* Create(size_t capacity, long long startOffset);
+    void IncrRefCount();
+    /* The block is freed when the last reference is released */
+    void DecrRefCount();
+    /* Returns how many bytes are appended, it's less than len if the block is full */
+    size_t Append(const char* data, size_t len);
+    const char* GetData();
+    size_t GetUsed();
+    size_t GetFreeSize();
+    /* The replication offset of the first byte of the block */
+    long long GetStartOffset();
+private:
+    DmdbReplBufBlock(size_t capacity, long long startOffset);
+    ~DmdbReplBufBlock();
+    DmdbReplBufBlock(const DmdbReplBufBlock&);
+    DmdbReplBufBlock& operator=(const DmdbReplBufBlock&);
+    std::atomic<uint32_t> _ref_count;
+    char* _data;
+    size_t _capacity;
+    size_t _used;
+    long long _start_offset;
+};
+
+}
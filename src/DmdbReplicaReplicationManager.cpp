@@ -3,7 +3,9 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
-#include <signal.h> 
+#include <string.h>
+
+#include <algorithm>
 
 
 #include "DmdbReplicaReplicationManager.hpp"
@@ -12,18 +14,22 @@
 #include "DmdbServerFriends.hpp"
 #include "DmdbRDBManager.hpp"
 #include "DmdbServerLogger.hpp"
-#include "DmdbTimerHandlerForBlockingIO.hpp"
+#include "DmdbEventManager.hpp"
+#include "DmdbEventManagerCommon.hpp"
+#include "DmdbEventProcessor.hpp"
 #include "DmdbClientManager.hpp"
 
 namespace Dmdb {
 
 const size_t TMP_RECV_BUF_LEN = 1024;
+const uint64_t MIN_RECONNECT_DELAY_MS = 500;
+const uint64_t MAX_RECONNECT_DELAY_MS = 30*1000;
 
 DmdbClientContact* DmdbReplicaReplicationManager::GetMasterClientContact() {
     return _current_master;
 }
 
-void DmdbReplicaReplicationManager::ReplicateDataToSlaves(const std::string &data) {
+void DmdbReplicaReplicationManager::ReplicateDataToSlaves(const char* data, size_t len) {
     
 }
 
@@ -49,7 +55,15 @@ long long DmdbReplicaReplicationManager::GetReplayOkSize() {
 
 bool DmdbReplicaReplicationManager::RemoveMasterOrReplica(DmdbClientContact* client) {
     if(client == _current_master) {
+        DmdbRepilcationManagerRequiredComponents components;
+        GetDmdbRepilcationManagerRequiredComponents(components);
         _current_master = nullptr;
+        _link_state = ReplicaLinkState::NONE;
+        _next_reconnect_ms = DmdbUtil::GetCurrentMs() + _reconnect_delay_ms;
+        components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                    "Lost the connection with master(ip:%s, port:%d), reconnect in %llu ms",
+                                                    _master_ip.c_str(), _master_port_for_client,
+                                                    static_cast<unsigned long long>(_reconnect_delay_ms));
         return true;
     }
     return false;
@@ -59,6 +73,11 @@ bool DmdbReplicaReplicationManager::FullSyncDataToReplica(DmdbClientContact* cli
     return false;
 }
 
+bool DmdbReplicaReplicationManager::PartialSyncToReplica(DmdbClientContact* client, const std::string &replId,
+                                                         long long offset) {
+    return false;
+}
+
 bool DmdbReplicaReplicationManager::HandleFullSyncOver(int fd, bool isSuccess, bool isDisconnected) {
     return false;
 }
@@ -67,133 +86,291 @@ void DmdbReplicaReplicationManager::AddReplicaByFd(int fd) {
 
 }
 
-std::string DmdbReplicaReplicationManager::SendCommandToMasterAndCheck(const std::string &command, const std::string &commandName,
-                                                                       int socket, const std::string &expectReply,
-                                                                       bool isCheck = false) {
+bool DmdbReplicaReplicationManager::SendCommandToMaster(const std::string &command) {
+    /* The commands of the handshake are small, the socket buffer of a new connection can hold them */
+    ssize_t ret = send(_master_link_fd, command.c_str(), command.length(), MSG_NOSIGNAL);
+    return ret == static_cast<ssize_t>(command.length());
+}
+
+/* Only the line is taken from the socket, what follows it is left for the next step */
+int DmdbReplicaReplicationManager::ReadLineFromMaster(std::string &line) {
+    char recvBuf[TMP_RECV_BUF_LEN];
+    ssize_t ret = recv(_master_link_fd, recvBuf, sizeof(recvBuf), MSG_PEEK);
+    if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0;
+    }
+    if(ret <= 0) {
+        return -1;
+    }
+    _last_master_io_ms = DmdbUtil::GetCurrentMs();
+    char* lineEnd = static_cast<char*>(memchr(recvBuf, '\n', ret));
+    if(lineEnd == nullptr) {
+        return ret == static_cast<ssize_t>(sizeof(recvBuf)) ? -1 : 0;
+    }
+    size_t lineLen = lineEnd - recvBuf;
+    if(recv(_master_link_fd, recvBuf, lineLen+1, 0) != static_cast<ssize_t>(lineLen+1)) {
+        return -1;
+    }
+    if(lineLen > 0 && recvBuf[lineLen-1] == '\r') {
+        lineLen--;
+    }
+    line.assign(recvBuf, lineLen);
+    return 1;
+}
+
+bool DmdbReplicaReplicationManager::ConnectToMaster() {
     DmdbRepilcationManagerRequiredComponents components;
-    GetDmdbRepilcationManagerRequiredComponents(components);    
-    char recvBuf[TMP_RECV_BUF_LEN] = {0};
-    std::string actualReceiveStr = "";
-    int ret = send(socket, command.c_str(), command.length(), 0);
-    if(ret < 0) {
-        components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
-                                                    (std::string("Failed to send to master, error info:") + std::string(strerror(errno))).c_str());
-        exit(0);
-    }
-    if(!isCheck)
-        return actualReceiveStr;
-    /* Using this function we can ensure that we will only receive one row of data even though there is much more data in tcp buffer */
-    ret = DmdbUtil::RecvLineFromSocket(socket, recvBuf, sizeof(recvBuf));
-    if(ret < 0) {
-        components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING, 
-                                                    ("Failed to receive data from master, error info:" + std::string(strerror(errno))).c_str());
-        exit(0);
-    }
-    actualReceiveStr = recvBuf;
-    if(actualReceiveStr.find(expectReply) == std::string::npos) {
-        std::string errMsg = recvBuf;
-        errMsg.substr(5, errMsg.length()-5);
-        errMsg = "Failed to execute " + commandName + " in master, error info:" + errMsg;
-        components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING, errMsg.c_str());
-        exit(0);
-    }
-    return actualReceiveStr;
-}
-
-void DmdbReplicaReplicationManager::HandleSignal(int sig) {
+    GetDmdbRepilcationManagerRequiredComponents(components);
+    struct sockaddr_in serveraddr;
+    serveraddr.sin_family = AF_INET;
+    serveraddr.sin_port = htons(_master_port_for_client);
+    serveraddr.sin_addr.s_addr = inet_addr(_master_ip.c_str());
+    _sync_start_ms = DmdbUtil::GetCurrentMs();
+    _last_master_io_ms = _sync_start_ms;
+    _link_state = ReplicaLinkState::CONNECTING;
+    _master_link_fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK, 0);
+    if(_master_link_fd < 0) {
+        HandleMasterLinkError(strerror(errno));
+        return false;
+    }
+    int ret = connect(_master_link_fd, (struct sockaddr *)&serveraddr, sizeof(struct sockaddr));
+    if(ret < 0 && errno != EINPROGRESS) {
+        HandleMasterLinkError(strerror(errno));
+        return false;
+    }
+    /* The socket becomes writable when the connection is established or failed */
+    if(!components._event_manager->AddEvent4Fd(_master_link_fd, EpollEvent::OUT, EventProcessorType::MASTER_LINK)) {
+        HandleMasterLinkError("too many connections");
+        return false;
+    }
+    components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE,
+                                                "Connecting to master(ip:%s, port:%d)",
+                                                _master_ip.c_str(), _master_port_for_client);
+    return true;
+}
+
+void DmdbReplicaReplicationManager::HandleMasterLinkWritable() {
     DmdbRepilcationManagerRequiredComponents components;
     GetDmdbRepilcationManagerRequiredComponents(components);
-    switch(sig) {
-        case SIGALRM: {
-            components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
-                                                        "It seems that the master doesn't response, we decide to exit");
-            exit(0);
-        }
+    if(_link_state != ReplicaLinkState::CONNECTING) {
+        return;
+    }
+    int err = 0;
+    socklen_t errLen = sizeof(err);
+    if(getsockopt(_master_link_fd, SOL_SOCKET, SO_ERROR, &err, &errLen) < 0 || err != 0) {
+        HandleMasterLinkError(strerror(err != 0 ? err : errno));
+        return;
     }
+    components._event_manager->DelEvent4Fd(_master_link_fd, EpollEvent::OUT);
+    components._event_manager->AddEvent4Fd(_master_link_fd, EpollEvent::IN, EventProcessorType::MASTER_LINK);
+    _last_master_io_ms = DmdbUtil::GetCurrentMs();
+    std::string command = std::string("*2\r\n") + std::string("$4\r\n") + std::string("auth\r\n") + "$"+std::to_string(_master_password.length())+std::string("\r\n")+_master_password+"\r\n";
+    if(!SendCommandToMaster(command)) {
+        HandleMasterLinkError(strerror(errno));
+        return;
+    }
+    _link_state = ReplicaLinkState::AUTH;
 }
 
-void DmdbReplicaReplicationManager::SetupTimer() {
-    DmdbTimerHandlerForBlockingIO::SetInstance(this);  
-    struct sigaction sa_alarm;
-    sigemptyset(&sa_alarm.sa_mask);
-    sa_alarm.sa_flags = SA_RESETHAND;
-    void (*fun)(int) = DmdbTimerHandlerForBlockingIO::HandleSignal;
-    sa_alarm.sa_handler = fun;
-    sigaction(SIGALRM, &sa_alarm, nullptr);
-    alarm(_full_sync_max_ms/1000);
+void DmdbReplicaReplicationManager::HandleMasterLinkReadable() {
+    switch(_link_state) {
+        case ReplicaLinkState::AUTH: {
+            HandleReplyOfAuth();
+            break;
+        }
+        case ReplicaLinkState::SYNC_SENT: {
+            HandleReplyOfPSync();
+            break;
+        }
+        case ReplicaLinkState::TRANSFER: {
+            HandleRDBDataFromMaster();
+            break;
+        }
+        default: {
+            break;
+        }
+    }
 }
 
-void DmdbReplicaReplicationManager::ClearTimer() {
-    alarm(0);
-    DmdbTimerHandlerForBlockingIO::SetInstance(nullptr);
-    sigset_t clearSet;
-    sigaddset(&clearSet, SIGALRM);
-    sigemptyset(&clearSet);
+bool DmdbReplicaReplicationManager::HandleReplyOfAuth() {
+    std::string line;
+    int ret = ReadLineFromMaster(line);
+    if(ret <= 0) {
+        if(ret < 0) {
+            HandleMasterLinkError("failed to receive the reply of auth");
+        }
+        return false;
+    }
+    if(line.find("OK") == std::string::npos) {
+        HandleMasterLinkError(("failed to execute auth in master, error info:" + line).c_str());
+        return false;
+    }
+    /* We only have the data of the master we replicated from, others must send all the data */
+    std::string replId = _master_replication_id.empty() ? "?" : _master_replication_id;
+    std::string offsetStr = _master_replication_id.empty() ? "-1" : std::to_string(_repl_ok_size);
+    std::string command = std::string("*3\r\n") + "$5\r\npsync\r\n" + "$" + std::to_string(replId.length()) + "\r\n" + replId + "\r\n" +
+                          "$" + std::to_string(offsetStr.length()) + "\r\n" + offsetStr + "\r\n";
+    if(!SendCommandToMaster(command)) {
+        HandleMasterLinkError(strerror(errno));
+        return false;
+    }
+    _link_state = ReplicaLinkState::SYNC_SENT;
+    return true;
 }
 
-bool DmdbReplicaReplicationManager::FullSyncFromMater() {
+/* The reply is "+FULLRESYNC <replid> <offset>" or "+CONTINUE <replid>" */
+bool DmdbReplicaReplicationManager::HandleReplyOfPSync() {
     DmdbRepilcationManagerRequiredComponents components;
     GetDmdbRepilcationManagerRequiredComponents(components);
-    
-   	struct sockaddr_in serveraddr;
-	serveraddr.sin_family = AF_INET;
-	serveraddr.sin_port = htons(_master_port_for_client);
-	serveraddr.sin_addr.s_addr = inet_addr(_master_ip.c_str());
-    int socketWithMaster = socket(AF_INET, SOCK_STREAM, 0);
-	if (socketWithMaster < 0) {
-        components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING, 
-                                                    ("Failed to create socket to connect master, error info:" + std::string(strerror(errno))).c_str());
-        exit(0);
+    std::string line;
+    int ret = ReadLineFromMaster(line);
+    if(ret <= 0) {
+        if(ret < 0) {
+            HandleMasterLinkError("failed to receive the reply of psync");
+        }
         return false;
-	}
-    int ret = connect(socketWithMaster, (struct sockaddr *)&serveraddr, sizeof(struct sockaddr));
-    if(ret < 0) {
-        components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING, 
-                                                    ("Failed to connect master, error info:" + std::string(strerror(errno))).c_str());
-        exit(0);
+    }
+    /* The missing commands follow +CONTINUE, they are processed as the master client's input */
+    if(line.compare(0, 9, "+CONTINUE") == 0) {
+        components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE,
+                                                    "Partial resynchronization with master(ip:%s, port:%d) is accepted",
+                                                    _master_ip.c_str(), _master_port_for_client);
+        HandOverMasterLink();
+        return true;
+    }
+    size_t idPos = line.find(' ');
+    size_t offsetPos = idPos == std::string::npos ? std::string::npos : line.find(' ', idPos+1);
+    if(line.compare(0, 11, "+FULLRESYNC") != 0 || offsetPos == std::string::npos) {
+        HandleMasterLinkError(("invalid reply of psync: " + line).c_str());
         return false;
     }
+    const char* strOffset = line.c_str() + offsetPos + 1;
+    char* endPtr = nullptr;
+    errno = 0;
+    long long fullSyncOffset = strtoll(strOffset, &endPtr, 10);
+    if(errno != 0 || endPtr == strOffset || *endPtr != '\0' || fullSyncOffset < 0) {
+        HandleMasterLinkError(("invalid offset in the reply of psync: " + line).c_str());
+        return false;
+    }
+    if(!components._rdb_manager->StartReceivingFromMaster()) {
+        HandleMasterLinkError("failed to create the file for RDB data");
+        return false;
+    }
+    _master_replication_id = line.substr(idPos+1, offsetPos-idPos-1);
+    _full_sync_offset = fullSyncOffset;
+    _link_state = ReplicaLinkState::TRANSFER;
+    /* The RDB data may be right behind the reply */
+    HandleRDBDataFromMaster();
+    return true;
+}
 
-#ifndef MAKE_TEST
-    /* We set this timer for setting a timeout for recving data from master, except disconnection, the master machine may be in an unresponsive state */
-    SetupTimer();
-#endif
-
-    /* Send auth and sync command to master */
-    std::string command = std::string("*2\r\n") + std::string("$4\r\n") + std::string("auth\r\n") + "$"+std::to_string(_master_password.length())+std::string("\r\n")+_master_password+"\r\n";
-    SendCommandToMasterAndCheck(command, "auth", socketWithMaster, "OK", true);
-    command = std::string("*1\r\n") + "$4\r\nsync\r\n";
-    std::string recvStr = SendCommandToMasterAndCheck(command, "sync", socketWithMaster, "FULLRESYNC", true);
-    recvStr = recvStr.substr(12, recvStr.length()-12);
-    size_t expectOffset = strtoll(recvStr.c_str(), nullptr, 10);
-
-    bool isReplSucc = components._rdb_manager->LoadDatabase(socketWithMaster);
-    if(isReplSucc) {
-        components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE,
-                                                    "Replicate RDB data from master(ip:%s, port:%d) successfully",
-                                                    _master_ip.c_str(),
-                                                    _master_port_for_client);
-        /* This function will add event processor for socketWithMaster, when constructing event processor, it will set socketWithMaster non-blocking */
-        components._client_manager->HandleConnForClient(socketWithMaster, _master_ip, _master_port_for_client);
-        _current_master = components._client_manager->GetClientContactByFd(socketWithMaster);
-        _current_master->SetChecked();
-    } else {
-        components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
-                                                    "Failed to replicate RDB data from master(ip:%s, port:%d)",
-                                                    _master_ip.c_str(),
-                                                    _master_port_for_client);
-        exit(0);
+/* The RDB data is saved into a file while we are still serving the old data, then the file is loaded
+ * in the background */
+void DmdbReplicaReplicationManager::HandleRDBDataFromMaster() {
+    DmdbRepilcationManagerRequiredComponents components;
+    GetDmdbRepilcationManagerRequiredComponents(components);
+    ReceiveRetCode ret = components._rdb_manager->ReceiveFromMaster(_master_link_fd);
+    if(ret == ReceiveRetCode::AGAIN) {
+        _last_master_io_ms = DmdbUtil::GetCurrentMs();
+        return;
+    }
+    if(ret == ReceiveRetCode::ERR) {
+        HandleMasterLinkError("failed to receive RDB data");
+        return;
+    }
+    if(!components._rdb_manager->StartLoadingReceivedData()) {
+        HandleMasterLinkError("failed to load RDB data");
+        return;
     }
+    /* The commands master sends meanwhile wait in the socket until the new data is loaded */
+    components._event_manager->DelEvent4Fd(_master_link_fd, EpollEvent::IN);
+    _link_state = ReplicaLinkState::LOADING;
+}
 
-#ifndef MAKE_TEST
-    /* If we receive data from master normally, we should cancel this timer */
-    ClearTimer();
-#endif
+void DmdbReplicaReplicationManager::CheckLoadingOver() {
+    DmdbRepilcationManagerRequiredComponents components;
+    GetDmdbRepilcationManagerRequiredComponents(components);
+    ReceiveRetCode ret = components._rdb_manager->CheckLoadingReceivedData();
+    if(ret == ReceiveRetCode::AGAIN) {
+        return;
+    }
+    if(ret == ReceiveRetCode::ERR) {
+        HandleMasterLinkError("failed to load RDB data");
+        return;
+    }
+    /* Only loading all the rdb data successfully, we set _repl_ok_size and report to master */
+    _repl_ok_size = _full_sync_offset;
+    components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE,
+                                                "Replicate RDB data from master(ip:%s, port:%d) successfully",
+                                                _master_ip.c_str(), _master_port_for_client);
+    HandOverMasterLink();
+}
 
-    /* Only receiving all the rdb data successfully, we set _repl_ok_size and report to master */
-    _repl_ok_size = expectOffset;
+void DmdbReplicaReplicationManager::HandOverMasterLink() {
+    DmdbRepilcationManagerRequiredComponents components;
+    GetDmdbRepilcationManagerRequiredComponents(components);
+    int fd = _master_link_fd;
+    components._event_manager->DelFd(fd, false);
+    _master_link_fd = -1;
+    /* This function will add event processor for the socket, the commands left in the socket will be read then */
+    components._client_manager->HandleConnForClient(fd, _master_ip, _master_port_for_client);
+    _current_master = components._client_manager->GetClientContactByFd(fd);
+    if(_current_master == nullptr) {
+        HandleMasterLinkError("too many connections");
+        return;
+    }
+    _current_master->SetChecked();
+    _link_state = ReplicaLinkState::CONNECTED;
+    _reconnect_delay_ms = MIN_RECONNECT_DELAY_MS;
+    components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE,
+                                                "Connected with master(ip:%s, port:%d), it took %llu ms",
+                                                _master_ip.c_str(), _master_port_for_client,
+                                                static_cast<unsigned long long>(DmdbUtil::GetCurrentMs() - _sync_start_ms));
     ReportToMasterMyReplayOkSize();
-    return isReplSucc;
+}
+
+void DmdbReplicaReplicationManager::CloseMasterLink() {
+    DmdbRepilcationManagerRequiredComponents components;
+    GetDmdbRepilcationManagerRequiredComponents(components);
+    if(_link_state == ReplicaLinkState::TRANSFER) {
+        components._rdb_manager->AbortReceivingFromMaster();
+    }
+    if(_master_link_fd >= 0) {
+        components._event_manager->DelFd(_master_link_fd, false);
+        close(_master_link_fd);
+        _master_link_fd = -1;
+    }
+}
+
+/* The data we have is kept, so we can still try to partially resync after reconnecting */
+void DmdbReplicaReplicationManager::HandleMasterLinkError(const char* reason) {
+    DmdbRepilcationManagerRequiredComponents components;
+    GetDmdbRepilcationManagerRequiredComponents(components);
+    CloseMasterLink();
+    _link_state = ReplicaLinkState::NONE;
+    _next_reconnect_ms = DmdbUtil::GetCurrentMs() + _reconnect_delay_ms;
+    components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                "Failed to sync with master(ip:%s, port:%d): %s, retry in %llu ms",
+                                                _master_ip.c_str(), _master_port_for_client, reason,
+                                                static_cast<unsigned long long>(_reconnect_delay_ms));
+    _reconnect_delay_ms = std::min(_reconnect_delay_ms*2, MAX_RECONNECT_DELAY_MS);
+}
+
+void DmdbReplicaReplicationManager::CheckMasterLinkTimeout(uint64_t currentMs) {
+    /* Nothing is read from master when loading, the loading thread can't be stopped either */
+    if(_link_state == ReplicaLinkState::NONE || _link_state == ReplicaLinkState::LOADING ||
+       _link_state == ReplicaLinkState::CONNECTED) {
+        return;
+    }
+    if(currentMs - _last_master_io_ms > _repl_timeout_ms) {
+        HandleMasterLinkError("timeout, the master doesn't response");
+    } else if(currentMs - _sync_start_ms > _full_sync_max_ms) {
+        HandleMasterLinkError("full sync takes too long");
+    }
+}
+
+bool DmdbReplicaReplicationManager::IsDataServable() {
+    return _link_state == ReplicaLinkState::CONNECTED || _is_serve_stale_data;
 }
 
 void DmdbReplicaReplicationManager::AskReplicaForReplayOkSize(DmdbClientContact* replica) {
@@ -219,10 +396,22 @@ DmdbReplicaReplicationManager::DmdbReplicaReplicationManager() {
     _master_port_for_client = -1;
     _current_master = nullptr;
     _repl_ok_size = 0;
+    _master_replication_id = "";
+    _repl_timeout_ms = 60*1000;
+    _is_serve_stale_data = true;
+    _link_state = ReplicaLinkState::NONE;
+    _master_link_fd = -1;
+    _sync_start_ms = 0;
+    _last_master_io_ms = 0;
+    _next_reconnect_ms = 0;
+    _reconnect_delay_ms = MIN_RECONNECT_DELAY_MS;
+    _full_sync_offset = 0;
 }
 
 DmdbReplicaReplicationManager::~DmdbReplicaReplicationManager() {
-
+    if(_master_link_fd >= 0) {
+        close(_master_link_fd);
+    }
 }
 
 void DmdbReplicaReplicationManager::SetMasterPassword(const std::string &pwd) {
@@ -246,6 +435,14 @@ void DmdbReplicaReplicationManager::SetReplOffset(long long offset) {
     _repl_ok_size = offset;
 }
 
+std::string DmdbReplicaReplicationManager::GetReplicationId() {
+    return _master_replication_id;
+}
+
+void DmdbReplicaReplicationManager::SetBacklogSize(size_t size) {
+
+}
+
 std::string DmdbReplicaReplicationManager::GetMultiBulkOfReplicasOrMaster() {
     std::string multiBulk = "*4\r\n";
     multiBulk += "$7\r\n";
@@ -261,6 +458,13 @@ std::string DmdbReplicaReplicationManager::GetMultiBulkOfReplicasOrMaster() {
 
 void DmdbReplicaReplicationManager::TimelyTask() {
     uint64_t currentMs = DmdbUtil::GetCurrentMs();
+    CheckMasterLinkTimeout(currentMs);
+    if(_link_state == ReplicaLinkState::LOADING) {
+        CheckLoadingOver();
+    }
+    if(_link_state == ReplicaLinkState::NONE && currentMs >= _next_reconnect_ms) {
+        ConnectToMaster();
+    }
     if(currentMs - _last_timely_exe_ms < _repl_timely_task_interval) {
         return;
     }
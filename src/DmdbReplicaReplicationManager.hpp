@@ -9,10 +9,22 @@ namespace Dmdb {
 
 class DmdbClientContact;
 
+/* The steps of a replica connecting to its master, the socket is owned by the replication manager
+ * until CONNECTED, then it's handed over to DmdbClientManager as the master client */
+enum class ReplicaLinkState {
+    NONE,
+    CONNECTING,
+    AUTH,
+    SYNC_SENT,
+    TRANSFER,
+    LOADING,
+    CONNECTED
+};
+
 class DmdbReplicaReplicationManager : public DmdbReplicationManager {
 public:
     virtual DmdbClientContact* GetMasterClientContact();
-    virtual void ReplicateDataToSlaves(const std::string &data);
+    virtual void ReplicateDataToSlaves(const char* data, size_t len);
     virtual bool IsOneOfMySlaves(DmdbClientContact* client);
     virtual bool IsMyMaster(const std::string clientName);
     virtual void SetMyMasterClientContact(DmdbClientContact* master);
@@ -20,14 +32,20 @@ public:
     virtual long long GetReplayOkSize();
     virtual bool RemoveMasterOrReplica(DmdbClientContact* client);
     virtual bool FullSyncDataToReplica(DmdbClientContact* client);
+    virtual bool PartialSyncToReplica(DmdbClientContact* client, const std::string &replId, long long offset);
     virtual bool HandleFullSyncOver(int fd, bool isSuccess, bool isDisconnected);
     virtual void AddReplicaByFd(int fd);
-    virtual bool FullSyncFromMater();
+    virtual bool ConnectToMaster();
+    virtual void HandleMasterLinkReadable();
+    virtual void HandleMasterLinkWritable();
+    virtual bool IsDataServable();
     virtual void ReportToMasterMyReplayOkSize();
     virtual void AskReplicaForReplayOkSize(DmdbClientContact* replica);
     virtual void SetReplicaReplayOkSize(DmdbClientContact* replica, long long size);
     virtual long long GetReplOffset();
     virtual void SetReplOffset(long long offset);
+    virtual std::string GetReplicationId();
+    virtual void SetBacklogSize(size_t size);
     virtual std::string GetMultiBulkOfReplicasOrMaster();
     virtual void SetMasterPassword(const std::string &pwd);
     virtual void SetMasterAddrInfo(const std::string &ip, int port);
@@ -36,14 +54,21 @@ public:
     virtual void WaitForNReplicasAck(DmdbClientContact* client, size_t waitNum, uint64_t waitMs);
     virtual bool StopWaitting(DmdbClientContact* client); 
     virtual bool IsWaitting(DmdbClientContact* client);
-    void HandleSignal(int sig);
     void TimelyTask();
     DmdbReplicaReplicationManager();
     ~DmdbReplicaReplicationManager();
 private:
-    std::string SendCommandToMasterAndCheck(const std::string &command, const std::string &commandName, int socket, const std::string &expectReply, bool isCheck);
-    void SetupTimer();
-    void ClearTimer();
+    bool SendCommandToMaster(const std::string &command);
+    /* Returns 1 if a line is read, 0 if the line hasn't been received completely, -1 if it fails */
+    int ReadLineFromMaster(std::string &line);
+    bool HandleReplyOfAuth();
+    bool HandleReplyOfPSync();
+    void HandleRDBDataFromMaster();
+    void CheckLoadingOver();
+    void HandOverMasterLink();
+    void HandleMasterLinkError(const char* reason);
+    void CloseMasterLink();
+    void CheckMasterLinkTimeout(uint64_t currentMs);
     std::string _master_password;
     std::string _master_ip;
     int _master_port_for_client;
@@ -51,6 +76,18 @@ private:
     DmdbClientContact *_current_master;
 
     long long _repl_ok_size;
+    /* The replication id of the master we replicate from, it's empty before the first full sync */
+    std::string _master_replication_id;
+
+    ReplicaLinkState _link_state;
+    int _master_link_fd;
+    uint64_t _sync_start_ms;
+    uint64_t _last_master_io_ms;
+    /* When the link fails, we wait longer and longer before reconnecting */
+    uint64_t _next_reconnect_ms;
+    uint64_t _reconnect_delay_ms;
+    /* The offset master told us in +FULLRESYNC, it's ours after the RDB data is loaded */
+    long long _full_sync_offset;
 };
 
 }
\ No newline at end of file
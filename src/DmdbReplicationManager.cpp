@@ -31,4 +31,12 @@ void DmdbReplicationManager::SetTaskInterval(uint64_t interval) {
     _repl_timely_task_interval = interval;
 }
 
+void DmdbReplicationManager::SetReplTimeoutMs(uint64_t ms) {
+    _repl_timeout_ms = ms;
+}
+
+void DmdbReplicationManager::SetServeStaleData(bool isServeStaleData) {
+    _is_serve_stale_data = isServeStaleData;
+}
+
 }
\ No newline at end of file
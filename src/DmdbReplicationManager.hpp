@@ -20,7 +20,7 @@ struct DmdbRepilcationManagerRequiredComponents {
 
 class DmdbReplicationManager {
 public:
-    virtual void ReplicateDataToSlaves(const std::string &data) = 0;
+    virtual void ReplicateDataToSlaves(const char* data, size_t len) = 0;
     virtual void AddReplayOkSize(size_t addLen) = 0;
     virtual long long GetReplayOkSize() = 0;
     virtual DmdbClientContact* GetMasterClientContact() = 0;
@@ -29,14 +29,23 @@ public:
     virtual void SetMyMasterClientContact(DmdbClientContact* master) = 0;
     virtual bool RemoveMasterOrReplica(DmdbClientContact* client) = 0;
     virtual bool FullSyncDataToReplica(DmdbClientContact* client) = 0;
+    /* Returns false if the replica has to full sync, otherwise it gets the missing data from the backlog */
+    virtual bool PartialSyncToReplica(DmdbClientContact* client, const std::string &replId, long long offset) = 0;
     virtual bool HandleFullSyncOver(int fd, bool isSuccess, bool isDisconnected) = 0;
     virtual void AddReplicaByFd(int fd) = 0;
-    virtual bool FullSyncFromMater() = 0;
+    /* It only starts connecting, the handshake and the full sync are driven by the event loop */
+    virtual bool ConnectToMaster() = 0;
+    virtual void HandleMasterLinkReadable() = 0;
+    virtual void HandleMasterLinkWritable() = 0;
+    /* False if the replica has lost its master and mustn't serve the stale data */
+    virtual bool IsDataServable() = 0;
     virtual void AskReplicaForReplayOkSize(DmdbClientContact* replica) = 0;
     virtual void ReportToMasterMyReplayOkSize() = 0;
     virtual void SetReplicaReplayOkSize(DmdbClientContact* replica, long long size) = 0;
     virtual long long GetReplOffset() = 0;
     virtual void SetReplOffset(long long offset) = 0;
+    virtual std::string GetReplicationId() = 0;
+    virtual void SetBacklogSize(size_t size) = 0;
     virtual std::string GetMultiBulkOfReplicasOrMaster() = 0;
     virtual void TimelyTask() = 0;
     virtual void SetMasterPassword(const std::string &pwd) = 0;
@@ -49,12 +58,17 @@ public:
     virtual ~DmdbReplicationManager();
     void SetFullSyncMaxMs(uint64_t ms);
     void SetTaskInterval(uint64_t interval);
+    void SetReplTimeoutMs(uint64_t ms);
+    void SetServeStaleData(bool isServeStaleData);
     static DmdbReplicationManager* GenerateReplicationManagerByRole(bool isMaster);
 protected:
     DmdbReplicationManager();
     uint64_t _full_sync_max_ms;
     uint64_t _last_timely_exe_ms;
     uint64_t _repl_timely_task_interval;
+    /* The max ms without receiving anything from master during the handshake and the full sync */
+    uint64_t _repl_timeout_ms;
+    bool _is_serve_stale_data;
 private:
 };
 
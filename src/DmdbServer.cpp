@@ -1,4 +1,6 @@
 #include <signal.h>
+#include <sys/stat.h>
+#include <fstream>
 
 #include "DmdbServer.hpp"
 #include "DmdbDatabaseManager.hpp"
@@ -13,27 +15,62 @@
 #include "DmdbEventManagerCommon.hpp"
 #include "DmdbRDBManager.hpp"
 #include "DmdbServerTerminateSignalHandler.hpp"
+#include "DmdbIOThreadManager.hpp"
+#include "DmdbLazyFreeManager.hpp"
+#include "DmdbShardManager.hpp"
+#include "DmdbAOFManager.hpp"
 
 
 
 namespace Dmdb {
 
-DmdbServer* DmdbServer::_self_instance = nullptr;
+extern thread_local DmdbServer* serverInstance;
 
-DmdbServer* DmdbServer::GetUniqueServerInstance(std::string &baseConfigFile) {
+thread_local DmdbServer* DmdbServer::_self_instance = nullptr;
+
+DmdbServer* DmdbServer::GetUniqueServerInstance(std::string &baseConfigFile, int shardId) {
     if(_self_instance == nullptr){
         DmdbUtil::TrimString(baseConfigFile);
-        _self_instance = new DmdbServer(baseConfigFile);
+        _self_instance = new DmdbServer(baseConfigFile, shardId);
     }
     return _self_instance;
 }
 
+/* The entry of the shard threads except shard 0 */
+void DmdbServer::RunShard(std::string baseConfigFile, int shardId) {
+    serverInstance = GetUniqueServerInstance(baseConfigFile, shardId);
+    serverInstance->DoService();
+}
+
 /* Child process like Rdb won't execute this function, if they finish their task, they will exit immediately,
  * won't enter while(1) loop */
-void DmdbServer::ShutDownServerIfNeed() {
+bool DmdbServer::ShutDownServerIfNeed() {
+    if(_shard_id != 0) {
+        /* Shard 0 will stop all the shards */
+        if(_plan_to_shutdown) {
+            _shard_manager->RequestShutdown();
+            _plan_to_shutdown = false;
+        }
+        if(_shard_manager->IsStopping()) {
+            _rdb_manager->KillChildProcessIfAlive();
+            if(_rdb_manager->SaveData(-1, false) != SaveRetCode::SAVE_OK) {
+                _server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE,
+                                                 "Shard %d failed to save RDB data to disk", _shard_id);
+            }
+            _aof_manager->StopAppendOnly();
+            ReleaseShardResources();
+            return true;
+        }
+        return false;
+    }
+    if(_shard_manager->IsShutdownRequested()) {
+        _plan_to_shutdown = true;
+    }
     if(_plan_to_shutdown) {
         _server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE,
                                          "Server is shutting down");
+        /* The other shards save their data before they quit */
+        _shard_manager->StopShards();
         _rdb_manager->KillChildProcessIfAlive();
 
         bool isSaveOk = _rdb_manager->SaveData(-1, false) == SaveRetCode::SAVE_OK;
@@ -41,19 +78,41 @@ void DmdbServer::ShutDownServerIfNeed() {
             _server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE,
                                             "Failed to save RDB data to disk");
         }
+        _aof_manager->StopAppendOnly();
 
         _server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE,
                                          "Bye bye!");
         // TODO: delete _cluster_manager;
+        _shard_manager->ReleaseShard();
+        delete _shard_manager;
+        delete _io_thread_manager;
         delete _base_config_file_loader;
         delete _client_manager;
         delete _database_manager;
         delete _server_logger;
         delete _repl_manager;
         delete _rdb_manager;
+        delete _aof_manager;
+        delete _lazy_free_manager;
         delete _event_manager;
         exit(0);
     }
+    return false;
+}
+
+/* The logger and the shard manager are shared by all the shards, they are released by shard 0 */
+void DmdbServer::ReleaseShardResources() {
+    _server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE, "Shard %d stopped", _shard_id);
+    _shard_manager->ReleaseShard();
+    delete _io_thread_manager;
+    delete _base_config_file_loader;
+    delete _client_manager;
+    delete _database_manager;
+    delete _repl_manager;
+    delete _rdb_manager;
+    delete _aof_manager;
+    delete _lazy_free_manager;
+    delete _event_manager;
 }
 
 bool DmdbServer::IsMyselfChild() {
@@ -139,10 +198,89 @@ void DmdbServer::InitWithConfigFile() {
             DmdbUtil::ServerExitWithErrMsg("Invalid is_daemonize!");
     }
 
-    if(parasMap.find("rdb_file") == parasMap.end()) {
-        _rdb_manager =  DmdbRDBManager::GetUniqueRDBManagerInstance("Dmdb_RDB_File.rdb");
-    } else {
-        _rdb_manager = DmdbRDBManager::GetUniqueRDBManagerInstance(parasMap["rdb_file"][0]);
+    if(parasMap.find("shards_num") != parasMap.end()) {
+        std::string strShardsNum = parasMap["shards_num"][0];
+        int shardsNum = atoi(strShardsNum.c_str());
+        if(shardsNum <= 0 || shardsNum > SHARDS_MAX_NUM) {
+            DmdbUtil::ServerExitWithErrMsg("Invalid shards_num!");
+        }
+        /* The other shards are started by shard 0 after it has been set */
+        if(_shard_id == 0) {
+            _shard_manager->SetShardsNum(shardsNum);
+        }
+    }
+    if(_shard_manager->IsShardMode()) {
+        _client_manager->SetReusePortForClient(true);
+    }
+
+    std::string rdbFile = "Dmdb_RDB_File.rdb";
+    if(parasMap.find("rdb_file") != parasMap.end()) {
+        rdbFile = parasMap["rdb_file"][0];
+    }
+    std::string rdbBaseFile = rdbFile;
+    /* Every shard saves its own keys */
+    if(_shard_manager->IsShardMode()) {
+        rdbFile += "." + std::to_string(_shard_id);
+    }
+    _rdb_manager = DmdbRDBManager::GetUniqueRDBManagerInstance(rdbFile);
+    if(parasMap.find("rdb_load_threads_num") != parasMap.end()) {
+        int rdbLoadThreadsNum = atoi(parasMap["rdb_load_threads_num"][0].c_str());
+        if(rdbLoadThreadsNum <= 0)
+            DmdbUtil::ServerExitWithErrMsg("Invalid rdb_load_threads_num!");
+        _rdb_manager->SetLoadThreadsNum(rdbLoadThreadsNum);
+    }
+    if(parasMap.find("is_rdb_compression_enabled") != parasMap.end()) {
+        std::string strIsCompressionEnabled = parasMap["is_rdb_compression_enabled"][0];
+        bool isCompressionEnabled = false;
+        bool isValid = DmdbUtil::GetBoolFromString(strIsCompressionEnabled, isCompressionEnabled);
+        if(!isValid)
+            DmdbUtil::ServerExitWithErrMsg("Invalid is_rdb_compression_enabled!");
+        _rdb_manager->SetCompressionEnabled(isCompressionEnabled);
+    }
+
+    std::string aofFile = "Dmdb_AOF_File.aof";
+    if(parasMap.find("aof_file") != parasMap.end()) {
+        aofFile = parasMap["aof_file"][0];
+    }
+    std::string aofBaseFile = aofFile;
+    if(_shard_manager->IsShardMode()) {
+        aofFile += "." + std::to_string(_shard_id);
+    }
+    _aof_manager = DmdbAOFManager::GetUniqueAOFManagerInstance(aofFile);
+    if(parasMap.find("is_aof_enabled") != parasMap.end()) {
+        std::string strIsAOFEnabled = parasMap["is_aof_enabled"][0];
+        bool isAOFEnabled = false;
+        bool isValid = DmdbUtil::GetBoolFromString(strIsAOFEnabled, isAOFEnabled);
+        if(!isValid)
+            DmdbUtil::ServerExitWithErrMsg("Invalid is_aof_enabled!");
+        _aof_manager->SetAOFEnabled(isAOFEnabled);
+    }
+    if(parasMap.find("aof_fsync_policy") != parasMap.end()) {
+        AOFFsyncPolicy fsyncPolicy = AOFFsyncPolicy::EVERYSEC;
+        if(!DmdbAOFManager::String2FsyncPolicy(parasMap["aof_fsync_policy"][0], fsyncPolicy)) {
+            DmdbUtil::ServerExitWithErrMsg("Invalid aof_fsync_policy!");
+        }
+        _aof_manager->SetFsyncPolicy(fsyncPolicy);
+    }
+    if(parasMap.find("aof_rewrite_percentage") != parasMap.end()) {
+        uint64_t rewritePercentage = strtoull(parasMap["aof_rewrite_percentage"][0].c_str(), nullptr, 10);
+        if(errno == ERANGE) {
+            DmdbUtil::ServerExitWithErrMsg("Invalid aof_rewrite_percentage!");
+        }
+        _aof_manager->SetRewritePercentage(rewritePercentage);
+    }
+    if(parasMap.find("aof_rewrite_min_size") != parasMap.end()) {
+        uint64_t rewriteMinSize = strtoull(parasMap["aof_rewrite_min_size"][0].c_str(), nullptr, 10);
+        if(errno == ERANGE) {
+            DmdbUtil::ServerExitWithErrMsg("Invalid aof_rewrite_min_size!");
+        }
+        _aof_manager->SetRewriteMinSize(rewriteMinSize);
+    }
+    if(parasMap.find("is_aof_preamble_enabled") != parasMap.end()) {
+        std::string strIsPreamble = parasMap["is_aof_preamble_enabled"][0];
+        bool isValid = DmdbUtil::GetBoolFromString(strIsPreamble, _is_preamble);
+        if(!isValid)
+            DmdbUtil::ServerExitWithErrMsg("Invalid is_aof_preamble_enabled!");
     }
     if(parasMap.find("server_log_file") == parasMap.end()) {
         _server_logger = DmdbServerLogger::GetUniqueServerLogger("Server_Log_File.log", DmdbServerLogger::Verbosity::VERBOSE);
@@ -167,8 +305,8 @@ void DmdbServer::InitWithConfigFile() {
             DmdbUtil::ServerExitWithErrMsg("Invalid max_connection_num!");
         }
     }
-    /* 2 for : _epfd and _bind_ipv4_fd_for_client */
-    _event_manager = DmdbEventManager::GetUniqueEventManagerInstance(_max_connection_num+2);
+    /* 3 for : _epfd, _bind_ipv4_fd_for_client and the notify fd of the shard */
+    _event_manager = DmdbEventManager::GetUniqueEventManagerInstance(_max_connection_num+3);
 
     if(parasMap.find("epoll_wait_timeout") != parasMap.end()) {
         std::string strTimeout = parasMap["epoll_wait_timeout"][0];
@@ -179,13 +317,40 @@ void DmdbServer::InitWithConfigFile() {
         _event_manager->SetEpollWaitTimeout(timeout);
     }
 
-    if(parasMap.find("memory_max_available_size") != parasMap.end()) {
-        std::string strMemoryMaxAvailableSize = parasMap["memory_max_available_size"][0];
-        _memory_max_available_size = strtoull(strMemoryMaxAvailableSize.c_str(), nullptr, 10);
-        if(errno == ERANGE || _memory_max_available_size <= 0) {
-            DmdbUtil::ServerExitWithErrMsg("Invalid memory_max_available_size!");
+    if(parasMap.find("io_threads_num") != parasMap.end()) {
+        std::string strIOThreadsNum = parasMap["io_threads_num"][0];
+        int ioThreadsNum = atoi(strIOThreadsNum.c_str());
+        if(ioThreadsNum <= 0 || ioThreadsNum > IO_THREADS_MAX_NUM) {
+            DmdbUtil::ServerExitWithErrMsg("Invalid io_threads_num!");
+        }
+        _io_thread_manager->SetIOThreadsNum(ioThreadsNum);
+    }
+
+    /* memory_max_available_size is the old name of maxmemory */
+    std::string maxMemoryName = parasMap.find("maxmemory") != parasMap.end() ? "maxmemory" : "memory_max_available_size";
+    if(parasMap.find(maxMemoryName) != parasMap.end()) {
+        errno = 0;
+        _memory_max_available_size = strtoull(parasMap[maxMemoryName][0].c_str(), nullptr, 10);
+        if(errno == ERANGE) {
+            DmdbUtil::ServerExitWithErrMsg("Invalid maxmemory!");
+        }
+    }
+    EvictionPolicy evictionPolicy = EvictionPolicy::NO_EVICTION;
+    if(parasMap.find("maxmemory_policy") != parasMap.end()) {
+        if(!DmdbDatabaseManager::String2EvictionPolicy(parasMap["maxmemory_policy"][0], evictionPolicy)) {
+            DmdbUtil::ServerExitWithErrMsg("Invalid maxmemory_policy!");
         }
     }
+    size_t evictionSamples = EVICTION_SAMPLES_DEFAULT;
+    if(parasMap.find("maxmemory_samples") != parasMap.end()) {
+        errno = 0;
+        evictionSamples = strtoull(parasMap["maxmemory_samples"][0].c_str(), nullptr, 10);
+        if(errno == ERANGE || evictionSamples == 0 || evictionSamples > EVICTION_POOL_SIZE) {
+            DmdbUtil::ServerExitWithErrMsg("Invalid maxmemory_samples!");
+        }
+    }
+    /* Every shard has its own database, so it takes its share of the memory */
+    _database_manager->SetMaxMemory(_memory_max_available_size / _shard_manager->GetShardsNum(), evictionPolicy, evictionSamples);
     if(parasMap.find("is_cluster_mode") != parasMap.end()) {
         std::string strIsClusterMode = parasMap["is_cluster_mode"][0];
         bool isValid = DmdbUtil::GetBoolFromString(strIsClusterMode, _is_cluster_mode);
@@ -200,6 +365,27 @@ void DmdbServer::InitWithConfigFile() {
         }
         _database_manager->SetExpireIntervalForDB(expireIntervalMs);
     }
+    if(parasMap.find("is_key_index_enabled") != parasMap.end()) {
+        bool isKeyIndexEnabled = false;
+        bool isValid = DmdbUtil::GetBoolFromString(parasMap["is_key_index_enabled"][0], isKeyIndexEnabled);
+        if(!isValid)
+            DmdbUtil::ServerExitWithErrMsg("Invalid is_key_index_enabled!");
+        if(isKeyIndexEnabled)
+            _database_manager->EnableKeyIndex();
+    }
+    bool isLazyExpire = false;
+    if(parasMap.find("lazyfree_lazy_expire") != parasMap.end()) {
+        bool isValid = DmdbUtil::GetBoolFromString(parasMap["lazyfree_lazy_expire"][0], isLazyExpire);
+        if(!isValid)
+            DmdbUtil::ServerExitWithErrMsg("Invalid lazyfree_lazy_expire!");
+    }
+    bool isLazyEviction = false;
+    if(parasMap.find("lazyfree_lazy_eviction") != parasMap.end()) {
+        bool isValid = DmdbUtil::GetBoolFromString(parasMap["lazyfree_lazy_eviction"][0], isLazyEviction);
+        if(!isValid)
+            DmdbUtil::ServerExitWithErrMsg("Invalid lazyfree_lazy_eviction!");
+    }
+    _database_manager->SetLazyFree(_lazy_free_manager, isLazyExpire, isLazyEviction);
 
     if(parasMap.find("is_master_role") != parasMap.end()) {
         std::string strIsMasterRole = parasMap["is_master_role"][0];
@@ -207,6 +393,9 @@ void DmdbServer::InitWithConfigFile() {
         if(!isValid)
             DmdbUtil::ServerExitWithErrMsg("Invalid is_master_role!");
     }
+    if(!_is_master_role && _shard_manager->IsShardMode()) {
+        DmdbUtil::ServerExitWithErrMsg("A replica can't run in shard mode!");
+    }
     _repl_manager = DmdbReplicationManager::GenerateReplicationManagerByRole(_is_master_role);
     if(parasMap.find("full_sync_max_ms") != parasMap.end()) {
         uint64_t fullSyncMaxMs = strtoull(parasMap["full_sync_max_ms"][0].c_str(), nullptr, 10);
@@ -222,6 +411,35 @@ void DmdbServer::InitWithConfigFile() {
         }
         _repl_manager->SetTaskInterval(timelyTaskInterval);
     }
+    if(parasMap.find("repl_backlog_size") != parasMap.end()) {
+        uint64_t backlogSize = strtoull(parasMap["repl_backlog_size"][0].c_str(), nullptr, 10);
+        if(errno == ERANGE || backlogSize < 16*1024 || backlogSize > 1024*1024*1024) {
+            DmdbUtil::ServerExitWithErrMsg("Invalid repl_backlog_size!");
+        }
+        _repl_manager->SetBacklogSize(backlogSize);
+    }
+    if(parasMap.find("repl_diskless_sync_delay_ms") != parasMap.end()) {
+        uint64_t syncDelayMs = strtoull(parasMap["repl_diskless_sync_delay_ms"][0].c_str(), nullptr, 10);
+        if(errno == ERANGE || syncDelayMs > 60*1000) {
+            DmdbUtil::ServerExitWithErrMsg("Invalid repl_diskless_sync_delay_ms!");
+        }
+        _rdb_manager->SetReplicasSyncDelayMs(syncDelayMs);
+    }
+    if(parasMap.find("repl_timeout_ms") != parasMap.end()) {
+        uint64_t replTimeoutMs = strtoull(parasMap["repl_timeout_ms"][0].c_str(), nullptr, 10);
+        if(errno == ERANGE || replTimeoutMs < 1000 || replTimeoutMs > 3600*1000) {
+            DmdbUtil::ServerExitWithErrMsg("Invalid repl_timeout_ms!");
+        }
+        _repl_manager->SetReplTimeoutMs(replTimeoutMs);
+    }
+    if(parasMap.find("replica_serve_stale_data") != parasMap.end()) {
+        std::string strIsServeStaleData = parasMap["replica_serve_stale_data"][0];
+        bool isServeStaleData = true;
+        bool isValid = DmdbUtil::GetBoolFromString(strIsServeStaleData, isServeStaleData);
+        if(!isValid)
+            DmdbUtil::ServerExitWithErrMsg("Invalid replica_serve_stale_data!");
+        _repl_manager->SetServeStaleData(isServeStaleData);
+    }
     if(!_is_master_role) {
         if(parasMap.find("master_ip") == parasMap.end()) {
             DmdbUtil::ServerExitWithErrMsg("You must configure a master ip for this replica!");
@@ -244,16 +462,114 @@ void DmdbServer::InitWithConfigFile() {
         _repl_manager->SetMasterAddrInfo(masterIp, masterPort);
         _repl_manager->SetMasterPassword(parasMap["master_password"][0]);
     }   
+
+    if(_shard_id == 0) {
+        CheckShardDataFiles(rdbBaseFile, aofBaseFile);
+    }
 }
 
+static bool IsNonEmptyFile(const std::string &fileName) {
+    struct stat fileStat;
+    return stat(fileName.c_str(), &fileStat) == 0 && fileStat.st_size > 0;
+}
 
+/* Keys are routed by hash % shards_num, so the files saved by the shards are only valid with the
+ * shards_num they were saved with, which is recorded in <rdb_file>.shards. We refuse to start
+ * rather than silently ignore a file that wouldn't be loaded or load keys into the wrong shard.
+ * A replica doesn't load its files, it only has to record the shards_num for the next start. */
+void DmdbServer::CheckShardDataFiles(const std::string &rdbFile, const std::string &aofFile) {
+    int shardsNum = _shard_manager->GetShardsNum();
+    bool isShardMode = _shard_manager->IsShardMode();
+    std::string metaFile = rdbFile + ".shards";
+    if(_is_master_role) {
+        std::vector<std::string> baseFiles = {rdbFile};
+        if(_aof_manager->IsAOFEnabled()) {
+            baseFiles.push_back(aofFile);
+        }
+        bool hasShardFiles = false;
+        for(const std::string &baseFile : baseFiles) {
+            if(isShardMode && IsNonEmptyFile(baseFile)) {
+                DmdbUtil::ServerExitWithErrMsg(baseFile + " was saved without shards, it won't be loaded "
+                                               "with shards_num " + std::to_string(shardsNum) + "!");
+            }
+            for(int id = 0; id < SHARDS_MAX_NUM; ++id) {
+                std::string shardFile = baseFile + "." + std::to_string(id);
+                if(!IsNonEmptyFile(shardFile)) {
+                    continue;
+                }
+                if(!isShardMode || id >= shardsNum) {
+                    DmdbUtil::ServerExitWithErrMsg(shardFile + " won't be loaded with shards_num " +
+                                                   std::to_string(shardsNum) + "!");
+                }
+                hasShardFiles = true;
+            }
+        }
+        if(hasShardFiles) {
+            int savedShardsNum = 0;
+            std::ifstream metaStream(metaFile);
+            if(!(metaStream >> savedShardsNum)) {
+                DmdbUtil::ServerExitWithErrMsg("Can't read the shards_num the shard files were saved with from " +
+                                               metaFile + "!");
+            }
+            if(savedShardsNum != shardsNum) {
+                DmdbUtil::ServerExitWithErrMsg("The shard files were saved with shards_num " + 
+                                               std::to_string(savedShardsNum) + ", but it's " +
+                                               std::to_string(shardsNum) + " now!");
+            }
+        }
+    }
+    if(!isShardMode) {
+        return;
+    }
+    std::string tmpMetaFile = metaFile + ".tmp";
+    std::ofstream metaStream(tmpMetaFile, std::ios::trunc);
+    metaStream << shardsNum << std::endl;
+    metaStream.close();
+    if(!metaStream || rename(tmpMetaFile.c_str(), metaFile.c_str()) != 0) {
+        DmdbUtil::ServerExitWithErrMsg("Failed to write " + metaFile + "!");
+    }
+}
+
+
+/* The AOF has newer data than the RDB file if it's enabled */
 bool DmdbServer::LoadDataFromDisk() {
+    if(_aof_manager->IsAOFEnabled() && _aof_manager->IsAOFFileExisting()) {
+        if(!_aof_manager->LoadAppendOnlyFile()) {
+            DmdbUtil::ServerExitWithErrMsg("Failed to load AOF file:" + _aof_manager->GetAOFFile() + "!");
+        }
+        return true;
+    }
     bool isOk = _rdb_manager->LoadDatabase(-1);
     return isOk;
 }
 
+/* A new AOF has to be rewritten from the data loaded from the RDB file, so does the AOF of
+ * a replica after the full sync */
+void DmdbServer::StartAppendOnlyIfNeed(bool isAOFFileExisting) {
+    if(!_aof_manager->IsAOFEnabled()) {
+        return;
+    }
+    if(!_aof_manager->StartAppendOnly()) {
+        DmdbUtil::ServerExitWithErrMsg("Failed to open AOF file:" + _aof_manager->GetAOFFile() + "!");
+    }
+    if(!_is_master_role || (!isAOFFileExisting && _database_manager->GetDatabaseSize() > 0)) {
+        _rdb_manager->SetAOFRewritePlan();
+    }
+}
+
 
 bool DmdbServer::StartServer() {
+    bool isAOFFileExisting = _aof_manager->IsAOFFileExisting();
+    if(_shard_id != 0) {
+        LoadDataFromDisk();
+        StartAppendOnlyIfNeed(isAOFFileExisting);
+        if(!_client_manager->StartToListenIPV4() || !_shard_manager->InitShard())
+            return false;
+        _io_thread_manager->StartIOThreads();
+        _lazy_free_manager->StartLazyFreeThread();
+        _server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE, "Shard %d started", _shard_id);
+        return true;
+    }
     std::cout << "Dmdb server is starting, please wait......" << std::endl;
     _server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE, "Dmdb server is starting");
     srand(time(nullptr));
@@ -261,9 +577,20 @@ bool DmdbServer::StartServer() {
     if(_is_master_role)
         LoadDataFromDisk();
     else
-        _repl_manager->FullSyncFromMater();
-    if(!_client_manager->StartToListenIPV4())
+        _repl_manager->ConnectToMaster();
+    StartAppendOnlyIfNeed(isAOFFileExisting);
+    if(!_client_manager->StartToListenIPV4() || !_shard_manager->InitShard())
         return false;
+    if(_io_thread_manager->StartIOThreads()) {
+        _server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE, "Started %d I/O threads", 
+                                         _io_thread_manager->GetIOThreadsNum() - 1);
+    }
+    _lazy_free_manager->StartLazyFreeThread();
+    std::string baseConfigFile = _base_config_file;
+    if(_shard_manager->StartShards([baseConfigFile](int shardId) { RunShard(baseConfigFile, shardId); })) {
+        _server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE, "Started %d shards", 
+                                         _shard_manager->GetShardsNum());
+    }
     std::cout << "Dmdb server started successfully!" << std::endl;
     std::cout << "Port: " << _client_manager->GetPortForClient() << std::endl;
     _server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::VERBOSE, "Dmdb server started successfully");
@@ -289,22 +616,30 @@ void DmdbServer::ClearSignalHandler() {
     DmdbServerTerminateSignalHandler::SetServerInstance(nullptr);
 }
 
-DmdbServer::DmdbServer(std::string &baseConfigFile) {
+DmdbServer::DmdbServer(std::string &baseConfigFile, int shardId) {
     _server_version = SERVER_VERSION;
     _plan_to_shutdown = false;
-    _is_preamble = false;
+    _is_preamble = true;
     _is_daemonize = false;
     _is_master_role = true;
-    _memory_max_available_size = 3ull*1024ull*1024ull*1024ull;
+    _memory_max_available_size = 0;
     _is_cluster_mode = false;
     _max_connection_num = 1000;
     _server_connection_num = 0;
     _ipv4 = "";
     _tcp_back_log = 511;
-    DmdbServerTerminateSignalHandler::SetServerInstance(this);
+    _shard_id = shardId;
+    _base_config_file = baseConfigFile;
+    /* Signals are handled by shard 0 */
+    if(_shard_id == 0) {
+        DmdbServerTerminateSignalHandler::SetServerInstance(this);
+    }
     _base_config_file_loader = new DmdbConfigFileLoader(baseConfigFile);
     _client_manager = DmdbClientManager::GetUniqueClientManagerInstance();
+    _io_thread_manager = DmdbIOThreadManager::GetUniqueIOThreadManagerInstance();
+    _shard_manager = DmdbShardManager::GetUniqueShardManagerInstance();
     _database_manager = new DmdbDatabaseManager();
+    _lazy_free_manager = DmdbLazyFreeManager::GetUniqueLazyFreeManagerInstance();
     /* _server_logger, _event_manager, _rdb_manager, _repl_manager will be created in function InitWithConfigFile */
     InitWithConfigFile();
 }
@@ -313,22 +648,40 @@ void DmdbServer::DoService() {
     StartServer();
     while(1) {
         _event_manager->WaitAndProcessEvents();
+        /* Requests from other shards and replies to the requests we sent */
+        _shard_manager->ProcessShardMessages();
         _client_manager->ProcessClients();
         _repl_manager->TimelyTask();
         _database_manager->RemoveExpiredKeys();
+        /* Moving entries touches lots of memory pages, avoid it while the rdb child shares them with us */
+        if(!_rdb_manager->IsRDBChildAlive()) {
+            _database_manager->IncrementallyRehash(1);
+        }
+        _aof_manager->RewriteIfNeed();
         _rdb_manager->RdbCheckAndFinishJob();
-        ShutDownServerIfNeed();
+        if(ShutDownServerIfNeed()) {
+            return;
+        }
+        /* Commands must be in the AOF before their replies are sent */
+        _aof_manager->FlushAppendOnlyFile();
+        _shard_manager->FlushShardMessages();
+        /* The tasks above may add replies too(e.g. WAIT, BGSAVE), send them before we sleep in epoll_wait() */
+        _client_manager->HandleClientsWithPendingWrites();
     }
     
 }
 
 DmdbServer::~DmdbServer() {
+    delete _shard_manager;
+    delete _io_thread_manager;
     delete _base_config_file_loader;
     delete _client_manager;
     delete _database_manager;
     delete _server_logger;
     delete _repl_manager;
     delete _rdb_manager;
+    delete _aof_manager;
+    delete _lazy_free_manager;
     delete _event_manager;
 }
 
@@ -25,6 +25,10 @@ class DmdbClusterManager;
 class DmdbClientManager;
 class DmdbEventManager;
 class DmdbRDBManager;
+class DmdbIOThreadManager;
+class DmdbShardManager;
+class DmdbAOFManager;
+class DmdbLazyFreeManager;
 
 struct DmdbEventMangerRequiredComponent;
 struct DmdbClientManagerRequiredComponent;
@@ -32,12 +36,14 @@ struct DmdbClientContactRequiredComponent;
 struct DmdbCommandRequiredComponent;
 struct DmdbRDBRequiredComponents;
 struct DmdbRepilcationManagerRequiredComponents;
+struct DmdbShardManagerRequiredComponents;
+struct DmdbAOFRequiredComponents;
 
 const uint8_t SERVER_VERSION = 1;
 
 class DmdbServer {
 public:
-    static DmdbServer* GetUniqueServerInstance(std::string &baseConfigFile);
+    static DmdbServer* GetUniqueServerInstance(std::string &baseConfigFile, int shardId = 0);
     static void ClearSignalHandler();
     void DoService();
     void ShutdownServerBySignal(int sig);
@@ -48,12 +54,19 @@ public:
     friend bool GetDmdbCommandRequiredComponents(DmdbCommandRequiredComponent &components);
     friend bool GetDmdbRDBRequiredComponents(DmdbRDBRequiredComponents &components);
     friend bool GetDmdbRepilcationManagerRequiredComponents(DmdbRepilcationManagerRequiredComponents &components);
+    friend bool GetDmdbShardManagerRequiredComponents(DmdbShardManagerRequiredComponents &components);
+    friend bool GetDmdbAOFRequiredComponents(DmdbAOFRequiredComponents &components);
 private:
-    DmdbServer(std::string &baseConfigfile);
+    DmdbServer(std::string &baseConfigfile, int shardId);
+    static void RunShard(std::string baseConfigFile, int shardId);
     DmdbServer& operator=(const DmdbServer&);
     void InitWithConfigFile();
+    void CheckShardDataFiles(const std::string &rdbFile, const std::string &aofFile);
     bool LoadDataFromDisk();
-    void ShutDownServerIfNeed();
+    void StartAppendOnlyIfNeed(bool isAOFFileExisting);
+    /* Returns true if the loop of the shard should stop */
+    bool ShutDownServerIfNeed();
+    void ReleaseShardResources();
     
     bool StartServer();
     void SetupSignalHandler(void (*fun)(int));
@@ -61,7 +74,8 @@ private:
     
     uint8_t _server_version;
 
-    static DmdbServer* _self_instance;
+    /* Every shard thread has its own server */
+    static thread_local DmdbServer* _self_instance;
     
     bool _plan_to_shutdown;
     
@@ -80,6 +94,12 @@ private:
     DmdbReplicationManager* _repl_manager;
     DmdbEventManager* _event_manager;
     DmdbRDBManager* _rdb_manager;
+    DmdbAOFManager* _aof_manager;
+    DmdbIOThreadManager* _io_thread_manager;
+    DmdbShardManager* _shard_manager;
+    DmdbLazyFreeManager* _lazy_free_manager;
+    int _shard_id;
+    std::string _base_config_file;
     uint16_t _max_connection_num;
     uint16_t _server_connection_num;
     std::string _ipv4;
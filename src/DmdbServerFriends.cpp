@@ -6,9 +6,11 @@
 #include "DmdbCommand.hpp"
 #include "DmdbRDBManager.hpp"
 #include "DmdbReplicationManager.hpp"
+#include "DmdbShardManager.hpp"
+#include "DmdbAOFManager.hpp"
 
 namespace Dmdb {
-extern DmdbServer* serverInstance;
+extern thread_local DmdbServer* serverInstance;
 
 /* Before using these functions, we should make sure some components are not null */
 bool GetDmdbEventMangerRequiredComponents(DmdbEventMangerRequiredComponent &components) {
@@ -16,6 +18,8 @@ bool GetDmdbEventMangerRequiredComponents(DmdbEventMangerRequiredComponent &comp
         return false;
     components._required_server_logger = serverInstance->_server_logger;
     components._required_client_manager = serverInstance->_client_manager;
+    components._required_rdb_manager = serverInstance->_rdb_manager;
+    components._required_repl_manager = serverInstance->_repl_manager;
     components._required_server_max_conn_num = serverInstance->_max_connection_num;
     components._required_server_connection_num = &serverInstance->_server_connection_num;
     return true;
@@ -23,11 +27,13 @@ bool GetDmdbEventMangerRequiredComponents(DmdbEventMangerRequiredComponent &comp
 
 bool GetDmdbClientManagerRequiredComponent(DmdbClientManagerRequiredComponent &components) {
     if(serverInstance == nullptr || serverInstance->_server_logger == nullptr || 
-       serverInstance->_event_manager == nullptr || serverInstance->_repl_manager == nullptr)
+       serverInstance->_event_manager == nullptr || serverInstance->_repl_manager == nullptr ||
+       serverInstance->_io_thread_manager == nullptr)
         return false;
     components._server_logger = serverInstance->_server_logger;
     components._event_manager = serverInstance->_event_manager;
     components._repl_manager = serverInstance->_repl_manager;
+    components._io_thread_manager = serverInstance->_io_thread_manager;
     components._server_ipv4 = serverInstance->_ipv4;
     components._server_tcp_backlog = serverInstance->_tcp_back_log;
     return true;
@@ -35,11 +41,16 @@ bool GetDmdbClientManagerRequiredComponent(DmdbClientManagerRequiredComponent &c
 
 bool GetDmdbClientContactRequiredComponent(DmdbClientContactRequiredComponent &components) {
     if(serverInstance == nullptr || serverInstance->_server_logger == nullptr || 
-       serverInstance->_client_manager == nullptr || serverInstance->_repl_manager == nullptr)
+       serverInstance->_client_manager == nullptr || serverInstance->_repl_manager == nullptr ||
+       serverInstance->_shard_manager == nullptr || serverInstance->_aof_manager == nullptr ||
+       serverInstance->_database_manager == nullptr)
         return false;
     components._server_logger = serverInstance->_server_logger;
     components._client_manager = serverInstance->_client_manager;
     components._repl_manager = serverInstance->_repl_manager;
+    components._shard_manager = serverInstance->_shard_manager;
+    components._aof_manager = serverInstance->_aof_manager;
+    components._database_manager = serverInstance->_database_manager;
     components._is_myself_master = serverInstance->_is_master_role;
     return true;    
 }
@@ -47,14 +58,19 @@ bool GetDmdbClientContactRequiredComponent(DmdbClientContactRequiredComponent &c
 bool GetDmdbCommandRequiredComponents(DmdbCommandRequiredComponent &components) {
     if(serverInstance == nullptr || serverInstance->_client_manager == nullptr ||
        serverInstance->_database_manager == nullptr || serverInstance->_rdb_manager == nullptr ||
-       serverInstance->_repl_manager == nullptr) {
+       serverInstance->_repl_manager == nullptr || serverInstance->_shard_manager == nullptr ||
+       serverInstance->_aof_manager == nullptr) {
         return false;
     }
     components._server_client_manager = serverInstance->_client_manager;
     components._server_database_manager = serverInstance->_database_manager;
     components._server_rdb_manager = serverInstance->_rdb_manager;
+    components._server_aof_manager = serverInstance->_aof_manager;
     components._repl_manager = serverInstance->_repl_manager;
     components._is_myself_master = serverInstance->_is_master_role;
+    components._is_shard_mode = serverInstance->_shard_manager->IsShardMode();
+    components._shard_id = serverInstance->_shard_id;
+    components._shards_num = serverInstance->_shard_manager->GetShardsNum();
     components._is_plan_to_shutdown = &serverInstance->_plan_to_shutdown;
     return true;
 }
@@ -62,13 +78,15 @@ bool GetDmdbCommandRequiredComponents(DmdbCommandRequiredComponent &components)
 bool GetDmdbRDBRequiredComponents(DmdbRDBRequiredComponents &components) {
     if(serverInstance == nullptr || serverInstance->_server_logger == nullptr ||
        serverInstance->_database_manager == nullptr || serverInstance->_client_manager == nullptr ||
-       serverInstance->_repl_manager == nullptr)
+       serverInstance->_repl_manager == nullptr || serverInstance->_aof_manager == nullptr)
         return false;
     components._server_logger = serverInstance->_server_logger;
     components._database_manager = serverInstance->_database_manager;
     components._client_manager = serverInstance->_client_manager;
     components._repl_manager = serverInstance->_repl_manager;
-    components._is_preamble = &serverInstance->_is_preamble;
+    components._aof_manager = serverInstance->_aof_manager;
+    components._event_manager = serverInstance->_event_manager;
+    components._lazy_free_manager = serverInstance->_lazy_free_manager;
     components._server_version = serverInstance->_server_version;
     
     return true;
@@ -88,4 +106,30 @@ bool GetDmdbRepilcationManagerRequiredComponents(DmdbRepilcationManagerRequiredC
     return true;
 }
 
+bool GetDmdbShardManagerRequiredComponents(DmdbShardManagerRequiredComponents &components) {
+    if(serverInstance == nullptr || serverInstance->_client_manager == nullptr ||
+       serverInstance->_event_manager == nullptr || serverInstance->_server_logger == nullptr ||
+       serverInstance->_aof_manager == nullptr) {
+        return false;
+    }
+    components._client_manager = serverInstance->_client_manager;
+    components._event_manager = serverInstance->_event_manager;
+    components._server_logger = serverInstance->_server_logger;
+    components._aof_manager = serverInstance->_aof_manager;
+    components._shard_id = serverInstance->_shard_id;
+    return true;
+}
+
+bool GetDmdbAOFRequiredComponents(DmdbAOFRequiredComponents &components) {
+    if(serverInstance == nullptr || serverInstance->_server_logger == nullptr ||
+       serverInstance->_database_manager == nullptr || serverInstance->_rdb_manager == nullptr) {
+        return false;
+    }
+    components._server_logger = serverInstance->_server_logger;
+    components._database_manager = serverInstance->_database_manager;
+    components._rdb_manager = serverInstance->_rdb_manager;
+    components._is_preamble = &serverInstance->_is_preamble;
+    return true;
+}
+
 }
\ No newline at end of file
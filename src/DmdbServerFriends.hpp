@@ -7,10 +7,14 @@ struct DmdbClientContactRequiredComponent;
 struct DmdbCommandRequiredComponent;
 struct DmdbRDBRequiredComponents;
 struct DmdbRepilcationManagerRequiredComponents;
+struct DmdbShardManagerRequiredComponents;
+struct DmdbAOFRequiredComponents;
 bool GetDmdbEventMangerRequiredComponents(DmdbEventMangerRequiredComponent &components);
 bool GetDmdbClientManagerRequiredComponent(DmdbClientManagerRequiredComponent &components);
 bool GetDmdbClientContactRequiredComponent(DmdbClientContactRequiredComponent &components);
 bool GetDmdbCommandRequiredComponents(DmdbCommandRequiredComponent &components);
 bool GetDmdbRDBRequiredComponents(DmdbRDBRequiredComponents &components);
 bool GetDmdbRepilcationManagerRequiredComponents(DmdbRepilcationManagerRequiredComponents &components);
+bool GetDmdbShardManagerRequiredComponents(DmdbShardManagerRequiredComponents &components);
+bool GetDmdbAOFRequiredComponents(DmdbAOFRequiredComponents &components);
 }
\ No newline at end of file
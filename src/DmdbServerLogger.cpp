@@ -1,3 +1,5 @@
+#include <pthread.h>
+
 #include "DmdbServerLogger.hpp"
 
 namespace Dmdb {
@@ -13,6 +15,21 @@ DmdbServerLogger::DmdbServerLogger(const std::string &logFile, Verbosity verbosi
     if(!_server_log_stream.is_open()) {
         DmdbUtil::ServerHandleOpenFileFailure(_server_log_file);
     }
+    /* A shard may fork while another shard is writing the log, the child would never get the
+     * mutex if it's copied in the locked state */
+    pthread_atfork(LockBeforeFork, UnlockAfterFork, UnlockAfterFork);
+}
+
+void DmdbServerLogger::LockBeforeFork() {
+    if(_server_logger_instance != nullptr) {
+        _server_logger_instance->_server_log_mutex.lock();
+    }
+}
+
+void DmdbServerLogger::UnlockAfterFork() {
+    if(_server_logger_instance != nullptr) {
+        _server_logger_instance->_server_log_mutex.unlock();
+    }
 }
 
 DmdbServerLogger* DmdbServerLogger::GetUniqueServerLogger(const std::string &logFile,
@@ -61,6 +78,7 @@ void DmdbServerLogger::WriteToServerLog(Verbosity logLevel, const char *fmt, ...
     std::string logContent = std::to_string(pid) + ":\t";
     logContent += std::string(buf) + "\t" + _log_level_msg[static_cast<uint8_t>(logLevel)] +
                     "\t" + logContentArray;
+    std::lock_guard<std::mutex> lock(_server_log_mutex);
     _server_log_stream << logContent << std::endl;
     _server_log_stream.flush();
 }
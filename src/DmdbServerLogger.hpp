@@ -6,11 +6,13 @@
 
 #include <string>
 #include <fstream>
+#include <mutex>
 
 #include "DmdbUtil.hpp"
 
 namespace Dmdb {
 
+/* The logger is shared by all the shard threads, so writing is protected by a mutex */
 class DmdbServerLogger
 {
 public:
@@ -30,9 +32,12 @@ private:
     std::string _server_log_file;
     Verbosity _server_log_verbosity;
     std::fstream _server_log_stream;
+    std::mutex _server_log_mutex;
     static DmdbServerLogger* _server_logger_instance;
     static std::string _log_level_msg[4];
     DmdbServerLogger(const std::string &logFile, Verbosity verbosity);
+    static void LockBeforeFork();
+    static void UnlockAfterFork();
 };
 
 
@@ -0,0 +1,514 @@
+#include <signal.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include <algorithm>
+
+#include "DmdbShardManager.hpp"
+#include "DmdbSpscQueue.hpp"
+#include "DmdbServerFriends.hpp"
+#include "DmdbClientContact.hpp"
+#include "DmdbClientManager.hpp"
+#include "DmdbCommand.hpp"
+#include "DmdbDict.hpp"
+#include "DmdbEventManager.hpp"
+#include "DmdbEventManagerCommon.hpp"
+#include "DmdbEventProcessor.hpp"
+#include "DmdbServerLogger.hpp"
+#include "DmdbUtil.hpp"
+#include "DmdbAOFManager.hpp"
+
+
+namespace Dmdb {
+
+DmdbShardManager* DmdbShardManager::_shard_manager_instance = nullptr;
+
+DmdbShardManager* DmdbShardManager::GetUniqueShardManagerInstance() {
+    if(_shard_manager_instance == nullptr) {
+        _shard_manager_instance = new DmdbShardManager();
+    }
+    return _shard_manager_instance;
+}
+
+DmdbShardManager::DmdbShardManager() {
+    _shards_num = 1;
+    _is_stopping = false;
+    _is_shutdown_requested = false;
+}
+
+DmdbShardManager::~DmdbShardManager() {
+    StopShards();
+    for(size_t i = 0; i < _queues.size(); ++i) {
+        if(_queues[i] == nullptr) {
+            continue;
+        }
+        DmdbShardMessage* message;
+        while((message = _queues[i]->Pop()) != nullptr) {
+            delete message;
+        }
+        delete _queues[i];
+    }
+    for(size_t i = 0; i < _notify_fds.size(); ++i) {
+        close(_notify_fds[i]);
+    }
+}
+
+void DmdbShardManager::SetShardsNum(int shardsNum) {
+    _shards_num = shardsNum;
+    if(_shards_num <= 1) {
+        return;
+    }
+    _queues.resize(_shards_num * _shards_num, nullptr);
+    for(int from = 0; from < _shards_num; ++from) {
+        for(int to = 0; to < _shards_num; ++to) {
+            if(from != to) {
+                _queues[from * _shards_num + to] = new DmdbSpscQueue<DmdbShardMessage>(SHARD_QUEUE_CAPACITY);
+            }
+        }
+    }
+    for(int i = 0; i < _shards_num; ++i) {
+        int notifyFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(notifyFd < 0) {
+            DmdbUtil::ServerExitWithErrMsg("Failed to create eventfd for shards!");
+        }
+        _notify_fds.push_back(notifyFd);
+    }
+    _shard_states.resize(_shards_num);
+    for(int i = 0; i < _shards_num; ++i) {
+        _shard_states[i]._shard_client = nullptr;
+        _shard_states[i]._next_request_id = 1;
+        _shard_states[i]._outgoing_messages.resize(_shards_num);
+        _shard_states[i]._is_notify_needed.resize(_shards_num, false);
+    }
+}
+
+int DmdbShardManager::GetShardsNum() {
+    return _shards_num;
+}
+
+bool DmdbShardManager::IsShardMode() {
+    return _shards_num > 1;
+}
+
+/* The dict takes its slot by the low bits of the hash, we use the high bits here, otherwise
+ * the keys of a shard would only fill a part of the slots */
+int DmdbShardManager::GetShardOfKey(std::string_view key) {
+    return static_cast<int>((DmdbDict::HashKey(key) >> 32) % static_cast<uint64_t>(_shards_num));
+}
+
+DmdbSpscQueue<DmdbShardMessage>* DmdbShardManager::GetQueue(int fromShard, int toShard) {
+    return _queues[fromShard * _shards_num + toShard];
+}
+
+bool DmdbShardManager::InitShard() {
+    if(!IsShardMode()) {
+        return true;
+    }
+    DmdbShardManagerRequiredComponents components;
+    GetDmdbShardManagerRequiredComponents(components);
+    DmdbShardLocalState &state = _shard_states[components._shard_id];
+    state._shard_client = new DmdbClientContact(-1, "shard", components._shard_id);
+    state._shard_client->SetChecked();
+    if(!components._event_manager->AddEvent4Fd(_notify_fds[components._shard_id], EpollEvent::IN,
+                                               EventProcessorType::SHARD_NOTIFY)) {
+        components._server_logger->WriteToServerLog(DmdbServerLogger::Verbosity::WARNING,
+                                                    "Failed to add the notify fd of shard %d into epoll",
+                                                    components._shard_id);
+        return false;
+    }
+    return true;
+}
+
+void DmdbShardManager::ReleaseShard() {
+    if(!IsShardMode()) {
+        return;
+    }
+    DmdbShardManagerRequiredComponents components;
+    GetDmdbShardManagerRequiredComponents(components);
+    DmdbShardLocalState &state = _shard_states[components._shard_id];
+    components._event_manager->DelFd(_notify_fds[components._shard_id], false);
+    for(size_t i = 0; i < state._outgoing_messages.size(); ++i) {
+        while(!state._outgoing_messages[i].empty()) {
+            delete state._outgoing_messages[i].front();
+            state._outgoing_messages[i].pop_front();
+        }
+    }
+    state._pending_requests.clear();
+    delete state._shard_client;
+    state._shard_client = nullptr;
+}
+
+/* Returns true if the request is handled here, the client will get the reply after all the
+ * shards owning its keys reply. If all the keys are owned by the current shard, returns false,
+ * the caller executes the request as usual */
+bool DmdbShardManager::DispatchRequest(DmdbClientContact* clientContact, DmdbCommand* command, const std::vector<std::string_view> &argv) {
+    DmdbShardManagerRequiredComponents components;
+    GetDmdbShardManagerRequiredComponents(components);
+    int myShard = components._shard_id;
+    const std::string &lowerName = command->GetName();
+
+    /* Keys of a transaction may be owned by different shards, we can't execute it atomically */
+    if(lowerName == "multi") {
+        clientContact->AddReplyData2Client("-ERR MULTI is not supported in shard mode\r\n");
+        return true;
+    }
+
+    /* parts[i] is the sub-request for shard i, it's empty if shard i has nothing to do */
+    std::vector<std::vector<std::string>> parts(_shards_num);
+    ShardReplyMergeType mergeType;
+    size_t arrayLimit = SIZE_MAX;
+    if((lowerName == "set" || lowerName == "get" || lowerName == "expire" || lowerName == "pttl" ||
+        lowerName == "persist" || lowerName == "type" || lowerName == "pexpireat") && argv.size() >= 2) {
+        int shard = GetShardOfKey(argv[1]);
+        if(shard == myShard) {
+            return false;
+        }
+        parts[shard].assign(argv.begin(), argv.end());
+        mergeType = ShardReplyMergeType::FORWARD;
+    } else if((lowerName == "del" || lowerName == "unlink" || lowerName == "exists") && argv.size() >= 2) {
+        for(size_t i = 1; i < argv.size(); ++i) {
+            std::vector<std::string> &part = parts[GetShardOfKey(argv[i])];
+            if(part.empty()) {
+                part.emplace_back(argv[0]);
+            }
+            part.emplace_back(argv[i]);
+        }
+        mergeType = ShardReplyMergeType::SUM_INTEGER;
+    } else if(lowerName == "mset" && argv.size() >= 3 && argv.size() % 2 == 1) {
+        for(size_t i = 1; i < argv.size(); i += 2) {
+            std::vector<std::string> &part = parts[GetShardOfKey(argv[i])];
+            if(part.empty()) {
+                part.emplace_back(argv[0]);
+            }
+            part.emplace_back(argv[i]);
+            part.emplace_back(argv[i+1]);
+        }
+        mergeType = ShardReplyMergeType::FIRST_ERROR;
+    } else if(lowerName == "scan" && argv.size() >= 2) {
+        /* The shard of the cursor scans it, an invalid cursor is found by the local SCAN */
+        uint64_t shard = strtoull(std::string(argv[1]).c_str(), nullptr, 10) >> SCAN_CURSOR_SHARD_SHIFT;
+        if(shard == static_cast<uint64_t>(myShard) || shard >= static_cast<uint64_t>(_shards_num)) {
+            return false;
+        }
+        parts[shard].assign(argv.begin(), argv.end());
+        mergeType = ShardReplyMergeType::FORWARD;
+    } else if(lowerName == "rangekeys" && argv.size() >= 3) {
+        /* Every shard returns at most limit keys, the first limit keys of them are the reply */
+        for(int i = 0; i < _shards_num; ++i) {
+            parts[i].assign(argv.begin(), argv.end());
+        }
+        if(argv.size() == 5) {
+            arrayLimit = strtoull(std::string(argv[4]).c_str(), nullptr, 10);
+        }
+        mergeType = ShardReplyMergeType::SORTED_ARRAY;
+    } else if((lowerName == "keys" && argv.size() == 2) ||
+              ((lowerName == "flushall" || lowerName == "flushdb") && argv.size() <= 2) ||
+              ((lowerName == "dbsize" || lowerName == "save" || lowerName == "bgsave" ||
+                lowerName == "bgrewriteaof") && argv.size() == 1)) {
+        for(int i = 0; i < _shards_num; ++i) {
+            parts[i].assign(argv.begin(), argv.end());
+        }
+        if(lowerName == "keys") {
+            mergeType = ShardReplyMergeType::CONCAT_ARRAY;
+        } else if(lowerName == "dbsize") {
+            mergeType = ShardReplyMergeType::SUM_INTEGER;
+        } else {
+            mergeType = ShardReplyMergeType::FIRST_ERROR;
+        }
+    } else {
+        return false;
+    }
+
+    bool isAllLocal = true;
+    for(int i = 0; i < _shards_num; ++i) {
+        if(i != myShard && !parts[i].empty()) {
+            isAllLocal = false;
+            break;
+        }
+    }
+    if(isAllLocal) {
+        return false;
+    }
+
+    DmdbShardLocalState &state = _shard_states[myShard];
+    uint64_t requestId = state._next_request_id++;
+    DmdbShardPendingRequest &pendingRequest = state._pending_requests[requestId];
+    pendingRequest._client_fd = clientContact->GetClientSocket();
+    pendingRequest._client_id = clientContact->GetClientId();
+    pendingRequest._merge_type = mergeType;
+    pendingRequest._unfinished_parts_num = 0;
+    pendingRequest._array_limit = arrayLimit;
+    for(int i = 0; i < _shards_num; ++i) {
+        if(parts[i].empty()) {
+            continue;
+        }
+        size_t partIndex = pendingRequest._part_replies.size();
+        pendingRequest._part_replies.emplace_back();
+        if(i == myShard) {
+            /* The local part needn't wait */
+            pendingRequest._part_replies[partIndex] = ExecuteRequest(state, parts[i]);
+        } else {
+            pendingRequest._unfinished_parts_num++;
+            SendRequestToShard(components, requestId, partIndex, i, parts[i]);
+        }
+    }
+    clientContact->SetStatus(static_cast<uint32_t>(ClientStatus::WAITING_SHARDS));
+    return true;
+}
+
+void DmdbShardManager::SendRequestToShard(DmdbShardManagerRequiredComponents &components, uint64_t requestId, size_t partIndex,
+                                          int toShard, std::vector<std::string> &argv) {
+    DmdbShardMessage* message = new DmdbShardMessage();
+    message->_type = ShardMessageType::REQUEST;
+    message->_from_shard = components._shard_id;
+    message->_request_id = requestId;
+    message->_part_index = partIndex;
+    message->_argv.swap(argv);
+    SendMessage(_shard_states[components._shard_id], toShard, message);
+}
+
+/* The message is kept by the sender if the queue is full, so the messages to a shard are always
+ * received in the order they are sent */
+void DmdbShardManager::SendMessage(DmdbShardLocalState &state, int toShard, DmdbShardMessage* message) {
+    std::deque<DmdbShardMessage*> &outgoingMessages = state._outgoing_messages[toShard];
+    if(outgoingMessages.empty() && GetQueue(message->_from_shard, toShard)->Push(message)) {
+        state._is_notify_needed[toShard] = true;
+        return;
+    }
+    outgoingMessages.push_back(message);
+}
+
+std::string DmdbShardManager::ExecuteRequest(DmdbShardLocalState &state, const std::vector<std::string> &argv) {
+    DmdbCommand* command = DmdbCommand::LookupCommand(argv[0]);
+    if(command == nullptr) {
+        return "-ERR Unknown command:" + argv[0] + "\r\n";
+    }
+    if(!command->IsArityOk(argv.size())) {
+        return command->GetWrongArityMsg();
+    }
+    if(command->HasFlag(CommandFlag::DENYOOM) && !state._shard_client->FreeMemoryIfNeed()) {
+        return OOM_ERR_REPLY;
+    }
+    std::vector<std::string> parameters(argv.begin() + 1, argv.end());
+    command->Execute(*state._shard_client, parameters);
+    /* The owner of the keys logs the command, the shard receiving the request doesn't */
+    DmdbShardManagerRequiredComponents components;
+    GetDmdbShardManagerRequiredComponents(components);
+    if(command->HasFlag(CommandFlag::WRITE) && components._aof_manager->IsAOFEnabled()) {
+        components._aof_manager->FeedCommand(command, std::vector<std::string_view>(argv.begin(), argv.end()), std::string_view());
+    }
+    return state._shard_client->TakeReplyData();
+}
+
+size_t DmdbShardManager::ProcessShardMessages() {
+    if(!IsShardMode()) {
+        return 0;
+    }
+    DmdbShardManagerRequiredComponents components;
+    GetDmdbShardManagerRequiredComponents(components);
+    int myShard = components._shard_id;
+    DmdbShardLocalState &state = _shard_states[myShard];
+    size_t processedNum = 0;
+    for(int from = 0; from < _shards_num; ++from) {
+        if(from == myShard) {
+            continue;
+        }
+        DmdbSpscQueue<DmdbShardMessage>* queue = GetQueue(from, myShard);
+        DmdbShardMessage* message;
+        while((message = queue->Pop()) != nullptr) {
+            processedNum++;
+            if(message->_type == ShardMessageType::REPLY) {
+                HandleReply(components, message);
+                continue;
+            }
+            /* Send the message back with the reply */
+            message->_reply = ExecuteRequest(state, message->_argv);
+            message->_argv.clear();
+            message->_type = ShardMessageType::REPLY;
+            message->_from_shard = myShard;
+            SendMessage(state, from, message);
+        }
+    }
+    return processedNum;
+}
+
+void DmdbShardManager::HandleReply(DmdbShardManagerRequiredComponents &components, DmdbShardMessage* message) {
+    DmdbShardLocalState &state = _shard_states[components._shard_id];
+    std::unordered_map<uint64_t, DmdbShardPendingRequest>::iterator it = state._pending_requests.find(message->_request_id);
+    if(it == state._pending_requests.end()) {
+        delete message;
+        return;
+    }
+    DmdbShardPendingRequest &pendingRequest = it->second;
+    pendingRequest._part_replies[message->_part_index].swap(message->_reply);
+    delete message;
+    if(--pendingRequest._unfinished_parts_num > 0) {
+        return;
+    }
+    DmdbClientContact* clientContact = components._client_manager->GetClientContactByFd(pendingRequest._client_fd);
+    if(clientContact != nullptr && clientContact->GetClientId() == pendingRequest._client_id) {
+        clientContact->AddReplyData2Client(MergeReplies(pendingRequest));
+        clientContact->ClearStatus(static_cast<uint32_t>(ClientStatus::WAITING_SHARDS));
+        /* Go on with the requests left in its input buffer */
+        components._client_manager->AddClientToPendingProcess(clientContact);
+    }
+    state._pending_requests.erase(it);
+}
+
+std::string DmdbShardManager::MergeReplies(const DmdbShardPendingRequest &pendingRequest) {
+    const std::vector<std::string> &replies = pendingRequest._part_replies;
+    switch(pendingRequest._merge_type) {
+        case ShardReplyMergeType::FORWARD: {
+            return replies[0];
+        }
+        case ShardReplyMergeType::SUM_INTEGER: {
+            long long sum = 0;
+            for(size_t i = 0; i < replies.size(); ++i) {
+                if(replies[i].empty() || replies[i][0] != ':') {
+                    return replies[i];
+                }
+                sum += strtoll(replies[i].c_str() + 1, nullptr, 10);
+            }
+            return ":" + std::to_string(sum) + "\r\n";
+        }
+        case ShardReplyMergeType::CONCAT_ARRAY: {
+            long long count = 0;
+            std::string elements;
+            for(size_t i = 0; i < replies.size(); ++i) {
+                size_t headerEnd = replies[i].find("\r\n");
+                if(replies[i].empty() || replies[i][0] != '*' || headerEnd == std::string::npos) {
+                    return replies[i];
+                }
+                count += strtoll(replies[i].c_str() + 1, nullptr, 10);
+                elements.append(replies[i], headerEnd + 2, std::string::npos);
+            }
+            return "*" + std::to_string(count) + "\r\n" + elements;
+        }
+        case ShardReplyMergeType::SORTED_ARRAY: {
+            std::vector<std::string> elements;
+            for(size_t i = 0; i < replies.size(); ++i) {
+                if(!ParseBulkArray(replies[i], elements)) {
+                    return replies[i];
+                }
+            }
+            std::sort(elements.begin(), elements.end());
+            size_t count = std::min(elements.size(), pendingRequest._array_limit);
+            std::string merged = "*" + std::to_string(count) + "\r\n";
+            for(size_t i = 0; i < count; ++i) {
+                merged += "$" + std::to_string(elements[i].length()) + "\r\n" + elements[i] + "\r\n";
+            }
+            return merged;
+        }
+        case ShardReplyMergeType::FIRST_ERROR: {
+            for(size_t i = 0; i < replies.size(); ++i) {
+                if(!replies[i].empty() && replies[i][0] == '-') {
+                    return replies[i];
+                }
+            }
+            return replies[0];
+        }
+    }
+    return replies[0];
+}
+
+/* The elements are appended to elements, false is returned if reply isn't an array of bulk strings */
+bool DmdbShardManager::ParseBulkArray(const std::string &reply, std::vector<std::string> &elements) {
+    if(reply.empty() || reply[0] != '*') {
+        return false;
+    }
+    char* endPtr = nullptr;
+    long long count = strtoll(reply.c_str() + 1, &endPtr, 10);
+    size_t pos = endPtr - reply.c_str() + 2;
+    for(long long i = 0; i < count; ++i) {
+        if(pos >= reply.length() || reply[pos] != '$') {
+            return false;
+        }
+        size_t len = strtoull(reply.c_str() + pos + 1, &endPtr, 10);
+        pos = endPtr - reply.c_str() + 2;
+        if(pos + len + 2 > reply.length()) {
+            return false;
+        }
+        elements.emplace_back(reply, pos, len);
+        pos += len + 2;
+    }
+    return true;
+}
+
+/* Push the messages kept by us, and wake up the shards which have new messages */
+void DmdbShardManager::FlushShardMessages() {
+    if(!IsShardMode()) {
+        return;
+    }
+    DmdbShardManagerRequiredComponents components;
+    GetDmdbShardManagerRequiredComponents(components);
+    int myShard = components._shard_id;
+    DmdbShardLocalState &state = _shard_states[myShard];
+    for(int to = 0; to < _shards_num; ++to) {
+        if(to == myShard) {
+            continue;
+        }
+        std::deque<DmdbShardMessage*> &outgoingMessages = state._outgoing_messages[to];
+        DmdbSpscQueue<DmdbShardMessage>* queue = GetQueue(myShard, to);
+        while(!outgoingMessages.empty() && queue->Push(outgoingMessages.front())) {
+            outgoingMessages.pop_front();
+            state._is_notify_needed[to] = true;
+        }
+        if(state._is_notify_needed[to]) {
+            state._is_notify_needed[to] = false;
+            NotifyShard(to);
+        }
+    }
+}
+
+void DmdbShardManager::NotifyShard(int shardId) {
+    uint64_t one = 1;
+    /* If it fails, the counter of eventfd is big enough, the shard will wake up anyway */
+    ssize_t ret = write(_notify_fds[shardId], &one, sizeof(one));
+    (void)ret;
+}
+
+bool DmdbShardManager::StartShards(const std::function<void(int)> &shardMain) {
+    if(!IsShardMode() || !_shard_threads.empty()) {
+        return false;
+    }
+    /* Signals should be handled by shard 0 only, the shard threads inherit this mask */
+    sigset_t blockSet, oldSet;
+    sigfillset(&blockSet);
+    pthread_sigmask(SIG_BLOCK, &blockSet, &oldSet);
+    for(int i = 1; i < _shards_num; ++i) {
+        _shard_threads.emplace_back(shardMain, i);
+    }
+    pthread_sigmask(SIG_SETMASK, &oldSet, nullptr);
+    return true;
+}
+
+/* Every shard saves its data and quits its loop when it finds that we are stopping */
+void DmdbShardManager::StopShards() {
+    if(_shard_threads.empty()) {
+        return;
+    }
+    _is_stopping = true;
+    for(int i = 1; i < _shards_num; ++i) {
+        NotifyShard(i);
+    }
+    for(size_t i = 0; i < _shard_threads.size(); ++i) {
+        _shard_threads[i].join();
+    }
+    _shard_threads.clear();
+}
+
+bool DmdbShardManager::IsStopping() {
+    return _is_stopping;
+}
+
+/* Only shard 0 can stop the server, the other shards ask it to do */
+void DmdbShardManager::RequestShutdown() {
+    _is_shutdown_requested = true;
+    NotifyShard(0);
+}
+
+bool DmdbShardManager::IsShutdownRequested() {
+    return _is_shutdown_requested;
+}
+
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+
+namespace Dmdb {
+
+class DmdbAOFManager;
+class DmdbClientContact;
+class DmdbClientManager;
+class DmdbCommand;
+class DmdbEventManager;
+class DmdbServerLogger;
+template<typename T> class DmdbSpscQueue;
+
+const int SHARDS_MAX_NUM = 64;
+/* The capacity of the queue from one shard to another, the messages which can't be pushed
+ * are kept by the sender and pushed again later */
+const size_t SHARD_QUEUE_CAPACITY = 4096;
+/* The bits of a SCAN cursor above it are the shard being scanned, a table never has so many slots */
+const int SCAN_CURSOR_SHARD_SHIFT = 48;
+
+/* All these members matches a member of DmdbServer of the current shard thread */
+struct DmdbShardManagerRequiredComponents {
+    DmdbClientManager* _client_manager;
+    DmdbEventManager* _event_manager;
+    DmdbServerLogger* _server_logger;
+    DmdbAOFManager* _aof_manager;
+    int _shard_id;
+};
+
+enum class ShardMessageType {
+    REQUEST,
+    REPLY
+};
+
+/* How the replies of the sub-requests are merged into one reply for the client */
+enum class ShardReplyMergeType {
+    /* There is only one sub-request, its reply is the reply */
+    FORWARD,
+    /* Integer replies are added up, e.g. DEL, EXISTS, DBSIZE */
+    SUM_INTEGER,
+    /* Array replies are joined, e.g. KEYS */
+    CONCAT_ARRAY,
+    /* Array replies of bulk strings are merged in order and cut to the limit, e.g. RANGEKEYS */
+    SORTED_ARRAY,
+    /* The first error reply if there is, otherwise the first reply, e.g. MSET, SAVE */
+    FIRST_ERROR
+};
+
+/* A request is sent to the owner shard of its keys, the owner executes it and sends the
+ * same message back with the reply */
+struct DmdbShardMessage {
+    ShardMessageType _type;
+    int _from_shard;
+    uint64_t _request_id;
+    size_t _part_index;
+    std::vector<std::string> _argv;
+    std::string _reply;
+};
+
+/* A client request waiting for the replies of its sub-requests. We keep the fd and id of
+ * the client rather than a pointer, the client may be closed before the replies come back */
+struct DmdbShardPendingRequest {
+    int _client_fd;
+    uint64_t _client_id;
+    ShardReplyMergeType _merge_type;
+    size_t _unfinished_parts_num;
+    /* The max elements of a SORTED_ARRAY reply */
+    size_t _array_limit;
+    std::vector<std::string> _part_replies;
+};
+
+/* Everything in it is only touched by the thread of the shard */
+struct DmdbShardLocalState {
+    /* Requests from other shards are executed by this fake client */
+    DmdbClientContact* _shard_client;
+    uint64_t _next_request_id;
+    std::unordered_map<uint64_t, DmdbShardPendingRequest> _pending_requests;
+    /* Messages to every shard which are not pushed into the queue yet */
+    std::vector<std::deque<DmdbShardMessage*>> _outgoing_messages;
+    /* The shards we pushed messages to since we woke them up last time */
+    std::vector<bool> _is_notify_needed;
+};
+
+/* In shard mode("shards_num > 1"), every shard thread runs a whole DmdbServer of its own, with
+ * its own epoll, clients and database, nothing is shared between shards except this manager and
+ * the logger. Every shard listens on the same port with SO_REUSEPORT, so the kernel spreads the
+ * connections. A key belongs to one shard by its hash, requests on keys of other shards are passed
+ * to the owners through SPSC queues, one queue for every pair of shards, and an eventfd of the owner
+ * is written to wake it up */
+class DmdbShardManager {
+public:
+    static DmdbShardManager* GetUniqueShardManagerInstance();
+    /* It must be called before any shard starts */
+    void SetShardsNum(int shardsNum);
+    int GetShardsNum();
+    bool IsShardMode();
+    int GetShardOfKey(std::string_view key);
+    /* The functions below are called by the shard threads, they work for the shard of the caller */
+    bool InitShard();
+    void ReleaseShard();
+    bool DispatchRequest(DmdbClientContact* clientContact, DmdbCommand* command, const std::vector<std::string_view> &argv);
+    size_t ProcessShardMessages();
+    void FlushShardMessages();
+    /* Shard 0 runs in the main thread, it starts and stops the others */
+    bool StartShards(const std::function<void(int)> &shardMain);
+    void StopShards();
+    bool IsStopping();
+    void RequestShutdown();
+    bool IsShutdownRequested();
+    ~DmdbShardManager();
+private:
+    DmdbShardManager();
+    DmdbSpscQueue<DmdbShardMessage>* GetQueue(int fromShard, int toShard);
+    void SendMessage(DmdbShardLocalState &state, int toShard, DmdbShardMessage* message);
+    void SendRequestToShard(DmdbShardManagerRequiredComponents &components, uint64_t requestId, size_t partIndex,
+                            int toShard, std::vector<std::string> &argv);
+    std::string ExecuteRequest(DmdbShardLocalState &state, const std::vector<std::string> &argv);
+    void HandleReply(DmdbShardManagerRequiredComponents &components, DmdbShardMessage* message);
+    std::string MergeReplies(const DmdbShardPendingRequest &pendingRequest);
+    static bool ParseBulkArray(const std::string &reply, std::vector<std::string> &elements);
+    void NotifyShard(int shardId);
+    static DmdbShardManager* _shard_manager_instance;
+    int _shards_num;
+    /* _queues[from * _shards_num + to] */
+    std::vector<DmdbSpscQueue<DmdbShardMessage>*> _queues;
+    std::vector<int> _notify_fds;
+    std::vector<DmdbShardLocalState> _shard_states;
+    std::vector<std::thread> _shard_threads;
+    std::atomic<bool> _is_stopping;
+    std::atomic<bool> _is_shutdown_requested;
+};
+
+}
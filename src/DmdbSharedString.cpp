@@ -0,0 +1,50 @@
+#include "DmdbSharedString.hpp"
+#include "DmdbUtil.hpp"
+
+
+namespace Dmdb {
+
+DmdbSharedString::DmdbSharedString(const std::string &str) : _ref_count(1), _data(str) {
+
+}
+
+DmdbSharedString::~DmdbSharedString() {
+
+}
+
+DmdbSharedString* DmdbSharedString::Create(const std::string &str) {
+    return new DmdbSharedString(str);
+}
+
+void DmdbSharedString::IncrRefCount() {
+    _ref_count.fetch_add(1, std::memory_order_relaxed);
+}
+
+void DmdbSharedString::DecrRefCount() {
+    if(_ref_count.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        delete this;
+    }
+}
+
+bool DmdbSharedString::IsShared() {
+    return _ref_count.load(std::memory_order_acquire) > 1;
+}
+
+const char* DmdbSharedString::GetData() {
+    return _data.data();
+}
+
+size_t DmdbSharedString::GetLength() {
+    return _data.length();
+}
+
+size_t DmdbSharedString::GetMemoryUsage() {
+    return sizeof(DmdbSharedString) + DmdbUtil::GetStringHeapSize(_data);
+}
+
+/* std::string::assign() reuses the buffer if its capacity is enough */
+void DmdbSharedString::Assign(const std::string &str) {
+    _data.assign(str);
+}
+
+}
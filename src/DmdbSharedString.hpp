@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <atomic>
+#include <string>
+
+
+namespace Dmdb {
+
+/* A reference counted byte string. A big value and the output buffers of clients which
+ * are replying it share the same DmdbSharedString, so the value is never copied for replying.
+ * The reference count is atomic because replies may be written by I/O threads */
+class DmdbSharedString {
+public:
+    static DmdbSharedString* Create(const std::string &str);
+    void IncrRefCount();
+    /* The string is freed when the last reference is released */
+    void DecrRefCount();
+    bool IsShared();
+    const char* GetData();
+    size_t GetLength();
+    size_t GetMemoryUsage();
+    /* It can only be called when nobody else references the string */
+    void Assign(const std::string &str);
+private:
+    DmdbSharedString(const std::string &str);
+    ~DmdbSharedString();
+    DmdbSharedString(const DmdbSharedString&);
+    DmdbSharedString& operator=(const DmdbSharedString&);
+    std::atomic<uint32_t> _ref_count;
+    std::string _data;
+};
+
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <atomic>
+
+
+namespace Dmdb {
+
+/* A bounded lock-free queue of T* with a single producer and a single consumer, shards use it to
+ * pass messages to each other. The producer only writes _tail and the consumer only writes _head,
+ * each side caches the other's index so it touches the shared cache line only when the cached
+ * one says the queue is full(or empty) */
+template<typename T>
+class DmdbSpscQueue {
+public:
+    /* capacity is rounded up to a power of 2 */
+    explicit DmdbSpscQueue(size_t capacity);
+    ~DmdbSpscQueue();
+    /* Only called by the producer, returns false if the queue is full */
+    bool Push(T* item);
+    /* Only called by the consumer, returns nullptr if the queue is empty */
+    T* Pop();
+private:
+    DmdbSpscQueue(const DmdbSpscQueue&);
+    DmdbSpscQueue& operator=(const DmdbSpscQueue&);
+    T** _slots;
+    size_t _mask;
+    alignas(64) std::atomic<size_t> _head;
+    size_t _cached_tail;
+    alignas(64) std::atomic<size_t> _tail;
+    size_t _cached_head;
+};
+
+template<typename T>
+DmdbSpscQueue<T>::DmdbSpscQueue(size_t capacity) {
+    size_t size = 2;
+    while(size < capacity) {
+        size <<= 1;
+    }
+    _slots = new T*[size]();
+    _mask = size - 1;
+    _head.store(0, std::memory_order_relaxed);
+    _cached_tail = 0;
+    _tail.store(0, std::memory_order_relaxed);
+    _cached_head = 0;
+}
+
+template<typename T>
+DmdbSpscQueue<T>::~DmdbSpscQueue() {
+    delete[] _slots;
+}
+
+template<typename T>
+bool DmdbSpscQueue<T>::Push(T* item) {
+    size_t tail = _tail.load(std::memory_order_relaxed);
+    if(tail - _cached_head > _mask) {
+        _cached_head = _head.load(std::memory_order_acquire);
+        if(tail - _cached_head > _mask) {
+            return false;
+        }
+    }
+    _slots[tail & _mask] = item;
+    _tail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+template<typename T>
+T* DmdbSpscQueue<T>::Pop() {
+    size_t head = _head.load(std::memory_order_relaxed);
+    if(head == _cached_tail) {
+        _cached_tail = _tail.load(std::memory_order_acquire);
+        if(head == _cached_tail) {
+            return nullptr;
+        }
+    }
+    T* item = _slots[head & _mask];
+    _head.store(head + 1, std::memory_order_release);
+    return item;
+}
+
+}
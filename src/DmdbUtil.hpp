@@ -22,9 +22,12 @@ public:
     static bool IsValidIPV4Address(const std::string &strIPV4);
     static void LocalTime(struct tm *tmp, time_t t, time_t tz, int dst);
     static uint64_t GetCurrentMs();
+    static uint64_t GetCurrentUs();
     static uint64_t Crc64(uint64_t crc, const unsigned char *s, uint64_t l);
     static int RecvLineFromSocket(int socketFd, char* buf, size_t bufLen);
     static void ServerAssert(bool expression, const std::string &expStr);
+    /* The bytes allocated by str besides itself, a short string is stored inside the object */
+    static size_t GetStringHeapSize(const std::string &str);
 private:
     static bool IsValidIPV4Num(const std::string &strNum);
     static int IsLeapYear(time_t year);